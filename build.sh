@@ -1,9 +1,9 @@
 #!/bin/sh -e
 
 #libdrm
-dependencies="libavcodec libavformat libavutil x11 xcomposite xrandr libpulse libswresample libavfilter"
+dependencies="libavcodec libavformat libavutil x11 xcomposite xdamage xrandr libpulse libswresample libavfilter"
 includes="$(pkg-config --cflags $dependencies)"
-libs="$(pkg-config --libs $dependencies) -ldl -pthread -lm"
+libs="$(pkg-config --libs $dependencies) -ldl -pthread -lm -lrt"
 gcc -c src/capture/capture.c -O2 -g0 -DNDEBUG $includes
 gcc -c src/capture/nvfbc.c -O2 -g0 -DNDEBUG $includes
 gcc -c src/capture/xcomposite_cuda.c -O2 -g0 -DNDEBUG $includes
@@ -11,8 +11,19 @@ gcc -c src/capture/xcomposite_drm.c -O2 -g0 -DNDEBUG $includes
 gcc -c src/egl.c -O2 -g0 -DNDEBUG $includes
 gcc -c src/cuda.c -O2 -g0 -DNDEBUG $includes
 gcc -c src/window_texture.c -O2 -g0 -DNDEBUG $includes
+gcc -c src/window_damage.c -O2 -g0 -DNDEBUG $includes
 gcc -c src/time.c -O2 -g0 -DNDEBUG $includes
+gcc -c src/replay_buffer.c -O2 -g0 -DNDEBUG $includes
+gcc -c src/spsc_queue.c -O2 -g0 -DNDEBUG $includes
+gcc -c src/audio_ring.c -O2 -g0 -DNDEBUG $includes
+gcc -c src/audio_mixer.c -O2 -g0 -DNDEBUG $includes
+gcc -c src/mpsc_queue.c -O2 -g0 -DNDEBUG $includes
 g++ -c src/sound.cpp -O2 -g0 -DNDEBUG $includes
+g++ -c src/replay_stream_info.cpp -O2 -g0 -DNDEBUG $includes
 g++ -c src/main.cpp -O2 -g0 -DNDEBUG $includes
-g++ -o gpu-screen-recorder -O2 capture.o nvfbc.o egl.o cuda.o window_texture.o time.o xcomposite_cuda.o xcomposite_drm.o sound.o main.o -s $libs
+g++ -c tools/replay_export.cpp -O2 -g0 -DNDEBUG $includes
+g++ -c tools/audio_mix_benchmark.cpp -O2 -g0 -DNDEBUG $includes
+g++ -o gpu-screen-recorder -O2 capture.o nvfbc.o egl.o cuda.o window_texture.o window_damage.o time.o replay_buffer.o spsc_queue.o audio_ring.o audio_mixer.o mpsc_queue.o replay_stream_info.o xcomposite_cuda.o xcomposite_drm.o sound.o main.o -s $libs
+g++ -o gpu-screen-recorder-replay-export -O2 replay_buffer.o replay_stream_info.o replay_export.o -s $libs
+g++ -o gpu-screen-recorder-audio-mix-benchmark -O2 audio_mixer.o time.o audio_mix_benchmark.o -s $libs
 echo "Successfully built gpu-screen-recorder"
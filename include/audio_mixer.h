@@ -0,0 +1,55 @@
+#ifndef GSR_AUDIO_MIXER_H
+#define GSR_AUDIO_MIXER_H
+
+/*
+    Mixes audio buffers by summing them with a gain for each input, and clipping the result to the range of the sample format.
+    The samples are converted to float for mixing, so S32 audio is mixed with 24 bits of precision.
+    Also converts interleaved float audio to planar float audio, which is what the aac encoder takes.
+    There are SSE2/AVX2 (x86_64) and NEON (aarch64) kernels, the best one the cpu supports is picked at runtime.
+*/
+
+#include <stddef.h>
+#include <stdbool.h>
+
+typedef enum {
+    GSR_AUDIO_MIXER_FORMAT_S16,
+    GSR_AUDIO_MIXER_FORMAT_S32,
+    GSR_AUDIO_MIXER_FORMAT_F32 /* Clipped to [-1.0, 1.0] */
+} gsr_audio_mixer_format;
+
+typedef enum {
+    GSR_AUDIO_MIXER_KERNEL_SCALAR,
+    GSR_AUDIO_MIXER_KERNEL_SSE2,
+    GSR_AUDIO_MIXER_KERNEL_AVX2,
+    GSR_AUDIO_MIXER_KERNEL_NEON
+} gsr_audio_mixer_kernel;
+
+#define GSR_AUDIO_MIXER_MAX_INPUTS 32
+/*
+    When the output and all the inputs are aligned to this, the sse2 and avx2 kernels use aligned loads and stores.
+    Unaligned buffers are mixed as well, with unaligned loads and stores
+*/
+#define GSR_AUDIO_MIXER_ALIGNMENT 32
+
+gsr_audio_mixer_kernel gsr_audio_mixer_get_best_kernel(void);
+bool gsr_audio_mixer_kernel_is_supported(gsr_audio_mixer_kernel kernel);
+const char* gsr_audio_mixer_kernel_get_name(gsr_audio_mixer_kernel kernel);
+
+/*
+    output = clip(inputs[0] * gains[0] + inputs[1] * gains[1] + ...), for |num_samples| samples.
+    |num_samples| counts the samples of every channel, the channels can be interleaved or not since every sample is mixed on its own.
+    |output| can be one of the inputs. |num_inputs| has to be between 1 and GSR_AUDIO_MIXER_MAX_INPUTS.
+*/
+void gsr_audio_mix(gsr_audio_mixer_format format, void *output, const void *const *inputs, const float *gains, int num_inputs, size_t num_samples);
+/* Same as |gsr_audio_mix|, with a specific kernel. The kernel has to be supported */
+void gsr_audio_mix_with_kernel(gsr_audio_mixer_kernel kernel, gsr_audio_mixer_format format, void *output, const void *const *inputs, const float *gains, int num_inputs, size_t num_samples);
+
+/*
+    Copies |num_frames| frames of interleaved float audio with |num_channels| channels from |input| to one buffer for each channel in |outputs|.
+    Stereo audio uses the simd kernels, other channel counts are converted one sample at a time.
+*/
+void gsr_audio_deinterleave_f32(const float *input, float *const *outputs, int num_channels, size_t num_frames);
+/* Same as |gsr_audio_deinterleave_f32|, with a specific kernel. The kernel has to be supported */
+void gsr_audio_deinterleave_f32_with_kernel(gsr_audio_mixer_kernel kernel, const float *input, float *const *outputs, int num_channels, size_t num_frames);
+
+#endif /* GSR_AUDIO_MIXER_H */
@@ -0,0 +1,45 @@
+#ifndef GSR_AUDIO_RING_H
+#define GSR_AUDIO_RING_H
+
+/*
+    Lock-free ring of audio samples for exactly one producer thread and one consumer thread.
+    The producer writes any number of samples at a time and the consumer reads them back as frames of exactly |frame_size| samples,
+    with the pts of the first sample of the frame. All frames are allocated when the ring is created, writing and reading never block and never allocate.
+    The data of every frame is aligned to GSR_AUDIO_MIXER_ALIGNMENT.
+    If the consumer doesn't keep up and the ring is full, the samples that don't fit are dropped.
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef struct {
+    int64_t pts; /* In samples */
+    uint8_t *data;
+    size_t size; /* |frame_size| * |bytes_per_sample| bytes */
+} gsr_audio_ring_frame;
+
+typedef struct gsr_audio_ring gsr_audio_ring;
+
+/* |bytes_per_sample| is the size of one sample of all channels together (the samples are interleaved). Returns NULL on failure */
+gsr_audio_ring* gsr_audio_ring_create(size_t num_frames, size_t frame_size, size_t bytes_per_sample);
+void gsr_audio_ring_destroy(gsr_audio_ring *self);
+
+/*
+    Can only be called from the producer thread. |pts| is the pts of the first sample in |samples|, in samples.
+    If it doesn't continue from the previous write then the frame that was being filled is made available as it is, and a new frame is started.
+    Returns false if samples had to be dropped because the ring is full.
+*/
+bool gsr_audio_ring_write(gsr_audio_ring *self, const void *samples, size_t num_samples, int64_t pts);
+
+/*
+    Can only be called from the consumer thread. Returns the oldest full frame, or NULL if there is none.
+    The frame is owned by the consumer until it's given back with |gsr_audio_ring_release|.
+*/
+gsr_audio_ring_frame* gsr_audio_ring_read(gsr_audio_ring *self);
+void gsr_audio_ring_release(gsr_audio_ring *self, gsr_audio_ring_frame *frame);
+
+/* Can be called from any thread. Returns the number of samples that have been dropped since the last call */
+uint64_t gsr_audio_ring_take_num_dropped_samples(gsr_audio_ring *self);
+
+#endif /* GSR_AUDIO_RING_H */
@@ -8,22 +8,41 @@ typedef struct AVFrame AVFrame;
 
 typedef struct gsr_capture gsr_capture;
 
+/*
+    Returned by |gsr_capture_capture| when the image is the same as in the previous capture.
+    The image is still written to the frame, unless |skip_unchanged_frames| is set
+*/
+#define GSR_CAPTURE_FRAME_UNCHANGED 1
+
 struct gsr_capture {
     /* These methods should not be called manually. Call gsr_capture_* instead */
     int (*start)(gsr_capture *cap, AVCodecContext *video_codec_context);
     void (*tick)(gsr_capture *cap, AVCodecContext *video_codec_context, AVFrame **frame); /* can be NULL */
     bool (*should_stop)(gsr_capture *cap, bool *err); /* can be NULL */
     int (*capture)(gsr_capture *cap, AVFrame *frame);
+    int (*get_event_fd)(gsr_capture *cap); /* can be NULL */
     void (*destroy)(gsr_capture *cap, AVCodecContext *video_codec_context);
 
     void *priv; /* can be NULL */
     bool started;
+    /*
+        True if |capture| writes the image into the hardware buffer that |frame| already has, instead of pointing |frame| at a buffer owned by the capture.
+        Then every capture can go into a different frame, which can wait to be encoded while the next one is captured
+    */
+    bool captures_into_frame_buffer;
+    /* Set by the caller before |gsr_capture_capture|, when unchanged frames aren't going to be used. Then nothing is copied if the image hasn't changed */
+    bool skip_unchanged_frames;
 };
 
 int gsr_capture_start(gsr_capture *cap, AVCodecContext *video_codec_context);
 void gsr_capture_tick(gsr_capture *cap, AVCodecContext *video_codec_context, AVFrame **frame);
 bool gsr_capture_should_stop(gsr_capture *cap, bool *err);
 int gsr_capture_capture(gsr_capture *cap, AVFrame *frame);
+/*
+    Returns a file descriptor that becomes readable when there are events (for example X11 events) that |gsr_capture_tick| should handle
+    before the next frame is captured, or -1 if there is none. Calling |gsr_capture_tick| handles all the events that made it readable.
+*/
+int gsr_capture_get_event_fd(gsr_capture *cap);
 /* Calls |gsr_capture_stop| as well */
 void gsr_capture_destroy(gsr_capture *cap, AVCodecContext *video_codec_context);
 
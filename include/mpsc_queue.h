@@ -0,0 +1,32 @@
+#ifndef GSR_MPSC_QUEUE_H
+#define GSR_MPSC_QUEUE_H
+
+/*
+    Bounded lock-free queue of pointers for any number of producer threads and exactly one consumer thread.
+    Pushing and popping never block and never allocate, the storage is allocated when the queue is created.
+    Each slot has a sequence number that tells whether it's free or filled for the current lap around the ring,
+    so producers only have to agree on the write position (with a compare and swap) and never wait for each other.
+*/
+
+#include <stddef.h>
+#include <stdbool.h>
+
+typedef struct gsr_mpsc_queue gsr_mpsc_queue;
+
+/* |capacity| is rounded up to a power of two. Returns NULL on failure */
+gsr_mpsc_queue* gsr_mpsc_queue_create(size_t capacity);
+void gsr_mpsc_queue_destroy(gsr_mpsc_queue *self);
+
+/* Can be called from any thread. Returns false if the queue is full */
+bool gsr_mpsc_queue_push(gsr_mpsc_queue *self, void *item);
+/*
+    Can only be called from the consumer thread. Returns false if the queue is empty, or if the oldest item is still being pushed
+    (another producer could have finished pushing a newer item already, it's returned once the oldest one is there).
+*/
+bool gsr_mpsc_queue_pop(gsr_mpsc_queue *self, void **item);
+
+/* Can be called from any thread, but the size can change right after it's returned */
+size_t gsr_mpsc_queue_size(const gsr_mpsc_queue *self);
+size_t gsr_mpsc_queue_capacity(const gsr_mpsc_queue *self);
+
+#endif /* GSR_MPSC_QUEUE_H */
@@ -0,0 +1,181 @@
+#ifndef GSR_REPLAY_BUFFER_H
+#define GSR_REPLAY_BUFFER_H
+
+/*
+    Replay buffer store. Packet data is copied into one large ring arena that is allocated up front,
+    so memory usage stays flat no matter how long the recording runs.
+    Packets are evicted a whole gop at a time (everything before the next keyframe of |keyframe_stream_index|)
+    when either the byte limit or the duration limit is reached, so the replay buffer always starts with a keyframe.
+    Optionally there is a second, larger ring in a preallocated file that is mapped into memory. Gops that don't fit in memory
+    anymore are moved there instead of being evicted, so long replays don't need a lot of memory.
+    This is not thread safe, the caller has to synchronize access. The exception is reading a snapshot,
+    which can be done from another thread without a lock while packets are being added.
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef enum {
+    GSR_REPLAY_BUFFER_MEMORY_DEFAULT,
+    GSR_REPLAY_BUFFER_MEMORY_LOCKED,   /* The arena is mlock'd so it can never be swapped out */
+    GSR_REPLAY_BUFFER_MEMORY_HUGEPAGES /* The arena is backed by huge pages (and mlock'd). Falls back to transparent huge pages if no huge pages are reserved */
+} gsr_replay_buffer_memory;
+
+#define GSR_REPLAY_BUFFER_MAX_STREAM_INFO_SIZE (64 * 1024)
+
+typedef struct {
+    size_t max_bytes; /* Hard limit of the memory used for packets in bytes, this includes a small header for each packet. An eighth of it is kept for the spill ring, see |gsr_replay_buffer_append| */
+    double max_duration_secs; /* The replay buffer is at least this long, as long as it fits in |max_bytes|. It's at most one gop longer */
+    int keyframe_stream_index; /* The stream whose keyframes packets are evicted by, usually the video stream. -1 to evict one packet at a time */
+    gsr_replay_buffer_memory memory;
+    const char *disk_filepath; /* File for the disk ring, it's created if it doesn't exist. NULL to keep everything in memory */
+    size_t disk_max_bytes; /* Size of the disk ring file in bytes. Only used if |disk_filepath| is set */
+    /*
+        Name of a shared memory object (see shm_open) for the memory arena, NULL to use private memory. The object is created if it doesn't exist and it's not removed
+        when the replay buffer is destroyed, or when the process dies. If it was created with the same |max_bytes|, |keyframe_stream_index| and |stream_info|
+        then the packets in it are kept and new packets are added after them (see |gsr_replay_buffer_get_resume_timestamp|), otherwise it's cleared.
+        Other processes can read it with |gsr_replay_buffer_reader_open|. Only the memory ring is shared, the disk ring starts empty.
+    */
+    const char *shm_name;
+    /* Stored in the shared memory object, for readers to know how to interpret the packets. Only used if |shm_name| is set */
+    const void *stream_info;
+    size_t stream_info_size; /* At most GSR_REPLAY_BUFFER_MAX_STREAM_INFO_SIZE */
+} gsr_replay_buffer_params;
+
+#define GSR_REPLAY_PACKET_FLAG_KEY           (1 << 0)
+/* Set by the replay buffer on the first packet that was added after packets were dropped, and by snapshots on the first packet after packets that are missing from the snapshot */
+#define GSR_REPLAY_PACKET_FLAG_DISCONTINUITY (1 << 1)
+
+typedef struct {
+    const uint8_t *data;
+    uint32_t size;
+    int stream_index;
+    int flags; /* GSR_REPLAY_PACKET_FLAG_* */
+    int64_t pts;
+    int64_t dts;
+    /*
+        Presentation time of the packet in seconds, on the same clock for every stream (for example the pts in seconds).
+        The duration limit only looks at the timestamps of |keyframe_stream_index|, so the streams don't have to be added in timestamp order
+    */
+    double timestamp;
+    /* Only set when reading packets. If the packet is in the disk ring this is the file and the offset of the data in the file, otherwise |fd| is -1 */
+    int fd;
+    int64_t fd_offset;
+} gsr_replay_packet;
+
+typedef struct gsr_replay_buffer gsr_replay_buffer;
+
+/* The disk ring has the oldest packets, the memory ring the newest */
+#define GSR_REPLAY_BUFFER_RING_DISK   0
+#define GSR_REPLAY_BUFFER_RING_MEMORY 1
+#define GSR_REPLAY_BUFFER_NUM_RINGS   2
+
+typedef struct {
+    int ring;
+    uint64_t pos;
+} gsr_replay_buffer_iterator;
+
+#define GSR_REPLAY_BUFFER_MAX_SNAPSHOTS 8
+
+/*
+    A view of the packets that were in the replay buffer when the snapshot was created.
+    The packets are not copied. Instead the snapshot pins the part of the arena it hasn't read yet,
+    so that it isn't overwritten while the snapshot is read.
+    Packets that are moved to the disk ring while the snapshot is read are read from the disk ring instead.
+*/
+typedef struct {
+    gsr_replay_buffer *buffer;
+    int pin_index;
+    int ring;
+    uint64_t pos[GSR_REPLAY_BUFFER_NUM_RINGS];
+    uint64_t seq; /* Sequence number of the next packet */
+    uint64_t end_seq;
+    double end_timestamp;
+} gsr_replay_buffer_snapshot;
+
+/* Returns NULL on failure */
+gsr_replay_buffer* gsr_replay_buffer_create(const gsr_replay_buffer_params *params);
+void gsr_replay_buffer_destroy(gsr_replay_buffer *self);
+
+/*
+    Copies the packet data into the memory arena, evicting (or moving to the disk ring) the oldest packets to make room for it.
+    If snapshots are pinning the space that is needed, the packet is copied to the spill ring instead, which is an eighth of |max_bytes| that is allocated up front,
+    and it's moved to the arena once the space is free. Spilled packets are not part of the replay buffer (or of new snapshots) until then.
+    Returns false if the packet is dropped: when it's larger than the whole arena, or when the spill ring is full.
+    After a packet of |keyframe_stream_index| is dropped, the packets of that stream are dropped until its next keyframe, so that a gop is never
+    missing packets. The first packet that is added after a drop has GSR_REPLAY_PACKET_FLAG_DISCONTINUITY set.
+*/
+bool gsr_replay_buffer_append(gsr_replay_buffer *self, const gsr_replay_packet *packet);
+
+size_t gsr_replay_buffer_get_num_packets(const gsr_replay_buffer *self);
+/* Returns the number of bytes of the arenas that are in use */
+size_t gsr_replay_buffer_get_size_bytes(const gsr_replay_buffer *self);
+/* Returns the number of packets that were dropped, see |gsr_replay_buffer_append| */
+uint64_t gsr_replay_buffer_get_num_dropped_packets(const gsr_replay_buffer *self);
+/*
+    Returns true if the replay buffer continues the packets of a previous process (see |shm_name|). The timestamps of new packets should
+    continue from |timestamp|, which is the timestamp of the newest packet plus the time that has passed since it was added.
+*/
+bool gsr_replay_buffer_get_resume_timestamp(const gsr_replay_buffer *self, double *timestamp);
+
+gsr_replay_buffer_iterator gsr_replay_buffer_begin(const gsr_replay_buffer *self);
+/*
+    Sets |it| to the oldest keyframe of |keyframe_stream_index|. This is O(1).
+    Returns false if there is no keyframe in the replay buffer.
+*/
+bool gsr_replay_buffer_find_first_keyframe(const gsr_replay_buffer *self, gsr_replay_buffer_iterator *it);
+/*
+    Sets |it| to the newest keyframe of |keyframe_stream_index| that was added before or at |timestamp|,
+    or to the oldest keyframe if they were all added after |timestamp|. This is O(log n).
+    Returns false if there is no keyframe in the replay buffer.
+*/
+bool gsr_replay_buffer_find_keyframe_before(const gsr_replay_buffer *self, double timestamp, gsr_replay_buffer_iterator *it);
+/*
+    Returns the packet at |it| in |packet| and moves |it| to the next packet, from oldest to newest.
+    |packet->data| points into the arena and is only valid until the replay buffer is modified.
+    Returns false when there are no more packets.
+*/
+bool gsr_replay_buffer_next(const gsr_replay_buffer *self, gsr_replay_buffer_iterator *it, gsr_replay_packet *packet);
+
+/*
+    Creates a snapshot of the packets from |start| to the newest packet, leaving out packets with a timestamp after |end_timestamp|
+    (use INFINITY to include all of them). The snapshot ends at the first packet of |keyframe_stream_index| after |end_timestamp|. This is O(1).
+    This has to be called with the same synchronization as |gsr_replay_buffer_append|.
+    Returns false if there are already GSR_REPLAY_BUFFER_MAX_SNAPSHOTS snapshots.
+*/
+bool gsr_replay_buffer_snapshot_create(gsr_replay_buffer *self, const gsr_replay_buffer_iterator *start, double end_timestamp, gsr_replay_buffer_snapshot *snapshot);
+/* Releases the pin. This can be called from any thread */
+void gsr_replay_buffer_snapshot_destroy(gsr_replay_buffer_snapshot *snapshot);
+/*
+    Returns the next packet of the snapshot in |packet|, from oldest to newest. This doesn't need a lock.
+    |packet->data| is only valid until the next call to this function or until the snapshot is destroyed.
+    If packets in the range of the snapshot were evicted before they were read, the packet after them has GSR_REPLAY_PACKET_FLAG_DISCONTINUITY set.
+    Returns false when there are no more packets.
+*/
+bool gsr_replay_buffer_snapshot_next(gsr_replay_buffer_snapshot *snapshot, gsr_replay_packet *packet);
+
+/*
+    Reads the replay buffer in a shared memory object (see |shm_name|) from another process, while the replay buffer is being recorded to.
+    The mapping is read-only so nothing is pinned. Instead each packet is copied and then checked to not have been overwritten in the meantime.
+*/
+typedef struct gsr_replay_buffer_reader gsr_replay_buffer_reader;
+
+/* Returns NULL on failure */
+gsr_replay_buffer_reader* gsr_replay_buffer_reader_open(const char *shm_name);
+void gsr_replay_buffer_reader_close(gsr_replay_buffer_reader *self);
+/* Returns the |stream_info| the replay buffer was created with */
+const void* gsr_replay_buffer_reader_get_stream_info(const gsr_replay_buffer_reader *self, size_t *size);
+/*
+    Moves the reader to the newest keyframe of |keyframe_stream_index| that is |duration_secs| or more before the newest packet,
+    or to the oldest keyframe if there is none or if |duration_secs| is 0. The reader stops at the packet that is the newest when this is called.
+    Returns false if there is no keyframe.
+*/
+bool gsr_replay_buffer_reader_seek(gsr_replay_buffer_reader *self, double duration_secs);
+/*
+    Copies the next packet to |packet|, |packet->data| is valid until the next call. Returns false when there are no more packets,
+    or if the recording overwrote the packets before they could be read (which only happens if reading is slower than recording).
+*/
+bool gsr_replay_buffer_reader_next(gsr_replay_buffer_reader *self, gsr_replay_packet *packet);
+
+#endif /* GSR_REPLAY_BUFFER_H */
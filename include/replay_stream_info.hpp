@@ -0,0 +1,45 @@
+#ifndef GSR_REPLAY_STREAM_INFO_HPP
+#define GSR_REPLAY_STREAM_INFO_HPP
+
+#include <stdint.h>
+
+struct AVCodecContext;
+struct AVCodecParameters;
+
+#define REPLAY_STREAM_INFO_MAX_STREAMS 16
+#define REPLAY_STREAM_INFO_MAX_EXTRADATA_SIZE 1024
+
+/*
+    Describes a stream of a replay buffer that is in shared memory, so that another process can mux its packets (see gpu-screen-recorder-replay-export).
+    This is stored in the shared memory as it is, so it can't have pointers. It's compared byte by byte to check if a replay buffer
+    can be continued, so it has to be zero initialized.
+*/
+struct ReplayStreamInfo {
+    int32_t codec_type;
+    int32_t codec_id;
+    int32_t format;
+    int32_t width;
+    int32_t height;
+    int32_t sample_rate;
+    int32_t num_channels;
+    int32_t frame_size;
+    int32_t time_base_num;
+    int32_t time_base_den;
+    int32_t framerate_num;
+    int32_t framerate_den;
+    uint32_t extradata_size;
+    uint8_t extradata[REPLAY_STREAM_INFO_MAX_EXTRADATA_SIZE];
+};
+
+/* The stream index of the packets in the replay buffer is the index in |streams| */
+struct ReplayStreamsInfo {
+    uint32_t num_streams;
+    ReplayStreamInfo streams[REPLAY_STREAM_INFO_MAX_STREAMS];
+};
+
+/* |codec_context| has to be opened. Returns false if there are too many streams or if the extradata is too large */
+bool replay_streams_info_add(ReplayStreamsInfo &streams_info, const AVCodecContext *codec_context);
+/* Returns false on failure */
+bool replay_stream_info_to_codec_parameters(const ReplayStreamInfo &stream_info, AVCodecParameters *codecpar);
+
+#endif /* GSR_REPLAY_STREAM_INFO_HPP */
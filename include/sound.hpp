@@ -20,6 +20,7 @@
 
 #include <vector>
 #include <string>
+#include <functional>
 
 typedef struct {
     void *handle;
@@ -41,6 +42,13 @@ typedef enum {
     F32
 } AudioFormat;
 
+/*
+    Called with a chunk of audio of a device, @frames frames (the period size of the device).
+    @buffer is only valid until the callback returns.
+    @timestamp is the CLOCK_MONOTONIC time in seconds when the first frame was recorded, estimated from the latency the server reports.
+*/
+using SoundDeviceReadCallback = std::function<void(const void *buffer, unsigned int frames, double timestamp)>;
+
 /*
     Get a sound device by name, returning the device into the @device parameter.
     The device should be closed with @sound_device_close after it has been used
@@ -52,10 +60,18 @@ int sound_device_get_by_name(SoundDevice *device, const char *device_name, const
 void sound_device_close(SoundDevice *device);
 
 /*
-    Returns the next chunk of audio into @buffer.
-    Returns the number of frames read, or a negative value on failure.
+    @read_callback is called every time the device has received a chunk of audio (@period_frame_size frames),
+    from the thread that calls @sound_devices_iterate. Audio that is received before the callback is set is dropped.
+*/
+void sound_device_set_read_callback(SoundDevice *device, SoundDeviceReadCallback read_callback);
+
+/*
+    Waits until any of the open sound devices has audio, or until @timeout_ms milliseconds have passed, and calls
+    the read callbacks of the devices that have a full chunk of audio. All devices are read by the thread that calls this,
+    devices can't be opened or closed while it's running.
+    Returns a negative value on failure (for example if the connection to the server was lost).
 */
-int sound_device_read_next_chunk(SoundDevice *device, void **buffer);
+int sound_devices_iterate(int timeout_ms);
 
 std::vector<AudioInput> get_pulseaudio_inputs();
 
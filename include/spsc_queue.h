@@ -0,0 +1,28 @@
+#ifndef GSR_SPSC_QUEUE_H
+#define GSR_SPSC_QUEUE_H
+
+/*
+    Bounded lock-free queue of pointers for exactly one producer thread and one consumer thread.
+    Pushing and popping never block and never allocate, the storage is allocated when the queue is created.
+    The producer and the consumer only write to their own index, which are on separate cache lines.
+*/
+
+#include <stddef.h>
+#include <stdbool.h>
+
+typedef struct gsr_spsc_queue gsr_spsc_queue;
+
+/* |capacity| is rounded up to a power of two. Returns NULL on failure */
+gsr_spsc_queue* gsr_spsc_queue_create(size_t capacity);
+void gsr_spsc_queue_destroy(gsr_spsc_queue *self);
+
+/* Can only be called from the producer thread. Returns false if the queue is full */
+bool gsr_spsc_queue_push(gsr_spsc_queue *self, void *item);
+/* Can only be called from the consumer thread. Returns false if the queue is empty */
+bool gsr_spsc_queue_pop(gsr_spsc_queue *self, void **item);
+
+/* Can be called from any thread, but the size can change right after it's returned */
+size_t gsr_spsc_queue_size(const gsr_spsc_queue *self);
+size_t gsr_spsc_queue_capacity(const gsr_spsc_queue *self);
+
+#endif /* GSR_SPSC_QUEUE_H */
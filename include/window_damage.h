@@ -0,0 +1,34 @@
+#ifndef WINDOW_DAMAGE_H
+#define WINDOW_DAMAGE_H
+
+#include <X11/Xlib.h>
+#include <X11/extensions/Xdamage.h>
+#include <stdbool.h>
+
+/*
+    Tracks if a window has been redrawn since it was last captured, with the XDamage extension.
+    If the X server doesn't support XDamage then the window is always reported as damaged.
+*/
+typedef struct {
+    Display *display;
+    Window window;
+    Damage damage;
+    int damage_event;
+    bool supported;
+    bool damaged;
+} WindowDamage;
+
+void window_damage_init(WindowDamage *self, Display *display);
+void window_damage_deinit(WindowDamage *self);
+
+/* Starts tracking |window| instead of the previous window. The window is reported as damaged until the next |window_damage_clear| */
+void window_damage_set_window(WindowDamage *self, Window window);
+/* Handles the damage events in the event queue of the display. Should be called before |window_damage_is_damaged| */
+void window_damage_update(WindowDamage *self);
+bool window_damage_is_damaged(const WindowDamage *self);
+/* Call this right before copying the window contents. Damage that happens after this is reported by the next |window_damage_update| */
+void window_damage_clear(WindowDamage *self);
+/* For when the captured image has to be updated for another reason, for example because the window was resized */
+void window_damage_set_damaged(WindowDamage *self);
+
+#endif /* WINDOW_DAMAGE_H */
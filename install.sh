@@ -8,4 +8,6 @@ cd "$script_dir"
 ./build.sh
 install -Dm755 "gpu-screen-recorder" "/usr/local/bin/gpu-screen-recorder"
 install -Dm755 "gpu-screen-recorder" "/usr/bin/gpu-screen-recorder"
+install -Dm755 "gpu-screen-recorder-replay-export" "/usr/local/bin/gpu-screen-recorder-replay-export"
+install -Dm755 "gpu-screen-recorder-replay-export" "/usr/bin/gpu-screen-recorder-replay-export"
 echo "Successfully installed gpu-screen-recorder"
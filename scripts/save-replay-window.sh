@@ -0,0 +1,10 @@
+#!/bin/sh -e
+
+[ "$#" -lt 1 ] && echo "usage: save-replay-window.sh <duration_sec> [end_offset_sec]" && exit 1
+end_offset="${2:-0}"
+
+# The duration and end offset are sent as the signal value, this requires kill from util-linux
+/usr/bin/kill --queue "$(( $1 | (end_offset << 16) ))" -SIGUSR1 $(pidof gpu-screen-recorder)
+
+# The recorder saves the replay in the background and prints the path of the file to stdout when it is done, this only knows that saving started
+notify-send -t 5000 -u low -- "GPU Screen Recorder" "Saving replay…"
@@ -0,0 +1,18 @@
+#!/bin/sh
+
+# Live stream to a local tcp sink that only reads <kbps> kilobits per second, to see how a slow upload is handled (see -ba and -wq).
+# The rate can be changed while streaming with: pv -R "$(pidof pv)" -L <bytes_per_sec>
+# Requires socat and pv
+
+[ "$#" -lt 3 ] && echo "usage: throttled-stream-test.sh <window_id> <fps> <kbps> [gpu-screen-recorder options...]" && exit 1
+window="$1"
+fps="$2"
+rate="$3"
+shift 3
+port=54321
+
+socat -u "TCP-LISTEN:$port,reuseaddr" SYSTEM:"pv -q -L $((rate * 125)) > /dev/null" &
+sink_pid=$!
+trap 'kill "$sink_pid" 2>/dev/null' EXIT
+sleep 0.5
+gpu-screen-recorder -w "$window" -c flv -f "$fps" "$@" -o "tcp://127.0.0.1:$port"
@@ -0,0 +1,385 @@
+#include "../include/audio_mixer.h"
+#include <stdint.h>
+#include <math.h>
+#include <stdio.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define GSR_AUDIO_MIXER_X86
+#include <immintrin.h>
+#define GSR_TARGET_AVX2 __attribute__((target("avx2")))
+#define GSR_ALWAYS_INLINE __attribute__((always_inline))
+#elif defined(__aarch64__)
+#define GSR_AUDIO_MIXER_NEON
+#include <arm_neon.h>
+#endif
+
+/* The largest floats that fit in the integer formats. 2147483647 can't be represented as a float, 2147483520 is the one below it */
+#define S16_MIN -32768.0f
+#define S16_MAX 32767.0f
+#define S32_MIN -2147483648.0f
+#define S32_MAX 2147483520.0f
+
+static float clampf(float value, float min, float max) {
+    return value < min ? min : (value > max ? max : value);
+}
+
+/* Mixes samples [start, end) one at a time. Also used for the samples at the end that don't fill a whole vector */
+static void mix_scalar(gsr_audio_mixer_format format, void *output, const void *const *inputs, const float *gains, int num_inputs, size_t start, size_t end) {
+    for(size_t i = start; i < end; ++i) {
+        float sum = 0.0f;
+        switch(format) {
+            case GSR_AUDIO_MIXER_FORMAT_S16:
+                for(int j = 0; j < num_inputs; ++j)
+                    sum += (float)((const int16_t*)inputs[j])[i] * gains[j];
+                ((int16_t*)output)[i] = (int16_t)lrintf(clampf(sum, S16_MIN, S16_MAX));
+                break;
+            case GSR_AUDIO_MIXER_FORMAT_S32:
+                for(int j = 0; j < num_inputs; ++j)
+                    sum += (float)((const int32_t*)inputs[j])[i] * gains[j];
+                ((int32_t*)output)[i] = (int32_t)lrintf(clampf(sum, S32_MIN, S32_MAX));
+                break;
+            case GSR_AUDIO_MIXER_FORMAT_F32:
+                for(int j = 0; j < num_inputs; ++j)
+                    sum += ((const float*)inputs[j])[i] * gains[j];
+                ((float*)output)[i] = clampf(sum, -1.0f, 1.0f);
+                break;
+        }
+    }
+}
+
+/* Converts frames [start, end) one sample at a time */
+static void deinterleave_f32_scalar(const float *input, float *const *outputs, int num_channels, size_t start, size_t end) {
+    for(size_t i = start; i < end; ++i) {
+        for(int c = 0; c < num_channels; ++c)
+            outputs[c][i] = input[i * num_channels + c];
+    }
+}
+
+#ifdef GSR_AUDIO_MIXER_X86
+static bool buffers_are_aligned(const void *buffer, const void *const *buffers, int num_buffers) {
+    uintptr_t address_bits = (uintptr_t)buffer;
+    for(int i = 0; i < num_buffers; ++i)
+        address_bits |= (uintptr_t)buffers[i];
+    return (address_bits & (GSR_AUDIO_MIXER_ALIGNMENT - 1)) == 0;
+}
+
+/*
+    The loads and stores take |aligned|, which is a constant where the kernels are inlined, so each kernel is compiled once with aligned
+    and once with unaligned loads and stores. The aligned version is used when all the buffers are aligned to GSR_AUDIO_MIXER_ALIGNMENT
+*/
+static inline __m128 load_ps(const float *data, bool aligned) { return aligned ? _mm_load_ps(data) : _mm_loadu_ps(data); }
+static inline void store_ps(float *data, __m128 value, bool aligned) { if(aligned) _mm_store_ps(data, value); else _mm_storeu_ps(data, value); }
+static inline __m128i load_si128(const __m128i *data, bool aligned) { return aligned ? _mm_load_si128(data) : _mm_loadu_si128(data); }
+static inline void store_si128(__m128i *data, __m128i value, bool aligned) { if(aligned) _mm_store_si128(data, value); else _mm_storeu_si128(data, value); }
+GSR_TARGET_AVX2 static inline __m256 load256_ps(const float *data, bool aligned) { return aligned ? _mm256_load_ps(data) : _mm256_loadu_ps(data); }
+GSR_TARGET_AVX2 static inline void store256_ps(float *data, __m256 value, bool aligned) { if(aligned) _mm256_store_ps(data, value); else _mm256_storeu_ps(data, value); }
+GSR_TARGET_AVX2 static inline __m256i load256_si256(const __m256i *data, bool aligned) { return aligned ? _mm256_load_si256(data) : _mm256_loadu_si256(data); }
+GSR_TARGET_AVX2 static inline void store256_si256(__m256i *data, __m256i value, bool aligned) { if(aligned) _mm256_store_si256(data, value); else _mm256_storeu_si256(data, value); }
+
+/* 4 samples at a time. SSE2 is always available on x86_64 */
+GSR_ALWAYS_INLINE
+static inline size_t mix_sse2_impl(gsr_audio_mixer_format format, void *output, const void *const *inputs, const float *gains, int num_inputs, size_t num_samples, bool aligned) {
+    const size_t num_vector_samples = num_samples & ~(size_t)3;
+    switch(format) {
+        case GSR_AUDIO_MIXER_FORMAT_S16:
+            for(size_t i = 0; i < num_vector_samples; i += 4) {
+                __m128 sum = _mm_setzero_ps();
+                for(int j = 0; j < num_inputs; ++j) {
+                    const __m128i samples16 = _mm_loadl_epi64((const __m128i*)((const int16_t*)inputs[j] + i));
+                    /* Sign extends to 32-bit by putting the samples in the upper half and shifting them down */
+                    const __m128i samples32 = _mm_srai_epi32(_mm_unpacklo_epi16(samples16, samples16), 16);
+                    sum = _mm_add_ps(sum, _mm_mul_ps(_mm_cvtepi32_ps(samples32), _mm_set1_ps(gains[j])));
+                }
+                sum = _mm_min_ps(_mm_max_ps(sum, _mm_set1_ps(S16_MIN)), _mm_set1_ps(S16_MAX));
+                const __m128i result32 = _mm_cvtps_epi32(sum);
+                _mm_storel_epi64((__m128i*)((int16_t*)output + i), _mm_packs_epi32(result32, result32));
+            }
+            break;
+        case GSR_AUDIO_MIXER_FORMAT_S32:
+            for(size_t i = 0; i < num_vector_samples; i += 4) {
+                __m128 sum = _mm_setzero_ps();
+                for(int j = 0; j < num_inputs; ++j) {
+                    const __m128i samples = load_si128((const __m128i*)((const int32_t*)inputs[j] + i), aligned);
+                    sum = _mm_add_ps(sum, _mm_mul_ps(_mm_cvtepi32_ps(samples), _mm_set1_ps(gains[j])));
+                }
+                sum = _mm_min_ps(_mm_max_ps(sum, _mm_set1_ps(S32_MIN)), _mm_set1_ps(S32_MAX));
+                store_si128((__m128i*)((int32_t*)output + i), _mm_cvtps_epi32(sum), aligned);
+            }
+            break;
+        case GSR_AUDIO_MIXER_FORMAT_F32:
+            for(size_t i = 0; i < num_vector_samples; i += 4) {
+                __m128 sum = _mm_setzero_ps();
+                for(int j = 0; j < num_inputs; ++j)
+                    sum = _mm_add_ps(sum, _mm_mul_ps(load_ps((const float*)inputs[j] + i, aligned), _mm_set1_ps(gains[j])));
+                sum = _mm_min_ps(_mm_max_ps(sum, _mm_set1_ps(-1.0f)), _mm_set1_ps(1.0f));
+                store_ps((float*)output + i, sum, aligned);
+            }
+            break;
+    }
+    return num_vector_samples;
+}
+
+static size_t mix_sse2(gsr_audio_mixer_format format, void *output, const void *const *inputs, const float *gains, int num_inputs, size_t num_samples) {
+    if(buffers_are_aligned(output, inputs, num_inputs))
+        return mix_sse2_impl(format, output, inputs, gains, num_inputs, num_samples, true);
+    return mix_sse2_impl(format, output, inputs, gains, num_inputs, num_samples, false);
+}
+
+/* 4 stereo frames at a time */
+GSR_ALWAYS_INLINE
+static inline size_t deinterleave_stereo_f32_sse2_impl(const float *input, float *left, float *right, size_t num_frames, bool aligned) {
+    const size_t num_vector_frames = num_frames & ~(size_t)3;
+    for(size_t i = 0; i < num_vector_frames; i += 4) {
+        const __m128 a = load_ps(input + i * 2, aligned);     /* l0 r0 l1 r1 */
+        const __m128 b = load_ps(input + i * 2 + 4, aligned); /* l2 r2 l3 r3 */
+        store_ps(left + i, _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)), aligned);
+        store_ps(right + i, _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)), aligned);
+    }
+    return num_vector_frames;
+}
+
+static size_t deinterleave_stereo_f32_sse2(const float *input, float *left, float *right, size_t num_frames) {
+    const void *const buffers[2] = { left, right };
+    if(buffers_are_aligned(input, buffers, 2))
+        return deinterleave_stereo_f32_sse2_impl(input, left, right, num_frames, true);
+    return deinterleave_stereo_f32_sse2_impl(input, left, right, num_frames, false);
+}
+
+/* 8 samples at a time */
+GSR_TARGET_AVX2 GSR_ALWAYS_INLINE
+static inline size_t mix_avx2_impl(gsr_audio_mixer_format format, void *output, const void *const *inputs, const float *gains, int num_inputs, size_t num_samples, bool aligned) {
+    const size_t num_vector_samples = num_samples & ~(size_t)7;
+    switch(format) {
+        case GSR_AUDIO_MIXER_FORMAT_S16:
+            for(size_t i = 0; i < num_vector_samples; i += 8) {
+                __m256 sum = _mm256_setzero_ps();
+                for(int j = 0; j < num_inputs; ++j) {
+                    const __m128i samples16 = load_si128((const __m128i*)((const int16_t*)inputs[j] + i), aligned);
+                    sum = _mm256_add_ps(sum, _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(samples16)), _mm256_set1_ps(gains[j])));
+                }
+                sum = _mm256_min_ps(_mm256_max_ps(sum, _mm256_set1_ps(S16_MIN)), _mm256_set1_ps(S16_MAX));
+                const __m256i result32 = _mm256_cvtps_epi32(sum);
+                /* _mm256_packs_epi32 packs within each 128-bit lane, so the halves are packed with the 128-bit version instead */
+                const __m128i result16 = _mm_packs_epi32(_mm256_castsi256_si128(result32), _mm256_extracti128_si256(result32, 1));
+                store_si128((__m128i*)((int16_t*)output + i), result16, aligned);
+            }
+            break;
+        case GSR_AUDIO_MIXER_FORMAT_S32:
+            for(size_t i = 0; i < num_vector_samples; i += 8) {
+                __m256 sum = _mm256_setzero_ps();
+                for(int j = 0; j < num_inputs; ++j) {
+                    const __m256i samples = load256_si256((const __m256i*)((const int32_t*)inputs[j] + i), aligned);
+                    sum = _mm256_add_ps(sum, _mm256_mul_ps(_mm256_cvtepi32_ps(samples), _mm256_set1_ps(gains[j])));
+                }
+                sum = _mm256_min_ps(_mm256_max_ps(sum, _mm256_set1_ps(S32_MIN)), _mm256_set1_ps(S32_MAX));
+                store256_si256((__m256i*)((int32_t*)output + i), _mm256_cvtps_epi32(sum), aligned);
+            }
+            break;
+        case GSR_AUDIO_MIXER_FORMAT_F32:
+            for(size_t i = 0; i < num_vector_samples; i += 8) {
+                __m256 sum = _mm256_setzero_ps();
+                for(int j = 0; j < num_inputs; ++j)
+                    sum = _mm256_add_ps(sum, _mm256_mul_ps(load256_ps((const float*)inputs[j] + i, aligned), _mm256_set1_ps(gains[j])));
+                sum = _mm256_min_ps(_mm256_max_ps(sum, _mm256_set1_ps(-1.0f)), _mm256_set1_ps(1.0f));
+                store256_ps((float*)output + i, sum, aligned);
+            }
+            break;
+    }
+    return num_vector_samples;
+}
+
+GSR_TARGET_AVX2
+static size_t mix_avx2(gsr_audio_mixer_format format, void *output, const void *const *inputs, const float *gains, int num_inputs, size_t num_samples) {
+    if(buffers_are_aligned(output, inputs, num_inputs))
+        return mix_avx2_impl(format, output, inputs, gains, num_inputs, num_samples, true);
+    return mix_avx2_impl(format, output, inputs, gains, num_inputs, num_samples, false);
+}
+
+/* 8 stereo frames at a time */
+GSR_TARGET_AVX2 GSR_ALWAYS_INLINE
+static inline size_t deinterleave_stereo_f32_avx2_impl(const float *input, float *left, float *right, size_t num_frames, bool aligned) {
+    const size_t num_vector_frames = num_frames & ~(size_t)7;
+    for(size_t i = 0; i < num_vector_frames; i += 8) {
+        const __m256 a = load256_ps(input + i * 2, aligned);     /* l0 r0 l1 r1 | l2 r2 l3 r3 */
+        const __m256 b = load256_ps(input + i * 2 + 8, aligned); /* l4 r4 l5 r5 | l6 r6 l7 r7 */
+        /* The shuffle works within each 128-bit lane, which gives l0 l1 l4 l5 | l2 l3 l6 l7. The 64-bit pairs are put back in order after it */
+        const __m256 left_shuffled = _mm256_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0));
+        const __m256 right_shuffled = _mm256_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1));
+        store256_ps(left + i, _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(left_shuffled), _MM_SHUFFLE(3, 1, 2, 0))), aligned);
+        store256_ps(right + i, _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(right_shuffled), _MM_SHUFFLE(3, 1, 2, 0))), aligned);
+    }
+    return num_vector_frames;
+}
+
+GSR_TARGET_AVX2
+static size_t deinterleave_stereo_f32_avx2(const float *input, float *left, float *right, size_t num_frames) {
+    const void *const buffers[2] = { left, right };
+    if(buffers_are_aligned(input, buffers, 2))
+        return deinterleave_stereo_f32_avx2_impl(input, left, right, num_frames, true);
+    return deinterleave_stereo_f32_avx2_impl(input, left, right, num_frames, false);
+}
+#endif /* GSR_AUDIO_MIXER_X86 */
+
+#ifdef GSR_AUDIO_MIXER_NEON
+/* 4 samples at a time. NEON is always available on aarch64 */
+static size_t mix_neon(gsr_audio_mixer_format format, void *output, const void *const *inputs, const float *gains, int num_inputs, size_t num_samples) {
+    const size_t num_vector_samples = num_samples & ~(size_t)3;
+    switch(format) {
+        case GSR_AUDIO_MIXER_FORMAT_S16:
+            for(size_t i = 0; i < num_vector_samples; i += 4) {
+                float32x4_t sum = vdupq_n_f32(0.0f);
+                for(int j = 0; j < num_inputs; ++j) {
+                    const int32x4_t samples = vmovl_s16(vld1_s16((const int16_t*)inputs[j] + i));
+                    sum = vmlaq_n_f32(sum, vcvtq_f32_s32(samples), gains[j]);
+                }
+                sum = vminq_f32(vmaxq_f32(sum, vdupq_n_f32(S16_MIN)), vdupq_n_f32(S16_MAX));
+                vst1_s16((int16_t*)output + i, vqmovn_s32(vcvtnq_s32_f32(sum)));
+            }
+            break;
+        case GSR_AUDIO_MIXER_FORMAT_S32:
+            for(size_t i = 0; i < num_vector_samples; i += 4) {
+                float32x4_t sum = vdupq_n_f32(0.0f);
+                for(int j = 0; j < num_inputs; ++j)
+                    sum = vmlaq_n_f32(sum, vcvtq_f32_s32(vld1q_s32((const int32_t*)inputs[j] + i)), gains[j]);
+                sum = vminq_f32(vmaxq_f32(sum, vdupq_n_f32(S32_MIN)), vdupq_n_f32(S32_MAX));
+                vst1q_s32((int32_t*)output + i, vcvtnq_s32_f32(sum));
+            }
+            break;
+        case GSR_AUDIO_MIXER_FORMAT_F32:
+            for(size_t i = 0; i < num_vector_samples; i += 4) {
+                float32x4_t sum = vdupq_n_f32(0.0f);
+                for(int j = 0; j < num_inputs; ++j)
+                    sum = vmlaq_n_f32(sum, vld1q_f32((const float*)inputs[j] + i), gains[j]);
+                sum = vminq_f32(vmaxq_f32(sum, vdupq_n_f32(-1.0f)), vdupq_n_f32(1.0f));
+                vst1q_f32((float*)output + i, sum);
+            }
+            break;
+    }
+    return num_vector_samples;
+}
+
+/* 4 stereo frames at a time */
+static size_t deinterleave_stereo_f32_neon(const float *input, float *left, float *right, size_t num_frames) {
+    const size_t num_vector_frames = num_frames & ~(size_t)3;
+    for(size_t i = 0; i < num_vector_frames; i += 4) {
+        const float32x4x2_t samples = vld2q_f32(input + i * 2);
+        vst1q_f32(left + i, samples.val[0]);
+        vst1q_f32(right + i, samples.val[1]);
+    }
+    return num_vector_frames;
+}
+#endif /* GSR_AUDIO_MIXER_NEON */
+
+bool gsr_audio_mixer_kernel_is_supported(gsr_audio_mixer_kernel kernel) {
+    switch(kernel) {
+        case GSR_AUDIO_MIXER_KERNEL_SCALAR:
+            return true;
+        case GSR_AUDIO_MIXER_KERNEL_SSE2:
+        #ifdef GSR_AUDIO_MIXER_X86
+            return __builtin_cpu_supports("sse2");
+        #else
+            return false;
+        #endif
+        case GSR_AUDIO_MIXER_KERNEL_AVX2:
+        #ifdef GSR_AUDIO_MIXER_X86
+            return __builtin_cpu_supports("avx2");
+        #else
+            return false;
+        #endif
+        case GSR_AUDIO_MIXER_KERNEL_NEON:
+        #ifdef GSR_AUDIO_MIXER_NEON
+            return true;
+        #else
+            return false;
+        #endif
+    }
+    return false;
+}
+
+gsr_audio_mixer_kernel gsr_audio_mixer_get_best_kernel(void) {
+    static int best_kernel = -1;
+    if(best_kernel == -1) {
+        if(gsr_audio_mixer_kernel_is_supported(GSR_AUDIO_MIXER_KERNEL_AVX2))
+            best_kernel = GSR_AUDIO_MIXER_KERNEL_AVX2;
+        else if(gsr_audio_mixer_kernel_is_supported(GSR_AUDIO_MIXER_KERNEL_SSE2))
+            best_kernel = GSR_AUDIO_MIXER_KERNEL_SSE2;
+        else if(gsr_audio_mixer_kernel_is_supported(GSR_AUDIO_MIXER_KERNEL_NEON))
+            best_kernel = GSR_AUDIO_MIXER_KERNEL_NEON;
+        else
+            best_kernel = GSR_AUDIO_MIXER_KERNEL_SCALAR;
+    }
+    return (gsr_audio_mixer_kernel)best_kernel;
+}
+
+const char* gsr_audio_mixer_kernel_get_name(gsr_audio_mixer_kernel kernel) {
+    switch(kernel) {
+        case GSR_AUDIO_MIXER_KERNEL_SCALAR: return "scalar";
+        case GSR_AUDIO_MIXER_KERNEL_SSE2:   return "sse2";
+        case GSR_AUDIO_MIXER_KERNEL_AVX2:   return "avx2";
+        case GSR_AUDIO_MIXER_KERNEL_NEON:   return "neon";
+    }
+    return "unknown";
+}
+
+void gsr_audio_mix_with_kernel(gsr_audio_mixer_kernel kernel, gsr_audio_mixer_format format, void *output, const void *const *inputs, const float *gains, int num_inputs, size_t num_samples) {
+    if(num_inputs < 1 || num_inputs > GSR_AUDIO_MIXER_MAX_INPUTS) {
+        fprintf(stderr, "gsr error: gsr_audio_mix: invalid number of inputs: %d\n", num_inputs);
+        return;
+    }
+
+    size_t num_mixed_samples = 0;
+    switch(kernel) {
+        case GSR_AUDIO_MIXER_KERNEL_SCALAR:
+            break;
+        case GSR_AUDIO_MIXER_KERNEL_SSE2:
+        #ifdef GSR_AUDIO_MIXER_X86
+            num_mixed_samples = mix_sse2(format, output, inputs, gains, num_inputs, num_samples);
+        #endif
+            break;
+        case GSR_AUDIO_MIXER_KERNEL_AVX2:
+        #ifdef GSR_AUDIO_MIXER_X86
+            num_mixed_samples = mix_avx2(format, output, inputs, gains, num_inputs, num_samples);
+        #endif
+            break;
+        case GSR_AUDIO_MIXER_KERNEL_NEON:
+        #ifdef GSR_AUDIO_MIXER_NEON
+            num_mixed_samples = mix_neon(format, output, inputs, gains, num_inputs, num_samples);
+        #endif
+            break;
+    }
+    mix_scalar(format, output, inputs, gains, num_inputs, num_mixed_samples, num_samples);
+}
+
+void gsr_audio_mix(gsr_audio_mixer_format format, void *output, const void *const *inputs, const float *gains, int num_inputs, size_t num_samples) {
+    gsr_audio_mix_with_kernel(gsr_audio_mixer_get_best_kernel(), format, output, inputs, gains, num_inputs, num_samples);
+}
+
+void gsr_audio_deinterleave_f32_with_kernel(gsr_audio_mixer_kernel kernel, const float *input, float *const *outputs, int num_channels, size_t num_frames) {
+    size_t num_converted_frames = 0;
+    if(num_channels == 2) {
+        switch(kernel) {
+            case GSR_AUDIO_MIXER_KERNEL_SCALAR:
+                break;
+            case GSR_AUDIO_MIXER_KERNEL_SSE2:
+            #ifdef GSR_AUDIO_MIXER_X86
+                num_converted_frames = deinterleave_stereo_f32_sse2(input, outputs[0], outputs[1], num_frames);
+            #endif
+                break;
+            case GSR_AUDIO_MIXER_KERNEL_AVX2:
+            #ifdef GSR_AUDIO_MIXER_X86
+                num_converted_frames = deinterleave_stereo_f32_avx2(input, outputs[0], outputs[1], num_frames);
+            #endif
+                break;
+            case GSR_AUDIO_MIXER_KERNEL_NEON:
+            #ifdef GSR_AUDIO_MIXER_NEON
+                num_converted_frames = deinterleave_stereo_f32_neon(input, outputs[0], outputs[1], num_frames);
+            #endif
+                break;
+        }
+    }
+    deinterleave_f32_scalar(input, outputs, num_channels, num_converted_frames, num_frames);
+}
+
+void gsr_audio_deinterleave_f32(const float *input, float *const *outputs, int num_channels, size_t num_frames) {
+    gsr_audio_deinterleave_f32_with_kernel(gsr_audio_mixer_get_best_kernel(), input, outputs, num_channels, num_frames);
+}
@@ -0,0 +1,133 @@
+#include "../include/audio_ring.h"
+#include "../include/spsc_queue.h"
+#include "../include/audio_mixer.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <stdio.h>
+
+/*
+    The frames move between two queues, the producer takes empty frames from |free_frames| and gives full frames to the consumer in |full_frames|.
+    The consumer gives them back in |free_frames|. Each queue has one producer and one consumer, so both are lock-free.
+*/
+struct gsr_audio_ring {
+    gsr_spsc_queue *free_frames;
+    gsr_spsc_queue *full_frames;
+    gsr_audio_ring_frame *frames;
+    uint8_t *frames_data;
+    size_t num_frames;
+    size_t frame_size;
+    size_t bytes_per_sample;
+
+    /* Only used by the producer */
+    gsr_audio_ring_frame *current_frame;
+    size_t current_frame_num_samples;
+
+    _Atomic uint64_t num_dropped_samples;
+};
+
+gsr_audio_ring* gsr_audio_ring_create(size_t num_frames, size_t frame_size, size_t bytes_per_sample) {
+    if(num_frames == 0 || frame_size == 0 || bytes_per_sample == 0) {
+        fprintf(stderr, "gsr error: gsr_audio_ring_create: invalid size\n");
+        return NULL;
+    }
+
+    gsr_audio_ring *self = calloc(1, sizeof(gsr_audio_ring));
+    if(!self)
+        return NULL;
+
+    self->num_frames = num_frames;
+    self->frame_size = frame_size;
+    self->bytes_per_sample = bytes_per_sample;
+    atomic_init(&self->num_dropped_samples, 0);
+
+    self->free_frames = gsr_spsc_queue_create(num_frames);
+    self->full_frames = gsr_spsc_queue_create(num_frames);
+    /* Every frame starts at a multiple of GSR_AUDIO_MIXER_ALIGNMENT so the mixer can use aligned loads on it */
+    const size_t frame_stride = (frame_size * bytes_per_sample + GSR_AUDIO_MIXER_ALIGNMENT - 1) & ~(size_t)(GSR_AUDIO_MIXER_ALIGNMENT - 1);
+    self->frames = calloc(num_frames, sizeof(gsr_audio_ring_frame));
+    self->frames_data = aligned_alloc(GSR_AUDIO_MIXER_ALIGNMENT, num_frames * frame_stride);
+    if(!self->free_frames || !self->full_frames || !self->frames || !self->frames_data) {
+        fprintf(stderr, "gsr error: gsr_audio_ring_create: failed to allocate %zu frames\n", num_frames);
+        gsr_audio_ring_destroy(self);
+        return NULL;
+    }
+
+    for(size_t i = 0; i < num_frames; ++i) {
+        self->frames[i].data = self->frames_data + i * frame_stride;
+        self->frames[i].size = frame_size * bytes_per_sample;
+        gsr_spsc_queue_push(self->free_frames, &self->frames[i]);
+    }
+
+    return self;
+}
+
+void gsr_audio_ring_destroy(gsr_audio_ring *self) {
+    if(!self)
+        return;
+
+    gsr_spsc_queue_destroy(self->free_frames);
+    gsr_spsc_queue_destroy(self->full_frames);
+    free(self->frames);
+    free(self->frames_data);
+    free(self);
+}
+
+static void gsr_audio_ring_submit_current_frame(gsr_audio_ring *self) {
+    /* A frame that was cut short by a gap is padded with silence, the consumer always gets full frames */
+    const size_t num_missing_samples = self->frame_size - self->current_frame_num_samples;
+    memset(self->current_frame->data + self->current_frame_num_samples * self->bytes_per_sample, 0, num_missing_samples * self->bytes_per_sample);
+
+    gsr_spsc_queue_push(self->full_frames, self->current_frame);
+    self->current_frame = NULL;
+    self->current_frame_num_samples = 0;
+}
+
+bool gsr_audio_ring_write(gsr_audio_ring *self, const void *samples, size_t num_samples, int64_t pts) {
+    if(self->current_frame && self->current_frame->pts + (int64_t)self->current_frame_num_samples != pts)
+        gsr_audio_ring_submit_current_frame(self);
+
+    const uint8_t *data = samples;
+    while(num_samples > 0) {
+        if(!self->current_frame) {
+            void *item = NULL;
+            if(!gsr_spsc_queue_pop(self->free_frames, &item)) {
+                atomic_fetch_add_explicit(&self->num_dropped_samples, num_samples, memory_order_relaxed);
+                return false;
+            }
+            self->current_frame = item;
+            self->current_frame->pts = pts;
+            self->current_frame_num_samples = 0;
+        }
+
+        size_t copy_samples = self->frame_size - self->current_frame_num_samples;
+        if(copy_samples > num_samples)
+            copy_samples = num_samples;
+
+        memcpy(self->current_frame->data + self->current_frame_num_samples * self->bytes_per_sample, data, copy_samples * self->bytes_per_sample);
+        self->current_frame_num_samples += copy_samples;
+        data += copy_samples * self->bytes_per_sample;
+        num_samples -= copy_samples;
+        pts += copy_samples;
+
+        if(self->current_frame_num_samples == self->frame_size)
+            gsr_audio_ring_submit_current_frame(self);
+    }
+
+    return true;
+}
+
+gsr_audio_ring_frame* gsr_audio_ring_read(gsr_audio_ring *self) {
+    void *item = NULL;
+    if(!gsr_spsc_queue_pop(self->full_frames, &item))
+        return NULL;
+    return item;
+}
+
+void gsr_audio_ring_release(gsr_audio_ring *self, gsr_audio_ring_frame *frame) {
+    gsr_spsc_queue_push(self->free_frames, frame);
+}
+
+uint64_t gsr_audio_ring_take_num_dropped_samples(gsr_audio_ring *self) {
+    return atomic_exchange_explicit(&self->num_dropped_samples, 0, memory_order_relaxed);
+}
@@ -42,6 +42,18 @@ int gsr_capture_capture(gsr_capture *cap, AVFrame *frame) {
     return cap->capture(cap, frame);
 }
 
+int gsr_capture_get_event_fd(gsr_capture *cap) {
+    if(!cap->started) {
+        fprintf(stderr, "gsr error: gsr_capture_get_event_fd failed: the gsr capture has not been started\n");
+        return -1;
+    }
+
+    if(!cap->get_event_fd)
+        return -1;
+
+    return cap->get_event_fd(cap);
+}
+
 void gsr_capture_destroy(gsr_capture *cap, AVCodecContext *video_codec_context) {
     cap->destroy(cap, video_codec_context);
 }
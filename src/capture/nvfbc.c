@@ -22,7 +22,6 @@ typedef struct {
     bool fbc_handle_created;
 
     gsr_cuda cuda;
-    bool frame_initialized;
 } gsr_capture_nvfbc;
 
 #if defined(_WIN64) || defined(__LP64__)
@@ -124,16 +123,6 @@ static bool gsr_capture_nvfbc_load_library(gsr_capture *cap) {
     return true;
 }
 
-#if LIBAVUTIL_VERSION_MAJOR < 57
-static AVBufferRef* dummy_hw_frame_init(int size) {
-    return av_buffer_alloc(size);
-}
-#else
-static AVBufferRef* dummy_hw_frame_init(size_t size) {
-    return av_buffer_alloc(size);
-}
-#endif
-
 static bool ffmpeg_create_cuda_contexts(gsr_capture_nvfbc *cap_nvfbc, AVCodecContext *video_codec_context) {
     AVBufferRef *device_ctx = av_hwdevice_ctx_alloc(AV_HWDEVICE_TYPE_CUDA);
     if(!device_ctx) {
@@ -164,9 +153,7 @@ static bool ffmpeg_create_cuda_contexts(gsr_capture_nvfbc *cap_nvfbc, AVCodecCon
     hw_frame_context->format = video_codec_context->pix_fmt;
     hw_frame_context->device_ref = device_ctx;
     hw_frame_context->device_ctx = (AVHWDeviceContext*)device_ctx->data;
-
-    hw_frame_context->pool = av_buffer_pool_init(1, dummy_hw_frame_init);
-    hw_frame_context->initial_pool_size = 1;
+    // Real cuda buffers (ffmpeg's default pool), the grabbed frames are copied into them so they can wait in the frame queue
 
     if (av_hwframe_ctx_init(frame_context) < 0) {
         fprintf(stderr, "gsr error: cuda_create_codec_context failed: failed to initialize hardware frame context "
@@ -370,16 +357,6 @@ static void gsr_capture_nvfbc_destroy_session(gsr_capture *cap) {
     cap_nvfbc->nv_fbc_handle = 0;
 }
 
-static void gsr_capture_nvfbc_tick(gsr_capture *cap, AVCodecContext *video_codec_context, AVFrame **frame) {
-    gsr_capture_nvfbc *cap_nvfbc = cap->priv;
-    if(!cap_nvfbc->frame_initialized && video_codec_context->hw_frames_ctx) {
-        cap_nvfbc->frame_initialized = true;
-        (*frame)->hw_frames_ctx = video_codec_context->hw_frames_ctx;
-        (*frame)->buf[0] = av_buffer_pool_get(((AVHWFramesContext*)video_codec_context->hw_frames_ctx->data)->pool);
-        (*frame)->extended_data = (*frame)->data;
-    }
-}
-
 static int gsr_capture_nvfbc_capture(gsr_capture *cap, AVFrame *frame) {
     gsr_capture_nvfbc *cap_nvfbc = cap->priv;
 
@@ -405,13 +382,36 @@ static int gsr_capture_nvfbc_capture(gsr_capture *cap, AVFrame *frame) {
     /*
         *byte_size = frame_info.dwByteSize;
 
-        TODO: Check bIsNewFrame
         TODO: Check dwWidth and dwHeight and update size in video output in ffmpeg. This can happen when xrandr is used to change monitor resolution
     */
 
-    frame->data[0] = (uint8_t*)cu_device_ptr;
+    /* With NVFBC_TOCUDA_GRAB_FLAGS_NOWAIT the previous frame is returned again if nothing has changed since then */
+    if(!frame_info.bIsNewFrame && cap->skip_unchanged_frames)
+        return GSR_CAPTURE_FRAME_UNCHANGED;
+
+    /*
+        The grabbed frame is in a buffer owned by NvFBC which is overwritten by the next grab,
+        so it's copied to the buffer of |frame| which stays valid while it's waiting to be encoded.
+    */
     frame->linesize[0] = frame->width * 4;
-    return 0;
+
+    CUDA_MEMCPY2D memcpy_struct;
+    memset(&memcpy_struct, 0, sizeof(memcpy_struct));
+    memcpy_struct.srcMemoryType = CU_MEMORYTYPE_DEVICE;
+    memcpy_struct.srcDevice = cu_device_ptr;
+    memcpy_struct.srcPitch = frame->width * 4;
+
+    memcpy_struct.dstMemoryType = CU_MEMORYTYPE_DEVICE;
+    memcpy_struct.dstDevice = (CUdeviceptr)frame->data[0];
+    memcpy_struct.dstPitch = frame->linesize[0];
+    memcpy_struct.WidthInBytes = frame->width * 4;
+    memcpy_struct.Height = frame->height;
+    if(cap_nvfbc->cuda.cuMemcpy2D_v2(&memcpy_struct) != CUDA_SUCCESS) {
+        fprintf(stderr, "gsr error: gsr_capture_nvfbc_capture: cuMemcpy2D failed\n");
+        return -1;
+    }
+
+    return frame_info.bIsNewFrame ? 0 : GSR_CAPTURE_FRAME_UNCHANGED;
 }
 
 static void gsr_capture_nvfbc_destroy(gsr_capture *cap, AVCodecContext *video_codec_context) {
@@ -466,11 +466,12 @@ gsr_capture* gsr_capture_nvfbc_create(const gsr_capture_nvfbc_params *params) {
     
     *cap = (gsr_capture) {
         .start = gsr_capture_nvfbc_start,
-        .tick = gsr_capture_nvfbc_tick,
+        .tick = NULL,
         .should_stop = NULL,
         .capture = gsr_capture_nvfbc_capture,
         .destroy = gsr_capture_nvfbc_destroy,
-        .priv = cap_nvfbc
+        .priv = cap_nvfbc,
+        .captures_into_frame_buffer = true
     };
 
     return cap;
@@ -2,6 +2,7 @@
 #include "../../include/egl.h"
 #include "../../include/cuda.h"
 #include "../../include/window_texture.h"
+#include "../../include/window_damage.h"
 #include "../../include/time.h"
 #include <X11/extensions/Xcomposite.h>
 #include <libavutil/hwcontext.h>
@@ -26,6 +27,7 @@ typedef struct {
     vec2i texture_size;
     Window window;
     WindowTexture window_texture;
+    WindowDamage window_damage;
     Atom net_active_window_atom;
 
     CUgraphicsResource cuda_graphics_resource;
@@ -184,6 +186,9 @@ static int gsr_capture_xcomposite_cuda_start(gsr_capture *cap, AVCodecContext *v
 
     XSelectInput(cap_xcomp->dpy, cap_xcomp->window, StructureNotifyMask | ExposureMask);
 
+    window_damage_init(&cap_xcomp->window_damage, cap_xcomp->dpy);
+    window_damage_set_window(&cap_xcomp->window_damage, cap_xcomp->window);
+
     if(!gsr_egl_load(&cap_xcomp->egl, cap_xcomp->dpy)) {
         fprintf(stderr, "gsr error: gsr_capture_xcomposite_cuda_start: failed to load opengl\n");
         return -1;
@@ -269,6 +274,7 @@ static void gsr_capture_xcomposite_cuda_stop(gsr_capture *cap, AVCodecContext *v
 
     gsr_egl_unload(&cap_xcomp->egl);
     if(cap_xcomp->dpy) {
+        window_damage_deinit(&cap_xcomp->window_damage);
         XCloseDisplay(cap_xcomp->dpy);
         cap_xcomp->dpy = NULL;
     }
@@ -303,6 +309,7 @@ static void gsr_capture_xcomposite_cuda_tick(gsr_capture *cap, AVCodecContext *v
     if(XCheckTypedWindowEvent(cap_xcomp->dpy, cap_xcomp->window, Expose, &cap_xcomp->xev) && cap_xcomp->xev.xexpose.count == 0) {
         cap_xcomp->window_resize_timer = clock_get_monotonic_seconds();
         cap_xcomp->window_resized = true;
+        window_damage_set_damaged(&cap_xcomp->window_damage);
     }
 
     if(XCheckTypedWindowEvent(cap_xcomp->dpy, cap_xcomp->window, ConfigureNotify, &cap_xcomp->xev) && cap_xcomp->xev.xconfigure.window == cap_xcomp->window) {
@@ -324,6 +331,7 @@ static void gsr_capture_xcomposite_cuda_tick(gsr_capture *cap, AVCodecContext *v
             XSelectInput(cap_xcomp->dpy, cap_xcomp->window, 0);
             cap_xcomp->window = focused_window;
             XSelectInput(cap_xcomp->dpy, cap_xcomp->window, StructureNotifyMask | ExposureMask);
+            window_damage_set_window(&cap_xcomp->window_damage, cap_xcomp->window);
 
             XWindowAttributes attr;
             attr.width = 0;
@@ -401,7 +409,10 @@ static void gsr_capture_xcomposite_cuda_tick(gsr_capture *cap, AVCodecContext *v
         // Clear texture with black background because the source texture (window_texture_get_opengl_texture_id(&cap_xcomp->window_texture))
         // might be smaller than cap_xcomp->target_texture_id
         cap_xcomp->egl.glClearTexImage(cap_xcomp->target_texture_id, 0, GL_RGB, GL_UNSIGNED_BYTE, NULL);
+        window_damage_set_damaged(&cap_xcomp->window_damage);
     }
+
+    window_damage_update(&cap_xcomp->window_damage);
 }
 
 static bool gsr_capture_xcomposite_cuda_should_stop(gsr_capture *cap, bool *err) {
@@ -423,7 +434,15 @@ static int gsr_capture_xcomposite_cuda_capture(gsr_capture *cap, AVFrame *frame)
     vec2i source_pos = { 0, 0 };
     vec2i source_size = cap_xcomp->texture_size;
 
-    if(cap_xcomp->window_texture.texture_id != 0) {
+    /* |target_texture_id| keeps the image of the previous capture, so it only has to be copied to again if the window has changed */
+    const bool window_changed = window_damage_is_damaged(&cap_xcomp->window_damage);
+    if(!window_changed && cap->skip_unchanged_frames)
+        return GSR_CAPTURE_FRAME_UNCHANGED;
+
+    if(window_changed)
+        window_damage_clear(&cap_xcomp->window_damage);
+
+    if(window_changed && cap_xcomp->window_texture.texture_id != 0) {
         /* TODO: Remove this copy, which is only possible by using nvenc directly and encoding window_pixmap.target_texture_id */
         cap_xcomp->egl.glCopyImageSubData(
             window_texture_get_opengl_texture_id(&cap_xcomp->window_texture), GL_TEXTURE_2D, 0, source_pos.x, source_pos.y, 0,
@@ -458,7 +477,13 @@ static int gsr_capture_xcomposite_cuda_capture(gsr_capture *cap, AVFrame *frame)
     memcpy_struct.Height = frame->height;
     cap_xcomp->cuda.cuMemcpy2D_v2(&memcpy_struct);
 
-    return 0;
+    return window_changed ? 0 : GSR_CAPTURE_FRAME_UNCHANGED;
+}
+
+/* Tick always checks the window events, which reads all pending events from the connection */
+static int gsr_capture_xcomposite_cuda_get_event_fd(gsr_capture *cap) {
+    gsr_capture_xcomposite_cuda *cap_xcomp = cap->priv;
+    return ConnectionNumber(cap_xcomp->dpy);
 }
 
 static void gsr_capture_xcomposite_cuda_destroy(gsr_capture *cap, AVCodecContext *video_codec_context) {
@@ -502,8 +527,10 @@ gsr_capture* gsr_capture_xcomposite_cuda_create(const gsr_capture_xcomposite_cud
         .tick = gsr_capture_xcomposite_cuda_tick,
         .should_stop = gsr_capture_xcomposite_cuda_should_stop,
         .capture = gsr_capture_xcomposite_cuda_capture,
+        .get_event_fd = gsr_capture_xcomposite_cuda_get_event_fd,
         .destroy = gsr_capture_xcomposite_cuda_destroy,
-        .priv = cap_xcomp
+        .priv = cap_xcomp,
+        .captures_into_frame_buffer = true
     };
 
     return cap;
@@ -1,6 +1,7 @@
 #include "../../include/capture/xcomposite_drm.h"
 #include "../../include/egl.h"
 #include "../../include/window_texture.h"
+#include "../../include/window_damage.h"
 #include "../../include/time.h"
 #include <stdlib.h>
 #include <stdio.h>
@@ -26,6 +27,7 @@ typedef struct {
     double window_resize_timer;
     
     WindowTexture window_texture;
+    WindowDamage window_damage;
 
     gsr_egl egl;
 
@@ -398,6 +400,9 @@ static int gsr_capture_xcomposite_drm_start(gsr_capture *cap, AVCodecContext *vi
     // TODO: Get select and add these on top of it and then restore at the end. Also do the same in other xcomposite
     XSelectInput(cap_xcomp->dpy, cap_xcomp->params.window, StructureNotifyMask | ExposureMask);
 
+    window_damage_init(&cap_xcomp->window_damage, cap_xcomp->dpy);
+    window_damage_set_window(&cap_xcomp->window_damage, cap_xcomp->params.window);
+
     if(!gsr_egl_load(&cap_xcomp->egl, cap_xcomp->dpy)) {
         fprintf(stderr, "gsr error: gsr_capture_xcomposite_start: failed to load opengl\n");
         return -1;
@@ -720,7 +725,20 @@ static void gsr_capture_xcomposite_drm_tick(gsr_capture *cap, AVCodecContext *vi
         // Clear texture with black background because the source texture (window_texture_get_opengl_texture_id(&cap_xcomp->window_texture))
         // might be smaller than cap_xcomp->target_texture_id
         cap_xcomp->egl.glClearTexImage(cap_xcomp->target_texture_id, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+        window_damage_set_damaged(&cap_xcomp->window_damage);
     }
+
+    /* Damage isn't reported for everything that changes the image (for example when the window is uncovered), so these count as damage as well */
+    if(XCheckTypedWindowEvent(cap_xcomp->dpy, cap_xcomp->params.window, Expose, &cap_xcomp->xev) && cap_xcomp->xev.xexpose.count == 0)
+        window_damage_set_damaged(&cap_xcomp->window_damage);
+
+    /* This backend doesn't handle resizing, the window is captured at the size it had when the recording started. The new size is only damage */
+    if(XCheckTypedWindowEvent(cap_xcomp->dpy, cap_xcomp->params.window, ConfigureNotify, &cap_xcomp->xev) && cap_xcomp->xev.xconfigure.window == cap_xcomp->params.window) {
+        while(XCheckTypedWindowEvent(cap_xcomp->dpy, cap_xcomp->params.window, ConfigureNotify, &cap_xcomp->xev)) {}
+        window_damage_set_damaged(&cap_xcomp->window_damage);
+    }
+
+    window_damage_update(&cap_xcomp->window_damage);
 }
 
 static bool gsr_capture_xcomposite_drm_should_stop(gsr_capture *cap, bool *err) {
@@ -779,18 +797,28 @@ static int gsr_capture_xcomposite_drm_capture(gsr_capture *cap, AVFrame *frame)
     gsr_capture_xcomposite_drm *cap_xcomp = cap->priv;
     vec2i source_size = cap_xcomp->texture_size;
 
+    /* The frame is mapped to |target_texture_id|, which keeps the image of the previous capture, so it only has to be copied to again if the window has changed */
+    const bool window_changed = window_damage_is_damaged(&cap_xcomp->window_damage);
+    if(!window_changed && cap->skip_unchanged_frames)
+        return GSR_CAPTURE_FRAME_UNCHANGED;
+
+    if(window_changed)
+        window_damage_clear(&cap_xcomp->window_damage);
+
     #if 1
-    /* TODO: Remove this copy, which is only possible by using nvenc directly and encoding window_pixmap.target_texture_id */
-    cap_xcomp->egl.glCopyImageSubData(
-        window_texture_get_opengl_texture_id(&cap_xcomp->window_texture), GL_TEXTURE_2D, 0, 0, 0, 0,
-        cap_xcomp->target_texture_id, GL_TEXTURE_2D, 0, 0, 0, 0,
-        source_size.x, source_size.y, 1);
-    unsigned int err = cap_xcomp->egl.glGetError();
-    if(err != 0) {
-        static bool error_shown = false;
-        if(!error_shown) {
-            error_shown = true;
-            fprintf(stderr, "Error: glCopyImageSubData failed, gl error: %d\n", err);
+    if(window_changed) {
+        /* TODO: Remove this copy, which is only possible by using nvenc directly and encoding window_pixmap.target_texture_id */
+        cap_xcomp->egl.glCopyImageSubData(
+            window_texture_get_opengl_texture_id(&cap_xcomp->window_texture), GL_TEXTURE_2D, 0, 0, 0, 0,
+            cap_xcomp->target_texture_id, GL_TEXTURE_2D, 0, 0, 0, 0,
+            source_size.x, source_size.y, 1);
+        unsigned int err = cap_xcomp->egl.glGetError();
+        if(err != 0) {
+            static bool error_shown = false;
+            if(!error_shown) {
+                error_shown = true;
+                fprintf(stderr, "Error: glCopyImageSubData failed, gl error: %d\n", err);
+            }
         }
     }
     #elif 0
@@ -820,12 +848,14 @@ static int gsr_capture_xcomposite_drm_capture(gsr_capture *cap, AVFrame *frame)
     #endif
     cap_xcomp->egl.eglSwapBuffers(cap_xcomp->egl.egl_display, cap_xcomp->egl.egl_surface);
 
-    return 0;
+    return window_changed ? 0 : GSR_CAPTURE_FRAME_UNCHANGED;
 }
 
 static void gsr_capture_xcomposite_drm_destroy(gsr_capture *cap, AVCodecContext *video_codec_context) {
     (void)video_codec_context;
     if(cap->priv) {
+        gsr_capture_xcomposite_drm *cap_xcomp = cap->priv;
+        window_damage_deinit(&cap_xcomp->window_damage);
         free(cap->priv);
         cap->priv = NULL;
     }
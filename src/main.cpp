@@ -4,6 +4,11 @@ extern "C" {
 #include "../include/capture/xcomposite_drm.h"
 #include "../include/egl.h"
 #include "../include/time.h"
+#include "../include/replay_buffer.h"
+#include "../include/spsc_queue.h"
+#include "../include/audio_ring.h"
+#include "../include/audio_mixer.h"
+#include "../include/mpsc_queue.h"
 }
 
 #include <assert.h>
@@ -17,11 +22,18 @@ extern "C" {
 #include <map>
 #include <signal.h>
 #include <sys/stat.h>
+#include <dirent.h>
+#include <semaphore.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <sched.h>
 
 #include <unistd.h>
 #include <fcntl.h>
 
 #include "../include/sound.hpp"
+#include "../include/replay_stream_info.hpp"
 
 #include <X11/extensions/Xrandr.h>
 
@@ -31,6 +43,7 @@ extern "C" {
 #include <libavformat/avformat.h>
 #include <libavutil/opt.h>
 #include <libswresample/swresample.h>
+#include <libavutil/audio_fifo.h>
 #include <libavutil/avutil.h>
 #include <libavutil/time.h>
 #include <libavfilter/avfilter.h>
@@ -39,7 +52,11 @@ extern "C" {
 }
 
 #include <deque>
-#include <future>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <algorithm>
+#include <memory>
 
 typedef enum {
     GPU_VENDOR_AMD,
@@ -154,667 +171,2807 @@ static int x11_io_error_handler(Display *dpy) {
     return 0;
 }
 
-// |stream| is only required for non-replay mode
-static void receive_frames(AVCodecContext *av_codec_context, int stream_index, AVStream *stream, AVFrame *frame,
-                           AVFormatContext *av_format_context,
-                           double replay_start_time,
-                           std::deque<AVPacket> &frame_data_queue,
-                           int replay_buffer_size_secs,
-                           bool &frames_erased,
-						   std::mutex &write_output_mutex) {
-    for (;;) {
-        // TODO: Use av_packet_alloc instead because sizeof(av_packet) might not be future proof(?)
-        AVPacket av_packet;
-        memset(&av_packet, 0, sizeof(av_packet));
-        av_packet.data = NULL;
-        av_packet.size = 0;
-        int res = avcodec_receive_packet(av_codec_context, &av_packet);
-        if (res == 0) { // we have a packet, send the packet to the muxer
-            av_packet.stream_index = stream_index;
-            av_packet.pts = av_packet.dts = frame->pts;
-
-            if(frame->flags & AV_FRAME_FLAG_DISCARD)
-                av_packet.flags |= AV_PKT_FLAG_DISCARD;
-
-            std::lock_guard<std::mutex> lock(write_output_mutex);
-            if(replay_buffer_size_secs != -1) {
-                double time_now = clock_get_monotonic_seconds();
-                double replay_time_elapsed = time_now - replay_start_time;
-
-                AVPacket new_pack;
-                av_packet_move_ref(&new_pack, &av_packet);
-                frame_data_queue.push_back(std::move(new_pack));
-                if(replay_time_elapsed >= replay_buffer_size_secs) {
-                    av_packet_unref(&frame_data_queue.front());
-                    frame_data_queue.pop_front();
-                    frames_erased = true;
-                }
-                av_packet_unref(&av_packet);
-            } else {
-                av_packet_rescale_ts(&av_packet, av_codec_context->time_base, stream->time_base);
-                av_packet.stream_index = stream->index;
-                // TODO: Is av_interleaved_write_frame needed?
-                int ret = av_interleaved_write_frame(av_format_context, &av_packet);
-                if(ret < 0) {
-                    fprintf(stderr, "Error: Failed to write frame index %d to muxer, reason: %s (%d)\n", av_packet.stream_index, av_error_to_string(ret), ret);
-                }
-            }
-        } else if (res == AVERROR(EAGAIN)) { // we have no packet
-                                             // fprintf(stderr, "No packet!\n");
-            av_packet_unref(&av_packet);
-            break;
-        } else if (res == AVERROR_EOF) { // this is the end of the stream
-            fprintf(stderr, "End of stream!\n");
-            av_packet_unref(&av_packet);
-            break;
-        } else {
-            fprintf(stderr, "Unexpected error: %d\n", res);
-            av_packet_unref(&av_packet);
-            break;
-        }
+static std::string get_date_str() {
+    char str[128];
+    time_t now = time(NULL);
+    struct tm *t = localtime(&now);
+    strftime(str, sizeof(str)-1, "%Y-%m-%d_%H-%M-%S", t);
+    return str; 
+}
+
+// A fragment is only cut once the audio of every stream has passed the video keyframe the next fragment starts with,
+// but at most this long after the keyframe in case an audio stream stops
+#define REPLAY_FRAGMENT_MAX_CUT_DELAY_SECS 1.0
+
+struct ReplayFragmentPacket {
+    AVPacket *av_packet = nullptr;
+    AVRational codec_time_base;
+};
+
+// In fragmented replay mode packets are muxed while recording, into fragments that start with a video keyframe
+// (fragmented mp4 or matroska clusters). The replay buffer stores whole fragments, so saving a replay only copies the init segment and the fragments to a file.
+struct ReplayFragments {
+    AVIOContext *avio_context = nullptr;
+    std::vector<uint8_t> init_segment; // Doesn't change after |replay_fragments_init|
+    std::vector<uint8_t> fragment; // Muxer output since the last fragment was added to the replay buffer
+    double fragment_timestamp = 0.0; // Presentation time of the video keyframe the fragment starts with, in seconds
+
+    // Audio is encoded with a different delay than video, so audio for before a video keyframe can be received after it.
+    // Between receiving a keyframe and cutting the fragment, the packets for after the keyframe wait here and the audio for before it is still muxed
+    bool cut_pending = false;
+    double cut_timestamp = 0.0; // Presentation time of the keyframe that starts the next fragment, in seconds
+    std::deque<ReplayFragmentPacket> pending_packets; // Starts with the keyframe
+    std::vector<bool> stream_passed_cut; // For each output stream, if it has received a packet for after |cut_timestamp|
+};
+
+#if LIBAVFORMAT_VERSION_MAJOR >= 61
+static int replay_fragments_write(void *opaque, const uint8_t *buf, int buf_size) {
+#else
+static int replay_fragments_write(void *opaque, uint8_t *buf, int buf_size) {
+#endif
+    ReplayFragments *replay_fragments = (ReplayFragments*)opaque;
+    replay_fragments->fragment.insert(replay_fragments->fragment.end(), buf, buf + buf_size);
+    return buf_size;
+}
+
+static bool replay_fragments_init(ReplayFragments &replay_fragments, AVFormatContext *av_format_context) {
+    const int avio_buffer_size = 64 * 1024;
+    uint8_t *avio_buffer = (uint8_t*)av_malloc(avio_buffer_size);
+    if(!avio_buffer)
+        return false;
+
+    replay_fragments.avio_context = avio_alloc_context(avio_buffer, avio_buffer_size, 1, &replay_fragments, nullptr, replay_fragments_write, nullptr);
+    if(!replay_fragments.avio_context) {
+        av_free(avio_buffer);
+        return false;
+    }
+    av_format_context->pb = replay_fragments.avio_context;
+
+    AVDictionary *options = nullptr;
+    av_dict_set(&options, "strict", "experimental", 0);
+    // Fragments are only written when av_write_frame is called with NULL and the moov is written in the header (the init segment), without any samples.
+    // Matroska ends a cluster when av_write_frame is called with NULL without any options
+    const char *format_name = av_format_context->oformat->name;
+    if(strcmp(format_name, "mp4") == 0 || strcmp(format_name, "mov") == 0)
+        av_dict_set(&options, "movflags", "+frag_custom+empty_moov+default_base_moof", 0);
+
+    int ret = avformat_write_header(av_format_context, &options);
+    av_dict_free(&options);
+    if(ret < 0) {
+        fprintf(stderr, "Error occurred when writing header for the fragmented replay buffer: %s\n", av_error_to_string(ret));
+        return false;
     }
+
+    avio_flush(replay_fragments.avio_context);
+    replay_fragments.init_segment.swap(replay_fragments.fragment);
+    replay_fragments.fragment.clear();
+    replay_fragments.fragment_timestamp = 0.0;
+    replay_fragments.stream_passed_cut.resize(av_format_context->nb_streams, false);
+    return true;
 }
 
-static const char* audio_codec_get_name(AudioCodec audio_codec) {
-    switch(audio_codec) {
-        case AudioCodec::AAC:  return "aac";
-        case AudioCodec::OPUS: return "opus";
-        case AudioCodec::FLAC: return "flac";
+static void replay_fragments_deinit(ReplayFragments &replay_fragments) {
+    for(ReplayFragmentPacket &pending_packet : replay_fragments.pending_packets) {
+        av_packet_free(&pending_packet.av_packet);
+    }
+    replay_fragments.pending_packets.clear();
+
+    if(replay_fragments.avio_context) {
+        av_freep(&replay_fragments.avio_context->buffer);
+        avio_context_free(&replay_fragments.avio_context);
     }
-    assert(false);
-    return "";
 }
 
-static AVCodecID audio_codec_get_id(AudioCodec audio_codec) {
-    switch(audio_codec) {
-        case AudioCodec::AAC:  return AV_CODEC_ID_AAC;
-        case AudioCodec::OPUS: return AV_CODEC_ID_OPUS;
-        case AudioCodec::FLAC: return AV_CODEC_ID_FLAC;
+// Ends the current fragment and adds it to the replay buffer. This has to be called before writing a video keyframe, |keyframe_timestamp| is the presentation time of that keyframe in seconds.
+// Only adding the fragment to the replay buffer is done with |write_output_mutex| locked
+static void replay_fragments_flush(ReplayFragments &replay_fragments, AVFormatContext *av_format_context, gsr_replay_buffer *replay_buffer, std::mutex &write_output_mutex, double keyframe_timestamp) {
+    av_interleaved_write_frame(av_format_context, nullptr);
+    av_write_frame(av_format_context, nullptr);
+    avio_flush(replay_fragments.avio_context);
+
+    if(!replay_fragments.fragment.empty()) {
+        gsr_replay_packet replay_packet;
+        replay_packet.data = replay_fragments.fragment.data();
+        replay_packet.size = replay_fragments.fragment.size();
+        replay_packet.stream_index = VIDEO_STREAM_INDEX;
+        replay_packet.flags = GSR_REPLAY_PACKET_FLAG_KEY;
+        replay_packet.pts = 0;
+        replay_packet.dts = 0;
+        replay_packet.timestamp = replay_fragments.fragment_timestamp;
+
+        std::lock_guard<std::mutex> lock(write_output_mutex);
+        if(!gsr_replay_buffer_append(replay_buffer, &replay_packet))
+            fprintf(stderr, "Error: Failed to add fragment of size %zu to the replay buffer, it will be skipped. Either the fragment is larger than the replay buffer memory limit (-rm) or saving a replay is slower than recording\n", replay_fragments.fragment.size());
+        replay_fragments.fragment.clear();
     }
-    assert(false);
-    return AV_CODEC_ID_AAC;
+
+    replay_fragments.fragment_timestamp = keyframe_timestamp;
 }
 
-static AVSampleFormat audio_codec_get_sample_format(AudioCodec audio_codec, const AVCodec *codec) {
-    switch(audio_codec) {
-        case AudioCodec::AAC: {
-            return AV_SAMPLE_FMT_FLTP;
-        }
-        case AudioCodec::OPUS: {
-            bool supports_s16 = false;
-            bool supports_flt = false;
+// In segmented mode the recording is split into files of about |segment_duration_secs| each. The next segment starts at the first video keyframe after that,
+// so every segment starts with a keyframe and packets are never lost between segments. Only the muxer is recreated, the encoders keep running.
+// A segment is written to a temporary file which is renamed when the segment is finished, so a segment file is always complete.
+// Opening the next segment and finishing the previous one is done by |worker_thread|, so the writer thread never waits for it.
+struct SegmentFinishJob {
+    AVFormatContext *format_context = nullptr;
+    std::string temp_filepath;
+    std::string filepath;
+};
 
-            for(size_t i = 0; codec->sample_fmts && codec->sample_fmts[i] != -1; ++i) {
-                if(codec->sample_fmts[i] == AV_SAMPLE_FMT_S16) {
-                    supports_s16 = true;
-                } else if(codec->sample_fmts[i] == AV_SAMPLE_FMT_FLT) {
-                    supports_flt = true;
-                }
-            }
+struct Segments {
+    const AVFormatContext *template_format_context = nullptr; // Has the streams of the segments, it's never written to
+    std::string output_dir;
+    std::string file_extension;
+    double segment_duration_secs = 0.0;
+    int64_t max_total_bytes = 0; // The oldest segments are removed when the segments are larger than this in total. 0 = no limit
+    double max_age_secs = 0.0; // The oldest segments are removed when they are older than this. 0 = no limit
+
+    // Only used by the writer thread
+    AVFormatContext *format_context = nullptr;
+    std::string temp_filepath;
+    std::string filepath; // Where the current segment ends up when it's finished
+    double start_time = 0.0;
+    // The pts of the video keyframe the segment starts with, in |start_time_base|. It's subtracted from every stream (in its own time base),
+    // so each segment starts at 0 and the streams keep lining up
+    int64_t start_pts = 0;
+    AVRational start_time_base = {1, 1};
+
+    // Audio is encoded with a different delay than video, so audio for before the keyframe the segment starts with can be received after it.
+    // That audio is still written to the previous segment, which is only finished once every audio stream has passed the keyframe
+    AVFormatContext *prev_format_context = nullptr;
+    std::string prev_temp_filepath;
+    std::string prev_filepath;
+    int64_t prev_start_pts = 0;
+    AVRational prev_start_time_base = {1, 1};
+    std::vector<bool> stream_passed_start; // For each stream, if it has received a packet for the current segment
+
+    std::thread worker_thread;
+    std::mutex worker_mutex;
+    std::condition_variable worker_cond;
+    // Protected by |worker_mutex|
+    std::deque<SegmentFinishJob> finish_jobs;
+    AVFormatContext *next_format_context = nullptr; // The next segment, opened ahead of time
+    std::string next_temp_filepath;
+    bool open_next = false; // Set when |worker_thread| should open the next segment
+    int num_next_opened = 0;
+    bool stop = false;
+};
 
-            if(!supports_s16 && !supports_flt) {
-                fprintf(stderr, "Warning: opus audio codec is chosen but your ffmpeg version does not support s16/flt sample format and performance might be slightly worse. You can either rebuild ffmpeg with libopus instead of the built-in opus, use the flatpak version of gpu screen recorder or record with flac audio codec instead (-ac flac). Falling back to fltp audio sample format instead.\n");
-            }
+struct SegmentFile {
+    std::string filepath;
+    int64_t size;
+    time_t modified_time;
+};
 
-            if(supports_s16)
-                return AV_SAMPLE_FMT_S16;
-            else if(supports_flt)
-                return AV_SAMPLE_FMT_FLT;
-            else
-                return AV_SAMPLE_FMT_FLTP;
+static bool string_ends_with(const char *str, const std::string &suffix) {
+    const size_t len = strlen(str);
+    return len >= suffix.size() && memcmp(str + len - suffix.size(), suffix.data(), suffix.size()) == 0;
+}
+
+// Removes the oldest segments in |output_dir| until the segments are within the size and age limit. The newest segment is never removed
+static void segments_apply_retention(const Segments &segments) {
+    if(segments.max_total_bytes <= 0 && segments.max_age_secs <= 0.0)
+        return;
+
+    DIR *dir = opendir(segments.output_dir.c_str());
+    if(!dir) {
+        fprintf(stderr, "Error: failed to open directory \"%s\" to remove old segments\n", segments.output_dir.c_str());
+        return;
+    }
+
+    const std::string suffix = "." + segments.file_extension;
+    std::vector<SegmentFile> segment_files;
+    int64_t total_bytes = 0;
+    struct dirent *entry;
+    while((entry = readdir(dir))) {
+        if(strncmp(entry->d_name, "Segment_", 8) != 0 || !string_ends_with(entry->d_name, suffix))
+            continue;
+
+        SegmentFile segment_file;
+        segment_file.filepath = segments.output_dir + "/" + entry->d_name;
+        struct stat buf;
+        if(stat(segment_file.filepath.c_str(), &buf) == -1 || !S_ISREG(buf.st_mode))
+            continue;
+
+        segment_file.size = buf.st_size;
+        segment_file.modified_time = buf.st_mtime;
+        total_bytes += buf.st_size;
+        segment_files.push_back(std::move(segment_file));
+    }
+    closedir(dir);
+
+    // The date in the name sorts the segments from oldest to newest
+    std::sort(segment_files.begin(), segment_files.end(), [](const SegmentFile &a, const SegmentFile &b) {
+        return a.filepath < b.filepath;
+    });
+
+    const time_t now = time(NULL);
+    for(size_t i = 0; i + 1 < segment_files.size(); ++i) {
+        const SegmentFile &segment_file = segment_files[i];
+        const bool over_size_limit = segments.max_total_bytes > 0 && total_bytes > segments.max_total_bytes;
+        const bool over_age_limit = segments.max_age_secs > 0.0 && difftime(now, segment_file.modified_time) > segments.max_age_secs;
+        if(!over_size_limit && !over_age_limit)
+            break;
+
+        if(unlink(segment_file.filepath.c_str()) == -1) {
+            fprintf(stderr, "Error: failed to remove old segment \"%s\"\n", segment_file.filepath.c_str());
+            continue;
         }
-        case AudioCodec::FLAC: {
-            return AV_SAMPLE_FMT_S32;
+        total_bytes -= segment_file.size;
+    }
+}
+
+// Returns nullptr on failure
+static AVFormatContext* segments_open(const Segments &segments, const std::string &temp_filepath) {
+    AVFormatContext *av_format_context = nullptr;
+    avformat_alloc_output_context2(&av_format_context, nullptr, segments.template_format_context->oformat->name, nullptr);
+    if(!av_format_context) {
+        fprintf(stderr, "Error: failed to create segment \"%s\"\n", temp_filepath.c_str());
+        return nullptr;
+    }
+
+    av_format_context->flags |= AVFMT_FLAG_GENPTS;
+    av_format_context->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+
+    for(unsigned int i = 0; i < segments.template_format_context->nb_streams; ++i) {
+        const AVStream *template_stream = segments.template_format_context->streams[i];
+        AVStream *stream = avformat_new_stream(av_format_context, nullptr);
+        if(!stream) {
+            fprintf(stderr, "Error: Could not allocate stream\n");
+            avformat_free_context(av_format_context);
+            return nullptr;
         }
+        stream->id = template_stream->id;
+        stream->time_base = template_stream->time_base;
+        stream->avg_frame_rate = template_stream->avg_frame_rate;
+        avcodec_parameters_copy(stream->codecpar, template_stream->codecpar);
     }
-    assert(false);
-    return AV_SAMPLE_FMT_FLTP;
+
+    int ret = avio_open(&av_format_context->pb, temp_filepath.c_str(), AVIO_FLAG_WRITE);
+    if(ret < 0) {
+        fprintf(stderr, "Error: Could not open '%s': %s\n", temp_filepath.c_str(), av_error_to_string(ret));
+        avformat_free_context(av_format_context);
+        return nullptr;
+    }
+
+    AVDictionary *options = nullptr;
+    av_dict_set(&options, "strict", "experimental", 0);
+    ret = avformat_write_header(av_format_context, &options);
+    av_dict_free(&options);
+    if(ret < 0) {
+        fprintf(stderr, "Error occurred when writing header to segment \"%s\": %s\n", temp_filepath.c_str(), av_error_to_string(ret));
+        avio_closep(&av_format_context->pb);
+        avformat_free_context(av_format_context);
+        unlink(temp_filepath.c_str());
+        return nullptr;
+    }
+
+    return av_format_context;
 }
 
-static int64_t audio_codec_get_get_bitrate(AudioCodec audio_codec) {
-    switch(audio_codec) {
-        case AudioCodec::AAC:  return 128000;
-        case AudioCodec::OPUS: return 96000;
-        case AudioCodec::FLAC: return 96000;
+// For a segment that was opened but never written to
+static void segments_discard(AVFormatContext *av_format_context, const std::string &temp_filepath) {
+    avio_closep(&av_format_context->pb);
+    avformat_free_context(av_format_context);
+    unlink(temp_filepath.c_str());
+}
+
+// Writes the trailer and moves the segment to |filepath|. This is done by the worker thread because writing the trailer can take a while for long segments
+static void segments_finish(const Segments &segments, AVFormatContext *av_format_context, const std::string &temp_filepath, const std::string &filepath) {
+    if(av_write_trailer(av_format_context) != 0)
+        fprintf(stderr, "Failed to write trailer to segment \"%s\"\n", filepath.c_str());
+    avio_closep(&av_format_context->pb);
+    avformat_free_context(av_format_context);
+
+    // The data has to be on the disk before the rename, otherwise a crash could leave an incomplete file with the final name
+    const int fd = open(temp_filepath.c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd != -1) {
+        fsync(fd);
+        close(fd);
     }
-    assert(false);
-    return 96000;
+
+    if(rename(temp_filepath.c_str(), filepath.c_str()) == -1) {
+        fprintf(stderr, "Error: failed to move segment \"%s\" to \"%s\"\n", temp_filepath.c_str(), filepath.c_str());
+        return;
+    }
+
+    // And the rename has to be on the disk before the segment is reported as finished
+    const int dir_fd = open(segments.output_dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(dir_fd != -1) {
+        fsync(dir_fd);
+        close(dir_fd);
+    }
+
+    puts(filepath.c_str());
+    fflush(stdout);
+    segments_apply_retention(segments);
 }
 
-static AudioFormat audio_codec_context_get_audio_format(const AVCodecContext *audio_codec_context) {
-    switch(audio_codec_context->sample_fmt) {
-        case AV_SAMPLE_FMT_FLT:   return F32;
-        case AV_SAMPLE_FMT_FLTP:  return S32;
-        case AV_SAMPLE_FMT_S16:   return S16;
-        case AV_SAMPLE_FMT_S32:   return S32;
-        default:                  return S16;
+static void segments_worker_thread(Segments &segments) {
+    std::unique_lock<std::mutex> lock(segments.worker_mutex);
+    for(;;) {
+        segments.worker_cond.wait(lock, [&segments] {
+            return segments.stop || !segments.finish_jobs.empty() || (segments.open_next && !segments.next_format_context);
+        });
+
+        if(!segments.finish_jobs.empty()) {
+            SegmentFinishJob finish_job = std::move(segments.finish_jobs.front());
+            segments.finish_jobs.pop_front();
+            lock.unlock();
+            segments_finish(segments, finish_job.format_context, finish_job.temp_filepath, finish_job.filepath);
+            lock.lock();
+        } else if(segments.open_next && !segments.next_format_context && !segments.stop) {
+            // The final name depends on when the segment starts, so the segment is opened with a temporary name
+            const std::string temp_filepath = segments.output_dir + "/Segment_next_" + std::to_string(segments.num_next_opened++) + "." + segments.file_extension + ".part";
+            lock.unlock();
+            AVFormatContext *av_format_context = segments_open(segments, temp_filepath);
+            lock.lock();
+            segments.open_next = false;
+            segments.next_format_context = av_format_context;
+            segments.next_temp_filepath = temp_filepath;
+        } else if(segments.stop) {
+            break;
+        }
     }
 }
 
-static AVSampleFormat audio_format_to_sample_format(const AudioFormat audio_format) {
-    switch(audio_format) {
-        case S16:   return AV_SAMPLE_FMT_S16;
-        case S32:   return AV_SAMPLE_FMT_S32;
-        case F32:   return AV_SAMPLE_FMT_FLT;
+static void segments_queue_finish(Segments &segments, AVFormatContext *av_format_context, const std::string &temp_filepath, const std::string &filepath) {
+    SegmentFinishJob finish_job;
+    finish_job.format_context = av_format_context;
+    finish_job.temp_filepath = temp_filepath;
+    finish_job.filepath = filepath;
+
+    std::lock_guard<std::mutex> lock(segments.worker_mutex);
+    segments.finish_jobs.push_back(std::move(finish_job));
+    segments.worker_cond.notify_one();
+}
+
+static void segments_request_next(Segments &segments) {
+    std::lock_guard<std::mutex> lock(segments.worker_mutex);
+    segments.open_next = true;
+    segments.worker_cond.notify_one();
+}
+
+static bool segments_init(Segments &segments) {
+    segments.filepath = segments.output_dir + "/Segment_" + get_date_str() + "." + segments.file_extension;
+    segments.temp_filepath = segments.filepath + ".part";
+    segments.format_context = segments_open(segments, segments.temp_filepath);
+    if(!segments.format_context)
+        return false;
+
+    // All streams start at pts 0 in the first segment
+    segments.start_time = clock_get_monotonic_seconds();
+    segments.start_pts = 0;
+    segments.start_time_base = {1, 1};
+    segments.stream_passed_start.assign(segments.template_format_context->nb_streams, true);
+
+    segments.worker_thread = std::thread(segments_worker_thread, std::ref(segments));
+    segments_request_next(segments);
+    return true;
+}
+
+static void segments_deinit(Segments &segments) {
+    if(segments.prev_format_context) {
+        segments_queue_finish(segments, segments.prev_format_context, segments.prev_temp_filepath, segments.prev_filepath);
+        segments.prev_format_context = nullptr;
+    }
+
+    if(segments.format_context) {
+        segments_queue_finish(segments, segments.format_context, segments.temp_filepath, segments.filepath);
+        segments.format_context = nullptr;
+    }
+
+    // The worker thread finishes the queued segments before it stops
+    {
+        std::lock_guard<std::mutex> lock(segments.worker_mutex);
+        segments.stop = true;
+        segments.worker_cond.notify_one();
+    }
+    if(segments.worker_thread.joinable())
+        segments.worker_thread.join();
+
+    if(segments.next_format_context) {
+        segments_discard(segments.next_format_context, segments.next_temp_filepath);
+        segments.next_format_context = nullptr;
     }
-    assert(false);
-    return AV_SAMPLE_FMT_S16;
 }
 
-static AVCodecContext* create_audio_codec_context(int fps, AudioCodec audio_codec) {
-    const AVCodec *codec = avcodec_find_encoder(audio_codec_get_id(audio_codec));
-    if (!codec) {
-        fprintf(stderr, "Error: Could not find %s audio encoder\n", audio_codec_get_name(audio_codec));
-        exit(1);
+// Finishes the previous segment, all packets that are received after this are for the current segment
+static void segments_finish_prev(Segments &segments) {
+    if(!segments.prev_format_context)
+        return;
+
+    segments_queue_finish(segments, segments.prev_format_context, segments.prev_temp_filepath, segments.prev_filepath);
+    segments.prev_format_context = nullptr;
+    std::fill(segments.stream_passed_start.begin(), segments.stream_passed_start.end(), true);
+}
+
+// Starts the next segment at the video keyframe |av_packet|. If the next segment hasn't been opened (yet) then the current segment continues, so nothing is lost
+static void segments_start_next(Segments &segments, const AVPacket &av_packet, AVRational codec_time_base) {
+    const std::string filepath = segments.output_dir + "/Segment_" + get_date_str() + "." + segments.file_extension;
+    if(filepath == segments.filepath)
+        return;
+
+    AVFormatContext *next_format_context = nullptr;
+    std::string next_temp_filepath;
+    {
+        std::lock_guard<std::mutex> lock(segments.worker_mutex);
+        std::swap(next_format_context, segments.next_format_context);
+        next_temp_filepath = segments.next_temp_filepath;
+        // Opening the segment failed, try again
+        if(!next_format_context)
+            segments.open_next = true;
+        segments.worker_cond.notify_one();
     }
 
-    AVCodecContext *codec_context = avcodec_alloc_context3(codec);
+    if(!next_format_context)
+        return;
 
-    assert(codec->type == AVMEDIA_TYPE_AUDIO);
-	codec_context->codec_id = codec->id;
-    codec_context->sample_fmt = audio_codec_get_sample_format(audio_codec, codec);
-    codec_context->bit_rate = audio_codec_get_get_bitrate(audio_codec);
-    codec_context->sample_rate = 48000;
-    if(audio_codec == AudioCodec::AAC)
-        codec_context->profile = FF_PROFILE_AAC_LOW;
-#if LIBAVCODEC_VERSION_MAJOR < 60
-    codec_context->channel_layout = AV_CH_LAYOUT_STEREO;
-    codec_context->channels = 2;
-#else
-    av_channel_layout_default(&codec_context->ch_layout, 2);
-#endif
+    // The segment before the previous one has had a whole segment duration for its audio, so it doesn't wait for audio anymore
+    segments_finish_prev(segments);
+
+    segments.prev_format_context = segments.format_context;
+    segments.prev_temp_filepath = segments.temp_filepath;
+    segments.prev_filepath = segments.filepath;
+    segments.prev_start_pts = segments.start_pts;
+    segments.prev_start_time_base = segments.start_time_base;
+    std::fill(segments.stream_passed_start.begin(), segments.stream_passed_start.end(), false);
+
+    segments.format_context = next_format_context;
+    segments.temp_filepath = next_temp_filepath;
+    segments.filepath = filepath;
+    segments.start_time = clock_get_monotonic_seconds();
+    segments.start_pts = av_packet.pts;
+    segments.start_time_base = codec_time_base;
+    segments_request_next(segments);
+}
 
-    codec_context->time_base.num = 1;
-    codec_context->time_base.den = codec_context->sample_rate;
-    codec_context->framerate.num = fps;
-    codec_context->framerate.den = 1;
-    codec_context->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+// |av_packet| timestamps are in |codec_time_base|
+static void segments_write_packet(Segments &segments, AVPacket &av_packet, AVRational codec_time_base) {
+    const bool is_video = av_packet.stream_index == VIDEO_STREAM_INDEX;
+    if(is_video && (av_packet.flags & AV_PKT_FLAG_KEY) && clock_get_monotonic_seconds() - segments.start_time >= segments.segment_duration_secs)
+        segments_start_next(segments, av_packet, codec_time_base);
+
+    AVFormatContext *format_context = segments.format_context;
+    int64_t pts_offset = av_rescale_q(segments.start_pts, segments.start_time_base, codec_time_base);
+    if(segments.prev_format_context) {
+        if(!is_video && av_packet.pts < pts_offset) {
+            // Audio for before the keyframe the current segment starts with
+            format_context = segments.prev_format_context;
+            pts_offset = av_rescale_q(segments.prev_start_pts, segments.prev_start_time_base, codec_time_base);
+        } else {
+            segments.stream_passed_start[av_packet.stream_index] = true;
+            const bool all_streams_passed_start = std::find(segments.stream_passed_start.begin(), segments.stream_passed_start.end(), false) == segments.stream_passed_start.end();
+            // An audio stream that stops (which shouldn't happen, silence is written then) holds back the previous segment for at most a second
+            const bool audio_waited_too_long = is_video && av_packet.pts - pts_offset > av_rescale_q(1, AVRational{1, 1}, codec_time_base);
+            if(all_streams_passed_start || audio_waited_too_long)
+                segments_finish_prev(segments);
+        }
+    }
 
-    return codec_context;
+    av_packet.pts -= pts_offset;
+    av_packet.dts -= pts_offset;
+
+    AVStream *stream = format_context->streams[av_packet.stream_index];
+    av_packet_rescale_ts(&av_packet, codec_time_base, stream->time_base);
+    int ret = av_interleaved_write_frame(format_context, &av_packet);
+    if(ret < 0) {
+        fprintf(stderr, "Error: Failed to write frame index %d to segment, reason: %s (%d)\n", av_packet.stream_index, av_error_to_string(ret), ret);
+    }
 }
 
-static AVCodecContext *create_video_codec_context(AVPixelFormat pix_fmt,
-                            VideoQuality video_quality,
-                            int fps, const AVCodec *codec, bool is_livestream) {
+// A few seconds of packets at 60 fps with a couple of audio tracks
+static const int WRITE_QUEUE_MAX_PACKETS = 512;
 
-    AVCodecContext *codec_context = avcodec_alloc_context3(codec);
+enum class WriteQueuePolicy {
+    BLOCK,
+    DROP
+};
 
-    //double fps_ratio = (double)fps / 30.0;
+// An encoded packet on its way to the writer thread. These are in a pool that is allocated with the queue, so pushing a packet doesn't allocate
+struct WritePacket {
+    AVPacket av_packet;
+    AVRational codec_time_base;
+    std::atomic<bool> in_use{false};
+};
 
-    assert(codec->type == AVMEDIA_TYPE_VIDEO);
-    codec_context->codec_id = codec->id;
-    // Timebase: This is the fundamental unit of time (in seconds) in terms
-    // of which frame timestamps are represented. For fixed-fps content,
-    // timebase should be 1/framerate and timestamp increments should be
-    // identical to 1
-    codec_context->time_base.num = 1;
-    codec_context->time_base.den = fps;
-    codec_context->framerate.num = fps;
-    codec_context->framerate.den = 1;
-    codec_context->sample_aspect_ratio.num = 0;
-    codec_context->sample_aspect_ratio.den = 0;
-    // High values reeduce file size but increases time it takes to seek
-    if(is_livestream) {
-        codec_context->flags |= (AV_CODEC_FLAG_CLOSED_GOP | AV_CODEC_FLAG_LOW_DELAY);
-        codec_context->flags2 |= AV_CODEC_FLAG2_FAST;
-        //codec_context->gop_size = std::numeric_limits<int>::max();
-        //codec_context->keyint_min = std::numeric_limits<int>::max();
-        codec_context->gop_size = fps * 2;
-    } else {
-        codec_context->gop_size = fps * 2;
+// All encoders push their packets to |queue| (from any thread), and the writer thread is the only one that writes to the output
+// (muxer, replay buffer or segments). A slow disk or a blocked stdout pipe only stalls the writer thread, until the queue is full.
+// Then the encoders either wait for room in the queue (block) or drop the packet (drop). When a video packet is dropped then
+// the video packets after it are dropped as well until the next keyframe, because they can't be decoded without it.
+struct PacketWriter {
+    gsr_mpsc_queue *queue = nullptr;
+    sem_t num_packets_sem; // Wakes up the writer thread
+    sem_t num_free_sem; // Producers take a slot from this before pushing, so pushing can't fail and there is always a free packet in |packet_pool|
+    std::unique_ptr<WritePacket[]> packet_pool; // One packet for each slot of |queue|
+    size_t packet_pool_size = 0;
+    std::atomic<size_t> next_pool_index{0}; // Where producers start looking for a free packet in |packet_pool|
+    WriteQueuePolicy policy = WriteQueuePolicy::BLOCK;
+    std::thread thread;
+    std::atomic<bool> stop{false};
+
+    AVFormatContext *av_format_context = nullptr;
+    std::vector<AVStream*> streams; // The output stream of each stream index, only used when muxing (not in non-fragmented replay mode)
+    gsr_replay_buffer *replay_buffer = nullptr;
+    ReplayFragments *replay_fragments = nullptr;
+    Segments *segments = nullptr;
+    // Only the writer thread (while it adds to the replay buffer) and saving a replay take this, saving a replay needs the replay buffer to not change
+    // while the snapshot is created. Muxing is done without it
+    std::mutex *write_output_mutex = nullptr;
+
+    std::string name; // Of the output, shown in the stats. Empty for the first output
+
+    bool video_waiting_for_keyframe = false; // Only used by the video encode thread
+    bool replay_buffer_dropping = false; // Packets are being dropped by the replay buffer, so the error is only shown once for each time it happens
+
+    // Updated by the encoders and the writer thread, read and reset once a second
+    std::atomic<int> max_depth{0};
+    std::atomic<int> num_written{0};
+    std::atomic<int> num_dropped{0};
+    std::atomic<int> num_blocked{0};
+    std::atomic<int64_t> blocked_time_us{0};
+    std::atomic<int64_t> write_time_us{0}; // Time the writer thread spent writing
+    std::atomic<int64_t> num_bytes_written{0};
+};
+
+// Takes the data of |av_packet|
+static void packet_writer_mux(PacketWriter &packet_writer, AVPacket &av_packet, AVRational codec_time_base) {
+    AVStream *stream = packet_writer.streams[av_packet.stream_index];
+    av_packet_rescale_ts(&av_packet, codec_time_base, stream->time_base);
+    av_packet.stream_index = stream->index;
+    // av_interleaved_write_frame interleaves the streams by dts, so it doesn't matter in which order the encoders pushed the packets
+    int ret = av_interleaved_write_frame(packet_writer.av_format_context, &av_packet);
+    if(ret < 0) {
+        fprintf(stderr, "Error: Failed to write frame index %d to muxer, reason: %s (%d)\n", av_packet.stream_index, av_error_to_string(ret), ret);
+    }
+}
+
+static void replay_fragments_write_packet(PacketWriter &packet_writer, AVPacket &av_packet, AVRational codec_time_base);
+
+// Adds the current fragment to the replay buffer and muxes the packets that were waiting for it, the first of which is the keyframe the next fragment starts with
+static void replay_fragments_cut(PacketWriter &packet_writer) {
+    ReplayFragments &replay_fragments = *packet_writer.replay_fragments;
+    replay_fragments_flush(replay_fragments, packet_writer.av_format_context, packet_writer.replay_buffer, *packet_writer.write_output_mutex, replay_fragments.cut_timestamp);
+    replay_fragments.cut_pending = false;
+
+    std::deque<ReplayFragmentPacket> pending_packets;
+    pending_packets.swap(replay_fragments.pending_packets);
+    for(size_t i = 0; i < pending_packets.size(); ++i) {
+        ReplayFragmentPacket &pending_packet = pending_packets[i];
+        // The packets after the keyframe can start the next cut
+        if(i == 0)
+            packet_writer_mux(packet_writer, *pending_packet.av_packet, pending_packet.codec_time_base);
+        else
+            replay_fragments_write_packet(packet_writer, *pending_packet.av_packet, pending_packet.codec_time_base);
+        av_packet_free(&pending_packet.av_packet);
+    }
+}
+
+// Takes the data of |av_packet|
+static void replay_fragments_write_packet(PacketWriter &packet_writer, AVPacket &av_packet, AVRational codec_time_base) {
+    ReplayFragments &replay_fragments = *packet_writer.replay_fragments;
+    const bool is_video = av_packet.stream_index == VIDEO_STREAM_INDEX;
+    const double timestamp = av_packet.pts * av_q2d(codec_time_base);
+
+    if(!replay_fragments.cut_pending && !(is_video && (av_packet.flags & AV_PKT_FLAG_KEY))) {
+        packet_writer_mux(packet_writer, av_packet, codec_time_base);
+        return;
+    }
+
+    if(!replay_fragments.cut_pending) {
+        replay_fragments.cut_pending = true;
+        replay_fragments.cut_timestamp = timestamp;
+        std::fill(replay_fragments.stream_passed_cut.begin(), replay_fragments.stream_passed_cut.end(), false);
+    } else if(!is_video && timestamp < replay_fragments.cut_timestamp) {
+        // Audio that belongs to the fragment that hasn't been cut yet
+        packet_writer_mux(packet_writer, av_packet, codec_time_base);
+        return;
+    }
+
+    ReplayFragmentPacket pending_packet;
+    pending_packet.av_packet = av_packet_alloc();
+    if(!pending_packet.av_packet) {
+        fprintf(stderr, "Error: failed to allocate packet\n");
+        exit(1);
+    }
+    av_packet_move_ref(pending_packet.av_packet, &av_packet);
+    pending_packet.codec_time_base = codec_time_base;
+    replay_fragments.pending_packets.push_back(pending_packet);
+
+    const AVStream *stream = packet_writer.streams[pending_packet.av_packet->stream_index];
+    replay_fragments.stream_passed_cut[stream->index] = true;
+
+    const AVStream *video_stream = packet_writer.streams[VIDEO_STREAM_INDEX];
+    bool all_streams_passed_cut = true;
+    for(size_t i = 0; i < replay_fragments.stream_passed_cut.size(); ++i) {
+        if((int)i != video_stream->index && !replay_fragments.stream_passed_cut[i])
+            all_streams_passed_cut = false;
+    }
+
+    if(all_streams_passed_cut || (is_video && timestamp - replay_fragments.cut_timestamp > REPLAY_FRAGMENT_MAX_CUT_DELAY_SECS))
+        replay_fragments_cut(packet_writer);
+}
+
+static void packet_writer_write(PacketWriter &packet_writer, WritePacket &write_packet) {
+    AVPacket &av_packet = write_packet.av_packet;
+    const int stream_index = av_packet.stream_index;
+
+    if(packet_writer.replay_buffer && !packet_writer.replay_fragments) {
+        std::lock_guard<std::mutex> lock(*packet_writer.write_output_mutex);
+        gsr_replay_packet replay_packet;
+        replay_packet.data = av_packet.data;
+        replay_packet.size = av_packet.size;
+        replay_packet.stream_index = av_packet.stream_index;
+        replay_packet.flags = 0;
+        if(av_packet.flags & AV_PKT_FLAG_KEY)
+            replay_packet.flags |= GSR_REPLAY_PACKET_FLAG_KEY;
+        replay_packet.pts = av_packet.pts;
+        replay_packet.dts = av_packet.dts;
+        // Each stream's own clock, so eviction and saving line up the streams by presentation time instead of by when the packets happened to be encoded
+        replay_packet.timestamp = av_packet.pts * av_q2d(write_packet.codec_time_base);
+
+        const bool added = gsr_replay_buffer_append(packet_writer.replay_buffer, &replay_packet);
+        if(!added && !packet_writer.replay_buffer_dropping)
+            fprintf(stderr, "Error: Failed to add packet of size %d to the replay buffer, packets are skipped until the next keyframe. Either the packet is larger than the replay buffer memory limit (-rm) or saving a replay is slower than recording\n", av_packet.size);
+        packet_writer.replay_buffer_dropping = !added;
+    } else if(packet_writer.segments) {
+        av_packet.stream_index = packet_writer.streams[stream_index]->index;
+        segments_write_packet(*packet_writer.segments, av_packet, write_packet.codec_time_base);
+    } else if(packet_writer.replay_fragments) {
+        replay_fragments_write_packet(packet_writer, av_packet, write_packet.codec_time_base);
+    } else {
+        packet_writer_mux(packet_writer, av_packet, write_packet.codec_time_base);
+    }
+}
+
+static void packet_writer_thread(PacketWriter &packet_writer) {
+    for(;;) {
+        while(sem_wait(&packet_writer.num_packets_sem) == -1 && errno == EINTR) {}
+
+        void *item = nullptr;
+        // The packet that woke this thread up can be there before an older packet that another encoder is still pushing
+        while(!gsr_mpsc_queue_pop(packet_writer.queue, &item)) {
+            // Stopping happens after all encoders have stopped, so an empty queue means everything has been written
+            if(packet_writer.stop && gsr_mpsc_queue_size(packet_writer.queue) == 0)
+                return;
+            sched_yield();
+        }
+
+        const int depth = (int)gsr_mpsc_queue_size(packet_writer.queue) + 1;
+        if(depth > packet_writer.max_depth.load(std::memory_order_relaxed))
+            packet_writer.max_depth.store(depth, std::memory_order_relaxed);
+
+        WritePacket *write_packet = (WritePacket*)item;
+        packet_writer.num_bytes_written += write_packet->av_packet.size;
+        const double write_start = clock_get_monotonic_seconds();
+        packet_writer_write(packet_writer, *write_packet);
+        packet_writer.write_time_us += (int64_t)((clock_get_monotonic_seconds() - write_start) * 1000000.0);
+        av_packet_unref(&write_packet->av_packet);
+        ++packet_writer.num_written;
+
+        // The packet goes back to the pool before the slot is given back, so a producer that gets the slot always finds a free packet
+        write_packet->in_use.store(false, std::memory_order_release);
+        sem_post(&packet_writer.num_free_sem);
+    }
+}
+
+// The caller has to have taken a slot from |num_free_sem|, then at least one packet of the pool is free.
+// Producers start at different packets, so they rarely try the same one
+static WritePacket* packet_writer_take_pool_packet(PacketWriter &packet_writer) {
+    for(size_t index = packet_writer.next_pool_index.fetch_add(1, std::memory_order_relaxed);; ++index) {
+        WritePacket &write_packet = packet_writer.packet_pool[index % packet_writer.packet_pool_size];
+        if(!write_packet.in_use.load(std::memory_order_relaxed) && !write_packet.in_use.exchange(true, std::memory_order_acquire))
+            return &write_packet;
+    }
+}
+
+// Takes the data of |av_packet|
+static void packet_writer_push(PacketWriter &packet_writer, AVPacket &av_packet, AVRational codec_time_base) {
+    const bool is_video = av_packet.stream_index == VIDEO_STREAM_INDEX;
+    if(is_video && packet_writer.video_waiting_for_keyframe) {
+        if(!(av_packet.flags & AV_PKT_FLAG_KEY)) {
+            ++packet_writer.num_dropped;
+            av_packet_unref(&av_packet);
+            return;
+        }
+        packet_writer.video_waiting_for_keyframe = false;
+    }
+
+    if(sem_trywait(&packet_writer.num_free_sem) == -1) {
+        if(packet_writer.policy == WriteQueuePolicy::DROP) {
+            ++packet_writer.num_dropped;
+            if(is_video)
+                packet_writer.video_waiting_for_keyframe = true;
+            av_packet_unref(&av_packet);
+            return;
+        }
+
+        const double wait_start = clock_get_monotonic_seconds();
+        while(sem_wait(&packet_writer.num_free_sem) == -1 && errno == EINTR) {}
+        ++packet_writer.num_blocked;
+        packet_writer.blocked_time_us += (int64_t)((clock_get_monotonic_seconds() - wait_start) * 1000000.0);
+    }
+
+    WritePacket *write_packet = packet_writer_take_pool_packet(packet_writer);
+    av_packet_move_ref(&write_packet->av_packet, &av_packet);
+    write_packet->codec_time_base = codec_time_base;
+
+    // Can't fail, a free slot was taken above
+    gsr_mpsc_queue_push(packet_writer.queue, write_packet);
+    sem_post(&packet_writer.num_packets_sem);
+}
+
+// Every output has its own packet writer. The outputs share the data of the packet by reference, it's only copied when it's muxed.
+// Takes the data of |av_packet|
+static void packet_writers_push(const std::vector<PacketWriter*> &packet_writers, AVPacket &av_packet, AVRational codec_time_base) {
+    for(size_t i = 0; i + 1 < packet_writers.size(); ++i) {
+        AVPacket packet_ref;
+        memset(&packet_ref, 0, sizeof(packet_ref));
+        av_packet_ref(&packet_ref, &av_packet);
+        packet_writer_push(*packet_writers[i], packet_ref, codec_time_base);
+    }
+    packet_writer_push(*packet_writers.back(), av_packet, codec_time_base);
+}
+
+static bool packet_writer_init(PacketWriter &packet_writer, size_t max_packets) {
+    packet_writer.queue = gsr_mpsc_queue_create(max_packets);
+    if(!packet_writer.queue)
+        return false;
+
+    const unsigned int capacity = gsr_mpsc_queue_capacity(packet_writer.queue);
+    packet_writer.packet_pool = std::make_unique<WritePacket[]>(capacity);
+    packet_writer.packet_pool_size = capacity;
+
+    if(sem_init(&packet_writer.num_packets_sem, 0, 0) == -1 || sem_init(&packet_writer.num_free_sem, 0, capacity) == -1) {
+        fprintf(stderr, "Error: sem_init failed: %s\n", strerror(errno));
+        return false;
+    }
+
+    packet_writer.thread = std::thread(packet_writer_thread, std::ref(packet_writer));
+    return true;
+}
+
+// Writes the packets that are still in the queue before returning. All encoders have to be stopped before this is called
+struct PacketWriterStats {
+    int max_depth = 0;
+    int num_written = 0;
+    int num_dropped = 0;
+    int num_blocked = 0;
+    int64_t blocked_time_us = 0;
+    int64_t write_time_us = 0;
+    int64_t num_bytes_written = 0;
+};
+
+// Returns the stats since the last call
+static PacketWriterStats packet_writer_take_stats(PacketWriter &packet_writer) {
+    PacketWriterStats stats;
+    stats.max_depth = packet_writer.max_depth.exchange(0);
+    stats.num_written = packet_writer.num_written.exchange(0);
+    stats.num_dropped = packet_writer.num_dropped.exchange(0);
+    stats.num_blocked = packet_writer.num_blocked.exchange(0);
+    stats.blocked_time_us = packet_writer.blocked_time_us.exchange(0);
+    stats.write_time_us = packet_writer.write_time_us.exchange(0);
+    stats.num_bytes_written = packet_writer.num_bytes_written.exchange(0);
+    return stats;
+}
+
+static void packet_writer_deinit(PacketWriter &packet_writer) {
+    if(packet_writer.thread.joinable()) {
+        packet_writer.stop = true;
+        sem_post(&packet_writer.num_packets_sem);
+        packet_writer.thread.join();
+    }
+
+    sem_destroy(&packet_writer.num_packets_sem);
+    sem_destroy(&packet_writer.num_free_sem);
+    gsr_mpsc_queue_destroy(packet_writer.queue);
+    packet_writer.queue = nullptr;
+}
+
+// If |last_packet| is set then it's set to a reference to the last packet that was received, if any
+static void receive_frames(AVCodecContext *av_codec_context, int stream_index, AVFrame *frame, const std::vector<PacketWriter*> &packet_writers, AVPacket *last_packet = nullptr) {
+    for (;;) {
+        // TODO: Use av_packet_alloc instead because sizeof(av_packet) might not be future proof(?)
+        AVPacket av_packet;
+        memset(&av_packet, 0, sizeof(av_packet));
+        av_packet.data = NULL;
+        av_packet.size = 0;
+        int res = avcodec_receive_packet(av_codec_context, &av_packet);
+        if (res == 0) { // we have a packet, send the packet to the writer thread
+            av_packet.stream_index = stream_index;
+            // The video encoder holds a few frames before it gives back the packet of a frame, so the packet isn't of |frame|.
+            // The encoder passes the pts of the frame through to its packet, which is what has to be used when frames are far apart (vfr mode, or skipped frames).
+            // The audio timestamps are still from |frame|, the pts of the audio encoders is shifted by their padding
+            if(av_codec_context->codec_type != AVMEDIA_TYPE_VIDEO || av_packet.pts == AV_NOPTS_VALUE)
+                av_packet.pts = av_packet.dts = frame->pts;
+            else if(av_packet.dts == AV_NOPTS_VALUE)
+                av_packet.dts = av_packet.pts;
+
+            if(last_packet) {
+                av_packet_unref(last_packet);
+                av_packet_ref(last_packet, &av_packet);
+            }
+
+            packet_writers_push(packet_writers, av_packet, av_codec_context->time_base);
+        } else if (res == AVERROR(EAGAIN)) { // we have no packet
+                                             // fprintf(stderr, "No packet!\n");
+            av_packet_unref(&av_packet);
+            break;
+        } else if (res == AVERROR_EOF) { // this is the end of the stream
+            fprintf(stderr, "End of stream!\n");
+            av_packet_unref(&av_packet);
+            break;
+        } else {
+            fprintf(stderr, "Unexpected error: %d\n", res);
+            av_packet_unref(&av_packet);
+            break;
+        }
+    }
+}
+
+enum class BitrateMode {
+    CONSTANT_QP,
+    CBR,
+    VBR
+};
+
+// Used for live streams when -b isn't set
+static const int64_t LIVESTREAM_DEFAULT_BITRATE = 6000000;
+
+// The vbv buffer is one second of the max bitrate. nvenc applies changes of these while encoding, if the gpu supports it
+static void set_video_bitrate(AVCodecContext *codec_context, BitrateMode bitrate_mode, int64_t bitrate) {
+    codec_context->bit_rate = bitrate;
+    codec_context->rc_max_rate = bitrate_mode == BitrateMode::VBR ? bitrate * 3 / 2 : bitrate;
+    codec_context->rc_min_rate = bitrate_mode == BitrateMode::CBR ? bitrate : 0;
+    codec_context->rc_buffer_size = codec_context->rc_max_rate;
+}
+
+enum class FrameMode {
+    CFR,
+    VFR
+};
+
+static const int FRAME_RATE_GOVERNOR_MAX_DIVISOR = 4;
+// Load is the time a frame takes (in the slowest of capture, encode and write) divided by the time between captured frames
+static const double FRAME_RATE_GOVERNOR_OVERLOAD = 0.9;
+static const double FRAME_RATE_GOVERNOR_UNDERLOAD = 0.7; // The load the next higher capture rate would have
+static const int FRAME_RATE_GOVERNOR_OVERLOAD_SECS = 2;
+static const int FRAME_RATE_GOVERNOR_UNDERLOAD_SECS = 5;
+
+// Lowers the capture rate when the recording can't keep up, so that the video has a steady lower frame rate instead of stuttering,
+// and raises it again when there is headroom. Only every |divisor|th frame is captured, the pts of the frames stay in units of the requested fps.
+// It takes a few seconds of overload before lowering and longer before raising, so the capture rate doesn't keep going back and forth.
+// The resolution and encoder preset are not changed because that requires opening a new encoder, which starts a new video stream.
+struct FrameRateGovernor {
+    bool enabled = true;
+    int divisor = 1;
+    int num_overloaded_secs = 0;
+    int num_underloaded_secs = 0;
+    int num_changes = 0;
+    double load = 0.0; // Of the last update
+};
+
+// Called once a second with the average time a captured frame took to capture and to encode, the fraction of the time the writer thread was busy
+// and the number of captures that were skipped because the encoder was behind. Returns true if |divisor| changed
+static bool frame_rate_governor_update(FrameRateGovernor &governor, double frame_time, double capture_secs, double encode_secs, double write_busy, int num_skipped) {
+    const double frame_secs = std::max(capture_secs, encode_secs);
+    // Writing is shared with audio, but most of it is video which scales with the capture rate
+    governor.load = std::max(frame_secs / (frame_time * governor.divisor), write_busy);
+    if(!governor.enabled)
+        return false;
+
+    if(governor.load > FRAME_RATE_GOVERNOR_OVERLOAD || num_skipped > 0) {
+        governor.num_underloaded_secs = 0;
+        ++governor.num_overloaded_secs;
+        if(governor.num_overloaded_secs < FRAME_RATE_GOVERNOR_OVERLOAD_SECS || governor.divisor == FRAME_RATE_GOVERNOR_MAX_DIVISOR)
+            return false;
+
+        ++governor.divisor;
+        fprintf(stderr, "gsr info: recording can't keep up (capture: %.2f ms, encode: %.2f ms, write: %d%% busy, skipped captures: %d), lowering the capture rate to %.2f fps\n",
+            capture_secs * 1000.0, encode_secs * 1000.0, (int)(write_busy * 100.0), num_skipped, 1.0 / (frame_time * governor.divisor));
+    } else if(governor.divisor > 1) {
+        governor.num_overloaded_secs = 0;
+        const int next_divisor = governor.divisor - 1;
+        const double next_load = std::max(frame_secs / (frame_time * next_divisor), write_busy * governor.divisor / next_divisor);
+        if(next_load > FRAME_RATE_GOVERNOR_UNDERLOAD) {
+            governor.num_underloaded_secs = 0;
+            return false;
+        }
+
+        ++governor.num_underloaded_secs;
+        if(governor.num_underloaded_secs < FRAME_RATE_GOVERNOR_UNDERLOAD_SECS)
+            return false;
+
+        governor.divisor = next_divisor;
+        fprintf(stderr, "gsr info: recording has headroom again (capture: %.2f ms, encode: %.2f ms, write: %d%% busy), raising the capture rate to %.2f fps\n",
+            capture_secs * 1000.0, encode_secs * 1000.0, (int)(write_busy * 100.0), 1.0 / (frame_time * governor.divisor));
+    } else {
+        governor.num_overloaded_secs = 0;
+        return false;
+    }
+
+    governor.num_overloaded_secs = 0;
+    governor.num_underloaded_secs = 0;
+    ++governor.num_changes;
+    return true;
+}
+
+static const int BITRATE_CONTROLLER_RAISE_SECS = 3; // Seconds without congestion before the bitrate is raised, and between raises
+static const int64_t BITRATE_CONTROLLER_MIN_DIVISOR = 8; // The bitrate isn't lowered below the requested bitrate divided by this
+
+// Adapts the video bitrate to what the output (usually a network connection) can take. The output is congested when packets wait
+// in the packet queue for more than half a second, or when the queue was full. Then the bitrate is lowered right away, to below what
+// was actually written in the last second. It's raised again slowly (additive increase, multiplicative decrease) while there's no congestion,
+// up to the requested bitrate. This keeps the queue short so the stream doesn't fall behind or drop video.
+struct BitrateController {
+    bool enabled = false;
+    BitrateMode mode = BitrateMode::CONSTANT_QP;
+    int64_t max_bitrate = 0;
+    int64_t bitrate = 0;
+    int num_clear_secs = 0;
+    int num_changes = 0;
+};
+
+// Called once a second with the packet queue stats of the output of that second. Returns true if |bitrate| changed
+static bool bitrate_controller_update(BitrateController &controller, double elapsed, const PacketWriterStats &stats) {
+    if(!controller.enabled)
+        return false;
+
+    const int64_t min_bitrate = controller.max_bitrate / BITRATE_CONTROLLER_MIN_DIVISOR;
+    const int64_t written_bitrate = (int64_t)((double)stats.num_bytes_written * 8.0 / elapsed);
+    const int max_depth = stats.max_depth;
+    const int num_dropped = stats.num_dropped;
+    const int num_blocked = stats.num_blocked;
+    const bool congested = num_dropped > 0 || num_blocked > 0 || max_depth > std::max(8, stats.num_written / 2);
+    if(congested) {
+        controller.num_clear_secs = 0;
+        if(controller.bitrate == min_bitrate)
+            return false;
+
+        // Audio is part of the written bitrate, but it's small compared to video
+        const int64_t prev_bitrate = controller.bitrate;
+        controller.bitrate = std::max(min_bitrate, std::min(controller.bitrate * 3 / 4, written_bitrate * 17 / 20));
+        fprintf(stderr, "gsr info: output can't keep up (written: %d kbps, queue max: %d packets, dropped: %d, blocked: %d), lowering the video bitrate from %d kbps to %d kbps\n",
+            (int)(written_bitrate / 1000), max_depth, num_dropped, num_blocked, (int)(prev_bitrate / 1000), (int)(controller.bitrate / 1000));
+    } else {
+        ++controller.num_clear_secs;
+        if(controller.bitrate == controller.max_bitrate || controller.num_clear_secs < BITRATE_CONTROLLER_RAISE_SECS)
+            return false;
+
+        const int64_t prev_bitrate = controller.bitrate;
+        controller.bitrate = std::min(controller.max_bitrate, controller.bitrate + controller.max_bitrate / 10);
+        fprintf(stderr, "gsr info: output is keeping up (written: %d kbps, queue max: %d packets), raising the video bitrate from %d kbps to %d kbps\n",
+            (int)(written_bitrate / 1000), max_depth, (int)(prev_bitrate / 1000), (int)(controller.bitrate / 1000));
+    }
+
+    controller.num_clear_secs = 0;
+    ++controller.num_changes;
+    return true;
+}
+
+// A captured frame waiting to be encoded. Frames that were missed before it are not encoded, there is a gap in the pts instead
+// so the previous frame is shown for longer
+struct CapturedFrame {
+    AVFrame *frame = nullptr;
+    int64_t pts = 0;
+    bool force_keyframe = false;
+    double capture_time = 0.0;
+};
+
+// A second encode of the captured frames at another resolution and bitrate (-so), for example to live stream at 720p while recording at full quality.
+// The captured frame is scaled on the gpu by a filter (scale_cuda or scale_vaapi) and then encoded by the encode thread, after the main encode.
+// The packets go to the simulcast outputs only, the audio packets go to all outputs
+struct Simulcast {
+    AVCodecContext *codec_context = nullptr;
+    AVFilterGraph *graph = nullptr;
+    AVFilterContext *src = nullptr;
+    AVFilterContext *sink = nullptr;
+    AVFrame *frame = nullptr; // The scaled frame
+    std::vector<PacketWriter*> packet_writers;
+    // Set by the capture thread, applied by the encode thread before the next frame. 0 if the bitrate isn't changed while recording
+    std::atomic<int64_t> video_bitrate{0};
+    BitrateMode bitrate_mode = BitrateMode::CONSTANT_QP;
+};
+
+static void simulcast_encode(Simulcast &simulcast, AVFrame *frame) {
+    const int64_t video_bitrate = simulcast.video_bitrate.load(std::memory_order_relaxed);
+    if(video_bitrate > 0 && video_bitrate != simulcast.codec_context->bit_rate)
+        set_video_bitrate(simulcast.codec_context, simulcast.bitrate_mode, video_bitrate);
+
+    // The filter only keeps a reference to the captured frame until it has been scaled
+    int ret = av_buffersrc_add_frame_flags(simulcast.src, frame, AV_BUFFERSRC_FLAG_KEEP_REF);
+    if(ret < 0) {
+        fprintf(stderr, "Error: failed to add frame to the simulcast scale filter, error: %s\n", av_error_to_string(ret));
+        return;
+    }
+
+    while(av_buffersink_get_frame(simulcast.sink, simulcast.frame) >= 0) {
+        simulcast.frame->pict_type = frame->pict_type;
+        ret = avcodec_send_frame(simulcast.codec_context, simulcast.frame);
+        if(ret >= 0) {
+            receive_frames(simulcast.codec_context, VIDEO_STREAM_INDEX, simulcast.frame, simulcast.packet_writers);
+        } else {
+            fprintf(stderr, "Error: avcodec_send_frame failed for the simulcast encode, error: %s\n", av_error_to_string(ret));
+        }
+        av_frame_unref(simulcast.frame);
+    }
+}
+
+// Frames are captured on the main thread and encoded (and muxed) on the encode thread, so that a slow encode doesn't delay the next capture.
+// The frames are allocated up front and go around in a loop: |free_frames| -> capture -> |captured_frames| -> encode -> |free_frames|.
+// Both queues are lock-free single producer/single consumer queues, |captured_sem| only wakes up the encode thread.
+// If there is no free frame when it's time to capture then the capture is skipped, and the previous frame is shown until the next captured frame.
+struct FrameQueue {
+    std::vector<CapturedFrame> frames;
+    gsr_spsc_queue *free_frames = nullptr;
+    gsr_spsc_queue *captured_frames = nullptr;
+    sem_t captured_sem;
+    std::thread encode_thread;
+
+    // Updated by the encode thread, read and reset by the capture thread once a second
+    std::atomic<int> max_depth{0};
+    std::atomic<int> num_encoded{0};
+    std::atomic<int64_t> wait_time_us{0};
+    std::atomic<int64_t> encode_time_us{0};
+    // Set by the capture thread, applied by the encode thread before the next frame. 0 if the bitrate isn't changed while recording
+    std::atomic<int64_t> video_bitrate{0};
+    BitrateMode bitrate_mode = BitrateMode::CONSTANT_QP;
+    Simulcast *simulcast = nullptr;
+    // Only used by the capture thread
+    CapturedFrame *unused_frame = nullptr; // A free frame that was captured to but not encoded, because the image hadn't changed
+    int num_skipped = 0;
+    int num_unchanged = 0;
+    int64_t capture_time_us = 0;
+    int num_captured = 0;
+};
+
+// Pooled frames keep their hardware buffer and reuse it once the encoder is done with it, so no buffers are allocated in steady state.
+// If the encoder still has a reference to it then another buffer is taken from the hw frames pool of the codec context, which recycles buffers as well.
+static bool frame_queue_prepare_frame(AVFrame *frame, AVCodecContext *video_codec_context) {
+    if(frame->buf[0] && av_buffer_is_writable(frame->buf[0]))
+        return true;
+
+    av_frame_unref(frame);
+    frame->format = video_codec_context->pix_fmt;
+    frame->width = video_codec_context->width;
+    frame->height = video_codec_context->height;
+    frame->color_range = AVCOL_RANGE_JPEG;
+
+    const int ret = av_hwframe_get_buffer(video_codec_context->hw_frames_ctx, frame, 0);
+    if(ret < 0) {
+        fprintf(stderr, "Error: av_hwframe_get_buffer failed, error: %s\n", av_error_to_string(ret));
+        return false;
+    }
+    return true;
+}
+
+// Returns nullptr if all frames are waiting to be encoded
+static CapturedFrame* frame_queue_get_free_frame(FrameQueue &frame_queue) {
+    if(frame_queue.unused_frame) {
+        CapturedFrame *captured_frame = frame_queue.unused_frame;
+        frame_queue.unused_frame = nullptr;
+        return captured_frame;
+    }
+
+    void *item = nullptr;
+    if(!gsr_spsc_queue_pop(frame_queue.free_frames, &item))
+        return nullptr;
+    return (CapturedFrame*)item;
+}
+
+static void frame_queue_push_captured_frame(FrameQueue &frame_queue, CapturedFrame *captured_frame) {
+    gsr_spsc_queue_push(frame_queue.captured_frames, captured_frame);
+    sem_post(&frame_queue.captured_sem);
+}
+
+static void frame_queue_encode_thread(FrameQueue &frame_queue, AVCodecContext *video_codec_context, const std::vector<PacketWriter*> &packet_writers) {
+    for(;;) {
+        while(sem_wait(&frame_queue.captured_sem) == -1 && errno == EINTR) {}
+
+        // Every captured frame posts once and stopping posts once more, so an empty queue here means the capture has stopped
+        void *item = nullptr;
+        if(!gsr_spsc_queue_pop(frame_queue.captured_frames, &item))
+            break;
+
+        CapturedFrame *captured_frame = (CapturedFrame*)item;
+        const int depth = (int)gsr_spsc_queue_size(frame_queue.captured_frames) + 1;
+        if(depth > frame_queue.max_depth.load(std::memory_order_relaxed))
+            frame_queue.max_depth.store(depth, std::memory_order_relaxed);
+
+        const double encode_start = clock_get_monotonic_seconds();
+        const int64_t video_bitrate = frame_queue.video_bitrate.load(std::memory_order_relaxed);
+        if(video_bitrate > 0 && video_bitrate != video_codec_context->bit_rate)
+            set_video_bitrate(video_codec_context, frame_queue.bitrate_mode, video_bitrate);
+
+        AVFrame *frame = captured_frame->frame;
+        frame->pict_type = captured_frame->force_keyframe ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
+        frame->pts = captured_frame->pts;
+        int ret = avcodec_send_frame(video_codec_context, frame);
+        if (ret >= 0) {
+            receive_frames(video_codec_context, VIDEO_STREAM_INDEX, frame, packet_writers);
+        } else {
+            fprintf(stderr, "Error: avcodec_send_frame failed, error: %s\n", av_error_to_string(ret));
+        }
+
+        if(frame_queue.simulcast)
+            simulcast_encode(*frame_queue.simulcast, frame);
+        const double encode_end = clock_get_monotonic_seconds();
+
+        frame_queue.wait_time_us += (int64_t)((encode_start - captured_frame->capture_time) * 1000000.0);
+        frame_queue.encode_time_us += (int64_t)((encode_end - encode_start) * 1000000.0);
+        ++frame_queue.num_encoded;
+
+        // Can't fail, there are never more frames than the queue can hold
+        gsr_spsc_queue_push(frame_queue.free_frames, captured_frame);
+    }
+}
+
+// If the capture doesn't write into the buffer of the frame it's given then there is only one frame,
+// because the next capture overwrites the image of the previous one
+static bool frame_queue_init(FrameQueue &frame_queue, const gsr_capture *capture) {
+    const size_t num_frames = capture->captures_into_frame_buffer ? 4 : 1;
+    frame_queue.free_frames = gsr_spsc_queue_create(num_frames);
+    frame_queue.captured_frames = gsr_spsc_queue_create(num_frames);
+    if(!frame_queue.free_frames || !frame_queue.captured_frames)
+        return false;
+
+    if(sem_init(&frame_queue.captured_sem, 0, 0) == -1) {
+        fprintf(stderr, "Error: sem_init failed: %s\n", strerror(errno));
+        return false;
+    }
+
+    frame_queue.frames.resize(num_frames);
+    for(CapturedFrame &captured_frame : frame_queue.frames) {
+        captured_frame.frame = av_frame_alloc();
+        if(!captured_frame.frame) {
+            fprintf(stderr, "Error: Failed to allocate frame\n");
+            return false;
+        }
+        gsr_spsc_queue_push(frame_queue.free_frames, &captured_frame);
+    }
+    return true;
+}
+
+// Encodes the frames that are still in the queue before returning
+static void frame_queue_deinit(FrameQueue &frame_queue) {
+    if(frame_queue.encode_thread.joinable()) {
+        sem_post(&frame_queue.captured_sem);
+        frame_queue.encode_thread.join();
+    }
+
+    for(CapturedFrame &captured_frame : frame_queue.frames) {
+        av_frame_free(&captured_frame.frame);
+    }
+    frame_queue.frames.clear();
+
+    sem_destroy(&frame_queue.captured_sem);
+    gsr_spsc_queue_destroy(frame_queue.free_frames);
+    gsr_spsc_queue_destroy(frame_queue.captured_frames);
+    frame_queue.free_frames = nullptr;
+    frame_queue.captured_frames = nullptr;
+}
+
+static const char* audio_codec_get_name(AudioCodec audio_codec) {
+    switch(audio_codec) {
+        case AudioCodec::AAC:  return "aac";
+        case AudioCodec::OPUS: return "opus";
+        case AudioCodec::FLAC: return "flac";
+    }
+    assert(false);
+    return "";
+}
+
+static AVCodecID audio_codec_get_id(AudioCodec audio_codec) {
+    switch(audio_codec) {
+        case AudioCodec::AAC:  return AV_CODEC_ID_AAC;
+        case AudioCodec::OPUS: return AV_CODEC_ID_OPUS;
+        case AudioCodec::FLAC: return AV_CODEC_ID_FLAC;
+    }
+    assert(false);
+    return AV_CODEC_ID_AAC;
+}
+
+static AVSampleFormat audio_codec_get_sample_format(AudioCodec audio_codec, const AVCodec *codec) {
+    switch(audio_codec) {
+        case AudioCodec::AAC: {
+            return AV_SAMPLE_FMT_FLTP;
+        }
+        case AudioCodec::OPUS: {
+            bool supports_s16 = false;
+            bool supports_flt = false;
+
+            for(size_t i = 0; codec->sample_fmts && codec->sample_fmts[i] != -1; ++i) {
+                if(codec->sample_fmts[i] == AV_SAMPLE_FMT_S16) {
+                    supports_s16 = true;
+                } else if(codec->sample_fmts[i] == AV_SAMPLE_FMT_FLT) {
+                    supports_flt = true;
+                }
+            }
+
+            if(!supports_s16 && !supports_flt) {
+                fprintf(stderr, "Warning: opus audio codec is chosen but your ffmpeg version does not support s16/flt sample format and performance might be slightly worse. You can either rebuild ffmpeg with libopus instead of the built-in opus, use the flatpak version of gpu screen recorder or record with flac audio codec instead (-ac flac). Falling back to fltp audio sample format instead.\n");
+            }
+
+            if(supports_s16)
+                return AV_SAMPLE_FMT_S16;
+            else if(supports_flt)
+                return AV_SAMPLE_FMT_FLT;
+            else
+                return AV_SAMPLE_FMT_FLTP;
+        }
+        case AudioCodec::FLAC: {
+            return AV_SAMPLE_FMT_S32;
+        }
+    }
+    assert(false);
+    return AV_SAMPLE_FMT_FLTP;
+}
+
+static int64_t audio_codec_get_get_bitrate(AudioCodec audio_codec) {
+    switch(audio_codec) {
+        case AudioCodec::AAC:  return 128000;
+        case AudioCodec::OPUS: return 96000;
+        case AudioCodec::FLAC: return 96000;
+    }
+    assert(false);
+    return 96000;
+}
+
+static AudioFormat audio_codec_context_get_audio_format(const AVCodecContext *audio_codec_context) {
+    switch(audio_codec_context->sample_fmt) {
+        case AV_SAMPLE_FMT_FLT:   return F32;
+        case AV_SAMPLE_FMT_FLTP:  return F32; // Deinterleaved by the audio thread, without swr
+        case AV_SAMPLE_FMT_S16:   return S16;
+        case AV_SAMPLE_FMT_S32:   return S32;
+        default:                  return S16;
+    }
+}
+
+static AVSampleFormat audio_format_to_sample_format(const AudioFormat audio_format) {
+    switch(audio_format) {
+        case S16:   return AV_SAMPLE_FMT_S16;
+        case S32:   return AV_SAMPLE_FMT_S32;
+        case F32:   return AV_SAMPLE_FMT_FLT;
+    }
+    assert(false);
+    return AV_SAMPLE_FMT_S16;
+}
+
+static AVCodecContext* create_audio_codec_context(int fps, AudioCodec audio_codec) {
+    const AVCodec *codec = avcodec_find_encoder(audio_codec_get_id(audio_codec));
+    if (!codec) {
+        fprintf(stderr, "Error: Could not find %s audio encoder\n", audio_codec_get_name(audio_codec));
+        exit(1);
+    }
+
+    AVCodecContext *codec_context = avcodec_alloc_context3(codec);
+
+    assert(codec->type == AVMEDIA_TYPE_AUDIO);
+	codec_context->codec_id = codec->id;
+    codec_context->sample_fmt = audio_codec_get_sample_format(audio_codec, codec);
+    codec_context->bit_rate = audio_codec_get_get_bitrate(audio_codec);
+    codec_context->sample_rate = 48000;
+    if(audio_codec == AudioCodec::AAC)
+        codec_context->profile = FF_PROFILE_AAC_LOW;
+#if LIBAVCODEC_VERSION_MAJOR < 60
+    codec_context->channel_layout = AV_CH_LAYOUT_STEREO;
+    codec_context->channels = 2;
+#else
+    av_channel_layout_default(&codec_context->ch_layout, 2);
+#endif
+
+    codec_context->time_base.num = 1;
+    codec_context->time_base.den = codec_context->sample_rate;
+    codec_context->framerate.num = fps;
+    codec_context->framerate.den = 1;
+    codec_context->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+
+    return codec_context;
+}
+
+static AVCodecContext *create_video_codec_context(AVPixelFormat pix_fmt,
+                            VideoQuality video_quality,
+                            int fps, const AVCodec *codec, bool is_livestream) {
+
+    AVCodecContext *codec_context = avcodec_alloc_context3(codec);
+
+    //double fps_ratio = (double)fps / 30.0;
+
+    assert(codec->type == AVMEDIA_TYPE_VIDEO);
+    codec_context->codec_id = codec->id;
+    // Timebase: This is the fundamental unit of time (in seconds) in terms
+    // of which frame timestamps are represented. For fixed-fps content,
+    // timebase should be 1/framerate and timestamp increments should be
+    // identical to 1
+    codec_context->time_base.num = 1;
+    codec_context->time_base.den = fps;
+    codec_context->framerate.num = fps;
+    codec_context->framerate.den = 1;
+    codec_context->sample_aspect_ratio.num = 0;
+    codec_context->sample_aspect_ratio.den = 0;
+    // High values reeduce file size but increases time it takes to seek
+    if(is_livestream) {
+        codec_context->flags |= (AV_CODEC_FLAG_CLOSED_GOP | AV_CODEC_FLAG_LOW_DELAY);
+        codec_context->flags2 |= AV_CODEC_FLAG2_FAST;
+        //codec_context->gop_size = std::numeric_limits<int>::max();
+        //codec_context->keyint_min = std::numeric_limits<int>::max();
+        codec_context->gop_size = fps * 2;
+    } else {
+        codec_context->gop_size = fps * 2;
+    }
+    codec_context->max_b_frames = 0;
+    codec_context->pix_fmt = pix_fmt;
+    codec_context->color_range = AVCOL_RANGE_JPEG;
+    if(codec->id == AV_CODEC_ID_HEVC)
+        codec_context->codec_tag = MKTAG('h', 'v', 'c', '1');
+    switch(video_quality) {
+        case VideoQuality::MEDIUM:
+            //codec_context->qmin = 35;
+            //codec_context->qmax = 35;
+            codec_context->bit_rate = 100000;//4500000 + (codec_context->width * codec_context->height)*0.75;
+            break;
+        case VideoQuality::HIGH:
+            //codec_context->qmin = 34;
+            //codec_context->qmax = 34;
+            codec_context->bit_rate = 100000;//10000000-9000000 + (codec_context->width * codec_context->height)*0.75;
+            break;
+        case VideoQuality::VERY_HIGH:
+            //codec_context->qmin = 28;
+            //codec_context->qmax = 28;
+            codec_context->bit_rate = 100000;//10000000-9000000 + (codec_context->width * codec_context->height)*0.75;
+            break;
+        case VideoQuality::ULTRA:
+            //codec_context->qmin = 22;
+            //codec_context->qmax = 22;
+            codec_context->bit_rate = 100000;//10000000-9000000 + (codec_context->width * codec_context->height)*0.75;
+            break;
+    }
+    //codec_context->profile = FF_PROFILE_H264_MAIN;
+    if (codec_context->codec_id == AV_CODEC_ID_MPEG1VIDEO)
+        codec_context->mb_decision = 2;
+
+    // stream->time_base = codec_context->time_base;
+    // codec_context->ticks_per_frame = 30;
+    //av_opt_set(codec_context->priv_data, "tune", "hq", 0);
+    // TODO: Do this for better file size? also allows setting qmin, qmax per frame? which can then be used to dynamically set bitrate to reduce quality
+    // if live streaming is slow or if the users harddrive is cant handle writing megabytes of data per second.
+    #if 0
+    char qmin_str[32];
+    snprintf(qmin_str, sizeof(qmin_str), "%d", codec_context->qmin);
+
+    char qmax_str[32];
+    snprintf(qmax_str, sizeof(qmax_str), "%d", codec_context->qmax);
+
+    av_opt_set(codec_context->priv_data, "cq", qmax_str, 0);
+    av_opt_set(codec_context->priv_data, "rc", "vbr", 0);
+    av_opt_set(codec_context->priv_data, "qmin", qmin_str, 0);
+    av_opt_set(codec_context->priv_data, "qmax", qmax_str, 0);
+    codec_context->bit_rate = 0;
+    #endif
+
+    av_opt_set_int(codec_context->priv_data, "b_ref_mode", 0, 0);
+
+    //codec_context->rc_max_rate = codec_context->bit_rate;
+    //codec_context->rc_min_rate = codec_context->bit_rate;
+    //codec_context->rc_buffer_size = codec_context->bit_rate / 10;
+
+    codec_context->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+
+    return codec_context;
+}
+
+// The replay buffer memory is allocated up front, so this is only a rough estimate of the bitrate with some headroom.
+// Packets are evicted before the replay duration is reached if the estimate is too low.
+static size_t estimate_replay_buffer_size_bytes(const AVCodecContext *video_codec_context, VideoQuality video_quality, int fps, size_t num_audio_tracks, int replay_buffer_size_secs) {
+    double bits_per_pixel = 0.25;
+    switch(video_quality) {
+        case VideoQuality::MEDIUM:
+            bits_per_pixel = 0.1;
+            break;
+        case VideoQuality::HIGH:
+            bits_per_pixel = 0.15;
+            break;
+        case VideoQuality::VERY_HIGH:
+            bits_per_pixel = 0.25;
+            break;
+        case VideoQuality::ULTRA:
+            bits_per_pixel = 0.5;
+            break;
+    }
+
+    const double video_bitrate = (double)video_codec_context->width * (double)video_codec_context->height * (double)fps * bits_per_pixel;
+    const double audio_bitrate = 256000.0 * (double)num_audio_tracks;
+    const double min_bytes = 64.0 * 1024.0 * 1024.0;
+    return std::max(min_bytes, (video_bitrate + audio_bitrate) / 8.0 * (double)replay_buffer_size_secs);
+}
+
+static bool check_if_codec_valid_for_hardware(const AVCodec *codec) {
+    bool success = false;
+    // Do not use AV_PIX_FMT_CUDA because we dont want to do full check with hardware context
+    AVCodecContext *codec_context = create_video_codec_context(AV_PIX_FMT_YUV420P, VideoQuality::VERY_HIGH, 60, codec, false);
+    codec_context->width = 1920;
+    codec_context->height = 1080;
+    if(codec_context) {
+        success = avcodec_open2(codec_context, codec_context->codec, NULL) == 0;
+        avcodec_free_context(&codec_context);
+    }
+    return success;
+}
+
+static const AVCodec* find_h264_encoder(gpu_vendor vendor) {
+    const AVCodec *codec = avcodec_find_encoder_by_name(vendor == GPU_VENDOR_NVIDIA ? "h264_nvenc" : "h264_vaapi");
+    if(!codec)
+        codec = avcodec_find_encoder_by_name(vendor == GPU_VENDOR_NVIDIA ? "nvenc_h264" : "vaapi_h264");
+
+    static bool checked = false;
+    static bool checked_success = true;
+    if(!checked) {
+        checked = true;
+        if(!check_if_codec_valid_for_hardware(codec))
+            checked_success = false;
+    }
+    return checked_success ? codec : nullptr;
+}
+
+// TODO: Disable under intel/amd?
+
+static const AVCodec* find_h265_encoder(gpu_vendor vendor) {
+    const AVCodec *codec = avcodec_find_encoder_by_name(vendor == GPU_VENDOR_NVIDIA ? "hevc_nvenc" : "hevc_vaapi");
+    if(!codec)
+        codec = avcodec_find_encoder_by_name(vendor == GPU_VENDOR_NVIDIA ? "nvenc_hevc" : "vaapi_hevc");
+
+    if(!codec)
+        return nullptr;
+
+    static bool checked = false;
+    static bool checked_success = true;
+    if(!checked) {
+        checked = true;
+        if(!check_if_codec_valid_for_hardware(codec))
+            checked_success = false;
+    }
+    return checked_success ? codec : nullptr;
+}
+
+static AVFrame* create_audio_frame(const AVCodecContext *audio_codec_context) {
+    AVFrame *frame = av_frame_alloc();
+    if(!frame) {
+        fprintf(stderr, "failed to allocate audio frame\n");
+        exit(1);
+    }
+
+    frame->sample_rate = audio_codec_context->sample_rate;
+    frame->nb_samples = audio_codec_context->frame_size;
+    frame->format = audio_codec_context->sample_fmt;
+#if LIBAVCODEC_VERSION_MAJOR < 60
+    frame->channels = audio_codec_context->channels;
+    frame->channel_layout = audio_codec_context->channel_layout;
+#else
+    av_channel_layout_copy(&frame->ch_layout, &audio_codec_context->ch_layout);
+#endif
+
+    const int ret = av_frame_get_buffer(frame, 0);
+    if(ret < 0) {
+        fprintf(stderr, "failed to allocate audio data buffers, reason: %s\n", av_error_to_string(ret));
+        exit(1);
+    }
+
+    return frame;
+}
+
+static AVFrame* open_audio(AVCodecContext *audio_codec_context) {
+    AVDictionary *options = nullptr;
+    av_dict_set(&options, "strict", "experimental", 0);
+
+    const int ret = avcodec_open2(audio_codec_context, audio_codec_context->codec, &options);
+    if(ret < 0) {
+        fprintf(stderr, "failed to open codec, reason: %s\n", av_error_to_string(ret));
+        exit(1);
+    }
+
+    return create_audio_frame(audio_codec_context);
+}
+
+// |bitrate| is only used if |bitrate_mode| isn't CONSTANT_QP, the quality is used otherwise
+static void open_video(AVCodecContext *codec_context, VideoQuality video_quality, bool very_old_gpu, BitrateMode bitrate_mode, int64_t bitrate) {
+    bool supports_p4 = false;
+    bool supports_p6 = false;
+
+    const AVOption *opt = nullptr;
+    while((opt = av_opt_next(codec_context->priv_data, opt))) {
+        if(opt->type == AV_OPT_TYPE_CONST) {
+            if(strcmp(opt->name, "p4") == 0)
+                supports_p4 = true;
+            else if(strcmp(opt->name, "p6") == 0)
+                supports_p6 = true;
+        }
+    }
+
+    AVDictionary *options = nullptr;
+    if(bitrate_mode != BitrateMode::CONSTANT_QP) {
+        set_video_bitrate(codec_context, bitrate_mode, bitrate);
+    } else if(very_old_gpu) {
+        switch(video_quality) {
+            case VideoQuality::MEDIUM:
+                av_dict_set_int(&options, "qp", 37, 0);
+                break;
+            case VideoQuality::HIGH:
+                av_dict_set_int(&options, "qp", 32, 0);
+                break;
+            case VideoQuality::VERY_HIGH:
+                av_dict_set_int(&options, "qp", 27, 0);
+                break;
+            case VideoQuality::ULTRA:
+                av_dict_set_int(&options, "qp", 21, 0);
+                break;
+        }
+    } else {
+        switch(video_quality) {
+            case VideoQuality::MEDIUM:
+                av_dict_set_int(&options, "qp", 40, 0);
+                break;
+            case VideoQuality::HIGH:
+                av_dict_set_int(&options, "qp", 35, 0);
+                break;
+            case VideoQuality::VERY_HIGH:
+                av_dict_set_int(&options, "qp", 30, 0);
+                break;
+            case VideoQuality::ULTRA:
+                av_dict_set_int(&options, "qp", 24, 0);
+                break;
+        }
+    }
+
+    if(!supports_p4 && !supports_p6)
+        fprintf(stderr, "Info: your ffmpeg version is outdated. It's recommended that you use the flatpak version of gpu-screen-recorder version instead, which you can find at https://flathub.org/apps/details/com.dec05eba.gpu_screen_recorder\n");
+
+    //if(is_livestream) {
+    //    av_dict_set_int(&options, "zerolatency", 1, 0);
+    //    //av_dict_set(&options, "preset", "llhq", 0);
+    //}
+
+    // Fuck nvidia and ffmpeg, I want to use a good preset for the gpu but all gpus prefer different
+    // presets. Nvidia and ffmpeg used to support "hq" preset that chose the best preset for the gpu
+    // with pretty good performance but you now have to choose p1-p7, which are gpu agnostic and on
+    // older gpus p5-p7 slow the gpu down to a crawl...
+    // "hq" is now just an alias for p7 in ffmpeg :(
+    // TODO: Temporary disable because of stuttering?
+    if(very_old_gpu)
+        av_dict_set(&options, "preset", supports_p4 ? "p4" : "medium", 0);
+    else
+        av_dict_set(&options, "preset", supports_p6 ? "p6" : "slow", 0);
+
+    av_dict_set(&options, "tune", "hq", 0);
+    // "rc" is the nvenc option and "rc_mode" the vaapi option, vaapi picks constant qp by itself when qp is set
+    switch(bitrate_mode) {
+        case BitrateMode::CONSTANT_QP:
+            av_dict_set(&options, "rc", "constqp", 0);
+            break;
+        case BitrateMode::CBR:
+            av_dict_set(&options, "rc", "cbr", 0);
+            av_dict_set(&options, "rc_mode", "CBR", 0);
+            break;
+        case BitrateMode::VBR:
+            av_dict_set(&options, "rc", "vbr", 0);
+            av_dict_set(&options, "rc_mode", "VBR", 0);
+            break;
+    }
+
+    if(codec_context->codec_id == AV_CODEC_ID_H264)
+        av_dict_set(&options, "profile", "high", 0);
+
+    av_dict_set(&options, "strict", "experimental", 0);
+    // The keyframes that are forced in vfr mode have to be idr frames, nvenc doesn't mark other intra frames as keyframes
+    av_dict_set(&options, "forced-idr", "1", 0);
+
+    int ret = avcodec_open2(codec_context, codec_context->codec, &options);
+    if (ret < 0) {
+        fprintf(stderr, "Error: Could not open video codec: %s\n", av_error_to_string(ret));
+        exit(1);
+    }
+}
+
+// Creates the scale filter and the encoder of the simulcast. The main encoder has to be opened (and the capture started) first
+static bool simulcast_init(Simulcast &simulcast, AVCodecContext *video_codec_context, gpu_vendor vendor, vec2i size, VideoQuality video_quality, int fps,
+                           bool is_livestream, bool very_old_gpu, BitrateMode bitrate_mode, int64_t bitrate)
+{
+    const char *scale_filter_name = vendor == GPU_VENDOR_NVIDIA ? "scale_cuda" : "scale_vaapi";
+    const AVFilter *scale_filter = avfilter_get_by_name(scale_filter_name);
+    if(!scale_filter) {
+        fprintf(stderr, "Error: simulcast requires the %s filter, which your ffmpeg doesn't have\n", scale_filter_name);
+        return false;
+    }
+
+    simulcast.graph = avfilter_graph_alloc();
+    if(!simulcast.graph) {
+        fprintf(stderr, "Error: failed to create the simulcast filter graph\n");
+        return false;
+    }
+
+    simulcast.src = avfilter_graph_alloc_filter(simulcast.graph, avfilter_get_by_name("buffer"), "src");
+    AVBufferSrcParameters *src_params = av_buffersrc_parameters_alloc();
+    if(!simulcast.src || !src_params) {
+        fprintf(stderr, "Error: failed to create the simulcast buffer filter\n");
+        av_free(src_params);
+        return false;
+    }
+
+    // The captured frames are gpu frames, so they go through the filter without being copied to the cpu
+    src_params->format = video_codec_context->pix_fmt;
+    src_params->width = video_codec_context->width;
+    src_params->height = video_codec_context->height;
+    src_params->time_base = video_codec_context->time_base;
+    src_params->hw_frames_ctx = video_codec_context->hw_frames_ctx;
+    int err = av_buffersrc_parameters_set(simulcast.src, src_params);
+    av_free(src_params);
+    if(err >= 0)
+        err = avfilter_init_str(simulcast.src, nullptr);
+    if(err < 0) {
+        fprintf(stderr, "Error: failed to initialize the simulcast buffer filter, error: %s\n", av_error_to_string(err));
+        return false;
+    }
+
+    char scale_args[64];
+    snprintf(scale_args, sizeof(scale_args), "w=%d:h=%d", size.x, size.y);
+    AVFilterContext *scale_ctx = nullptr;
+    err = avfilter_graph_create_filter(&scale_ctx, scale_filter, "scale", scale_args, nullptr, simulcast.graph);
+    if(err >= 0)
+        err = avfilter_graph_create_filter(&simulcast.sink, avfilter_get_by_name("buffersink"), "sink", nullptr, nullptr, simulcast.graph);
+    if(err >= 0)
+        err = avfilter_link(simulcast.src, 0, scale_ctx, 0);
+    if(err >= 0)
+        err = avfilter_link(scale_ctx, 0, simulcast.sink, 0);
+    if(err >= 0)
+        err = avfilter_graph_config(simulcast.graph, nullptr);
+    if(err < 0) {
+        fprintf(stderr, "Error: failed to create the simulcast scale filter, error: %s\n", av_error_to_string(err));
+        return false;
+    }
+
+    AVBufferRef *scaled_hw_frames_ctx = av_buffersink_get_hw_frames_ctx(simulcast.sink);
+    if(!scaled_hw_frames_ctx) {
+        fprintf(stderr, "Error: the simulcast scale filter doesn't output gpu frames\n");
+        return false;
+    }
+
+    simulcast.codec_context = create_video_codec_context(video_codec_context->pix_fmt, video_quality, fps, video_codec_context->codec, is_livestream);
+    simulcast.codec_context->width = size.x;
+    simulcast.codec_context->height = size.y;
+    simulcast.codec_context->hw_frames_ctx = av_buffer_ref(scaled_hw_frames_ctx);
+    open_video(simulcast.codec_context, video_quality, very_old_gpu, bitrate_mode, bitrate);
+    simulcast.bitrate_mode = bitrate_mode;
+
+    simulcast.frame = av_frame_alloc();
+    if(!simulcast.frame) {
+        fprintf(stderr, "Error: Failed to allocate frame\n");
+        return false;
+    }
+    return true;
+}
+
+static void simulcast_deinit(Simulcast &simulcast) {
+    av_frame_free(&simulcast.frame);
+    avcodec_free_context(&simulcast.codec_context);
+    avfilter_graph_free(&simulcast.graph);
+}
+
+static void usage() {
+    fprintf(stderr, "usage: gpu-screen-recorder -w <window_id|monitor|focused> [-c <container_format>] [-s WxH] -f <fps> [-a <audio_input>...] [-q <quality>] [-r <replay_buffer_size_sec>] [-rm <replay_buffer_memory_mb>] [-rl no|yes|hugepages] [-rd <replay_buffer_file>] [-rds <replay_buffer_file_mb>] [-rf yes|no] [-rs <replay_buffer_shm_name>] [-sg <segment_duration_sec>] [-sgs <segments_max_mb>] [-sga <segments_max_age_min>] [-wq block|drop] [-fm cfr|vfr] [-fmk <keepalive_fps>] [-fg yes|no] [-v yes|no] [-b <bitrate_kbps>] [-bm cbr|vbr] [-ba yes|no] [-so <simulcast_output>...] [-ss WxH] [-sb <simulcast_bitrate_kbps>] [-k h264|h265] [-ac aac|opus|flac] [-o <output_file>...]\n");
+    fprintf(stderr, "OPTIONS:\n");
+    fprintf(stderr, "  -w    Window to record, a display, \"screen\", \"screen-direct\", \"screen-direct-force\" or \"focused\". The display is the display (monitor) name in xrandr and if \"screen\" or \"screen-direct\" is selected then all displays are recorded. If this is \"focused\" then the currently focused window is recorded. When recording the focused window then the -s option has to be used as well.\n"
+        "        \"screen-direct\"/\"screen-direct-force\" skips one texture copy for fullscreen applications so it may lead to better performance and it works with VRR monitors when recording fullscreen application but may break some applications, such as mpv in fullscreen mode. Direct mode doesn't capture cursor either. \"screen-direct-force\" is not recommended unless you use a VRR monitor because there might be driver issues that cause the video to stutter or record a black screen.\n");
+    fprintf(stderr, "  -c    Container format for output file, for example mp4, or flv. Only required if no output file is specified or if recording in replay buffer mode. If an output file is specified and -c is not used then the container format is determined from the output filename extension.\n");
+    fprintf(stderr, "  -e    Fail fast [true/false] defaults to false - if fail-fast is true the gpu-screen-recorder will not try as hard to restart the recording session.\n");
+    fprintf(stderr, "  -s    The size (area) to record at in the format WxH, for example 1920x1080. This option is only supported (and required) when -w is \"focused\".\n");
+    fprintf(stderr, "  -f    Framerate to record at.\n");
+    fprintf(stderr, "  -a    Audio device to record from (pulse audio device). Can be specified multiple times. Each time this is specified a new audio track is added for the specified audio device. A name can be given to the audio input device by prefixing the audio input with <name>/, for example \"dummy/alsa_output.pci-0000_00_1b.0.analog-stereo.monitor\". Multiple audio devices can be merged into one audio track by using \"|\" as a separator into one -a argument, for example: -a \"alsa_output1|alsa_output2\". Optional, no audio track is added by default.\n");
+    fprintf(stderr, "  -q    Video quality. Should be either 'medium', 'high', 'very_high' or 'ultra'. 'high' is the recommended option when live streaming or when you have a slower harddrive. Optional, set to 'very_high' be default.\n");
+    fprintf(stderr, "  -r    Replay buffer size in seconds. If this is set, then only the last seconds as set by this option will be stored"
+        " and the video will only be saved when the gpu-screen-recorder is closed. This feature is similar to Nvidia's instant replay feature."
+        " This option has be between 5 and 1200, or between 5 and 3600 when -rd is used. Note that the replay can be up to one keyframe interval (2 seconds) longer than this, because a replay has to start with a keyframe. Optional, disabled by default.\n");
+    fprintf(stderr, "  -rm   Replay buffer memory limit in megabytes. The memory is allocated when the recording starts and the memory usage stays the same for the whole recording."
+        " If the limit is reached then the oldest part of the replay is removed, even if the replay is shorter than -r. An eighth of the memory is kept for the video and audio that is recorded while a replay is being saved,"
+        " so the replay itself can use the rest. Optional, estimated from the resolution, fps and quality by default.\n");
+    fprintf(stderr, "  -rl   Lock the replay buffer memory so it's never swapped out. Should be either 'no', 'yes' or 'hugepages'. 'hugepages' uses huge pages for the replay buffer as well,"
+        " which requires huge pages to be reserved (vm.nr_hugepages), otherwise transparent huge pages are used. Locking memory might require increasing the memlock limit (ulimit -l). Optional, set to 'no' by default.\n");
+    fprintf(stderr, "  -rd   Replay buffer file. If this is set then only the last 30 seconds of the replay are kept in memory (see -rm) and the rest of the replay is moved to this file,"
+        " which allows long replays without using a lot of memory. The file is allocated when the recording starts and should be on a fast local drive. It's created if it doesn't exist. Optional, disabled by default.\n");
+    fprintf(stderr, "  -rds  Replay buffer file size in megabytes. If the limit is reached then the oldest part of the replay is removed, even if the replay is shorter than -r. Optional, estimated from the resolution, fps and quality by default.\n");
+    fprintf(stderr, "  -rf   Fragmented replay buffer. Should be either 'yes' or 'no'. If this is 'yes' then the replay is muxed while recording into fragments that start with a keyframe,"
+        " so saving a replay is only a file copy, which is a lot faster for long replays. Only supported by the mp4, mov and mkv containers. The timestamps in the saved replay continue from the start of the recording. Optional, set to 'no' by default.\n");
+    fprintf(stderr, "  -rs   Replay buffer shared memory name, for example /gsr-replay. If this is set then the replay buffer memory (-rm) is a shared memory object (in /dev/shm) that is kept when gpu-screen-recorder exits or crashes."
+        " When gpu-screen-recorder is started again with the same options it continues that replay buffer, so a restart doesn't lose the replay. The replay file (-rd) isn't kept."
+        " Other programs can export replays from it while recording with gpu-screen-recorder-replay-export. Remove the file in /dev/shm to free the memory. Can't be used together with -rf. Optional, disabled by default.\n");
+    fprintf(stderr, "  -sg   Segment duration in seconds. If this is set then the recording is split into files (segments) of this duration in the directory specified with -o."
+        " A segment is only ended at a keyframe so segments can be up to one keyframe interval (2 seconds) longer than this. Nothing is lost between segments."
+        " A segment is written to a .part file that is renamed when the segment is finished, and the path of the finished segment is printed to stdout. This option has to be at least 10. Optional, disabled by default.\n");
+    fprintf(stderr, "  -sgs  Segments size limit in megabytes. The oldest segments in the -o directory are removed when the segments are larger than this in total. Optional, no limit by default.\n");
+    fprintf(stderr, "  -sga  Segments age limit in minutes. Segments in the -o directory that are older than this are removed. Optional, no limit by default.\n");
+    fprintf(stderr, "  -wq   What to do when the output can't keep up, for example because of a slow drive or because the program reading stdout is too slow. Should be either 'block' or 'drop'."
+        " Encoded packets wait in a queue of %d packets until they are written. When the queue is full 'block' waits for room in the queue, which delays capturing and can make the video stutter,"
+        " and 'drop' drops the packets, the video packets until the next keyframe. 'drop' is recommended when live streaming. Optional, set to 'drop' for live streams and 'block' for other outputs by default.\n", WRITE_QUEUE_MAX_PACKETS);
+    fprintf(stderr, "  -fm   Framerate mode. Should be either 'cfr' (constant frame rate) or 'vfr' (variable frame rate). In 'vfr' mode frames are only encoded when the image changes,"
+        " which lowers the gpu usage and the file size a lot when recording a mostly still desktop. Screen recording (nvfbc) gets this from the driver and window recording uses the XDamage extension. Optional, set to 'cfr' by default.\n");
+    fprintf(stderr, "  -fmk  Minimum framerate in 'vfr' mode. A frame is encoded at least this often even if the image doesn't change. Optional, set to 1 by default.\n");
+    fprintf(stderr, "  -fg   Lower the capture framerate when capturing, encoding or writing a frame takes longer than the time between frames, and raise it again when there is time to spare."
+        " Should be either 'yes' or 'no'. The framerate is lowered in steps of -f divided by 2, 3 and %d, so the video keeps a steady framerate instead of stuttering. The changes are printed to stderr. Optional, set to 'yes' by default when live streaming and 'no' otherwise.\n", FRAME_RATE_GOVERNOR_MAX_DIVISOR);
+    fprintf(stderr, "  -v    Print recording stats to stderr every second. Should be either 'yes' or 'no'. If this is 'no' then only the fps is printed."
+        " If this is 'yes' then the capture rate, the packet queue of every output, the video bitrate and the audio sync of every audio device are printed as well. Optional, set to 'no' by default.\n");
+    fprintf(stderr, "  -b    Video bitrate in kbps. If this is set then the video is encoded at this bitrate instead of at a constant quality (-q), which is what live streaming services expect."
+        " Optional, set to %d by default when live streaming and not used otherwise.\n", (int)(LIVESTREAM_DEFAULT_BITRATE / 1000));
+    fprintf(stderr, "  -bm   Bitrate mode. Should be either 'cbr' (constant bitrate) or 'vbr' (variable bitrate, up to 1.5 times -b). Optional, set to 'cbr' by default. Can only be used when a bitrate is used.\n");
+    fprintf(stderr, "  -ba   Adaptive bitrate. Should be either 'yes' or 'no'. If this is 'yes' then the video bitrate is lowered when the output can't keep up (for example a slow upload when live streaming)"
+        " and raised again up to -b when it can. The changes are printed to stderr. Only supported on nvidia. Optional, set to 'yes' by default when live streaming and 'no' otherwise. Can only be used when a bitrate is used.\n");
+    fprintf(stderr, "  -so   Simulcast output. The captured video is also encoded a second time at the size set with -ss (scaled on the gpu) and written to this output, together with the audio."
+        " For example to record at full quality and live stream at a lower resolution at the same time: -o video.mp4 -so rtmp://... -ss 1280x720. Can be specified multiple times to write the simulcast to several outputs."
+        " The container is deduced from the file extension, or -c if there is none. Requires the scale_cuda filter in ffmpeg (ffmpeg 5.0 or newer) on nvidia and scale_vaapi on amd/intel. Optional, disabled by default.\n");
+    fprintf(stderr, "  -ss   The size of the simulcast video in the format WxH, for example 1280x720. Required when using -so.\n");
+    fprintf(stderr, "  -sb   Simulcast video bitrate in kbps, see -b. -bm is used for the simulcast as well. If the first live stream output is a simulcast output then -ba changes the simulcast bitrate."
+        " Optional, set to %d by default when the simulcast is live streamed and not used otherwise (then the simulcast has the quality of -q).\n", (int)(LIVESTREAM_DEFAULT_BITRATE / 1000));
+    fprintf(stderr, "  -k    Video codec to use. Should be either 'auto', 'h264' or 'h265'. Defaults to 'auto' which defaults to 'h265' unless recording at a higher resolution than 3840x2160. Forcefully set to 'h264' if -c is 'flv'.\n");
+    fprintf(stderr, "  -ac   Audio codec to use. Should be either 'aac', 'opus' or 'flac'. Defaults to 'opus' for .mp4/.mkv files, otherwise defaults to 'aac'. 'opus' and 'flac' is only supported by .mp4/.mkv files. 'opus' is recommended for best performance and smallest audio size.\n");
+    fprintf(stderr, "  -o    The output file path. If omitted then the encoded data is sent to stdout. Required in replay mode (when using -r) and segmented mode (when using -sg). In replay mode and segmented mode this has to be an existing directory instead of a file.\n"
+        "        Can be specified multiple times to record to several outputs at once from the same encoded video and audio, for example to live stream and save the stream to a file (-c flv -o rtmp://... -o video.mp4)."
+        " The outputs after the first one are always files or live streams (also in replay and segmented mode). Their container is deduced from the file extension, or -c if they don't have one."
+        " Each output has its own queue (see -wq), so a slow live stream doesn't delay writing to the other outputs.\n");
+    fprintf(stderr, "NOTES:\n");
+    fprintf(stderr, "  Send signal SIGINT (Ctrl+C) to gpu-screen-recorder to stop and save the recording (when not using replay mode).\n");
+    fprintf(stderr, "  Send signal SIGUSR1 (killall -SIGUSR1 gpu-screen-recorder) to gpu-screen-recorder to save a replay. A new replay can be saved while the previous one is still being saved.\n");
+    fprintf(stderr, "  To save only part of the replay, send SIGUSR1 with sigqueue and the value <duration_sec> | (<end_offset_sec> << 16), where <end_offset_sec> is how many seconds before now the replay should end."
+        " The replay starts at the keyframe before that. For example to save the last 30 seconds: kill --queue 30 -SIGUSR1 $(pidof gpu-screen-recorder) (kill from util-linux), see scripts/save-replay-window.sh.\n");
+    fprintf(stderr, "EXAMPLES\n");
+    fprintf(stderr, "  gpu-screen-recorder -w screen -f 60 -a \"$(pactl get-default-sink).monitor\" -o video.mp4\n");
+    exit(1);
+}
+
+static sig_atomic_t running = 1;
+// Replays to save, written by the signal handler. Each request is the (sigqueue) signal value with SAVE_REPLAY_REQUEST_SET set, 0 if the slot is empty.
+// The value is the duration to save in seconds in the lower 16 bits (0 to save the whole replay buffer)
+// and how many seconds before now the replay should end in the next 15 bits
+#define MAX_SAVE_REPLAY_REQUESTS 64
+#define SAVE_REPLAY_REQUEST_SET (1u << 31)
+static std::atomic<uint32_t> save_replay_requests[MAX_SAVE_REPLAY_REQUESTS];
+static std::atomic<uint32_t> save_replay_requests_write_index(0);
+static uint32_t save_replay_requests_read_index = 0;
+
+// Written to by the signal handlers to wake up the main loop, see Scheduler
+static int signal_wakeup_fd = -1;
+
+// This is called from signal handlers
+static void wake_up_main_loop() {
+    if(signal_wakeup_fd == -1)
+        return;
+
+    const int prev_errno = errno;
+    const uint64_t value = 1;
+    ssize_t bytes_written = write(signal_wakeup_fd, &value, sizeof(value));
+    (void)bytes_written;
+    errno = prev_errno;
+}
+
+static void int_handler(int) {
+    running = 0;
+    wake_up_main_loop();
+}
+
+static void save_replay_handler(int, siginfo_t *info, void*) {
+    // killall and kill without --queue don't set a value, that saves the whole replay buffer
+    const uint32_t value = info->si_code == SI_QUEUE ? (uint32_t)info->si_value.sival_int & ~SAVE_REPLAY_REQUEST_SET : 0;
+    const uint32_t index = save_replay_requests_write_index++;
+    save_replay_requests[index % MAX_SAVE_REPLAY_REQUESTS].store(value | SAVE_REPLAY_REQUEST_SET);
+    wake_up_main_loop();
+}
+
+// Returns false if there are no more requests. If more than MAX_SAVE_REPLAY_REQUESTS requests are made before they are handled then some of them are lost
+static bool pop_save_replay_request(double *duration_secs, double *end_offset_secs) {
+    const uint32_t request = save_replay_requests[save_replay_requests_read_index % MAX_SAVE_REPLAY_REQUESTS].exchange(0);
+    if(!(request & SAVE_REPLAY_REQUEST_SET))
+        return false;
+
+    ++save_replay_requests_read_index;
+    *duration_secs = request & 0xFFFF;
+    *end_offset_secs = (request >> 16) & 0x7FFF;
+    return true;
+}
+
+// The main loop sleeps in epoll until the deadline of the next frame, which is an absolute timerfd deadline so it doesn't drift,
+// or until there is something else to do: events for the capture (for example the window was resized), audio that has to
+// be mixed or a signal (stop or save a replay). So the main loop wakes up about once per frame instead of polling.
+struct Scheduler {
+    int epoll_fd = -1;
+    int timer_fd = -1;
+    int audio_fd = -1; // Written to by the audio thread when it adds audio that has to be mixed
+    int capture_event_fd = -1;
+};
+
+static bool scheduler_add_fd(Scheduler &scheduler, int fd) {
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+    if(epoll_ctl(scheduler.epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+        fprintf(stderr, "Error: epoll_ctl failed: %s\n", strerror(errno));
+        return false;
     }
-    codec_context->max_b_frames = 0;
-    codec_context->pix_fmt = pix_fmt;
-    codec_context->color_range = AVCOL_RANGE_JPEG;
-    if(codec->id == AV_CODEC_ID_HEVC)
-        codec_context->codec_tag = MKTAG('h', 'v', 'c', '1');
-    switch(video_quality) {
-        case VideoQuality::MEDIUM:
-            //codec_context->qmin = 35;
-            //codec_context->qmax = 35;
-            codec_context->bit_rate = 100000;//4500000 + (codec_context->width * codec_context->height)*0.75;
-            break;
-        case VideoQuality::HIGH:
-            //codec_context->qmin = 34;
-            //codec_context->qmax = 34;
-            codec_context->bit_rate = 100000;//10000000-9000000 + (codec_context->width * codec_context->height)*0.75;
-            break;
-        case VideoQuality::VERY_HIGH:
-            //codec_context->qmin = 28;
-            //codec_context->qmax = 28;
-            codec_context->bit_rate = 100000;//10000000-9000000 + (codec_context->width * codec_context->height)*0.75;
-            break;
-        case VideoQuality::ULTRA:
-            //codec_context->qmin = 22;
-            //codec_context->qmax = 22;
-            codec_context->bit_rate = 100000;//10000000-9000000 + (codec_context->width * codec_context->height)*0.75;
-            break;
+    return true;
+}
+
+// |capture_event_fd| can be -1
+static bool scheduler_init(Scheduler &scheduler, int capture_event_fd) {
+    scheduler.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    scheduler.timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    scheduler.audio_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    scheduler.capture_event_fd = capture_event_fd;
+    signal_wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(scheduler.epoll_fd == -1 || scheduler.timer_fd == -1 || scheduler.audio_fd == -1 || signal_wakeup_fd == -1) {
+        fprintf(stderr, "Error: failed to create the scheduler: %s\n", strerror(errno));
+        return false;
     }
-    //codec_context->profile = FF_PROFILE_H264_MAIN;
-    if (codec_context->codec_id == AV_CODEC_ID_MPEG1VIDEO)
-        codec_context->mb_decision = 2;
 
-    // stream->time_base = codec_context->time_base;
-    // codec_context->ticks_per_frame = 30;
-    //av_opt_set(codec_context->priv_data, "tune", "hq", 0);
-    // TODO: Do this for better file size? also allows setting qmin, qmax per frame? which can then be used to dynamically set bitrate to reduce quality
-    // if live streaming is slow or if the users harddrive is cant handle writing megabytes of data per second.
-    #if 0
-    char qmin_str[32];
-    snprintf(qmin_str, sizeof(qmin_str), "%d", codec_context->qmin);
+    if(!scheduler_add_fd(scheduler, scheduler.timer_fd) || !scheduler_add_fd(scheduler, scheduler.audio_fd) || !scheduler_add_fd(scheduler, signal_wakeup_fd))
+        return false;
 
-    char qmax_str[32];
-    snprintf(qmax_str, sizeof(qmax_str), "%d", codec_context->qmax);
+    if(capture_event_fd != -1 && !scheduler_add_fd(scheduler, capture_event_fd))
+        return false;
 
-    av_opt_set(codec_context->priv_data, "cq", qmax_str, 0);
-    av_opt_set(codec_context->priv_data, "rc", "vbr", 0);
-    av_opt_set(codec_context->priv_data, "qmin", qmin_str, 0);
-    av_opt_set(codec_context->priv_data, "qmax", qmax_str, 0);
-    codec_context->bit_rate = 0;
-    #endif
+    return true;
+}
 
-    av_opt_set_int(codec_context->priv_data, "b_ref_mode", 0, 0);
+static void scheduler_deinit(Scheduler &scheduler) {
+    const int wakeup_fd = signal_wakeup_fd;
+    signal_wakeup_fd = -1;
+    if(wakeup_fd != -1)
+        close(wakeup_fd);
+    if(scheduler.audio_fd != -1)
+        close(scheduler.audio_fd);
+    if(scheduler.timer_fd != -1)
+        close(scheduler.timer_fd);
+    if(scheduler.epoll_fd != -1)
+        close(scheduler.epoll_fd);
+}
 
-    //codec_context->rc_max_rate = codec_context->bit_rate;
-    //codec_context->rc_min_rate = codec_context->bit_rate;
-    //codec_context->rc_buffer_size = codec_context->bit_rate / 10;
+// |deadline| is in seconds, on the same clock as clock_get_monotonic_seconds
+static void scheduler_set_deadline(Scheduler &scheduler, double deadline) {
+    // A zero deadline would disarm the timer
+    deadline = std::max(deadline, 0.000001);
+
+    struct itimerspec timer;
+    memset(&timer, 0, sizeof(timer));
+    timer.it_value.tv_sec = (time_t)deadline;
+    timer.it_value.tv_nsec = (long)((deadline - (double)timer.it_value.tv_sec) * 1000000000.0);
+    if(timerfd_settime(scheduler.timer_fd, TFD_TIMER_ABSTIME, &timer, nullptr) == -1)
+        fprintf(stderr, "Error: timerfd_settime failed: %s\n", strerror(errno));
+}
 
-    codec_context->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+// Sleeps until the deadline or until something else happens
+static void scheduler_wait(Scheduler &scheduler) {
+    struct epoll_event events[4];
+    const int num_events = epoll_wait(scheduler.epoll_fd, events, 4, -1);
+    for(int i = 0; i < num_events; ++i) {
+        // The capture events are read by gsr_capture_tick
+        if(events[i].data.fd == scheduler.capture_event_fd)
+            continue;
+
+        uint64_t value = 0;
+        ssize_t bytes_read = read(events[i].data.fd, &value, sizeof(value));
+        (void)bytes_read;
+    }
+}
 
-    return codec_context;
+// Can be called from any thread
+static void scheduler_notify_audio(Scheduler &scheduler) {
+    const uint64_t value = 1;
+    ssize_t bytes_written = write(scheduler.audio_fd, &value, sizeof(value));
+    (void)bytes_written;
 }
 
-static bool check_if_codec_valid_for_hardware(const AVCodec *codec) {
-    bool success = false;
-    // Do not use AV_PIX_FMT_CUDA because we dont want to do full check with hardware context
-    AVCodecContext *codec_context = create_video_codec_context(AV_PIX_FMT_YUV420P, VideoQuality::VERY_HIGH, 60, codec, false);
-    codec_context->width = 1920;
-    codec_context->height = 1080;
-    if(codec_context) {
-        success = avcodec_open2(codec_context, codec_context->codec, NULL) == 0;
-        avcodec_free_context(&codec_context);
+struct Arg {
+    std::vector<const char*> values;
+    bool optional = false;
+    bool list = false;
+
+    const char* value() const {
+        if(values.empty())
+            return nullptr;
+        return values.front();
     }
-    return success;
+};
+
+static bool is_hex_num(char c) {
+    return (c >= 'A' && c <= 'F') || (c >= 'a' && c <= 'f') || (c >= '0' && c <= '9');
 }
 
-static const AVCodec* find_h264_encoder(gpu_vendor vendor) {
-    const AVCodec *codec = avcodec_find_encoder_by_name(vendor == GPU_VENDOR_NVIDIA ? "h264_nvenc" : "h264_vaapi");
-    if(!codec)
-        codec = avcodec_find_encoder_by_name(vendor == GPU_VENDOR_NVIDIA ? "nvenc_h264" : "vaapi_h264");
+static bool contains_non_hex_number(const char *str) {
+    size_t len = strlen(str);
+    if(len >= 2 && memcmp(str, "0x", 2) == 0) {
+        str += 2;
+        len -= 2;
+    }
 
-    static bool checked = false;
-    static bool checked_success = true;
-    if(!checked) {
-        checked = true;
-        if(!check_if_codec_valid_for_hardware(codec))
-            checked_success = false;
+    for(size_t i = 0; i < len; ++i) {
+        char c = str[i];
+        if(c == '\0')
+            return false;
+        if(!is_hex_num(c))
+            return true;
     }
-    return checked_success ? codec : nullptr;
+    return false;
 }
 
-// TODO: Disable under intel/amd?
+static AVStream* create_stream(AVFormatContext *av_format_context, AVCodecContext *codec_context) {
+    AVStream *stream = avformat_new_stream(av_format_context, nullptr);
+    if (!stream) {
+        fprintf(stderr, "Error: Could not allocate stream\n");
+        exit(1);
+    }
+    stream->id = av_format_context->nb_streams - 1;
+    stream->time_base = codec_context->time_base;
+    stream->avg_frame_rate = codec_context->framerate;
+    return stream;
+}
 
-static const AVCodec* find_h265_encoder(gpu_vendor vendor) {
-    const AVCodec *codec = avcodec_find_encoder_by_name(vendor == GPU_VENDOR_NVIDIA ? "hevc_nvenc" : "hevc_vaapi");
-    if(!codec)
-        codec = avcodec_find_encoder_by_name(vendor == GPU_VENDOR_NVIDIA ? "nvenc_hevc" : "vaapi_hevc");
+// An output that is given with -o after the first one. These are always muxed while recording, whatever the mode of the first output is.
+// Every output has its own muxer and packet writer, so a slow output (with -wq drop) doesn't delay the others
+struct ExtraOutput {
+    AVFormatContext *av_format_context = nullptr;
+    std::mutex write_output_mutex;
+    PacketWriter packet_writer;
+};
 
-    if(!codec)
-        return nullptr;
+// |codec_contexts| are the encoders of each stream index
+static bool extra_output_open(ExtraOutput &extra_output, const char *filepath, const char *container_format, const std::vector<AVCodecContext*> &codec_contexts, WriteQueuePolicy policy) {
+    // The container is deduced from the file extension, -c is used for outputs without one (such as rtmp urls)
+    avformat_alloc_output_context2(&extra_output.av_format_context, nullptr, nullptr, filepath);
+    if(!extra_output.av_format_context && container_format)
+        avformat_alloc_output_context2(&extra_output.av_format_context, nullptr, container_format, filepath);
+    if(!extra_output.av_format_context) {
+        fprintf(stderr, "Error: Failed to deduce container format of output %s, add a file extension or use -c\n", filepath);
+        return false;
+    }
 
-    static bool checked = false;
-    static bool checked_success = true;
-    if(!checked) {
-        checked = true;
-        if(!check_if_codec_valid_for_hardware(codec))
-            checked_success = false;
+    AVFormatContext *av_format_context = extra_output.av_format_context;
+    av_format_context->flags |= AVFMT_FLAG_GENPTS;
+    for(AVCodecContext *codec_context : codec_contexts) {
+        if(avformat_query_codec(av_format_context->oformat, codec_context->codec_id, FF_COMPLIANCE_EXPERIMENTAL) == 0) {
+            fprintf(stderr, "Error: the %s container of output %s doesn't support the %s codec, the codecs are chosen for the first output\n",
+                av_format_context->oformat->name, filepath, avcodec_get_name(codec_context->codec_id));
+            return false;
+        }
+
+        AVStream *stream = create_stream(av_format_context, codec_context);
+        avcodec_parameters_from_context(stream->codecpar, codec_context);
+        extra_output.packet_writer.streams.push_back(stream);
+    }
+
+    if(!(av_format_context->oformat->flags & AVFMT_NOFILE)) {
+        int ret = avio_open(&av_format_context->pb, filepath, AVIO_FLAG_WRITE);
+        if(ret < 0) {
+            fprintf(stderr, "Error: Could not open '%s': %s\n", filepath, av_error_to_string(ret));
+            return false;
+        }
     }
-    return checked_success ? codec : nullptr;
-}
 
-static AVFrame* open_audio(AVCodecContext *audio_codec_context) {
     AVDictionary *options = nullptr;
     av_dict_set(&options, "strict", "experimental", 0);
-
-    int ret;
-    ret = avcodec_open2(audio_codec_context, audio_codec_context->codec, &options);
+    int ret = avformat_write_header(av_format_context, &options);
+    av_dict_free(&options);
     if(ret < 0) {
-        fprintf(stderr, "failed to open codec, reason: %s\n", av_error_to_string(ret));
-        exit(1);
+        fprintf(stderr, "Error occurred when writing header to output %s: %s\n", filepath, av_error_to_string(ret));
+        return false;
     }
 
-    AVFrame *frame = av_frame_alloc();
-    if(!frame) {
-        fprintf(stderr, "failed to allocate audio frame\n");
-        exit(1);
-    }
+    extra_output.packet_writer.name = filepath;
+    extra_output.packet_writer.policy = policy;
+    extra_output.packet_writer.av_format_context = av_format_context;
+    extra_output.packet_writer.write_output_mutex = &extra_output.write_output_mutex;
+    return packet_writer_init(extra_output.packet_writer, WRITE_QUEUE_MAX_PACKETS);
+}
 
-    frame->sample_rate = audio_codec_context->sample_rate;
-    frame->nb_samples = audio_codec_context->frame_size;
-    frame->format = audio_codec_context->sample_fmt;
+// Writes the packets that are still in the queue before closing the output
+static void extra_output_close(ExtraOutput &extra_output) {
+    packet_writer_deinit(extra_output.packet_writer);
+
+    AVFormatContext *av_format_context = extra_output.av_format_context;
+    if(av_write_trailer(av_format_context) != 0)
+        fprintf(stderr, "Failed to write trailer to output %s\n", extra_output.packet_writer.name.c_str());
+
+    if(!(av_format_context->oformat->flags & AVFMT_NOFILE))
+        avio_close(av_format_context->pb);
+
+    avformat_free_context(av_format_context);
+    extra_output.av_format_context = nullptr;
+}
+
+// Written by the audio thread, read by the main thread for the stats that are shown every second
+struct AudioSyncStats {
+    std::atomic<int64_t> sync_error_us{0};
+    std::atomic<int> drift_compensation_ppm{0};
+    std::atomic<int64_t> num_silence_samples{0}; // Since the last time the stats were shown
+    std::atomic<int64_t> num_dropped_samples{0};
+};
+
+struct AudioDevice {
+    SoundDevice sound_device;
+    AudioInput audio_input;
+    float gain = 1.0f; // Gain when it's mixed with other devices
+
+    // Audio of tracks that mix several devices goes through this ring, from the audio thread to the main thread which mixes it
+    gsr_audio_ring *ring = nullptr;
+    int64_t ring_pts = 0;
+    gsr_audio_ring_frame *mix_frame = nullptr; // Only used by the main thread, the frame that is waiting for the other devices to have a frame to mix with
+
+    // Only used by the audio thread
+    AVPacket *silent_packet = nullptr;
+    int num_silent_frames_encoded = 0;
+    // The newest frame of silence that the silent packet would be reused for is held back, so that it can be encoded for real
+    // when the audio comes back. Otherwise the encoder would go from the silence it was last given straight to the audio, skipping the time in between
+    bool silent_frame_held_back = false;
+    int64_t held_back_silent_frame_pts = 0;
+
+    // The audio of the device is placed on the same timeline as the video, from the time the audio was recorded. Gaps are filled with silence
+    // and the drift between the clock of the device and the system clock is corrected by resampling the audio slightly faster or slower.
+    // Only used by the audio thread
+    int64_t timeline_pts = 0; // The pts (in samples) of the next sample of the device
+    double smoothed_sync_error = 0.0; // In samples. Positive if the audio is ahead of the clock
+    double latency_secs = 0.0; // How old the audio is when it's received
+    int drift_compensation = 0; // Samples added (or removed if negative) per second of audio
+    SwrContext *drift_swr = nullptr;
+    bool drift_swr_active = false; // The audio only goes through |drift_swr| once drift has been compensated, until then it's copied to the fifo as is
+    uint8_t *drift_buffer = nullptr;
+    int drift_buffer_num_samples = 0;
+    AVAudioFifo *fifo = nullptr; // Cuts the resampled audio back into frames of the frame size of the encoder
+    uint8_t *fifo_frame = nullptr;
+    std::unique_ptr<AudioSyncStats> sync_stats; // Allocated because AudioDevice is moved, std::atomic can't be
+};
+
+// Number of silent audio frames that are encoded before the encoded packet is reused for the rest of the silence
+#define NUM_SILENT_AUDIO_FRAMES_TO_ENCODE 4
+
+struct AudioTrack {
+    AVCodecContext *codec_context = nullptr;
+    AVFrame *frame = nullptr;
+    AVFrame *silent_frame = nullptr; // A frame of silence in the sample format of the encoder. It's never written to, so the encoder can keep a reference to it
+    AVStream *stream = nullptr;
+
+    std::vector<AudioDevice> audio_devices;
+    // Set if the encoder takes a sample format that the sound devices can't give and that can't be deinterleaved from it.
+    // This doesn't happen with the sample formats that are chosen for the codecs. Used by the thread that builds the frames
+    SwrContext *swr = nullptr;
+    uint8_t *mix_buffer = nullptr; // Set if the track mixes several devices. Aligned to GSR_AUDIO_MIXER_ALIGNMENT like the frames of the rings
+    int64_t mix_pts = 0; // The pts in the rings of the devices of the next frame to mix
+    double start_time = 0.0; // The CLOCK_MONOTONIC time of pts 0
+    int64_t pts = 0;
+    int stream_index = 0;
+};
+
+static int audio_codec_context_get_num_channels(const AVCodecContext *audio_codec_context) {
 #if LIBAVCODEC_VERSION_MAJOR < 60
-    frame->channels = audio_codec_context->channels;
-    frame->channel_layout = audio_codec_context->channel_layout;
+    return audio_codec_context->channels;
 #else
-    av_channel_layout_copy(&frame->ch_layout, &audio_codec_context->ch_layout);
+    return audio_codec_context->ch_layout.nb_channels;
 #endif
+}
 
-    ret = av_frame_get_buffer(frame, 0);
-    if(ret < 0) {
-        fprintf(stderr, "failed to allocate audio data buffers, reason: %s\n", av_error_to_string(ret));
-        exit(1);
+static gsr_audio_mixer_format audio_format_to_mixer_format(AudioFormat audio_format) {
+    switch(audio_format) {
+        case S16: return GSR_AUDIO_MIXER_FORMAT_S16;
+        case S32: return GSR_AUDIO_MIXER_FORMAT_S32;
+        case F32: return GSR_AUDIO_MIXER_FORMAT_F32;
     }
-
-    return frame;
+    assert(false);
+    return GSR_AUDIO_MIXER_FORMAT_S16;
 }
 
-static void open_video(AVCodecContext *codec_context, VideoQuality video_quality, bool very_old_gpu) {
-    bool supports_p4 = false;
-    bool supports_p6 = false;
+static void audio_track_init(AudioTrack &audio_track, double start_time) {
+    audio_track.start_time = start_time;
+    const AVSampleFormat sound_device_sample_format = audio_format_to_sample_format(audio_codec_context_get_audio_format(audio_track.codec_context));
+    const bool can_deinterleave = sound_device_sample_format == AV_SAMPLE_FMT_FLT && audio_track.codec_context->sample_fmt == AV_SAMPLE_FMT_FLTP;
+    if(audio_track.codec_context->sample_fmt != sound_device_sample_format && !can_deinterleave) {
+        audio_track.swr = swr_alloc();
+        if(!audio_track.swr) {
+            fprintf(stderr, "Failed to create SwrContext\n");
+            exit(1);
+        }
+        av_opt_set_int(audio_track.swr, "in_channel_layout", AV_CH_LAYOUT_STEREO, 0);
+        av_opt_set_int(audio_track.swr, "out_channel_layout", AV_CH_LAYOUT_STEREO, 0);
+        av_opt_set_int(audio_track.swr, "in_sample_rate", audio_track.codec_context->sample_rate, 0);
+        av_opt_set_int(audio_track.swr, "out_sample_rate", audio_track.codec_context->sample_rate, 0);
+        av_opt_set_sample_fmt(audio_track.swr, "in_sample_fmt", sound_device_sample_format, 0);
+        av_opt_set_sample_fmt(audio_track.swr, "out_sample_fmt", audio_track.codec_context->sample_fmt, 0);
+        swr_init(audio_track.swr);
+    }
 
-    const AVOption *opt = nullptr;
-    while((opt = av_opt_next(codec_context->priv_data, opt))) {
-        if(opt->type == AV_OPT_TYPE_CONST) {
-            if(strcmp(opt->name, "p4") == 0)
-                supports_p4 = true;
-            else if(strcmp(opt->name, "p6") == 0)
-                supports_p6 = true;
+    audio_track.silent_frame = create_audio_frame(audio_track.codec_context);
+    av_samples_set_silence(audio_track.silent_frame->extended_data, 0, audio_track.silent_frame->nb_samples,
+        audio_codec_context_get_num_channels(audio_track.codec_context), audio_track.codec_context->sample_fmt);
+
+    if(audio_track.audio_devices.size() > 1) {
+        const int num_channels = audio_codec_context_get_num_channels(audio_track.codec_context);
+        const size_t bytes_per_sample = av_get_bytes_per_sample(sound_device_sample_format) * num_channels;
+        const size_t mix_buffer_size = (audio_track.codec_context->frame_size * bytes_per_sample + GSR_AUDIO_MIXER_ALIGNMENT - 1) & ~(size_t)(GSR_AUDIO_MIXER_ALIGNMENT - 1);
+        audio_track.mix_buffer = (uint8_t*)aligned_alloc(GSR_AUDIO_MIXER_ALIGNMENT, mix_buffer_size);
+        if(!audio_track.mix_buffer) {
+            fprintf(stderr, "Error: failed to allocate audio mix buffer\n");
+            exit(1);
+        }
+
+        for(AudioDevice &audio_device : audio_track.audio_devices) {
+            // About a second of audio, the main thread normally takes it out every video frame
+            const size_t ring_num_frames = std::max(8, audio_track.codec_context->sample_rate / audio_track.codec_context->frame_size);
+            audio_device.ring = gsr_audio_ring_create(ring_num_frames, audio_track.codec_context->frame_size, bytes_per_sample);
+            if(!audio_device.ring) {
+                fprintf(stderr, "Error: failed to create audio ring\n");
+                exit(1);
+            }
         }
     }
 
-    AVDictionary *options = nullptr;
-    if(very_old_gpu) {
-        switch(video_quality) {
-            case VideoQuality::MEDIUM:
-                av_dict_set_int(&options, "qp", 37, 0);
-                break;
-            case VideoQuality::HIGH:
-                av_dict_set_int(&options, "qp", 32, 0);
-                break;
-            case VideoQuality::VERY_HIGH:
-                av_dict_set_int(&options, "qp", 27, 0);
-                break;
-            case VideoQuality::ULTRA:
-                av_dict_set_int(&options, "qp", 21, 0);
-                break;
+    for(AudioDevice &audio_device : audio_track.audio_devices) {
+        audio_device.silent_packet = av_packet_alloc();
+        if(!audio_device.silent_packet) {
+            fprintf(stderr, "Error: failed to allocate packet\n");
+            exit(1);
+        }
+        audio_device.num_silent_frames_encoded = 0;
+        audio_device.timeline_pts = audio_track.pts;
+        audio_device.sync_stats = std::make_unique<AudioSyncStats>();
+
+        if(!audio_device.sound_device.handle)
+            continue;
+
+        // Resamples from and to the sample format of the sound device, it only changes the speed of the audio when drift compensation is set
+        audio_device.drift_swr = swr_alloc();
+        if(!audio_device.drift_swr) {
+            fprintf(stderr, "Failed to create SwrContext\n");
+            exit(1);
+        }
+        av_opt_set_int(audio_device.drift_swr, "in_channel_layout", AV_CH_LAYOUT_STEREO, 0);
+        av_opt_set_int(audio_device.drift_swr, "out_channel_layout", AV_CH_LAYOUT_STEREO, 0);
+        av_opt_set_int(audio_device.drift_swr, "in_sample_rate", audio_track.codec_context->sample_rate, 0);
+        av_opt_set_int(audio_device.drift_swr, "out_sample_rate", audio_track.codec_context->sample_rate, 0);
+        av_opt_set_sample_fmt(audio_device.drift_swr, "in_sample_fmt", sound_device_sample_format, 0);
+        av_opt_set_sample_fmt(audio_device.drift_swr, "out_sample_fmt", sound_device_sample_format, 0);
+        swr_init(audio_device.drift_swr);
+
+        const int num_channels = audio_codec_context_get_num_channels(audio_track.codec_context);
+        const int frame_size_bytes = audio_track.codec_context->frame_size * av_get_bytes_per_sample(sound_device_sample_format) * num_channels;
+        // Room for a frame of audio that is resampled to be a bit longer, and the audio the resampler holds back
+        audio_device.drift_buffer_num_samples = audio_track.codec_context->frame_size * 2;
+        audio_device.drift_buffer = (uint8_t*)av_malloc(frame_size_bytes * 2);
+        audio_device.fifo = av_audio_fifo_alloc(sound_device_sample_format, num_channels, audio_track.codec_context->frame_size * 2);
+        audio_device.fifo_frame = (uint8_t*)av_malloc(frame_size_bytes);
+        if(!audio_device.drift_buffer || !audio_device.fifo || !audio_device.fifo_frame) {
+            fprintf(stderr, "Error: failed to allocate audio buffers\n");
+            exit(1);
+        }
+    }
+}
+
+static void audio_track_deinit(AudioTrack &audio_track) {
+    for(AudioDevice &audio_device : audio_track.audio_devices) {
+        sound_device_close(&audio_device.sound_device);
+        av_packet_free(&audio_device.silent_packet);
+        gsr_audio_ring_destroy(audio_device.ring);
+        audio_device.ring = nullptr;
+        if(audio_device.drift_swr)
+            swr_free(&audio_device.drift_swr);
+        av_freep(&audio_device.drift_buffer);
+        if(audio_device.fifo) {
+            av_audio_fifo_free(audio_device.fifo);
+            audio_device.fifo = nullptr;
+        }
+        av_freep(&audio_device.fifo_frame);
+    }
+
+    free(audio_track.mix_buffer);
+    audio_track.mix_buffer = nullptr;
+    av_frame_free(&audio_track.silent_frame);
+    if(audio_track.swr)
+        swr_free(&audio_track.swr);
+}
+
+// Puts one period of audio in the sound device format in the frame of the track, in the sample format of the encoder.
+// The frame has to be writable
+static void audio_track_fill_frame(AudioTrack &audio_track, const uint8_t *sound_buffer) {
+    if(audio_track.swr) {
+        swr_convert(audio_track.swr, &audio_track.frame->data[0], audio_track.frame->nb_samples, &sound_buffer, audio_track.codec_context->frame_size);
+    } else if(audio_track.codec_context->sample_fmt == AV_SAMPLE_FMT_FLTP) {
+        gsr_audio_deinterleave_f32((const float*)sound_buffer, (float *const*)audio_track.frame->extended_data,
+            audio_codec_context_get_num_channels(audio_track.codec_context), audio_track.frame->nb_samples);
+    } else {
+        audio_track.frame->data[0] = (uint8_t*)sound_buffer;
+    }
+}
+
+static void audio_device_encode_frame(AudioTrack &audio_track, AudioDevice &audio_device, AVFrame *frame, int64_t pts, bool silence, const std::vector<PacketWriter*> &packet_writers) {
+    frame->pts = pts;
+    const int ret = avcodec_send_frame(audio_track.codec_context, frame);
+    if(ret >= 0){
+        receive_frames(audio_track.codec_context, audio_track.stream_index, frame, packet_writers, silence ? audio_device.silent_packet : nullptr);
+        if(silence)
+            ++audio_device.num_silent_frames_encoded;
+    } else {
+        fprintf(stderr, "Failed to encode audio!\n");
+    }
+}
+
+// Encodes the silent frame that was held back instead of reusing the silent packet for it, see |silent_frame_held_back|
+static void audio_device_encode_held_back_silent_frame(AudioTrack &audio_track, AudioDevice &audio_device, const std::vector<PacketWriter*> &packet_writers) {
+    if(!audio_device.silent_frame_held_back)
+        return;
+
+    audio_device.silent_frame_held_back = false;
+    audio_device_encode_frame(audio_track, audio_device, audio_track.silent_frame, audio_device.held_back_silent_frame_pts, true, packet_writers);
+}
+
+// Sends |sound_buffer| (one period of audio in the sound device format) |num_frames| times to the mixer of the track, or encodes it
+static void audio_device_write_frames(AudioTrack &audio_track, AudioDevice &audio_device, const void *sound_buffer, int64_t num_frames, bool silence,
+    const std::vector<PacketWriter*> &packet_writers, Scheduler &scheduler)
+{
+    if(num_frames <= 0)
+        return;
+
+    if(audio_device.ring) {
+        for(int64_t i = 0; i < num_frames; ++i) {
+            gsr_audio_ring_write(audio_device.ring, sound_buffer, audio_track.frame->nb_samples, audio_device.ring_pts);
+            audio_device.ring_pts += audio_track.frame->nb_samples;
         }
-    } else {
-        switch(video_quality) {
-            case VideoQuality::MEDIUM:
-                av_dict_set_int(&options, "qp", 40, 0);
-                break;
-            case VideoQuality::HIGH:
-                av_dict_set_int(&options, "qp", 35, 0);
-                break;
-            case VideoQuality::VERY_HIGH:
-                av_dict_set_int(&options, "qp", 30, 0);
-                break;
-            case VideoQuality::ULTRA:
-                av_dict_set_int(&options, "qp", 24, 0);
-                break;
+        scheduler_notify_audio(scheduler);
+        return;
+    }
+
+    // Silence is in the prebuilt silent frame, so it doesn't have to be converted every time
+    AVFrame *frame = audio_track.silent_frame;
+    if(!silence) {
+        audio_device_encode_held_back_silent_frame(audio_track, audio_device, packet_writers);
+        frame = audio_track.frame;
+        if(av_frame_make_writable(frame) < 0) {
+            fprintf(stderr, "Failed to make audio frame writable\n");
+            return;
         }
+        audio_track_fill_frame(audio_track, (const uint8_t*)sound_buffer);
     }
 
-    if(!supports_p4 && !supports_p6)
-        fprintf(stderr, "Info: your ffmpeg version is outdated. It's recommended that you use the flatpak version of gpu-screen-recorder version instead, which you can find at https://flathub.org/apps/details/com.dec05eba.gpu_screen_recorder\n");
+    // Once the encoder has been given enough silence that its output doesn't depend on the audio before it anymore, every silent frame
+    // encodes to the same packet. That packet is kept and written with a new pts for the rest of the silence, instead of encoding every frame.
+    // The newest of those frames is held back and encoded for real before the audio comes back, so the encoder is given silence right before the audio.
+    // Flac packets have the frame number in them so they can't be reused, but flac encodes silence cheaply anyway
+    const bool can_reuse_silent_packet = silence && audio_track.codec_context->codec_id != AV_CODEC_ID_FLAC;
+
+    for(int64_t i = 0; i < num_frames; ++i) {
+        if(can_reuse_silent_packet && audio_device.num_silent_frames_encoded >= NUM_SILENT_AUDIO_FRAMES_TO_ENCODE && audio_device.silent_packet->data) {
+            if(audio_device.silent_frame_held_back) {
+                AVPacket av_packet;
+                memset(&av_packet, 0, sizeof(av_packet));
+                av_packet_ref(&av_packet, audio_device.silent_packet);
+                av_packet.pts = av_packet.dts = audio_device.held_back_silent_frame_pts;
+                packet_writers_push(packet_writers, av_packet, audio_track.codec_context->time_base);
+            }
+            audio_device.silent_frame_held_back = true;
+            audio_device.held_back_silent_frame_pts = audio_track.pts;
+        } else {
+            audio_device_encode_frame(audio_track, audio_device, frame, audio_track.pts, silence, packet_writers);
+        }
+        audio_track.pts += frame->nb_samples;
+    }
 
-    //if(is_livestream) {
-    //    av_dict_set_int(&options, "zerolatency", 1, 0);
-    //    //av_dict_set(&options, "preset", "llhq", 0);
-    //}
+    if(!silence) {
+        audio_device.num_silent_frames_encoded = 0;
+        av_packet_unref(audio_device.silent_packet);
+    }
+}
 
-    // Fuck nvidia and ffmpeg, I want to use a good preset for the gpu but all gpus prefer different
-    // presets. Nvidia and ffmpeg used to support "hq" preset that chose the best preset for the gpu
-    // with pretty good performance but you now have to choose p1-p7, which are gpu agnostic and on
-    // older gpus p5-p7 slow the gpu down to a crawl...
-    // "hq" is now just an alias for p7 in ffmpeg :(
-    // TODO: Temporary disable because of stuttering?
-    if(very_old_gpu)
-        av_dict_set(&options, "preset", supports_p4 ? "p4" : "medium", 0);
-    else
-        av_dict_set(&options, "preset", supports_p6 ? "p6" : "slow", 0);
+// Called by the main thread. Mixes the audio the audio thread has received for the devices of the track, one frame of every device at a time,
+// and encodes it. Nothing here is shared with the audio thread other than the rings, so this never waits for it
+static void audio_track_mix(AudioTrack &audio_track, const std::vector<PacketWriter*> &packet_writers) {
+    const void *inputs[GSR_AUDIO_MIXER_MAX_INPUTS];
+    float gains[GSR_AUDIO_MIXER_MAX_INPUTS];
+    const gsr_audio_mixer_format mixer_format = audio_format_to_mixer_format(audio_codec_context_get_audio_format(audio_track.codec_context));
+    const size_t num_samples = audio_track.codec_context->frame_size * audio_codec_context_get_num_channels(audio_track.codec_context);
+
+    for(;;) {
+        // The audio thread writes silence for devices that don't receive audio, so a device can't hold back the others for long.
+        // Frames older than the frame that is mixed next are skipped
+        for(AudioDevice &audio_device : audio_track.audio_devices) {
+            for(;;) {
+                if(!audio_device.mix_frame)
+                    audio_device.mix_frame = gsr_audio_ring_read(audio_device.ring);
+                if(!audio_device.mix_frame)
+                    return;
+                if(audio_device.mix_frame->pts >= audio_track.mix_pts)
+                    break;
+                gsr_audio_ring_release(audio_device.ring, audio_device.mix_frame);
+                audio_device.mix_frame = nullptr;
+            }
+        }
 
-    av_dict_set(&options, "tune", "hq", 0);
-    av_dict_set(&options, "rc", "constqp", 0);
+        // The frames are mixed by their pts, not in the order they arrived. A device that doesn't have a frame for this pts (because its ring was full
+        // and the frame was dropped) is silent in this frame and its next frame waits for its own pts, so the devices stay in sync after a drop
+        int num_inputs = 0;
+        for(AudioDevice &audio_device : audio_track.audio_devices) {
+            if(audio_device.mix_frame->pts != audio_track.mix_pts)
+                continue;
+            inputs[num_inputs] = audio_device.mix_frame->data;
+            gains[num_inputs] = audio_device.gain;
+            ++num_inputs;
+        }
 
-    if(codec_context->codec_id == AV_CODEC_ID_H264)
-        av_dict_set(&options, "profile", "high", 0);
+        if(num_inputs > 0)
+            gsr_audio_mix(mixer_format, audio_track.mix_buffer, inputs, gains, num_inputs, num_samples);
+        else
+            memset(audio_track.mix_buffer, 0, num_samples * av_get_bytes_per_sample(audio_format_to_sample_format(audio_codec_context_get_audio_format(audio_track.codec_context))));
+        audio_track.mix_pts += audio_track.codec_context->frame_size;
 
-    av_dict_set(&options, "strict", "experimental", 0);
+        for(AudioDevice &audio_device : audio_track.audio_devices) {
+            if(audio_device.mix_frame->pts < audio_track.mix_pts) {
+                gsr_audio_ring_release(audio_device.ring, audio_device.mix_frame);
+                audio_device.mix_frame = nullptr;
+            }
 
-    int ret = avcodec_open2(codec_context, codec_context->codec, &options);
-    if (ret < 0) {
-        fprintf(stderr, "Error: Could not open video codec: %s\n", av_error_to_string(ret));
-        exit(1);
+            const uint64_t num_dropped_samples = gsr_audio_ring_take_num_dropped_samples(audio_device.ring);
+            if(num_dropped_samples > 0)
+                fprintf(stderr, "gsr warning: dropped %d audio samples of %s, the audio is not mixed fast enough\n", (int)num_dropped_samples, audio_device.audio_input.name.c_str());
+        }
+
+        if(av_frame_make_writable(audio_track.frame) < 0) {
+            fprintf(stderr, "Failed to make audio frame writable\n");
+            return;
+        }
+
+        audio_track_fill_frame(audio_track, audio_track.mix_buffer);
+
+        audio_track.frame->pts = audio_track.pts;
+        audio_track.pts += audio_track.frame->nb_samples;
+        const int ret = avcodec_send_frame(audio_track.codec_context, audio_track.frame);
+        if(ret >= 0){
+            receive_frames(audio_track.codec_context, audio_track.stream_index, audio_track.frame, packet_writers);
+        } else {
+            fprintf(stderr, "Failed to encode audio!\n");
+        }
     }
 }
 
-static void usage() {
-    fprintf(stderr, "usage: gpu-screen-recorder -w <window_id|monitor|focused> [-c <container_format>] [-s WxH] -f <fps> [-a <audio_input>...] [-q <quality>] [-r <replay_buffer_size_sec>] [-k h264|h265] [-ac aac|opus|flac] [-o <output_file>]\n");
-    fprintf(stderr, "OPTIONS:\n");
-    fprintf(stderr, "  -w    Window to record, a display, \"screen\", \"screen-direct\", \"screen-direct-force\" or \"focused\". The display is the display (monitor) name in xrandr and if \"screen\" or \"screen-direct\" is selected then all displays are recorded. If this is \"focused\" then the currently focused window is recorded. When recording the focused window then the -s option has to be used as well.\n"
-        "        \"screen-direct\"/\"screen-direct-force\" skips one texture copy for fullscreen applications so it may lead to better performance and it works with VRR monitors when recording fullscreen application but may break some applications, such as mpv in fullscreen mode. Direct mode doesn't capture cursor either. \"screen-direct-force\" is not recommended unless you use a VRR monitor because there might be driver issues that cause the video to stutter or record a black screen.\n");
-    fprintf(stderr, "  -c    Container format for output file, for example mp4, or flv. Only required if no output file is specified or if recording in replay buffer mode. If an output file is specified and -c is not used then the container format is determined from the output filename extension.\n");
-    fprintf(stderr, "  -e    Fail fast [true/false] defaults to false - if fail-fast is true the gpu-screen-recorder will not try as hard to restart the recording session.\n");
-    fprintf(stderr, "  -s    The size (area) to record at in the format WxH, for example 1920x1080. This option is only supported (and required) when -w is \"focused\".\n");
-    fprintf(stderr, "  -f    Framerate to record at.\n");
-    fprintf(stderr, "  -a    Audio device to record from (pulse audio device). Can be specified multiple times. Each time this is specified a new audio track is added for the specified audio device. A name can be given to the audio input device by prefixing the audio input with <name>/, for example \"dummy/alsa_output.pci-0000_00_1b.0.analog-stereo.monitor\". Multiple audio devices can be merged into one audio track by using \"|\" as a separator into one -a argument, for example: -a \"alsa_output1|alsa_output2\". Optional, no audio track is added by default.\n");
-    fprintf(stderr, "  -q    Video quality. Should be either 'medium', 'high', 'very_high' or 'ultra'. 'high' is the recommended option when live streaming or when you have a slower harddrive. Optional, set to 'very_high' be default.\n");
-    fprintf(stderr, "  -r    Replay buffer size in seconds. If this is set, then only the last seconds as set by this option will be stored"
-        " and the video will only be saved when the gpu-screen-recorder is closed. This feature is similar to Nvidia's instant replay feature."
-        " This option has be between 5 and 1200. Note that the replay buffer size will not always be precise, because of keyframes. Optional, disabled by default.\n");
-    fprintf(stderr, "  -k    Video codec to use. Should be either 'auto', 'h264' or 'h265'. Defaults to 'auto' which defaults to 'h265' unless recording at a higher resolution than 3840x2160. Forcefully set to 'h264' if -c is 'flv'.\n");
-    fprintf(stderr, "  -ac   Audio codec to use. Should be either 'aac', 'opus' or 'flac'. Defaults to 'opus' for .mp4/.mkv files, otherwise defaults to 'aac'. 'opus' and 'flac' is only supported by .mp4/.mkv files. 'opus' is recommended for best performance and smallest audio size.\n");
-    fprintf(stderr, "  -o    The output file path. If omitted then the encoded data is sent to stdout. Required in replay mode (when using -r). In replay mode this has to be an existing directory instead of a file.\n");
-    fprintf(stderr, "NOTES:\n");
-    fprintf(stderr, "  Send signal SIGINT (Ctrl+C) to gpu-screen-recorder to stop and save the recording (when not using replay mode).\n");
-    fprintf(stderr, "  Send signal SIGUSR1 (killall -SIGUSR1 gpu-screen-recorder) to gpu-screen-recorder to save a replay.\n");
-    fprintf(stderr, "EXAMPLES\n");
-    fprintf(stderr, "  gpu-screen-recorder -w screen -f 60 -a \"$(pactl get-default-sink).monitor\" -o video.mp4\n");
-    exit(1);
+static double audio_track_get_period_secs(const AudioTrack &audio_track) {
+    return (double)audio_track.frame->nb_samples / (double)audio_track.codec_context->sample_rate;
 }
 
-static sig_atomic_t running = 1;
-static sig_atomic_t save_replay = 0;
-
-static void int_handler(int) {
-    running = 0;
+// How far (in seconds) the audio of a device can be from the clock before it's treated as a gap, which is filled with silence,
+// or as audio for a time that already has audio, which is dropped. Smaller differences are corrected by resampling
+#define AUDIO_MAX_SYNC_ERROR_SECS 0.1
+// Drift is only corrected once the audio is this far off, the timestamps from the audio server jitter by about a millisecond
+#define AUDIO_SYNC_DEADBAND_SECS 0.002
+// The audio is resampled at most this much faster or slower (0.1%), which can't be heard
+#define AUDIO_MAX_DRIFT_COMPENSATION 0.001
+// How much each new sync error measurement moves the smoothed sync error
+#define AUDIO_SYNC_ERROR_SMOOTHING 0.05
+
+// The pts (in samples) of audio that was recorded at |time|
+static double audio_track_get_pts_at_time(const AudioTrack &audio_track, double time) {
+    return (time - audio_track.start_time) * (double)audio_track.codec_context->sample_rate;
 }
 
-static void save_replay_handler(int) {
-    save_replay = 1;
+// Writes the audio that is in the fifo of the device, in whole frames
+static void audio_device_flush_fifo(AudioTrack &audio_track, AudioDevice &audio_device, const std::vector<PacketWriter*> &packet_writers, Scheduler &scheduler) {
+    const int frame_size = audio_track.codec_context->frame_size;
+    while(av_audio_fifo_size(audio_device.fifo) >= frame_size) {
+        void *fifo_frame = audio_device.fifo_frame;
+        av_audio_fifo_read(audio_device.fifo, &fifo_frame, frame_size);
+        audio_device_write_frames(audio_track, audio_device, audio_device.fifo_frame, 1, false, packet_writers, scheduler);
+    }
 }
 
-struct Arg {
-    std::vector<const char*> values;
-    bool optional = false;
-    bool list = false;
+// Adds exactly |num_samples| samples of silence to the audio of the device
+static void audio_device_write_silence(AudioTrack &audio_track, AudioDevice &audio_device, int64_t num_samples, const uint8_t *empty_audio,
+    const std::vector<PacketWriter*> &packet_writers, Scheduler &scheduler)
+{
+    if(num_samples <= 0)
+        return;
 
-    const char* value() const {
-        if(values.empty())
-            return nullptr;
-        return values.front();
+    audio_device.timeline_pts += num_samples;
+    audio_device.sync_stats->num_silence_samples += num_samples;
+
+    // The silence that completes the frame that is in the fifo goes through the fifo. The whole frames after it are written directly,
+    // so the encoded packet of silence can be reused for them
+    const int frame_size = audio_track.codec_context->frame_size;
+    void *silence = (void*)empty_audio;
+    const int64_t fifo_size = av_audio_fifo_size(audio_device.fifo);
+    if(fifo_size > 0) {
+        const int64_t num_fifo_samples = std::min(num_samples, frame_size - fifo_size);
+        av_audio_fifo_write(audio_device.fifo, &silence, num_fifo_samples);
+        num_samples -= num_fifo_samples;
+        audio_device_flush_fifo(audio_track, audio_device, packet_writers, scheduler);
     }
-};
 
-static bool is_hex_num(char c) {
-    return (c >= 'A' && c <= 'F') || (c >= 'a' && c <= 'f') || (c >= '0' && c <= '9');
+    audio_device_write_frames(audio_track, audio_device, empty_audio, num_samples / frame_size, true, packet_writers, scheduler);
+    if(num_samples % frame_size > 0)
+        av_audio_fifo_write(audio_device.fifo, &silence, num_samples % frame_size);
 }
 
-static bool contains_non_hex_number(const char *str) {
-    size_t len = strlen(str);
-    if(len >= 2 && memcmp(str, "0x", 2) == 0) {
-        str += 2;
-        len -= 2;
+// Called by the audio thread when the sound device has received a period of audio, that was recorded at |timestamp|
+static void audio_device_receive(AudioTrack &audio_track, AudioDevice &audio_device, const void *sound_buffer, double timestamp, const uint8_t *empty_audio,
+    const std::vector<PacketWriter*> &packet_writers, Scheduler &scheduler)
+{
+    const int sample_rate = audio_track.codec_context->sample_rate;
+    const int frame_size = audio_track.codec_context->frame_size;
+    const int bytes_per_sample = av_get_bytes_per_sample(audio_format_to_sample_format(audio_codec_context_get_audio_format(audio_track.codec_context)))
+        * audio_codec_context_get_num_channels(audio_track.codec_context);
+    audio_device.latency_secs = std::max(0.0, clock_get_monotonic_seconds() - (timestamp + audio_track_get_period_secs(audio_track)));
+
+    const uint8_t *samples = (const uint8_t*)sound_buffer;
+    int num_samples = frame_size;
+    double sync_error = (double)audio_device.timeline_pts - audio_track_get_pts_at_time(audio_track, timestamp);
+    const double max_sync_error = AUDIO_MAX_SYNC_ERROR_SECS * sample_rate;
+    if(sync_error < -max_sync_error) {
+        // No audio was received for a while (the device was suspended, or the audio server was busy)
+        audio_device_write_silence(audio_track, audio_device, std::llround(-sync_error), empty_audio, packet_writers, scheduler);
+        sync_error = 0.0;
+        audio_device.smoothed_sync_error = 0.0;
+    } else if(sync_error > max_sync_error) {
+        // The audio is for a time that has already been filled with silence because the audio was late
+        const int num_dropped_samples = std::min((int64_t)num_samples, (int64_t)std::llround(sync_error));
+        samples += num_dropped_samples * bytes_per_sample;
+        num_samples -= num_dropped_samples;
+        sync_error -= num_dropped_samples;
+        audio_device.smoothed_sync_error = sync_error;
+        audio_device.sync_stats->num_dropped_samples += num_dropped_samples;
+        if(num_samples == 0)
+            return;
     }
 
-    for(size_t i = 0; i < len; ++i) {
-        char c = str[i];
-        if(c == '\0')
-            return false;
-        if(!is_hex_num(c))
-            return true;
+    audio_device.smoothed_sync_error += (sync_error - audio_device.smoothed_sync_error) * AUDIO_SYNC_ERROR_SMOOTHING;
+
+    // The sync error is turned into a number of samples to add or remove over the next second of audio. This is recalculated for every period
+    // so it converges as the sync error gets smaller
+    int drift_compensation = 0;
+    if(std::abs(audio_device.smoothed_sync_error) > AUDIO_SYNC_DEADBAND_SECS * sample_rate) {
+        const double max_drift_compensation = AUDIO_MAX_DRIFT_COMPENSATION * sample_rate;
+        drift_compensation = std::round(std::clamp(-audio_device.smoothed_sync_error, -max_drift_compensation, max_drift_compensation));
     }
-    return false;
+
+    if(drift_compensation != audio_device.drift_compensation) {
+        if(swr_set_compensation(audio_device.drift_swr, drift_compensation, drift_compensation == 0 ? 0 : sample_rate) < 0)
+            fprintf(stderr, "gsr warning: failed to set audio drift compensation\n");
+        audio_device.drift_compensation = drift_compensation;
+        audio_device.drift_swr_active = true;
+    }
+
+    // The resampler holds back some of the audio once it has been used, so after that the audio has to keep going through it
+    if(audio_device.drift_swr_active) {
+        uint8_t *drift_buffer = audio_device.drift_buffer;
+        const int num_resampled_samples = swr_convert(audio_device.drift_swr, &drift_buffer, audio_device.drift_buffer_num_samples, &samples, num_samples);
+        if(num_resampled_samples > 0) {
+            void *resampled_samples = drift_buffer;
+            av_audio_fifo_write(audio_device.fifo, &resampled_samples, num_resampled_samples);
+            audio_device.timeline_pts += num_resampled_samples;
+        }
+    } else {
+        void *device_samples = (void*)samples;
+        av_audio_fifo_write(audio_device.fifo, &device_samples, num_samples);
+        audio_device.timeline_pts += num_samples;
+    }
+    audio_device_flush_fifo(audio_track, audio_device, packet_writers, scheduler);
+
+    audio_device.sync_stats->sync_error_us = (int64_t)(audio_device.smoothed_sync_error * 1000000.0 / sample_rate);
+    audio_device.sync_stats->drift_compensation_ppm = (int)((int64_t)drift_compensation * 1000000 / sample_rate);
 }
 
-static std::string get_date_str() {
-    char str[128];
-    time_t now = time(NULL);
-    struct tm *t = localtime(&now);
-    strftime(str, sizeof(str)-1, "%Y-%m-%d_%H-%M-%S", t);
-    return str; 
+// Called by the audio thread every time it wakes up. Devices without an audio input get silence up to the current time.
+// If a device hasn't received audio for longer than it should, silence is added up to where its audio would be if it was received now.
+// Audio that is received later for that time is dropped
+static void audio_device_write_missing_silence(AudioTrack &audio_track, AudioDevice &audio_device, const uint8_t *empty_audio,
+    const std::vector<PacketWriter*> &packet_writers, Scheduler &scheduler)
+{
+    const double now = clock_get_monotonic_seconds();
+    if(!audio_device.sound_device.handle) {
+        const int frame_size = audio_track.codec_context->frame_size;
+        const int64_t num_missing_frames = (audio_track_get_pts_at_time(audio_track, now) - (double)audio_device.timeline_pts) / frame_size;
+        if(num_missing_frames > 0) {
+            audio_device_write_frames(audio_track, audio_device, empty_audio, num_missing_frames, true, packet_writers, scheduler);
+            audio_device.timeline_pts += num_missing_frames * frame_size;
+        }
+        return;
+    }
+
+    const double num_missing_samples = audio_track_get_pts_at_time(audio_track, now - audio_device.latency_secs) - (double)audio_device.timeline_pts;
+    if(num_missing_samples > AUDIO_MAX_SYNC_ERROR_SECS * audio_track.codec_context->sample_rate) {
+        audio_device_write_silence(audio_track, audio_device, std::llround(num_missing_samples), empty_audio, packet_writers, scheduler);
+        audio_device.smoothed_sync_error = 0.0;
+    }
 }
 
-static AVStream* create_stream(AVFormatContext *av_format_context, AVCodecContext *codec_context) {
-    AVStream *stream = avformat_new_stream(av_format_context, nullptr);
-    if (!stream) {
-        fprintf(stderr, "Error: Could not allocate stream\n");
+struct SaveReplayJob {
+    gsr_replay_buffer_snapshot snapshot;
+    int64_t video_pts_offset = 0; // pts of the keyframe the replay starts with, the audio tracks are cut at the same presentation time
+    std::string output_filepath;
+    const ReplayFragments *replay_fragments = nullptr; // Set in fragmented replay mode
+};
+
+// Replays are saved by a small pool of threads, each save job has its own snapshot of the replay buffer and output file.
+// This way a replay can be saved while a previous (possibly very large) replay is still being written.
+#define NUM_SAVE_REPLAY_THREADS 2
+
+static std::mutex save_replay_mutex;
+static std::condition_variable save_replay_cv;
+static std::deque<SaveReplayJob> save_replay_jobs;
+static std::vector<std::string> saved_replay_filepaths;
+static std::vector<std::thread> save_replay_threads;
+static bool save_replay_threads_running = true;
+
+static void replay_packet_to_av_packet(const gsr_replay_packet &replay_packet, AVPacket &av_packet) {
+    if(av_new_packet(&av_packet, replay_packet.size) < 0) {
+        fprintf(stderr, "Error: failed to allocate replay packet\n");
         exit(1);
     }
-    stream->id = av_format_context->nb_streams - 1;
-    stream->time_base = codec_context->time_base;
-    stream->avg_frame_rate = codec_context->framerate;
-    return stream;
+
+    memcpy(av_packet.data, replay_packet.data, replay_packet.size);
+    av_packet.stream_index = replay_packet.stream_index;
+    av_packet.pts = replay_packet.pts;
+    av_packet.dts = replay_packet.dts;
+    if(replay_packet.flags & GSR_REPLAY_PACKET_FLAG_KEY)
+        av_packet.flags |= AV_PKT_FLAG_KEY;
 }
 
-struct AudioDevice {
-    SoundDevice sound_device;
-    AudioInput audio_input;
-    AVFilterContext *src_filter_ctx = nullptr;
-    std::thread thread; // TODO: Instead of having a thread for each track, have one thread for all threads and read the data with non-blocking read
-};
+static void write_replay(SaveReplayJob &job, AVCodecContext *video_codec_context, int video_stream_index, const std::vector<AudioTrack> &audio_tracks, const char *container_format) {
+    AVFormatContext *av_format_context;
+    avformat_alloc_output_context2(&av_format_context, nullptr, container_format, nullptr);
 
-struct AudioTrack {
-    AVCodecContext *codec_context = nullptr;
-    AVFrame *frame = nullptr;
-    AVStream *stream = nullptr;
+    av_format_context->flags |= AVFMT_FLAG_GENPTS;
+    av_format_context->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
 
-    std::vector<AudioDevice> audio_devices;
-    AVFilterGraph *graph = nullptr;
-    AVFilterContext *sink = nullptr;
-    int64_t pts = 0;
-    int stream_index = 0;
-};
+    AVStream *video_stream = create_stream(av_format_context, video_codec_context);
+    avcodec_parameters_from_context(video_stream->codecpar, video_codec_context);
 
-static std::future<void> save_replay_thread;
-static std::vector<AVPacket> save_replay_packets;
-static std::string save_replay_output_filepath;
+    // Each save has its own streams, the audio tracks are shared with the other saves
+    std::unordered_map<int, std::pair<AVStream*, AVCodecContext*>> stream_index_to_audio_stream_map;
+    for(const AudioTrack &audio_track : audio_tracks) {
+        AVStream *audio_stream = create_stream(av_format_context, audio_track.codec_context);
+        avcodec_parameters_from_context(audio_stream->codecpar, audio_track.codec_context);
+        stream_index_to_audio_stream_map[audio_track.stream_index] = { audio_stream, audio_track.codec_context };
+    }
 
-static void save_replay_async(AVCodecContext *video_codec_context, int video_stream_index, std::vector<AudioTrack> &audio_tracks, const std::deque<AVPacket> &frame_data_queue, bool frames_erased, std::string output_dir, const char *container_format, const std::string &file_extension, std::mutex &write_output_mutex) {
-    if(save_replay_thread.valid())
+    int ret = avio_open(&av_format_context->pb, job.output_filepath.c_str(), AVIO_FLAG_WRITE);
+    if (ret < 0) {
+        fprintf(stderr, "Error: Could not open '%s': %s. Make sure %s is an existing directory with write access\n", job.output_filepath.c_str(), av_error_to_string(ret), job.output_filepath.c_str());
+        avformat_free_context(av_format_context);
         return;
-    
-    size_t start_index = (size_t)-1;
-    int64_t video_pts_offset = 0;
-    int64_t audio_pts_offset = 0;
+    }
 
-    {
-        std::lock_guard<std::mutex> lock(write_output_mutex);
-        start_index = (size_t)-1;
-        for(size_t i = 0; i < frame_data_queue.size(); ++i) {
-            const AVPacket &av_packet = frame_data_queue[i];
-            if((av_packet.flags & AV_PKT_FLAG_KEY) && av_packet.stream_index == video_stream_index) {
-                start_index = i;
-                break;
-            }
+    AVDictionary *options = nullptr;
+    av_dict_set(&options, "strict", "experimental", 0);
+
+    ret = avformat_write_header(av_format_context, &options);
+    if (ret < 0) {
+        fprintf(stderr, "Error occurred when writing header to output file: %s\n", av_error_to_string(ret));
+        avio_close(av_format_context->pb);
+        avformat_free_context(av_format_context);
+        av_dict_free(&options);
+        return;
+    }
+
+    // Packets that were dropped before the first packet don't matter, the replay starts after them
+    bool is_first_packet = true;
+    bool gap_warning_shown = false;
+    gsr_replay_packet replay_packet;
+    while(gsr_replay_buffer_snapshot_next(&job.snapshot, &replay_packet)) {
+        if(!is_first_packet && !gap_warning_shown && (replay_packet.flags & GSR_REPLAY_PACKET_FLAG_DISCONTINUITY)) {
+            fprintf(stderr, "Warning: the replay %s has a gap, packets were dropped while recording because saving a replay was slower than recording\n", job.output_filepath.c_str());
+            gap_warning_shown = true;
         }
+        is_first_packet = false;
 
-        if(start_index == (size_t)-1)
-            return;
+        // The muxer may keep the packet around for interleaving, so the data is copied out of the replay buffer
+        AVPacket av_packet;
+        memset(&av_packet, 0, sizeof(av_packet));
+        replay_packet_to_av_packet(replay_packet, av_packet);
 
-        if(frames_erased) {
-            video_pts_offset = frame_data_queue[start_index].pts;
-            
-            // Find the next audio packet to use as audio pts offset
-            for(size_t i = start_index; i < frame_data_queue.size(); ++i) {
-                const AVPacket &av_packet = frame_data_queue[i];
-                if(av_packet.stream_index != video_stream_index) {
-                    audio_pts_offset = av_packet.pts;
-                    break;
-                }
-            }
-        } else {
-            start_index = 0;
+        AVStream *stream = video_stream;
+        AVCodecContext *codec_context = video_codec_context;
+
+        int64_t pts_offset = job.video_pts_offset;
+        if(av_packet.stream_index != video_stream_index) {
+            auto audio_stream = stream_index_to_audio_stream_map[av_packet.stream_index];
+            stream = audio_stream.first;
+            codec_context = audio_stream.second;
+            pts_offset = av_rescale_q(job.video_pts_offset, video_codec_context->time_base, codec_context->time_base);
         }
 
-        save_replay_packets.resize(frame_data_queue.size());
-        for(size_t i = 0; i < frame_data_queue.size(); ++i) {
-            av_packet_ref(&save_replay_packets[i], &frame_data_queue[i]);
+        // Audio that is presented before the first video frame is cut, so all streams start at the same time
+        if(av_packet.pts < pts_offset) {
+            av_packet_unref(&av_packet);
+            continue;
         }
+
+        av_packet.pts -= pts_offset;
+        av_packet.dts -= pts_offset;
+
+        av_packet.stream_index = stream->index;
+        av_packet_rescale_ts(&av_packet, codec_context->time_base, stream->time_base);
+
+        int ret = av_interleaved_write_frame(av_format_context, &av_packet);
+        if(ret < 0)
+            fprintf(stderr, "Error: Failed to write frame index %d to muxer, reason: %s (%d)\n", stream->index, av_error_to_string(ret), ret);
+        av_packet_unref(&av_packet);
     }
 
-    save_replay_output_filepath = output_dir + "/Replay_" + get_date_str() + "." + file_extension;
-    save_replay_thread = std::async(std::launch::async, [video_stream_index, container_format, start_index, video_pts_offset, audio_pts_offset, video_codec_context, &audio_tracks]() mutable {
-        AVFormatContext *av_format_context;
-        avformat_alloc_output_context2(&av_format_context, nullptr, container_format, nullptr);
+    if (av_write_trailer(av_format_context) != 0)
+        fprintf(stderr, "Failed to write trailer\n");
 
-        av_format_context->flags |= AVFMT_FLAG_GENPTS;
-        av_format_context->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    avio_close(av_format_context->pb);
+    avformat_free_context(av_format_context);
+    av_dict_free(&options);
 
-        AVStream *video_stream = create_stream(av_format_context, video_codec_context);
-        avcodec_parameters_from_context(video_stream->codecpar, video_codec_context);
+    std::lock_guard<std::mutex> lock(save_replay_mutex);
+    saved_replay_filepaths.push_back(job.output_filepath);
+}
 
-        std::unordered_map<int, AudioTrack*> stream_index_to_audio_track_map;
-        for(AudioTrack &audio_track : audio_tracks) {
-            stream_index_to_audio_track_map[audio_track.stream_index] = &audio_track;
-            AVStream *audio_stream = create_stream(av_format_context, audio_track.codec_context);
-            avcodec_parameters_from_context(audio_stream->codecpar, audio_track.codec_context);
-            audio_track.stream = audio_stream;
+static bool write_all(int fd, const uint8_t *data, size_t size) {
+    while(size > 0) {
+        const ssize_t bytes_written = write(fd, data, size);
+        if(bytes_written == -1) {
+            if(errno == EINTR)
+                continue;
+            return false;
         }
+        data += bytes_written;
+        size -= bytes_written;
+    }
+    return true;
+}
 
-        int ret = avio_open(&av_format_context->pb, save_replay_output_filepath.c_str(), AVIO_FLAG_WRITE);
-        if (ret < 0) {
-            fprintf(stderr, "Error: Could not open '%s': %s. Make sure %s is an existing directory with write access\n", save_replay_output_filepath.c_str(), av_error_to_string(ret), save_replay_output_filepath.c_str());
-            return;
+// Fragments that are in the replay buffer file are copied by the kernel, without going through user space
+static bool write_replay_fragment(int output_fd, const gsr_replay_packet &fragment) {
+    size_t offset = 0;
+    if(fragment.fd != -1) {
+        loff_t file_offset = fragment.fd_offset;
+        while(offset < fragment.size) {
+            const ssize_t bytes_copied = copy_file_range(fragment.fd, &file_offset, output_fd, nullptr, fragment.size - offset, 0);
+            if(bytes_copied <= 0)
+                break; // For example when the files are on different file systems on older kernels, the rest is written normally
+            offset += bytes_copied;
         }
+    }
+    return write_all(output_fd, fragment.data + offset, fragment.size - offset);
+}
 
-        AVDictionary *options = nullptr;
-        av_dict_set(&options, "strict", "experimental", 0);
+// The replay is the init segment followed by the fragments, no remuxing is needed
+static void write_replay_fragments(SaveReplayJob &job) {
+    const int output_fd = open(job.output_filepath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(output_fd == -1) {
+        fprintf(stderr, "Error: Could not open '%s': %s. Make sure %s is an existing directory with write access\n", job.output_filepath.c_str(), strerror(errno), job.output_filepath.c_str());
+        return;
+    }
 
-        ret = avformat_write_header(av_format_context, &options);
-        if (ret < 0) {
-            fprintf(stderr, "Error occurred when writing header to output file: %s\n", av_error_to_string(ret));
-            return;
+    bool success = write_all(output_fd, job.replay_fragments->init_segment.data(), job.replay_fragments->init_segment.size());
+    gsr_replay_packet fragment;
+    while(success && gsr_replay_buffer_snapshot_next(&job.snapshot, &fragment)) {
+        success = write_replay_fragment(output_fd, fragment);
+    }
+    close(output_fd);
+
+    if(!success) {
+        fprintf(stderr, "Error: Failed to write replay to '%s': %s\n", job.output_filepath.c_str(), strerror(errno));
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(save_replay_mutex);
+    saved_replay_filepaths.push_back(job.output_filepath);
+}
+
+// Runs until |stop_save_replay_threads| is called and all queued jobs are done
+static void save_replay_thread_func(AVCodecContext *video_codec_context, int video_stream_index, const std::vector<AudioTrack> &audio_tracks, const char *container_format) {
+    for(;;) {
+        SaveReplayJob job;
+        {
+            std::unique_lock<std::mutex> lock(save_replay_mutex);
+            save_replay_cv.wait(lock, []{ return !save_replay_jobs.empty() || !save_replay_threads_running; });
+            if(save_replay_jobs.empty())
+                return;
+
+            job = std::move(save_replay_jobs.front());
+            save_replay_jobs.pop_front();
         }
 
-        for(size_t i = start_index; i < save_replay_packets.size(); ++i) {
-            AVPacket &av_packet = save_replay_packets[i];
+        if(job.replay_fragments)
+            write_replay_fragments(job);
+        else
+            write_replay(job, video_codec_context, video_stream_index, audio_tracks, container_format);
+        gsr_replay_buffer_snapshot_destroy(&job.snapshot);
+    }
+}
+
+static void start_save_replay_threads(AVCodecContext *video_codec_context, int video_stream_index, const std::vector<AudioTrack> &audio_tracks, const char *container_format) {
+    for(int i = 0; i < NUM_SAVE_REPLAY_THREADS; ++i) {
+        save_replay_threads.push_back(std::thread(save_replay_thread_func, video_codec_context, video_stream_index, std::cref(audio_tracks), container_format));
+    }
+}
 
-            AVStream *stream = video_stream;
-            AVCodecContext *codec_context = video_codec_context;
+static void stop_save_replay_threads() {
+    {
+        std::lock_guard<std::mutex> lock(save_replay_mutex);
+        save_replay_threads_running = false;
+    }
+    save_replay_cv.notify_all();
 
-            if(av_packet.stream_index == video_stream_index) {
-                av_packet.pts -= video_pts_offset;
-                av_packet.dts -= video_pts_offset;
-            } else {
-                AudioTrack *audio_track = stream_index_to_audio_track_map[av_packet.stream_index];
-                stream = audio_track->stream;
-                codec_context = audio_track->codec_context;
+    for(std::thread &thread : save_replay_threads) {
+        thread.join();
+    }
+    save_replay_threads.clear();
+}
 
-                av_packet.pts -= audio_pts_offset;
-                av_packet.dts -= audio_pts_offset;
-            }
+// Prints the path of the replays that have been saved since the last call, so the order matches the order saves finish in
+static void print_saved_replays() {
+    std::vector<std::string> filepaths;
+    {
+        std::lock_guard<std::mutex> lock(save_replay_mutex);
+        filepaths.swap(saved_replay_filepaths);
+    }
 
-            av_packet.stream_index = stream->index;
-            av_packet_rescale_ts(&av_packet, codec_context->time_base, stream->time_base);
+    for(const std::string &filepath : filepaths) {
+        puts(filepath.c_str());
+    }
+    fflush(stdout);
+}
 
-            int ret = av_interleaved_write_frame(av_format_context, &av_packet);
-            if(ret < 0)
-                fprintf(stderr, "Error: Failed to write frame index %d to muxer, reason: %s (%d)\n", stream->index, av_error_to_string(ret), ret);
-        }
+// Replays that are saved within the same second get a number at the end, so they don't overwrite each other
+static std::string get_replay_filepath(const std::string &output_dir, const std::string &file_extension) {
+    static std::string prev_date_str;
+    static int num_replays_same_date = 0;
+
+    const std::string date_str = get_date_str();
+    std::string filepath = output_dir + "/Replay_" + date_str;
+    if(date_str == prev_date_str) {
+        ++num_replays_same_date;
+        filepath += "_" + std::to_string(num_replays_same_date + 1);
+    } else {
+        num_replays_same_date = 0;
+    }
+    prev_date_str = date_str;
+    return filepath + "." + file_extension;
+}
 
-        if (av_write_trailer(av_format_context) != 0)
-            fprintf(stderr, "Failed to write trailer\n");
+// Saves the packets from |duration_secs| before the end (starting at the keyframe before that) to |end_offset_secs| before now.
+// The whole replay buffer is saved if |duration_secs| is 0. |recording_time_secs| is how long the recording has been running, the packet timestamps are relative to the start of the recording
+static void save_replay_async(gsr_replay_buffer *replay_buffer, const ReplayFragments *replay_fragments, double recording_time_secs, double duration_secs, double end_offset_secs, const std::string &output_dir, const std::string &file_extension, std::mutex &write_output_mutex) {
+    SaveReplayJob job;
+    const double end_timestamp = end_offset_secs > 0.0 ? recording_time_secs - end_offset_secs : INFINITY;
 
-        avio_close(av_format_context->pb);
-        avformat_free_context(av_format_context);
-        av_dict_free(&options);
+    {
+        std::lock_guard<std::mutex> lock(write_output_mutex);
+        gsr_replay_packet replay_packet;
+        gsr_replay_buffer_iterator start_it;
+        bool found_keyframe = false;
+        if(duration_secs > 0.0)
+            found_keyframe = gsr_replay_buffer_find_keyframe_before(replay_buffer, std::min(recording_time_secs, end_timestamp) - duration_secs, &start_it);
+        else
+            found_keyframe = gsr_replay_buffer_find_first_keyframe(replay_buffer, &start_it);
+
+        if(!found_keyframe)
+            return;
 
-        for(AudioTrack &audio_track : audio_tracks) {
-            audio_track.stream = nullptr;
+        // The replay always starts with a keyframe. The audio offset is derived from its pts when the replay is written, so no audio packet has to be searched for
+        gsr_replay_buffer_iterator it = start_it;
+        gsr_replay_buffer_next(replay_buffer, &it, &replay_packet);
+        job.video_pts_offset = replay_packet.pts;
+
+        if(replay_packet.timestamp > end_timestamp) {
+            fprintf(stderr, "Error: failed to save replay, the replay buffer doesn't have any video that ends %f seconds ago\n", end_offset_secs);
+            return;
         }
-    });
+
+        // The packets are read from the snapshot in a save thread without holding the lock, so this doesn't block the recording
+        if(!gsr_replay_buffer_snapshot_create(replay_buffer, &start_it, end_timestamp, &job.snapshot)) {
+            fprintf(stderr, "Error: failed to save replay, %d replays are already being saved\n", GSR_REPLAY_BUFFER_MAX_SNAPSHOTS);
+            return;
+        }
+    }
+
+    job.output_filepath = get_replay_filepath(output_dir, file_extension);
+    job.replay_fragments = replay_fragments;
+    {
+        std::lock_guard<std::mutex> lock(save_replay_mutex);
+        save_replay_jobs.push_back(std::move(job));
+    }
+    save_replay_cv.notify_one();
 }
 
 static void split_string(const std::string &str, char delimiter, std::function<bool(const char*,size_t)> callback) {
@@ -854,6 +3011,8 @@ static bool is_livestream_path(const char *str) {
         return true;
     else if((len >= 7 && memcmp(str, "rtmp://", 7) == 0) || (len >= 8 && memcmp(str, "rtmps://", 8) == 0))
         return true;
+    else if((len >= 6 && memcmp(str, "tcp://", 6) == 0) || (len >= 6 && memcmp(str, "srt://", 6) == 0))
+        return true;
     else
         return false;
 }
@@ -905,113 +3064,14 @@ static bool gl_get_gpu_info(Display *dpy, gpu_info *info) {
 }
 
 // TODO: Proper cleanup
-static int init_filter_graph(AVCodecContext *audio_codec_context, AVFilterGraph **graph, AVFilterContext **sink, std::vector<AVFilterContext*> &src_filter_ctx, size_t num_sources)
-{
-    char ch_layout[64];
-    int err = 0;
- 
-    AVFilterGraph *filter_graph = avfilter_graph_alloc();
-    if (!filter_graph) {
-        fprintf(stderr, "Unable to create filter graph.\n");
-        return AVERROR(ENOMEM);
-    }
- 
-    for(size_t i = 0; i < num_sources; ++i) {
-        const AVFilter *abuffer = avfilter_get_by_name("abuffer");
-        if (!abuffer) {
-            fprintf(stderr, "Could not find the abuffer filter.\n");
-            return AVERROR_FILTER_NOT_FOUND;
-        }
-    
-        AVFilterContext *abuffer_ctx = avfilter_graph_alloc_filter(filter_graph, abuffer, NULL);
-        if (!abuffer_ctx) {
-            fprintf(stderr, "Could not allocate the abuffer instance.\n");
-            return AVERROR(ENOMEM);
-        }
-    
-        #if LIBAVCODEC_VERSION_MAJOR < 60
-        av_get_channel_layout_string(ch_layout, sizeof(ch_layout), 0, AV_CH_LAYOUT_STEREO);
-        #else
-        av_channel_layout_describe(&audio_codec_context->ch_layout, ch_layout, sizeof(ch_layout));
-        #endif
-        av_opt_set    (abuffer_ctx, "channel_layout", ch_layout,                            AV_OPT_SEARCH_CHILDREN);
-        av_opt_set    (abuffer_ctx, "sample_fmt",     av_get_sample_fmt_name(audio_codec_context->sample_fmt), AV_OPT_SEARCH_CHILDREN);
-        av_opt_set_q  (abuffer_ctx, "time_base",      { 1, audio_codec_context->sample_rate },  AV_OPT_SEARCH_CHILDREN);
-        av_opt_set_int(abuffer_ctx, "sample_rate",    audio_codec_context->sample_rate,                     AV_OPT_SEARCH_CHILDREN);
-    
-        err = avfilter_init_str(abuffer_ctx, NULL);
-        if (err < 0) {
-            fprintf(stderr, "Could not initialize the abuffer filter.\n");
-            return err;
-        }
-
-        src_filter_ctx.push_back(abuffer_ctx);
-    }
-
-    const AVFilter *mix_filter = avfilter_get_by_name("amix");
-    if (!mix_filter) {
-        av_log(NULL, AV_LOG_ERROR, "Could not find the mix filter.\n");
-        return AVERROR_FILTER_NOT_FOUND;
-    }
-    
-    char args[512];
-    snprintf(args, sizeof(args), "inputs=%d", (int)num_sources);
-	
-    AVFilterContext *mix_ctx;
-	err = avfilter_graph_create_filter(&mix_ctx, mix_filter, "amix",
-                                       args, NULL, filter_graph);
-
-    if (err < 0) {
-        av_log(NULL, AV_LOG_ERROR, "Cannot create audio amix filter\n");
-        return err;
-    }
- 
-    const AVFilter *abuffersink = avfilter_get_by_name("abuffersink");
-    if (!abuffersink) {
-        fprintf(stderr, "Could not find the abuffersink filter.\n");
-        return AVERROR_FILTER_NOT_FOUND;
-    }
- 
-    AVFilterContext *abuffersink_ctx = avfilter_graph_alloc_filter(filter_graph, abuffersink, "sink");
-    if (!abuffersink_ctx) {
-        fprintf(stderr, "Could not allocate the abuffersink instance.\n");
-        return AVERROR(ENOMEM);
-    }
- 
-    err = avfilter_init_str(abuffersink_ctx, NULL);
-    if (err < 0) {
-        fprintf(stderr, "Could not initialize the abuffersink instance.\n");
-        return err;
-    }
- 
-    err = 0;
-    for(size_t i = 0; i < src_filter_ctx.size(); ++i) {
-        AVFilterContext *src_ctx = src_filter_ctx[i];
-        if (err >= 0)
-            err = avfilter_link(src_ctx, 0, mix_ctx, i);
-    }
-    if (err >= 0)
-        err = avfilter_link(mix_ctx, 0, abuffersink_ctx, 0);
-    if (err < 0) {
-        av_log(NULL, AV_LOG_ERROR, "Error connecting filters\n");
-        return err;
-    }
- 
-    err = avfilter_graph_config(filter_graph, NULL);
-    if (err < 0) {
-        av_log(NULL, AV_LOG_ERROR, "Error configuring the filter graph\n");
-        return err;
-    }
- 
-    *graph = filter_graph;
-    *sink  = abuffersink_ctx;
- 
-    return 0;
-}
-
 int main(int argc, char **argv) {
     signal(SIGINT, int_handler);
-    signal(SIGUSR1, save_replay_handler);
+    struct sigaction save_replay_action;
+    memset(&save_replay_action, 0, sizeof(save_replay_action));
+    save_replay_action.sa_sigaction = save_replay_handler;
+    save_replay_action.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&save_replay_action.sa_mask);
+    sigaction(SIGUSR1, &save_replay_action, nullptr);
 
     //av_log_set_level(AV_LOG_TRACE);
 
@@ -1024,8 +3084,28 @@ int main(int argc, char **argv) {
         { "-s", Arg { {}, true, false } },
         { "-a", Arg { {}, true, true } },
         { "-q", Arg { {}, true, false } },
-        { "-o", Arg { {}, true, false } },
+        { "-o", Arg { {}, true, true } },
         { "-r", Arg { {}, true, false } },
+        { "-rm", Arg { {}, true, false } },
+        { "-rl", Arg { {}, true, false } },
+        { "-rd", Arg { {}, true, false } },
+        { "-rds", Arg { {}, true, false } },
+        { "-rf", Arg { {}, true, false } },
+        { "-rs", Arg { {}, true, false } },
+        { "-sg", Arg { {}, true, false } },
+        { "-sgs", Arg { {}, true, false } },
+        { "-sga", Arg { {}, true, false } },
+        { "-wq", Arg { {}, true, false } },
+        { "-fm", Arg { {}, true, false } },
+        { "-fmk", Arg { {}, true, false } },
+        { "-fg", Arg { {}, true, false } },
+        { "-v", Arg { {}, true, false } },
+        { "-b", Arg { {}, true, false } },
+        { "-bm", Arg { {}, true, false } },
+        { "-ba", Arg { {}, true, false } },
+        { "-so", Arg { {}, true, true } },
+        { "-ss", Arg { {}, true, false } },
+        { "-sb", Arg { {}, true, false } },
         { "-k", Arg { {}, true, false } },
         { "-ac", Arg { {}, true, false } }
     };
@@ -1154,17 +3234,262 @@ int main(int argc, char **argv) {
         usage();
     }
 
+    const char *replay_buffer_disk_filepath = args["-rd"].value();
+
+    // Long replays are only allowed with the disk ring, otherwise they would use too much memory
+    const int max_replay_buffer_size_secs = replay_buffer_disk_filepath ? 3600 : 1200;
     int replay_buffer_size_secs = -1;
     const char *replay_buffer_size_secs_str = args["-r"].value();
     if(replay_buffer_size_secs_str) {
         replay_buffer_size_secs = atoi(replay_buffer_size_secs_str);
-        if(replay_buffer_size_secs < 5 || replay_buffer_size_secs > 1200) {
-            fprintf(stderr, "Error: option -r has to be between 5 and 1200, was: %s\n", replay_buffer_size_secs_str);
+        if(replay_buffer_size_secs < 5 || replay_buffer_size_secs > max_replay_buffer_size_secs) {
+            fprintf(stderr, "Error: option -r has to be between 5 and %d, was: %s\n", max_replay_buffer_size_secs, replay_buffer_size_secs_str);
+            return 1;
+        }
+    }
+
+    if(replay_buffer_disk_filepath && replay_buffer_size_secs == -1) {
+        fprintf(stderr, "Error: option -rd can only be used together with -r\n");
+        usage();
+    }
+
+    int64_t replay_buffer_disk_mb = 0;
+    const char *replay_buffer_disk_size_str = args["-rds"].value();
+    if(replay_buffer_disk_size_str) {
+        if(!replay_buffer_disk_filepath) {
+            fprintf(stderr, "Error: option -rds can only be used together with -rd\n");
+            usage();
+        }
+
+        replay_buffer_disk_mb = atoll(replay_buffer_disk_size_str);
+        if(replay_buffer_disk_mb < 1) {
+            fprintf(stderr, "Error: option -rds has to be at least 1, was: %s\n", replay_buffer_disk_size_str);
+            return 1;
+        }
+    }
+
+    int64_t replay_buffer_memory_mb = 0;
+    const char *replay_buffer_memory_str = args["-rm"].value();
+    if(replay_buffer_memory_str) {
+        replay_buffer_memory_mb = atoll(replay_buffer_memory_str);
+        if(replay_buffer_memory_mb < 1) {
+            fprintf(stderr, "Error: option -rm has to be at least 1, was: %s\n", replay_buffer_memory_str);
+            return 1;
+        }
+    }
+
+    const char *replay_buffer_lock_str = args["-rl"].value();
+    if(!replay_buffer_lock_str)
+        replay_buffer_lock_str = "no";
+
+    gsr_replay_buffer_memory replay_buffer_memory = GSR_REPLAY_BUFFER_MEMORY_DEFAULT;
+    if(strcmp(replay_buffer_lock_str, "no") == 0) {
+        replay_buffer_memory = GSR_REPLAY_BUFFER_MEMORY_DEFAULT;
+    } else if(strcmp(replay_buffer_lock_str, "yes") == 0) {
+        replay_buffer_memory = GSR_REPLAY_BUFFER_MEMORY_LOCKED;
+    } else if(strcmp(replay_buffer_lock_str, "hugepages") == 0) {
+        replay_buffer_memory = GSR_REPLAY_BUFFER_MEMORY_HUGEPAGES;
+    } else {
+        fprintf(stderr, "Error: -rl should either be either 'no', 'yes' or 'hugepages', got: '%s'\n", replay_buffer_lock_str);
+        usage();
+    }
+
+    const char *replay_fragmented_str = args["-rf"].value();
+    if(!replay_fragmented_str)
+        replay_fragmented_str = "no";
+
+    bool replay_fragmented = false;
+    if(strcmp(replay_fragmented_str, "yes") == 0) {
+        replay_fragmented = true;
+    } else if(strcmp(replay_fragmented_str, "no") != 0) {
+        fprintf(stderr, "Error: -rf should either be either 'yes' or 'no', got: '%s'\n", replay_fragmented_str);
+        usage();
+    }
+
+    if(replay_fragmented && replay_buffer_size_secs == -1) {
+        fprintf(stderr, "Error: option -rf can only be used together with -r\n");
+        usage();
+    }
+
+    const char *replay_buffer_shm_name = args["-rs"].value();
+    if(replay_buffer_shm_name) {
+        if(replay_buffer_size_secs == -1) {
+            fprintf(stderr, "Error: option -rs can only be used together with -r\n");
+            usage();
+        }
+
+        if(replay_fragmented) {
+            fprintf(stderr, "Error: option -rs can't be used together with -rf\n");
+            usage();
+        }
+
+        if(replay_buffer_shm_name[0] != '/' || strchr(replay_buffer_shm_name + 1, '/')) {
+            fprintf(stderr, "Error: option -rs has to be a name that starts with / and has no other /, was: %s\n", replay_buffer_shm_name);
+            usage();
+        }
+    }
+
+    int segment_duration_secs = -1;
+    const char *segment_duration_secs_str = args["-sg"].value();
+    if(segment_duration_secs_str) {
+        segment_duration_secs = atoi(segment_duration_secs_str);
+        if(segment_duration_secs < 10) {
+            fprintf(stderr, "Error: option -sg has to be at least 10, was: %s\n", segment_duration_secs_str);
+            return 1;
+        }
+
+        if(replay_buffer_size_secs != -1) {
+            fprintf(stderr, "Error: option -sg can't be used together with -r\n");
+            usage();
+        }
+    }
+
+    int64_t segments_max_mb = 0;
+    const char *segments_max_mb_str = args["-sgs"].value();
+    if(segments_max_mb_str) {
+        segments_max_mb = atoll(segments_max_mb_str);
+        if(segments_max_mb < 1) {
+            fprintf(stderr, "Error: option -sgs has to be at least 1, was: %s\n", segments_max_mb_str);
+            return 1;
+        }
+    }
+
+    int64_t segments_max_age_mins = 0;
+    const char *segments_max_age_mins_str = args["-sga"].value();
+    if(segments_max_age_mins_str) {
+        segments_max_age_mins = atoll(segments_max_age_mins_str);
+        if(segments_max_age_mins < 1) {
+            fprintf(stderr, "Error: option -sga has to be at least 1, was: %s\n", segments_max_age_mins_str);
+            return 1;
+        }
+    }
+
+    if((segments_max_mb_str || segments_max_age_mins_str) && segment_duration_secs == -1) {
+        fprintf(stderr, "Error: options -sgs and -sga can only be used together with -sg\n");
+        usage();
+    }
+
+    const char *frame_mode_str = args["-fm"].value();
+    if(!frame_mode_str)
+        frame_mode_str = "cfr";
+
+    FrameMode frame_mode = FrameMode::CFR;
+    if(strcmp(frame_mode_str, "vfr") == 0) {
+        frame_mode = FrameMode::VFR;
+    } else if(strcmp(frame_mode_str, "cfr") != 0) {
+        fprintf(stderr, "Error: -fm should either be either 'cfr' or 'vfr', got: '%s'\n", frame_mode_str);
+        usage();
+    }
+
+    int frame_mode_keepalive_fps = 1;
+    const char *frame_mode_keepalive_fps_str = args["-fmk"].value();
+    if(frame_mode_keepalive_fps_str) {
+        frame_mode_keepalive_fps = atoi(frame_mode_keepalive_fps_str);
+        if(frame_mode_keepalive_fps < 1) {
+            fprintf(stderr, "Error: option -fmk has to be at least 1, was: %s\n", frame_mode_keepalive_fps_str);
+            return 1;
+        }
+
+        if(frame_mode != FrameMode::VFR) {
+            fprintf(stderr, "Error: option -fmk can only be used together with -fm vfr\n");
+            usage();
+        }
+    }
+
+    // The default depends on whether there is a live stream output, see below
+    const char *frame_rate_governor_str = args["-fg"].value();
+    bool frame_rate_governor_enabled = false;
+    if(frame_rate_governor_str) {
+        if(strcmp(frame_rate_governor_str, "yes") == 0) {
+            frame_rate_governor_enabled = true;
+        } else if(strcmp(frame_rate_governor_str, "no") != 0) {
+            fprintf(stderr, "Error: -fg should either be either 'yes' or 'no', got: '%s'\n", frame_rate_governor_str);
+            usage();
+        }
+    }
+
+    const char *verbose_str = args["-v"].value();
+    if(!verbose_str)
+        verbose_str = "no";
+
+    bool verbose = false;
+    if(strcmp(verbose_str, "yes") == 0) {
+        verbose = true;
+    } else if(strcmp(verbose_str, "no") != 0) {
+        fprintf(stderr, "Error: -v should either be either 'yes' or 'no', got: '%s'\n", verbose_str);
+        usage();
+    }
+
+    int64_t video_bitrate = 0;
+    const char *video_bitrate_str = args["-b"].value();
+    if(video_bitrate_str) {
+        video_bitrate = (int64_t)atoi(video_bitrate_str) * 1000;
+        if(video_bitrate < 100000) {
+            fprintf(stderr, "Error: option -b has to be at least 100, was: %s\n", video_bitrate_str);
+            return 1;
+        }
+    }
+
+    const std::vector<const char*> &simulcast_output_filepaths = args["-so"].values;
+    vec2i simulcast_size = { 0, 0 };
+    const char *simulcast_size_str = args["-ss"].value();
+    if(!simulcast_output_filepaths.empty()) {
+        if(!simulcast_size_str) {
+            fprintf(stderr, "Error: option -ss is required when using option -so\n");
+            usage();
+        }
+
+        if(sscanf(simulcast_size_str, "%dx%d", &simulcast_size.x, &simulcast_size.y) != 2) {
+            fprintf(stderr, "Error: invalid value for option -ss '%s', expected a value in format WxH\n", simulcast_size_str);
+            usage();
+        }
+
+        // Encoders require an even size
+        if(simulcast_size.x <= 0 || simulcast_size.y <= 0 || simulcast_size.x % 2 != 0 || simulcast_size.y % 2 != 0) {
+            fprintf(stderr, "Error: invalid value for option -ss '%s', expected width and height to be even and greater than 0\n", simulcast_size_str);
+            usage();
+        }
+    } else if(simulcast_size_str || args["-sb"].value()) {
+        fprintf(stderr, "Error: options -ss and -sb can only be used together with -so\n");
+        usage();
+    }
+
+    int64_t simulcast_bitrate = 0;
+    const char *simulcast_bitrate_str = args["-sb"].value();
+    if(simulcast_bitrate_str) {
+        simulcast_bitrate = (int64_t)atoi(simulcast_bitrate_str) * 1000;
+        if(simulcast_bitrate < 100000) {
+            fprintf(stderr, "Error: option -sb has to be at least 100, was: %s\n", simulcast_bitrate_str);
             return 1;
         }
-        replay_buffer_size_secs += 5; // Add a few seconds to account of lost packets because of non-keyframe packets skipped
     }
 
+    const char *bitrate_mode_str = args["-bm"].value();
+    const char *adaptive_bitrate_str = args["-ba"].value();
+
+    // Live streams drop by default, so that a slow upload doesn't delay the other outputs
+    const char *write_queue_policy_str = args["-wq"].value();
+    const bool write_queue_policy_is_default = !write_queue_policy_str;
+    if(!write_queue_policy_str)
+        write_queue_policy_str = "block";
+
+    WriteQueuePolicy write_queue_policy = WriteQueuePolicy::BLOCK;
+    if(strcmp(write_queue_policy_str, "drop") == 0) {
+        write_queue_policy = WriteQueuePolicy::DROP;
+    } else if(strcmp(write_queue_policy_str, "block") != 0) {
+        fprintf(stderr, "Error: -wq should either be either 'block' or 'drop', got: '%s'\n", write_queue_policy_str);
+        usage();
+    }
+
+    auto get_write_queue_policy = [&](const char *output_filepath) {
+        if(write_queue_policy_is_default && is_livestream_path(output_filepath))
+            return WriteQueuePolicy::DROP;
+        return write_queue_policy;
+    };
+
+    // In replay mode and segmented mode the output is a directory and the files are created later
+    const bool write_to_output_file = replay_buffer_size_secs == -1 && segment_duration_secs == -1;
+
     Display *dpy = XOpenDisplay(nullptr);
     if (!dpy) {
         fprintf(stderr, "Error: Failed to open display\n");
@@ -1334,9 +3659,9 @@ int main(int argc, char **argv) {
 
     const char *filename = args["-o"].value();
     if(filename) {
-        if(replay_buffer_size_secs != -1) {
+        if(!write_to_output_file) {
             if(!container_format) {
-                fprintf(stderr, "Error: option -c is required when using option -r\n");
+                fprintf(stderr, "Error: option -c is required when using option %s\n", replay_buffer_size_secs != -1 ? "-r" : "-sg");
                 usage();
             }
 
@@ -1347,10 +3672,10 @@ int main(int argc, char **argv) {
             }
         }
     } else {
-        if(replay_buffer_size_secs == -1) {
+        if(write_to_output_file) {
             filename = "/dev/stdout";
         } else {
-            fprintf(stderr, "Error: Option -o is required when using option -r\n");
+            fprintf(stderr, "Error: Option -o is required when using option %s\n", replay_buffer_size_secs != -1 ? "-r" : "-sg");
             usage();
         }
 
@@ -1360,6 +3685,10 @@ int main(int argc, char **argv) {
         }
     }
 
+    std::vector<const char*> extra_output_filepaths;
+    if(args["-o"].values.size() > 1)
+        extra_output_filepaths.assign(args["-o"].values.begin() + 1, args["-o"].values.end());
+
     AVFormatContext *av_format_context;
     // The output format is automatically guessed by the file extension
     avformat_alloc_output_context2(&av_format_context, nullptr, container_format, filename);
@@ -1369,6 +3698,15 @@ int main(int argc, char **argv) {
     }
 
     av_format_context->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+
+    const bool container_supports_fragments = strcmp(av_format_context->oformat->name, "mp4") == 0 || strcmp(av_format_context->oformat->name, "mov") == 0 || strcmp(av_format_context->oformat->name, "matroska") == 0;
+    if(replay_fragmented && !container_supports_fragments) {
+        fprintf(stderr, "Error: option -rf is only supported with the mp4, mov and mkv containers, got: %s\n", av_format_context->oformat->name);
+        return 1;
+    }
+
+    // In fragmented replay mode the packets are muxed while recording, so the output streams are needed just like when recording to a file
+    const bool mux_while_recording = replay_buffer_size_secs == -1 || replay_fragmented;
     av_format_context->flags |= AVFMT_FLAG_GENPTS;
     const AVOutputFormat *output_format = av_format_context->oformat;
 
@@ -1446,7 +3784,24 @@ int main(int argc, char **argv) {
         exit(2);
     }
 
-    const bool is_livestream = is_livestream_path(filename);
+    bool main_is_livestream = is_livestream_path(filename);
+    for(const char *extra_output_filepath : extra_output_filepaths) {
+        if(is_livestream_path(extra_output_filepath))
+            main_is_livestream = true;
+    }
+
+    bool simulcast_is_livestream = false;
+    for(const char *simulcast_output_filepath : simulcast_output_filepaths) {
+        if(is_livestream_path(simulcast_output_filepath))
+            simulcast_is_livestream = true;
+    }
+
+    const bool is_livestream = main_is_livestream || simulcast_is_livestream;
+
+    // A live stream is better off with a lower steady framerate than with stutter, but recordings keep the framerate they were asked for unless -fg is set
+    if(!frame_rate_governor_str)
+        frame_rate_governor_enabled = is_livestream;
+
     // (Some?) livestreaming services require at least one audio track to work.
     // If not audio is provided then create one silent audio track.
     if(is_livestream && requested_audio_inputs.empty()) {
@@ -1456,11 +3811,63 @@ int main(int argc, char **argv) {
         requested_audio_inputs.push_back(std::move(mai));
     }
 
+    if(main_is_livestream && video_bitrate == 0)
+        video_bitrate = LIVESTREAM_DEFAULT_BITRATE;
+    if(simulcast_is_livestream && simulcast_bitrate == 0)
+        simulcast_bitrate = LIVESTREAM_DEFAULT_BITRATE;
+
+    BitrateMode requested_bitrate_mode = BitrateMode::CBR;
+    if(bitrate_mode_str) {
+        if(strcmp(bitrate_mode_str, "cbr") == 0) {
+            requested_bitrate_mode = BitrateMode::CBR;
+        } else if(strcmp(bitrate_mode_str, "vbr") == 0) {
+            requested_bitrate_mode = BitrateMode::VBR;
+        } else {
+            fprintf(stderr, "Error: -bm should either be either 'cbr' or 'vbr', got: '%s'\n", bitrate_mode_str);
+            usage();
+        }
+
+        if(video_bitrate == 0 && simulcast_bitrate == 0) {
+            fprintf(stderr, "Error: option -bm can only be used together with -b, -sb or when live streaming\n");
+            usage();
+        }
+    }
+
+    const BitrateMode bitrate_mode = video_bitrate > 0 ? requested_bitrate_mode : BitrateMode::CONSTANT_QP;
+    const BitrateMode simulcast_bitrate_mode = simulcast_bitrate > 0 ? requested_bitrate_mode : BitrateMode::CONSTANT_QP;
+
+    // The adaptive bitrate follows the first live stream output, which is either an output of the main encode or of the simulcast
+    const bool bitrate_controller_simulcast = !main_is_livestream && simulcast_is_livestream;
+    BitrateController bitrate_controller;
+    bitrate_controller.mode = bitrate_controller_simulcast ? simulcast_bitrate_mode : bitrate_mode;
+    bitrate_controller.max_bitrate = bitrate_controller_simulcast ? simulcast_bitrate : video_bitrate;
+    bitrate_controller.bitrate = bitrate_controller.max_bitrate;
+    if(adaptive_bitrate_str) {
+        if(strcmp(adaptive_bitrate_str, "yes") == 0) {
+            bitrate_controller.enabled = true;
+        } else if(strcmp(adaptive_bitrate_str, "no") != 0) {
+            fprintf(stderr, "Error: -ba should either be either 'yes' or 'no', got: '%s'\n", adaptive_bitrate_str);
+            usage();
+        }
+
+        if(bitrate_controller.enabled && bitrate_controller.mode == BitrateMode::CONSTANT_QP) {
+            fprintf(stderr, "Error: option -ba can only be used together with -b or when live streaming\n");
+            usage();
+        }
+    } else {
+        bitrate_controller.enabled = is_livestream;
+    }
+
+    if(bitrate_controller.enabled && gpu_inf.vendor != GPU_VENDOR_NVIDIA) {
+        fprintf(stderr, "Warning: adaptive bitrate (-ba) is only supported on nvidia, the bitrate will not change while recording\n");
+        bitrate_controller.enabled = false;
+    }
+
     AVStream *video_stream = nullptr;
     std::vector<AudioTrack> audio_tracks;
 
-    AVCodecContext *video_codec_context = create_video_codec_context(gpu_inf.vendor == GPU_VENDOR_NVIDIA ? AV_PIX_FMT_CUDA : AV_PIX_FMT_VAAPI, quality, fps, video_codec_f, is_livestream);
-    if(replay_buffer_size_secs == -1)
+    AVCodecContext *video_codec_context = create_video_codec_context(gpu_inf.vendor == GPU_VENDOR_NVIDIA ? AV_PIX_FMT_CUDA : AV_PIX_FMT_VAAPI, quality, fps, video_codec_f, main_is_livestream);
+    if(mux_while_recording)
         video_stream = create_stream(av_format_context, video_codec_context);
 
     if(gsr_capture_start(capture, video_codec_context) != 0) {
@@ -1468,54 +3875,46 @@ int main(int argc, char **argv) {
         return 1;
     }
 
-    open_video(video_codec_context, quality, very_old_gpu);
+    open_video(video_codec_context, quality, very_old_gpu, bitrate_mode, video_bitrate);
     if(video_stream)
         avcodec_parameters_from_context(video_stream->codecpar, video_codec_context);
 
+    Simulcast simulcast;
+    if(!simulcast_output_filepaths.empty()) {
+        if(!simulcast_init(simulcast, video_codec_context, gpu_inf.vendor, simulcast_size, quality, fps, simulcast_is_livestream, very_old_gpu, simulcast_bitrate_mode, simulcast_bitrate))
+            return 1;
+    }
+
     int audio_stream_index = VIDEO_STREAM_INDEX + 1;
     for(const MergedAudioInputs &merged_audio_inputs : requested_audio_inputs) {
         AVCodecContext *audio_codec_context = create_audio_codec_context(fps, audio_codec);
 
         AVStream *audio_stream = nullptr;
-        if(replay_buffer_size_secs == -1)
+        if(mux_while_recording)
             audio_stream = create_stream(av_format_context, audio_codec_context);
 
         AVFrame *audio_frame = open_audio(audio_codec_context);
         if(audio_stream)
             avcodec_parameters_from_context(audio_stream->codecpar, audio_codec_context);
 
-        #if LIBAVCODEC_VERSION_MAJOR < 60
-        const int num_channels = audio_codec_context->channels;
-        #else
-        const int num_channels = audio_codec_context->ch_layout.nb_channels;
-        #endif
+        const int num_channels = audio_codec_context_get_num_channels(audio_codec_context);
 
         //audio_frame->sample_rate = audio_codec_context->sample_rate;
 
-        std::vector<AVFilterContext*> src_filter_ctx;
-        AVFilterGraph *graph = nullptr;
-        AVFilterContext *sink = nullptr;
-        bool use_amix = merged_audio_inputs.audio_inputs.size() > 1;
-        if(use_amix) {
-            int err = init_filter_graph(audio_codec_context, &graph, &sink, src_filter_ctx, merged_audio_inputs.audio_inputs.size());
-            if(err < 0) {
-                fprintf(stderr, "Error: failed to create audio filter\n");
-                exit(1);
-            }
+        const size_t num_audio_inputs = merged_audio_inputs.audio_inputs.size();
+        if(num_audio_inputs > GSR_AUDIO_MIXER_MAX_INPUTS) {
+            fprintf(stderr, "Error: at most %d audio devices can be merged into one audio track, got %d\n", GSR_AUDIO_MIXER_MAX_INPUTS, (int)num_audio_inputs);
+            exit(1);
         }
 
-        // TODO: Cleanup above
-
         std::vector<AudioDevice> audio_devices;
-        for(size_t i = 0; i < merged_audio_inputs.audio_inputs.size(); ++i) {
+        for(size_t i = 0; i < num_audio_inputs; ++i) {
             auto &audio_input = merged_audio_inputs.audio_inputs[i];
-            AVFilterContext *src_ctx = nullptr;
-            if(use_amix)
-                src_ctx = src_filter_ctx[i];
 
             AudioDevice audio_device;
             audio_device.audio_input = audio_input;
-            audio_device.src_filter_ctx = src_ctx;
+            // Each merged device is mixed at 1/n volume, the same as the amix filter of ffmpeg, so the sum of loud devices doesn't clip
+            audio_device.gain = 1.0f / (float)num_audio_inputs;
 
             if(audio_input.name.empty()) {
                 audio_device.sound_device.handle = NULL;
@@ -1535,8 +3934,6 @@ int main(int argc, char **argv) {
         audio_track.frame = audio_frame;
         audio_track.stream = audio_stream;
         audio_track.audio_devices = std::move(audio_devices);
-        audio_track.graph = graph;
-        audio_track.sink = sink;
         audio_track.pts = 0;
         audio_track.stream_index = audio_stream_index;
         audio_tracks.push_back(std::move(audio_track));
@@ -1545,7 +3942,7 @@ int main(int argc, char **argv) {
 
     //av_dump_format(av_format_context, 0, filename, 1);
 
-    if (replay_buffer_size_secs == -1 && !(output_format->flags & AVFMT_NOFILE)) {
+    if (write_to_output_file && !(output_format->flags & AVFMT_NOFILE)) {
         int ret = avio_open(&av_format_context->pb, filename, AVIO_FLAG_WRITE);
         if (ret < 0) {
             fprintf(stderr, "Error: Could not open '%s': %s\n", filename, av_error_to_string(ret));
@@ -1553,7 +3950,7 @@ int main(int argc, char **argv) {
         }
     }
 
-    if(replay_buffer_size_secs == -1) {
+    if(write_to_output_file) {
         AVDictionary *options = nullptr;
         av_dict_set(&options, "strict", "experimental", 0);
 
@@ -1566,10 +3963,23 @@ int main(int argc, char **argv) {
         av_dict_free(&options);
     }
 
-    const double start_time_pts = clock_get_monotonic_seconds();
+    Segments segments_storage;
+    Segments *segments = nullptr;
+    if(segment_duration_secs != -1) {
+        segments_storage.template_format_context = av_format_context;
+        segments_storage.output_dir = filename;
+        segments_storage.file_extension = file_extension;
+        segments_storage.segment_duration_secs = segment_duration_secs;
+        segments_storage.max_total_bytes = segments_max_mb * 1024 * 1024;
+        segments_storage.max_age_secs = segments_max_age_mins * 60.0;
+        if(!segments_init(segments_storage))
+            return 1;
+        segments = &segments_storage;
+    }
+
+    double start_time_pts = clock_get_monotonic_seconds();
 
     double start_time = clock_get_monotonic_seconds();
-    double frame_timer_start = start_time;
     int fps_counter = 0;
 
     AVFrame *frame = av_frame_alloc();
@@ -1583,11 +3993,135 @@ int main(int argc, char **argv) {
     frame->color_range = AVCOL_RANGE_JPEG;
 
     std::mutex write_output_mutex;
-    std::mutex audio_filter_mutex;
 
-    const double record_start_time = clock_get_monotonic_seconds();
-    std::deque<AVPacket> frame_data_queue;
-    bool frames_erased = false;
+    gsr_replay_buffer *replay_buffer = nullptr;
+    double resume_timestamp = 0.0;
+    ReplayFragments replay_fragments_storage;
+    ReplayFragments *replay_fragments = nullptr;
+    if(replay_buffer_size_secs != -1) {
+        // With the disk ring only the most recent part of the replay has to be in memory
+        const int replay_buffer_memory_secs = replay_buffer_disk_filepath ? std::min(replay_buffer_size_secs, 30) : replay_buffer_size_secs;
+
+        // The estimate is for the replay itself, the replay buffer keeps an eighth of |max_bytes| for packets that are recorded while a replay is saved
+        gsr_replay_buffer_params replay_buffer_params;
+        replay_buffer_params.max_bytes = replay_buffer_memory_mb > 0
+            ? (size_t)replay_buffer_memory_mb * 1024 * 1024
+            : estimate_replay_buffer_size_bytes(video_codec_context, quality, fps, audio_tracks.size(), replay_buffer_memory_secs) / 7 * 8;
+        replay_buffer_params.max_duration_secs = replay_buffer_size_secs;
+        replay_buffer_params.keyframe_stream_index = VIDEO_STREAM_INDEX;
+        replay_buffer_params.memory = replay_buffer_memory;
+        replay_buffer_params.disk_filepath = replay_buffer_disk_filepath;
+        replay_buffer_params.disk_max_bytes = 0;
+        replay_buffer_params.shm_name = replay_buffer_shm_name;
+        replay_buffer_params.stream_info = nullptr;
+        replay_buffer_params.stream_info_size = 0;
+
+        // Zero initialized because it's compared byte by byte to the stream info of the replay buffer in shared memory
+        ReplayStreamsInfo replay_streams_info;
+        memset(&replay_streams_info, 0, sizeof(replay_streams_info));
+        if(replay_buffer_shm_name) {
+            if(!replay_streams_info_add(replay_streams_info, video_codec_context))
+                return 1;
+            for(const AudioTrack &audio_track : audio_tracks) {
+                if(!replay_streams_info_add(replay_streams_info, audio_track.codec_context))
+                    return 1;
+            }
+            replay_buffer_params.stream_info = &replay_streams_info;
+            replay_buffer_params.stream_info_size = sizeof(replay_streams_info);
+        }
+
+        fprintf(stderr, "Info: replay buffer memory limit is %zu MB\n", replay_buffer_params.max_bytes / 1024 / 1024);
+        if(replay_buffer_disk_filepath) {
+            replay_buffer_params.disk_max_bytes = replay_buffer_disk_mb > 0
+                ? (size_t)replay_buffer_disk_mb * 1024 * 1024
+                : estimate_replay_buffer_size_bytes(video_codec_context, quality, fps, audio_tracks.size(), replay_buffer_size_secs);
+            fprintf(stderr, "Info: replay buffer disk limit is %zu MB (%s)\n", replay_buffer_params.disk_max_bytes / 1024 / 1024, replay_buffer_disk_filepath);
+        }
+
+        replay_buffer = gsr_replay_buffer_create(&replay_buffer_params);
+        if(!replay_buffer) {
+            fprintf(stderr, "Error: failed to create the replay buffer\n");
+            return 1;
+        }
+
+        // The replay buffer has the packets of a previous recording (that crashed or was restarted), so the timestamps continue from there.
+        // The time the recorder wasn't running becomes a pause in the replay
+        if(gsr_replay_buffer_get_resume_timestamp(replay_buffer, &resume_timestamp)) {
+            fprintf(stderr, "Info: continuing the replay buffer in shared memory %s (%zu packets)\n", replay_buffer_shm_name, gsr_replay_buffer_get_num_packets(replay_buffer));
+            start_time_pts -= resume_timestamp;
+            for(AudioTrack &audio_track : audio_tracks) {
+                audio_track.pts = std::round(resume_timestamp * audio_track.codec_context->sample_rate);
+            }
+        }
+
+        if(replay_fragmented) {
+            replay_fragments = &replay_fragments_storage;
+            if(!replay_fragments_init(*replay_fragments, av_format_context)) {
+                fprintf(stderr, "Error: failed to create the fragmented replay buffer\n");
+                return 1;
+            }
+        }
+
+        start_save_replay_threads(video_codec_context, VIDEO_STREAM_INDEX, audio_tracks, container_format);
+    }
+
+    PacketWriter packet_writer;
+    packet_writer.policy = get_write_queue_policy(filename);
+    packet_writer.av_format_context = av_format_context;
+    if(video_stream) {
+        packet_writer.streams.push_back(video_stream);
+        for(const AudioTrack &audio_track : audio_tracks) {
+            packet_writer.streams.push_back(audio_track.stream);
+        }
+    }
+    packet_writer.replay_buffer = replay_buffer;
+    packet_writer.replay_fragments = replay_fragments;
+    packet_writer.segments = segments;
+    packet_writer.write_output_mutex = &write_output_mutex;
+    if(!packet_writer_init(packet_writer, WRITE_QUEUE_MAX_PACKETS))
+        return 1;
+
+    std::vector<AVCodecContext*> stream_codec_contexts = { video_codec_context };
+    for(const AudioTrack &audio_track : audio_tracks) {
+        stream_codec_contexts.push_back(audio_track.codec_context);
+    }
+
+    std::vector<PacketWriter*> packet_writers = { &packet_writer };
+    std::vector<std::unique_ptr<ExtraOutput>> extra_outputs;
+    for(const char *extra_output_filepath : extra_output_filepaths) {
+        std::unique_ptr<ExtraOutput> extra_output = std::make_unique<ExtraOutput>();
+        if(!extra_output_open(*extra_output, extra_output_filepath, container_format, stream_codec_contexts, get_write_queue_policy(extra_output_filepath)))
+            return 1;
+        packet_writers.push_back(&extra_output->packet_writer);
+        extra_outputs.push_back(std::move(extra_output));
+    }
+
+    // Only the main encode goes to these outputs
+    const std::vector<PacketWriter*> main_packet_writers = packet_writers;
+
+    if(simulcast.codec_context) {
+        stream_codec_contexts[VIDEO_STREAM_INDEX] = simulcast.codec_context;
+        for(const char *simulcast_output_filepath : simulcast_output_filepaths) {
+            std::unique_ptr<ExtraOutput> extra_output = std::make_unique<ExtraOutput>();
+            if(!extra_output_open(*extra_output, simulcast_output_filepath, container_format, stream_codec_contexts, get_write_queue_policy(simulcast_output_filepath)))
+                return 1;
+            simulcast.packet_writers.push_back(&extra_output->packet_writer);
+            packet_writers.push_back(&extra_output->packet_writer);
+            extra_outputs.push_back(std::move(extra_output));
+        }
+    }
+
+    PacketWriter *bitrate_controller_packet_writer = &packet_writer;
+    for(PacketWriter *output_packet_writer : packet_writers) {
+        if(is_livestream_path(output_packet_writer == &packet_writer ? filename : output_packet_writer->name.c_str())) {
+            bitrate_controller_packet_writer = output_packet_writer;
+            break;
+        }
+    }
+
+    Scheduler scheduler;
+    if(!scheduler_init(scheduler, gsr_capture_get_event_fd(capture)))
+        return 1;
 
     const size_t audio_buffer_size = 1024 * 4 * 2; // max 4 bytes/sample, 2 channels
     uint8_t *empty_audio = (uint8_t*)malloc(audio_buffer_size);
@@ -1598,131 +4132,78 @@ int main(int argc, char **argv) {
     memset(empty_audio, 0, audio_buffer_size);
 
     for(AudioTrack &audio_track : audio_tracks) {
+        audio_track_init(audio_track, start_time_pts);
         for(AudioDevice &audio_device : audio_track.audio_devices) {
-            audio_device.thread = std::thread([record_start_time, replay_buffer_size_secs, &frame_data_queue, &frames_erased, &audio_track, empty_audio, &audio_device, &audio_filter_mutex, &write_output_mutex](AVFormatContext *av_format_context) mutable {
-                const AVSampleFormat sound_device_sample_format = audio_format_to_sample_format(audio_codec_context_get_audio_format(audio_track.codec_context));
-                const bool needs_audio_conversion = audio_track.codec_context->sample_fmt != sound_device_sample_format;
-                SwrContext *swr = nullptr;
-                if(needs_audio_conversion) {
-                    swr = swr_alloc();
-                    if(!swr) {
-                        fprintf(stderr, "Failed to create SwrContext\n");
-                        exit(1);
-                    }
-                    av_opt_set_int(swr, "in_channel_layout", AV_CH_LAYOUT_STEREO, 0);
-                    av_opt_set_int(swr, "out_channel_layout", AV_CH_LAYOUT_STEREO, 0);
-                    av_opt_set_int(swr, "in_sample_rate", audio_track.codec_context->sample_rate, 0);
-                    av_opt_set_int(swr, "out_sample_rate", audio_track.codec_context->sample_rate, 0);
-                    av_opt_set_sample_fmt(swr, "in_sample_fmt", sound_device_sample_format, 0);
-                    av_opt_set_sample_fmt(swr, "out_sample_fmt", audio_track.codec_context->sample_fmt, 0);
-                    swr_init(swr);
-                }
-
-                const double target_audio_hz = 1.0 / (double)audio_track.codec_context->sample_rate;
-                double received_audio_time = clock_get_monotonic_seconds();
-                const int64_t timeout_ms = std::round((1000.0 / (double)audio_track.codec_context->sample_rate) * 1000.0);
-
-                while(running) {
-                    void *sound_buffer;
-                    int sound_buffer_size = -1;
-                    if(audio_device.sound_device.handle)
-                        sound_buffer_size = sound_device_read_next_chunk(&audio_device.sound_device, &sound_buffer);
-                    const bool got_audio_data = sound_buffer_size >= 0;
-
-                    const double this_audio_frame_time = clock_get_monotonic_seconds();
-                    if(got_audio_data)
-                        received_audio_time = this_audio_frame_time;
-
-                    int ret = av_frame_make_writable(audio_track.frame);
-                    if (ret < 0) {
-                        fprintf(stderr, "Failed to make audio frame writable\n");
-                        break;
-                    }
-
-                    int64_t num_missing_frames = std::round((this_audio_frame_time - received_audio_time) / target_audio_hz / (int64_t)audio_track.frame->nb_samples);
-                    if(got_audio_data)
-                        num_missing_frames = std::max((int64_t)0, num_missing_frames - 1);
+            if(audio_device.sound_device.handle) {
+                sound_device_set_read_callback(&audio_device.sound_device, [&packet_writers, &scheduler, &audio_track, empty_audio, &audio_device](const void *buffer, unsigned int, double timestamp) {
+                    audio_device_receive(audio_track, audio_device, buffer, timestamp, empty_audio, packet_writers, scheduler);
+                });
+            }
+        }
+    }
 
-                    if(!audio_device.sound_device.handle)
-                        num_missing_frames = std::max((int64_t)1, num_missing_frames);
-
-                    // Jesus is there a better way to do this? I JUST WANT TO KEEP VIDEO AND AUDIO SYNCED HOLY FUCK I WANT TO KILL MYSELF NOW.
-                    // THIS PIECE OF SHIT WANTS EMPTY FRAMES OTHERWISE VIDEO PLAYS TOO FAST TO KEEP UP WITH AUDIO OR THE AUDIO PLAYS TOO EARLY.
-                    // BUT WE CANT USE DELAYS TO GIVE DUMMY DATA BECAUSE PULSEAUDIO MIGHT GIVE AUDIO A BIG DELAYED!!!
-                    if(num_missing_frames >= 5 || !audio_device.sound_device.handle) {
-                        // TODO:
-                        //audio_track.frame->data[0] = empty_audio;
-                        received_audio_time = this_audio_frame_time;
-                        if(needs_audio_conversion)
-                            swr_convert(swr, &audio_track.frame->data[0], audio_track.frame->nb_samples, (const uint8_t**)&empty_audio, audio_track.codec_context->frame_size);
-                        else
-                            audio_track.frame->data[0] = empty_audio;
-
-                        // TODO: Check if duplicate frame can be saved just by writing it with a different pts instead of sending it again
-                        std::lock_guard<std::mutex> lock(audio_filter_mutex);
-                        for(int i = 0; i < num_missing_frames; ++i) {
-                            if(audio_track.graph) {
-                                // TODO: av_buffersrc_add_frame
-                                if(av_buffersrc_write_frame(audio_device.src_filter_ctx, audio_track.frame) < 0) {
-                                    fprintf(stderr, "Error: failed to add audio frame to filter\n");
-                                }
-                            } else {
-                                audio_track.frame->pts = audio_track.pts;
-                                audio_track.pts += audio_track.frame->nb_samples;
-                                ret = avcodec_send_frame(audio_track.codec_context, audio_track.frame);
-                                if(ret >= 0){
-                                    receive_frames(audio_track.codec_context, audio_track.stream_index, audio_track.stream, audio_track.frame, av_format_context, record_start_time, frame_data_queue, replay_buffer_size_secs, frames_erased, write_output_mutex);
-                                } else {
-                                    fprintf(stderr, "Failed to encode audio!\n");
-                                }
-                            }
-                        }
-                    }
+    // All audio devices are read by this one thread. It sleeps until any device has a period of audio, or until it's time to write silence
+    // for a device that hasn't received any
+    std::thread audio_thread;
+    if(!audio_tracks.empty()) {
+        double min_period_secs = 1.0;
+        for(const AudioTrack &audio_track : audio_tracks) {
+            min_period_secs = std::min(min_period_secs, audio_track_get_period_secs(audio_track));
+        }
+        const int timeout_ms = std::max(1, (int)(min_period_secs * 1000.0));
+
+        audio_thread = std::thread([&packet_writers, &scheduler, &audio_tracks, empty_audio, timeout_ms]() {
+            bool iterate_failed = false;
+            while(running) {
+                if(sound_devices_iterate(timeout_ms) != 0) {
+                    // Keep writing silence for the devices
+                    if(!iterate_failed)
+                        fprintf(stderr, "gsr warning: lost connection to the audio server, audio will be silent\n");
+                    iterate_failed = true;
+                    usleep(timeout_ms * 1000);
+                }
 
-                    if(!audio_device.sound_device.handle)
-                        usleep(timeout_ms * 1000);
-
-                    if(got_audio_data) {
-                        // TODO: Instead of converting audio, get float audio from alsa. Or does alsa do conversion internally to get this format?
-                        if(needs_audio_conversion)
-                            swr_convert(swr, &audio_track.frame->data[0], audio_track.frame->nb_samples, (const uint8_t**)&sound_buffer, audio_track.codec_context->frame_size);
-                        else
-                            audio_track.frame->data[0] = (uint8_t*)sound_buffer;
-
-                        if(audio_track.graph) {
-                            std::lock_guard<std::mutex> lock(audio_filter_mutex);
-                            // TODO: av_buffersrc_add_frame
-                            if(av_buffersrc_write_frame(audio_device.src_filter_ctx, audio_track.frame) < 0) {
-                                fprintf(stderr, "Error: failed to add audio frame to filter\n");
-                            }
-                        } else {
-                            audio_track.frame->pts = audio_track.pts;
-                            audio_track.pts += audio_track.frame->nb_samples;
-                            ret = avcodec_send_frame(audio_track.codec_context, audio_track.frame);
-                            if(ret >= 0){
-                                receive_frames(audio_track.codec_context, audio_track.stream_index, audio_track.stream, audio_track.frame, av_format_context, record_start_time, frame_data_queue, replay_buffer_size_secs, frames_erased, write_output_mutex);
-                            } else {
-                                fprintf(stderr, "Failed to encode audio!\n");
-                            }
-                        }
+                for(AudioTrack &audio_track : audio_tracks) {
+                    for(AudioDevice &audio_device : audio_track.audio_devices) {
+                        audio_device_write_missing_silence(audio_track, audio_device, empty_audio, packet_writers, scheduler);
                     }
                 }
+            }
 
-                if(swr)
-                    swr_free(&swr);
-            }, av_format_context);
-        }
+            for(AudioTrack &audio_track : audio_tracks) {
+                for(AudioDevice &audio_device : audio_track.audio_devices) {
+                    audio_device_encode_held_back_silent_frame(audio_track, audio_device, packet_writers);
+                }
+            }
+        });
     }
 
-    // Set update_fps to 24 to test if duplicate/delayed frames cause video/audio desync or too fast/slow video.
-    const double update_fps = fps + 190;
-    int64_t video_pts_counter = 0;
+    int64_t video_pts_counter = std::round(resume_timestamp / target_fps);
     bool should_stop_error = false;
 
-    AVFrame *aframe = av_frame_alloc();
+    FrameQueue frame_queue;
+    if(!frame_queue_init(frame_queue, capture))
+        return 1;
+    frame_queue.bitrate_mode = bitrate_mode;
+    if(simulcast.codec_context)
+        frame_queue.simulcast = &simulcast;
+    frame_queue.encode_thread = std::thread(frame_queue_encode_thread, std::ref(frame_queue), video_codec_context, std::cref(main_packet_writers));
+
+    const double keepalive_interval_secs = 1.0 / (double)frame_mode_keepalive_fps;
+    const double keyframe_interval_secs = (double)video_codec_context->gop_size / (double)fps;
+    double last_encoded_frame_time = 0.0;
+    double last_keyframe_time = 0.0;
+
+    FrameRateGovernor frame_rate_governor;
+    frame_rate_governor.enabled = frame_rate_governor_enabled;
+
+    double frame_deadline = start_time + target_fps;
+    scheduler_set_deadline(scheduler, frame_deadline);
 
     while (running) {
-        double frame_start = clock_get_monotonic_seconds();
+        scheduler_wait(scheduler);
+        if(!running)
+            break;
 
         gsr_capture_tick(capture, video_codec_context, &frame);
         should_stop_error = false;
@@ -1732,109 +4213,204 @@ int main(int argc, char **argv) {
         }
         ++fps_counter;
 
-        {
-            std::lock_guard<std::mutex> lock(audio_filter_mutex);
-            for(AudioTrack &audio_track : audio_tracks) {
-                if(!audio_track.sink)
-                    continue;
-
-                int err = 0;
-                while ((err = av_buffersink_get_frame(audio_track.sink, aframe)) >= 0) {
-                    aframe->pts = audio_track.pts;
-                    audio_track.pts += audio_track.codec_context->frame_size;
-                    err = avcodec_send_frame(audio_track.codec_context, aframe);
-                    if(err >= 0){
-                        receive_frames(audio_track.codec_context, audio_track.stream_index, audio_track.stream, aframe, av_format_context, record_start_time, frame_data_queue, replay_buffer_size_secs, frames_erased, write_output_mutex);
-                    } else {
-                        fprintf(stderr, "Failed to encode audio!\n");
-                    }
-                    av_frame_unref(aframe);
-                }
-            }
+        for(AudioTrack &audio_track : audio_tracks) {
+            if(audio_track.mix_buffer)
+                audio_track_mix(audio_track, packet_writers);
         }
 
         double time_now = clock_get_monotonic_seconds();
-        double frame_timer_elapsed = time_now - frame_timer_start;
         double elapsed = time_now - start_time;
         if (elapsed >= 1.0) {
-            fprintf(stderr, "update fps: %d\n", fps_counter);
+            const int num_encoded = frame_queue.num_encoded.exchange(0);
+            const int64_t wait_time_us = frame_queue.wait_time_us.exchange(0);
+            const int64_t encode_time_us = frame_queue.encode_time_us.exchange(0);
+            const int frame_queue_max_depth = frame_queue.max_depth.exchange(0);
+            if(verbose) {
+                fprintf(stderr, "update fps: %d, frame queue: %d/%d (max %d), skipped captures: %d, unchanged frames: %d, capture: %.2f ms, queue wait: %.2f ms, encode: %.2f ms\n",
+                    fps_counter,
+                    (int)gsr_spsc_queue_size(frame_queue.captured_frames), (int)frame_queue.frames.size(), frame_queue_max_depth,
+                    frame_queue.num_skipped, frame_queue.num_unchanged,
+                    frame_queue.num_captured > 0 ? frame_queue.capture_time_us / 1000.0 / frame_queue.num_captured : 0.0,
+                    num_encoded > 0 ? wait_time_us / 1000.0 / num_encoded : 0.0,
+                    num_encoded > 0 ? encode_time_us / 1000.0 / num_encoded : 0.0);
+            } else {
+                fprintf(stderr, "update fps: %d\n", fps_counter);
+            }
+            // Only outputs that block can slow down the recording
+            double write_busy = 0.0;
+            for(PacketWriter *output_packet_writer : packet_writers) {
+                const PacketWriterStats stats = packet_writer_take_stats(*output_packet_writer);
+                if(verbose) {
+                    fprintf(stderr, "packet queue%s%s: %d/%d (max %d), written: %d (%d kbps, %.2f ms), dropped: %d, blocked: %d times (%.2f ms)\n",
+                        output_packet_writer->name.empty() ? "" : " ", output_packet_writer->name.c_str(),
+                        (int)gsr_mpsc_queue_size(output_packet_writer->queue), (int)gsr_mpsc_queue_capacity(output_packet_writer->queue), stats.max_depth,
+                        stats.num_written, (int)(stats.num_bytes_written * 8 / 1000 / elapsed), stats.write_time_us / 1000.0, stats.num_dropped,
+                        stats.num_blocked, stats.blocked_time_us / 1000.0);
+                }
+
+                if(output_packet_writer->policy == WriteQueuePolicy::BLOCK)
+                    write_busy = std::max(write_busy, stats.write_time_us / 1000000.0 / elapsed);
+
+                if(output_packet_writer == bitrate_controller_packet_writer && bitrate_controller_update(bitrate_controller, elapsed, stats))
+                    (bitrate_controller_simulcast ? simulcast.video_bitrate : frame_queue.video_bitrate) = bitrate_controller.bitrate;
+            }
+
+            for(AudioTrack &audio_track : audio_tracks) {
+                for(AudioDevice &audio_device : audio_track.audio_devices) {
+                    if(!audio_device.sound_device.handle)
+                        continue;
+
+                    // The counters are reset every second even when they aren't printed
+                    AudioSyncStats &sync_stats = *audio_device.sync_stats;
+                    const double sample_rate = audio_track.codec_context->sample_rate;
+                    const double silence_added_ms = sync_stats.num_silence_samples.exchange(0) * 1000.0 / sample_rate;
+                    const double dropped_ms = sync_stats.num_dropped_samples.exchange(0) * 1000.0 / sample_rate;
+                    if(verbose) {
+                        fprintf(stderr, "audio sync %s: %+.2f ms, drift compensation: %+d ppm, silence added: %.2f ms, dropped: %.2f ms\n",
+                            audio_device.audio_input.name.c_str(), sync_stats.sync_error_us / 1000.0, sync_stats.drift_compensation_ppm.load(), silence_added_ms, dropped_ms);
+                    }
+                }
+            }
+
+            if(verbose && bitrate_controller.enabled)
+                fprintf(stderr, "video bitrate: %d kbps (max %d kbps), bitrate changes: %d\n", (int)(bitrate_controller.bitrate / 1000), (int)(bitrate_controller.max_bitrate / 1000), bitrate_controller.num_changes);
+
+            frame_rate_governor_update(frame_rate_governor, target_fps,
+                frame_queue.num_captured > 0 ? frame_queue.capture_time_us / 1000000.0 / frame_queue.num_captured : 0.0,
+                num_encoded > 0 ? encode_time_us / 1000000.0 / num_encoded : 0.0,
+                write_busy, frame_queue.num_skipped);
+            if(verbose) {
+                fprintf(stderr, "capture rate: %.2f fps, load: %.2f, capture rate changes: %d\n",
+                    1.0 / (target_fps * frame_rate_governor.divisor), frame_rate_governor.load, frame_rate_governor.num_changes);
+            }
             start_time = time_now;
             fps_counter = 0;
+            frame_queue.num_skipped = 0;
+            frame_queue.num_unchanged = 0;
+            frame_queue.capture_time_us = 0;
+            frame_queue.num_captured = 0;
         }
 
-        double frame_time_overflow = frame_timer_elapsed - target_fps;
-        if (frame_time_overflow >= 0.0) {
-            frame_timer_start = time_now - frame_time_overflow;
-            int was_valid = gsr_capture_capture(capture, frame);
-            if (fail_fast && was_valid == -1) // -1 means not valid
-                return 4; // Some probably recoverable error but since fail_fast is enabled, just crash
+        if (time_now >= frame_deadline) {
+            // If whole frames were missed (for example because the system was suspended) then they are skipped instead of captured back to back,
+            // the next captured frame is duplicated instead
+            const double capture_interval = target_fps * frame_rate_governor.divisor;
+            if(time_now - frame_deadline >= capture_interval)
+                frame_deadline = time_now;
+            frame_deadline += capture_interval;
+            scheduler_set_deadline(scheduler, frame_deadline);
+
+            CapturedFrame *captured_frame = frame_queue_get_free_frame(frame_queue);
+            if(captured_frame) {
+                // Nothing is encoded in vfr mode while the image doesn't change, except for a frame every |keepalive_interval_secs|.
+                // The capture doesn't have to copy an unchanged image in that case
+                const bool keepalive = time_now - last_encoded_frame_time >= keepalive_interval_secs;
+                capture->skip_unchanged_frames = frame_mode == FrameMode::VFR && !keepalive;
+
+                // 0 if the image changed (or the capture doesn't know), GSR_CAPTURE_FRAME_UNCHANGED if it didn't, -1 on error
+                int was_valid = 0;
+                if(capture->captures_into_frame_buffer) {
+                    if(!frame_queue_prepare_frame(captured_frame->frame, video_codec_context)) {
+                        running = 0;
+                        break;
+                    }
+                    was_valid = gsr_capture_capture(capture, captured_frame->frame);
+                } else {
+                    was_valid = gsr_capture_capture(capture, frame);
+                    av_frame_unref(captured_frame->frame);
+                    av_frame_ref(captured_frame->frame, frame);
+                }
+                if (fail_fast && was_valid == -1) // -1 means not valid
+                    return 4; // Some probably recoverable error but since fail_fast is enabled, just crash
 
-            const double this_video_frame_time = clock_get_monotonic_seconds();
-            const int64_t expected_frames = std::round((this_video_frame_time - start_time_pts) / target_fps);
+                const double this_video_frame_time = clock_get_monotonic_seconds();
+                const int64_t expected_frames = std::round((this_video_frame_time - start_time_pts) / target_fps);
 
-            const int num_frames = std::max(0L, expected_frames - video_pts_counter);
+                const int num_frames = std::max(0L, expected_frames - video_pts_counter);
 
-            frame->flags &= ~AV_FRAME_FLAG_DISCARD;
-            // TODO: Check if duplicate frame can be saved just by writing it with a different pts instead of sending it again
-            for(int i = 0; i < num_frames; ++i) {
-                if(i > 0)
-                    frame->flags |= AV_FRAME_FLAG_DISCARD;
+                frame_queue.capture_time_us += (int64_t)((this_video_frame_time - time_now) * 1000000.0);
+                ++frame_queue.num_captured;
 
-                frame->pts = video_pts_counter + i;
-                int ret = avcodec_send_frame(video_codec_context, frame);
-                if (ret >= 0) {
-                    receive_frames(video_codec_context, VIDEO_STREAM_INDEX, video_stream, frame, av_format_context,
-                                record_start_time, frame_data_queue, replay_buffer_size_secs, frames_erased, write_output_mutex);
+                if(num_frames == 0 || (frame_mode == FrameMode::VFR && was_valid == GSR_CAPTURE_FRAME_UNCHANGED && !keepalive)) {
+                    if(num_frames > 0)
+                        ++frame_queue.num_unchanged;
+                    frame_queue.unused_frame = captured_frame;
                 } else {
-                    fprintf(stderr, "Error: avcodec_send_frame failed, error: %s\n", av_error_to_string(ret));
+                    // The frame that is encoded gets the timestamp of now. If frames were missed (the image didn't change in vfr mode, or the capture or encoder
+                    // fell behind) then the previous frame is shown until then, instead of encoding duplicates which would make the encoder fall behind even more
+                    captured_frame->force_keyframe = false;
+                    if(frame_mode == FrameMode::VFR || frame_rate_governor.divisor > 1) {
+                        // Keyframes are forced by time, because gop_size is in frames and frames can be seconds apart,
+                        // or further apart than -f when the capture rate is lowered
+                        captured_frame->force_keyframe = this_video_frame_time - last_keyframe_time >= keyframe_interval_secs;
+                        if(captured_frame->force_keyframe)
+                            last_keyframe_time = this_video_frame_time;
+                    }
+                    last_encoded_frame_time = this_video_frame_time;
+
+                    captured_frame->pts = video_pts_counter + num_frames - 1;
+                    captured_frame->capture_time = this_video_frame_time;
+                    frame_queue_push_captured_frame(frame_queue, captured_frame);
+                    video_pts_counter += num_frames;
                 }
+            } else {
+                // The encoder is behind. The previous frame is shown until the next captured frame
+                ++frame_queue.num_skipped;
             }
-            video_pts_counter += num_frames;
         }
 
-        if(save_replay_thread.valid() && save_replay_thread.wait_for(std::chrono::seconds(0)) == std::future_status::ready) {
-            save_replay_thread.get();
-            puts(save_replay_output_filepath.c_str());
-            save_replay_packets.clear();
-        }
+        if(replay_buffer_size_secs != -1) {
+            print_saved_replays();
 
-        if(save_replay == 1 && !save_replay_thread.valid() && replay_buffer_size_secs != -1) {
-            save_replay = 0;
-            save_replay_async(video_codec_context, VIDEO_STREAM_INDEX, audio_tracks, frame_data_queue, frames_erased, filename, container_format, file_extension, write_output_mutex);
+            double save_replay_duration_secs = 0.0;
+            double save_replay_end_offset_secs = 0.0;
+            while(pop_save_replay_request(&save_replay_duration_secs, &save_replay_end_offset_secs)) {
+                save_replay_async(replay_buffer, replay_fragments, clock_get_monotonic_seconds() - start_time_pts, save_replay_duration_secs, save_replay_end_offset_secs, filename, file_extension, write_output_mutex);
+            }
         }
 
-        // av_frame_free(&frame);
-        double frame_end = clock_get_monotonic_seconds();
-        double frame_sleep_fps = 1.0 / update_fps;
-        double sleep_time = frame_sleep_fps - (frame_end - frame_start);
-        if(sleep_time > 0.0)
-            usleep(sleep_time * 1000.0 * 1000.0);
     }
 
 	running = 0;
-    av_frame_free(&aframe);
+    frame_queue_deinit(frame_queue);
 
-    if(save_replay_thread.valid()) {
-        save_replay_thread.get();
-        puts(save_replay_output_filepath.c_str());
+    if(replay_buffer_size_secs != -1) {
+        stop_save_replay_threads();
+        print_saved_replays();
     }
 
+    if(audio_thread.joinable())
+        audio_thread.join();
+
     for(AudioTrack &audio_track : audio_tracks) {
-        for(AudioDevice &audio_device : audio_track.audio_devices) {
-            audio_device.thread.join();
-            sound_device_close(&audio_device.sound_device);
-        }
+        audio_track_deinit(audio_track);
+    }
+
+    packet_writer_deinit(packet_writer);
+    for(std::unique_ptr<ExtraOutput> &extra_output : extra_outputs) {
+        extra_output_close(*extra_output);
     }
+    simulcast_deinit(simulcast);
+    scheduler_deinit(scheduler);
 
-    if (replay_buffer_size_secs == -1 && av_write_trailer(av_format_context) != 0) {
+    if (write_to_output_file && av_write_trailer(av_format_context) != 0) {
         fprintf(stderr, "Failed to write trailer\n");
     }
 
-    if(replay_buffer_size_secs == -1 && !(output_format->flags & AVFMT_NOFILE))
+    if(write_to_output_file && !(output_format->flags & AVFMT_NOFILE))
         avio_close(av_format_context->pb);
 
+    if(segments)
+        segments_deinit(*segments);
+
     gsr_capture_destroy(capture, video_codec_context);
 
+    if(replay_fragments)
+        replay_fragments_deinit(*replay_fragments);
+
+    if(replay_buffer)
+        gsr_replay_buffer_destroy(replay_buffer);
+
     if(dpy)
         XCloseDisplay(dpy);
 
@@ -0,0 +1,118 @@
+#include "../include/mpsc_queue.h"
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <stdio.h>
+
+#define CACHE_LINE_SIZE 64
+
+typedef struct {
+    /* |pos| when the slot is free to be pushed to, |pos| + 1 when it has an item to be popped, where |pos| is the push/pop position of the current lap */
+    _Atomic uint64_t sequence;
+    void *item;
+} gsr_mpsc_queue_slot;
+
+struct gsr_mpsc_queue {
+    /* Shared by the producers */
+    _Alignas(CACHE_LINE_SIZE) _Atomic uint64_t tail;
+
+    /* Only written by the consumer */
+    _Alignas(CACHE_LINE_SIZE) _Atomic uint64_t head;
+
+    _Alignas(CACHE_LINE_SIZE) size_t capacity;
+    size_t mask;
+    gsr_mpsc_queue_slot *slots;
+};
+
+static size_t round_up_to_power_of_two(size_t value) {
+    size_t result = 1;
+    while(result < value)
+        result <<= 1;
+    return result;
+}
+
+gsr_mpsc_queue* gsr_mpsc_queue_create(size_t capacity) {
+    if(capacity == 0) {
+        fprintf(stderr, "gsr error: gsr_mpsc_queue_create: capacity is 0\n");
+        return NULL;
+    }
+
+    gsr_mpsc_queue *self = aligned_alloc(CACHE_LINE_SIZE, sizeof(gsr_mpsc_queue));
+    if(!self)
+        return NULL;
+
+    self->capacity = round_up_to_power_of_two(capacity);
+    self->mask = self->capacity - 1;
+    self->slots = malloc(self->capacity * sizeof(gsr_mpsc_queue_slot));
+    if(!self->slots) {
+        free(self);
+        return NULL;
+    }
+
+    for(size_t i = 0; i < self->capacity; ++i) {
+        atomic_init(&self->slots[i].sequence, i);
+        self->slots[i].item = NULL;
+    }
+
+    atomic_init(&self->tail, 0);
+    atomic_init(&self->head, 0);
+    return self;
+}
+
+void gsr_mpsc_queue_destroy(gsr_mpsc_queue *self) {
+    if(!self)
+        return;
+
+    free(self->slots);
+    free(self);
+}
+
+bool gsr_mpsc_queue_push(gsr_mpsc_queue *self, void *item) {
+    uint64_t pos = atomic_load_explicit(&self->tail, memory_order_relaxed);
+    gsr_mpsc_queue_slot *slot;
+    for(;;) {
+        slot = &self->slots[pos & self->mask];
+        const uint64_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        const int64_t diff = (int64_t)(sequence - pos);
+        if(diff == 0) {
+            /* On failure |pos| is updated to the current tail */
+            if(atomic_compare_exchange_weak_explicit(&self->tail, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed))
+                break;
+        } else if(diff < 0) {
+            /* The slot still has the item of the previous lap, the queue is full */
+            return false;
+        } else {
+            /* Another producer took this position */
+            pos = atomic_load_explicit(&self->tail, memory_order_relaxed);
+        }
+    }
+
+    slot->item = item;
+    atomic_store_explicit(&slot->sequence, pos + 1, memory_order_release);
+    return true;
+}
+
+bool gsr_mpsc_queue_pop(gsr_mpsc_queue *self, void **item) {
+    const uint64_t pos = atomic_load_explicit(&self->head, memory_order_relaxed);
+    gsr_mpsc_queue_slot *slot = &self->slots[pos & self->mask];
+    const uint64_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+    if(sequence != pos + 1)
+        return false;
+
+    *item = slot->item;
+    /* Free for the next lap */
+    atomic_store_explicit(&slot->sequence, pos + self->capacity, memory_order_release);
+    atomic_store_explicit(&self->head, pos + 1, memory_order_release);
+    return true;
+}
+
+size_t gsr_mpsc_queue_size(const gsr_mpsc_queue *self) {
+    /* Head is loaded first, so that the tail is never behind it */
+    const uint64_t head = atomic_load_explicit(&self->head, memory_order_acquire);
+    const uint64_t tail = atomic_load_explicit(&self->tail, memory_order_acquire);
+    return (size_t)(tail - head);
+}
+
+size_t gsr_mpsc_queue_capacity(const gsr_mpsc_queue *self) {
+    return self->capacity;
+}
@@ -0,0 +1,1315 @@
+/* For sync_file_range */
+#define _GNU_SOURCE
+#include "../include/replay_buffer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#define ENTRY_ALIGNMENT 8
+
+/* Set on the padding entry that is written when a packet doesn't fit at the end of the arena */
+#define ENTRY_FLAG_WRAP (1 << 30)
+
+#define PIN_UNUSED UINT64_MAX
+
+/* The part of |max_bytes| that is used for the spill ring instead of the memory ring */
+#define SPILL_RING_DIVISOR 8
+
+#define SHM_MAGIC 0x59414c5045525347ULL /* "GSREPLAY" */
+#define SHM_VERSION 1
+
+/*
+    At the start of the shared memory object, the memory ring arena follows it (at |shm_header_size|).
+    The entries between |tail| and |head| are always complete: an entry is written before |head| is moved past it and |tail| is moved
+    before the space is reused. So if the process dies at any point, the next process (or a reader) still finds a valid replay buffer.
+*/
+typedef struct {
+    uint64_t magic; /* Written last when the header is initialized */
+    uint32_t version;
+    int32_t keyframe_stream_index;
+    uint64_t capacity;
+    _Atomic uint64_t head;
+    _Atomic uint64_t tail;
+    /* Timestamp of the newest packet of |keyframe_stream_index| and the wall clock time when it was added, so a new process can continue the timestamps */
+    double newest_timestamp;
+    int64_t newest_realtime_ns;
+    uint64_t stream_info_size;
+    uint8_t stream_info[GSR_REPLAY_BUFFER_MAX_STREAM_INFO_SIZE];
+} gsr_replay_shm_header;
+
+/*
+    Data in the disk ring that is further than this behind the head is written to disk and dropped from the page cache by the writeback thread,
+    so the disk ring only uses about this much memory no matter how large it is. The thread is woken up every DISK_WRITEBACK_CHUNK bytes
+*/
+#define DISK_WRITEBACK_LAG (32 * 1024 * 1024)
+#define DISK_WRITEBACK_CHUNK (8 * 1024 * 1024)
+
+/* Stored in the arena right before the packet data */
+typedef struct {
+    uint32_t size;
+    int32_t stream_index;
+    int32_t flags;
+    uint32_t entry_size; /* Size of this header + the packet data, aligned to ENTRY_ALIGNMENT */
+    uint64_t seq; /* Sequence number of the packet in the replay buffer, it's kept when the packet is moved to the disk ring */
+    int64_t pts;
+    int64_t dts;
+    double timestamp;
+} gsr_replay_entry;
+
+typedef struct {
+    uint64_t pos;
+    uint64_t seq;
+    double timestamp;
+} gsr_replay_keyframe;
+
+typedef struct {
+    uint8_t *arena;
+    size_t capacity;
+    bool locked;
+    int fd; /* -1 unless the arena is a mapped file */
+
+    /* Positions are virtual and only ever increase, the position in the arena is |pos % capacity| */
+    uint64_t head; /* Where the next entry is written */
+    uint64_t tail; /* The oldest entry */
+    uint64_t head_seq; /* Number of entries that have been added to this ring */
+    uint64_t tail_seq; /* Number of entries that have been removed from this ring */
+    /* Copies of |head| and |tail| for the snapshot readers */
+    _Atomic uint64_t published_head;
+    _Atomic uint64_t published_tail;
+
+    /* Ring of the keyframes of |params.keyframe_stream_index| that are in the arena, oldest first */
+    gsr_replay_keyframe *keyframes;
+    size_t keyframes_capacity;
+    size_t keyframes_start;
+    size_t num_keyframes;
+
+    /*
+        Position of the oldest entry that each snapshot still reads, PIN_UNUSED if the slot is free.
+        These are updated by the snapshot readers without a lock. Space in the arena is only reused once no snapshot is pinning it.
+    */
+    _Atomic uint64_t pins[GSR_REPLAY_BUFFER_MAX_SNAPSHOTS];
+
+    /*
+        Waits for the data that is DISK_WRITEBACK_LAG behind |writeback_head| to be on disk and drops it from the page cache,
+        so that the thread that adds packets never waits for the disk. Only used when |fd| is not -1
+    */
+    pthread_t writeback_thread;
+    bool writeback_thread_started;
+    pthread_mutex_t writeback_mutex;
+    pthread_cond_t writeback_cond;
+    uint64_t writeback_head; /* Protected by |writeback_mutex| */
+    bool writeback_stop; /* Protected by |writeback_mutex| */
+    uint64_t writeback_signaled_head; /* The head the last time the writeback thread was woken up, only used by the thread that adds packets */
+
+    /* Set if the arena is in a shared memory object, |head| and |tail| are published there as well */
+    gsr_replay_shm_header *shm_header;
+} gsr_replay_ring;
+
+struct gsr_replay_buffer {
+    gsr_replay_buffer_params params;
+    /* Packets are added to the memory ring. When it's full the oldest gop is moved to the disk ring (if there is one) */
+    gsr_replay_ring rings[GSR_REPLAY_BUFFER_NUM_RINGS];
+    bool has_disk_ring;
+    bool reattached; /* The memory ring had packets from a previous process */
+    _Atomic bool snapshot_used[GSR_REPLAY_BUFFER_MAX_SNAPSHOTS];
+    uint64_t num_dropped_packets;
+
+    /*
+        Packets that are added while snapshots pin the space they need are kept here (oldest first) until they fit, so recording continues while a slow save runs.
+        Its arena is allocated up front as part of |max_bytes|, like the memory ring. It's not part of the replay buffer, nothing is evicted from it and snapshots don't read it
+    */
+    gsr_replay_ring spill_ring;
+    bool drop_until_keyframe; /* Set when a packet of |keyframe_stream_index| is dropped, the packets after it can't be decoded without the next keyframe */
+    bool discontinuity; /* Set when a packet is dropped, the next packet that is added gets GSR_REPLAY_PACKET_FLAG_DISCONTINUITY */
+};
+
+static size_t align_up(size_t value, size_t alignment) {
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+static uint8_t* arena_alloc(size_t *size, gsr_replay_buffer_memory memory, bool *locked) {
+    *locked = false;
+    void *arena = MAP_FAILED;
+
+    if(memory == GSR_REPLAY_BUFFER_MEMORY_HUGEPAGES) {
+        *size = align_up(*size, HUGE_PAGE_SIZE);
+        arena = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if(arena == MAP_FAILED)
+            fprintf(stderr, "gsr warning: gsr_replay_buffer_create: failed to allocate %zu bytes of huge pages (error: %s), falling back to transparent huge pages. Reserve huge pages with vm.nr_hugepages to use them\n", *size, strerror(errno));
+    } else {
+        *size = align_up(*size, getpagesize());
+    }
+
+    if(arena == MAP_FAILED) {
+        arena = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(arena == MAP_FAILED) {
+            fprintf(stderr, "gsr error: gsr_replay_buffer_create: failed to allocate %zu bytes, error: %s\n", *size, strerror(errno));
+            return NULL;
+        }
+
+        if(memory == GSR_REPLAY_BUFFER_MEMORY_HUGEPAGES)
+            madvise(arena, *size, MADV_HUGEPAGE);
+    }
+
+    if(memory != GSR_REPLAY_BUFFER_MEMORY_DEFAULT) {
+        if(mlock(arena, *size) == 0)
+            *locked = true;
+        else
+            fprintf(stderr, "gsr warning: gsr_replay_buffer_create: failed to lock %zu bytes of memory (error: %s), the replay buffer may be swapped out. Increase the memlock limit (ulimit -l) to lock it\n", *size, strerror(errno));
+    }
+
+    return arena;
+}
+
+/* The whole file is allocated up front so that writing to the mapping can't fail later because the disk is full */
+static uint8_t* arena_map_file(size_t *size, const char *filepath, int *fd) {
+    *size = align_up(*size, getpagesize());
+    *fd = open(filepath, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if(*fd == -1) {
+        fprintf(stderr, "gsr error: gsr_replay_buffer_create: failed to open %s, error: %s\n", filepath, strerror(errno));
+        return NULL;
+    }
+
+    const int err = ftruncate(*fd, *size) == 0 ? posix_fallocate(*fd, 0, *size) : errno;
+    if(err != 0) {
+        fprintf(stderr, "gsr error: gsr_replay_buffer_create: failed to allocate %zu bytes for %s, error: %s\n", *size, filepath, strerror(err));
+        close(*fd);
+        *fd = -1;
+        return NULL;
+    }
+
+    void *arena = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
+    if(arena == MAP_FAILED) {
+        fprintf(stderr, "gsr error: gsr_replay_buffer_create: failed to map %s, error: %s\n", filepath, strerror(errno));
+        close(*fd);
+        *fd = -1;
+        return NULL;
+    }
+
+    /* Saving a replay reads the file from start to end, this makes the kernel read ahead more and drop the pages sooner */
+    madvise(arena, *size, MADV_SEQUENTIAL);
+    return arena;
+}
+
+static size_t shm_header_size(void) {
+    return align_up(sizeof(gsr_replay_shm_header), getpagesize());
+}
+
+static bool shm_header_is_compatible(const gsr_replay_shm_header *header, size_t capacity, const gsr_replay_buffer_params *params) {
+    return header->magic == SHM_MAGIC && header->version == SHM_VERSION && header->capacity == capacity
+        && header->keyframe_stream_index == params->keyframe_stream_index
+        && header->stream_info_size == params->stream_info_size
+        && memcmp(header->stream_info, params->stream_info, params->stream_info_size) == 0;
+}
+
+/*
+    Maps the shared memory object |params->shm_name| with the header followed by the arena. The object is created if it doesn't exist.
+    If it exists and has the same size and stream info then its packets are kept, otherwise it's cleared.
+*/
+static uint8_t* arena_map_shm(size_t *size, const gsr_replay_buffer_params *params, gsr_replay_shm_header **shm_header) {
+    *size = align_up(*size, getpagesize());
+    const size_t total_size = shm_header_size() + *size;
+    const int fd = shm_open(params->shm_name, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if(fd == -1) {
+        fprintf(stderr, "gsr error: gsr_replay_buffer_create: failed to open shared memory %s, error: %s\n", params->shm_name, strerror(errno));
+        return NULL;
+    }
+
+    struct stat st;
+    const bool same_size = fstat(fd, &st) == 0 && (size_t)st.st_size == total_size;
+    /* The memory is allocated up front, otherwise writing to the mapping could fail with SIGBUS later when /dev/shm is full */
+    const int err = (same_size || ftruncate(fd, total_size) == 0) ? posix_fallocate(fd, 0, total_size) : errno;
+    if(err != 0) {
+        fprintf(stderr, "gsr error: gsr_replay_buffer_create: failed to allocate %zu bytes for shared memory %s, error: %s\n", total_size, params->shm_name, strerror(err));
+        close(fd);
+        return NULL;
+    }
+
+    uint8_t *mapping = mmap(NULL, total_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(mapping == MAP_FAILED) {
+        fprintf(stderr, "gsr error: gsr_replay_buffer_create: failed to map shared memory %s, error: %s\n", params->shm_name, strerror(errno));
+        return NULL;
+    }
+
+    gsr_replay_shm_header *header = (gsr_replay_shm_header*)mapping;
+    if(!same_size || !shm_header_is_compatible(header, *size, params)) {
+        if(header->magic == SHM_MAGIC)
+            fprintf(stderr, "gsr info: gsr_replay_buffer_create: the replay buffer in shared memory %s was recorded with different settings, it's cleared\n", params->shm_name);
+
+        header->magic = 0;
+        atomic_thread_fence(memory_order_seq_cst);
+        header->version = SHM_VERSION;
+        header->keyframe_stream_index = params->keyframe_stream_index;
+        header->capacity = *size;
+        atomic_store(&header->head, 0);
+        atomic_store(&header->tail, 0);
+        header->newest_timestamp = 0.0;
+        header->newest_realtime_ns = 0;
+        header->stream_info_size = params->stream_info_size;
+        memcpy(header->stream_info, params->stream_info, params->stream_info_size);
+        atomic_thread_fence(memory_order_seq_cst);
+        header->magic = SHM_MAGIC;
+    }
+
+    *shm_header = header;
+    return mapping + shm_header_size();
+}
+
+static bool ring_init(gsr_replay_ring *ring) {
+    ring->fd = -1;
+    atomic_init(&ring->published_head, 0);
+    atomic_init(&ring->published_tail, 0);
+    for(int i = 0; i < GSR_REPLAY_BUFFER_MAX_SNAPSHOTS; ++i) {
+        atomic_init(&ring->pins[i], PIN_UNUSED);
+    }
+
+    ring->keyframes_capacity = 256;
+    ring->keyframes = malloc(ring->keyframes_capacity * sizeof(gsr_replay_keyframe));
+    return ring->keyframes != NULL;
+}
+
+static void ring_stop_writeback_thread(gsr_replay_ring *ring);
+
+static void ring_deinit(gsr_replay_ring *ring) {
+    ring_stop_writeback_thread(ring);
+
+    if(ring->arena) {
+        if(ring->locked)
+            munlock(ring->arena, ring->capacity);
+
+        /* The shared memory object isn't removed, so the next process can continue the replay buffer */
+        if(ring->shm_header)
+            munmap(ring->shm_header, shm_header_size() + ring->capacity);
+        else
+            munmap(ring->arena, ring->capacity);
+    }
+
+    if(ring->fd != -1)
+        close(ring->fd);
+
+    free(ring->keyframes);
+}
+
+static void* writeback_thread_main(void *userdata) {
+    gsr_replay_ring *ring = userdata;
+    uint64_t writeback_pos = 0; /* Everything before this has been written to disk and dropped from the page cache */
+
+    pthread_mutex_lock(&ring->writeback_mutex);
+    for(;;) {
+        while(!ring->writeback_stop && ring->writeback_head - writeback_pos <= DISK_WRITEBACK_LAG)
+            pthread_cond_wait(&ring->writeback_cond, &ring->writeback_mutex);
+
+        if(ring->writeback_stop)
+            break;
+
+        const uint64_t head = ring->writeback_head;
+        pthread_mutex_unlock(&ring->writeback_mutex);
+
+        if(head - writeback_pos > ring->capacity)
+            writeback_pos = head - ring->capacity;
+
+        /*
+            The packets in this range can be overwritten while this runs, if the ring wraps around. That's fine, dropping the mapping
+            of a dirty page keeps it in the page cache and posix_fadvise doesn't drop dirty pages
+        */
+        while(head - writeback_pos > DISK_WRITEBACK_LAG) {
+            const uint64_t offset = writeback_pos % ring->capacity;
+            size_t chunk_size = DISK_WRITEBACK_CHUNK;
+            if(offset + chunk_size > ring->capacity)
+                chunk_size = ring->capacity - offset;
+
+            sync_file_range(ring->fd, offset, chunk_size, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+            madvise(ring->arena + offset, chunk_size, MADV_DONTNEED);
+            posix_fadvise(ring->fd, offset, chunk_size, POSIX_FADV_DONTNEED);
+            writeback_pos += chunk_size;
+        }
+
+        pthread_mutex_lock(&ring->writeback_mutex);
+    }
+    pthread_mutex_unlock(&ring->writeback_mutex);
+    return NULL;
+}
+
+static bool ring_start_writeback_thread(gsr_replay_ring *ring) {
+    if(pthread_mutex_init(&ring->writeback_mutex, NULL) != 0)
+        return false;
+
+    if(pthread_cond_init(&ring->writeback_cond, NULL) != 0) {
+        pthread_mutex_destroy(&ring->writeback_mutex);
+        return false;
+    }
+
+    if(pthread_create(&ring->writeback_thread, NULL, writeback_thread_main, ring) != 0) {
+        pthread_cond_destroy(&ring->writeback_cond);
+        pthread_mutex_destroy(&ring->writeback_mutex);
+        return false;
+    }
+
+    ring->writeback_thread_started = true;
+    return true;
+}
+
+static void ring_stop_writeback_thread(gsr_replay_ring *ring) {
+    if(!ring->writeback_thread_started)
+        return;
+
+    pthread_mutex_lock(&ring->writeback_mutex);
+    ring->writeback_stop = true;
+    pthread_cond_signal(&ring->writeback_cond);
+    pthread_mutex_unlock(&ring->writeback_mutex);
+
+    pthread_join(ring->writeback_thread, NULL);
+    pthread_cond_destroy(&ring->writeback_cond);
+    pthread_mutex_destroy(&ring->writeback_mutex);
+    ring->writeback_thread_started = false;
+}
+
+static bool ring_restore(gsr_replay_buffer *self, gsr_replay_ring *ring);
+static void ring_clear(gsr_replay_ring *ring);
+
+gsr_replay_buffer* gsr_replay_buffer_create(const gsr_replay_buffer_params *params) {
+    if(params->max_bytes == 0 || params->max_duration_secs <= 0.0) {
+        fprintf(stderr, "gsr error: gsr_replay_buffer_create: expected max_bytes and max_duration_secs to be greater than 0\n");
+        return NULL;
+    }
+
+    if(params->disk_filepath && params->disk_max_bytes == 0) {
+        fprintf(stderr, "gsr error: gsr_replay_buffer_create: expected disk_max_bytes to be greater than 0\n");
+        return NULL;
+    }
+
+    if(params->shm_name && params->stream_info_size > GSR_REPLAY_BUFFER_MAX_STREAM_INFO_SIZE) {
+        fprintf(stderr, "gsr error: gsr_replay_buffer_create: expected stream_info_size to be at most %d, was %zu\n", GSR_REPLAY_BUFFER_MAX_STREAM_INFO_SIZE, params->stream_info_size);
+        return NULL;
+    }
+
+    gsr_replay_buffer *self = calloc(1, sizeof(gsr_replay_buffer));
+    if(!self)
+        return NULL;
+
+    self->params = *params;
+    self->params.disk_filepath = NULL;
+    self->params.shm_name = NULL;
+    self->params.stream_info = NULL;
+    for(int i = 0; i < GSR_REPLAY_BUFFER_MAX_SNAPSHOTS; ++i) {
+        atomic_init(&self->snapshot_used[i], false);
+    }
+    for(int i = 0; i < GSR_REPLAY_BUFFER_NUM_RINGS; ++i) {
+        if(!ring_init(&self->rings[i])) {
+            gsr_replay_buffer_destroy(self);
+            return NULL;
+        }
+    }
+
+    if(!ring_init(&self->spill_ring)) {
+        gsr_replay_buffer_destroy(self);
+        return NULL;
+    }
+
+    self->spill_ring.capacity = params->max_bytes / SPILL_RING_DIVISOR;
+    self->spill_ring.arena = arena_alloc(&self->spill_ring.capacity, params->memory, &self->spill_ring.locked);
+    if(!self->spill_ring.arena) {
+        gsr_replay_buffer_destroy(self);
+        return NULL;
+    }
+
+    gsr_replay_ring *memory_ring = &self->rings[GSR_REPLAY_BUFFER_RING_MEMORY];
+    memory_ring->capacity = params->max_bytes - params->max_bytes / SPILL_RING_DIVISOR;
+    if(params->shm_name) {
+        memory_ring->arena = arena_map_shm(&memory_ring->capacity, params, &memory_ring->shm_header);
+        if(memory_ring->arena && params->memory != GSR_REPLAY_BUFFER_MEMORY_DEFAULT)
+            memory_ring->locked = mlock(memory_ring->arena, memory_ring->capacity) == 0;
+    } else {
+        memory_ring->arena = arena_alloc(&memory_ring->capacity, params->memory, &memory_ring->locked);
+    }
+
+    if(!memory_ring->arena) {
+        gsr_replay_buffer_destroy(self);
+        return NULL;
+    }
+
+    if(memory_ring->shm_header && !ring_restore(self, memory_ring)) {
+        fprintf(stderr, "gsr warning: gsr_replay_buffer_create: the replay buffer in shared memory %s is corrupt, it's cleared\n", params->shm_name);
+        ring_clear(memory_ring);
+    }
+
+    if(params->disk_filepath) {
+        gsr_replay_ring *disk_ring = &self->rings[GSR_REPLAY_BUFFER_RING_DISK];
+        disk_ring->capacity = params->disk_max_bytes;
+        disk_ring->arena = arena_map_file(&disk_ring->capacity, params->disk_filepath, &disk_ring->fd);
+        if(!disk_ring->arena) {
+            gsr_replay_buffer_destroy(self);
+            return NULL;
+        }
+
+        if(!ring_start_writeback_thread(disk_ring)) {
+            fprintf(stderr, "gsr error: gsr_replay_buffer_create: failed to create the writeback thread for %s\n", params->disk_filepath);
+            gsr_replay_buffer_destroy(self);
+            return NULL;
+        }
+        self->has_disk_ring = true;
+    }
+
+    return self;
+}
+
+void gsr_replay_buffer_destroy(gsr_replay_buffer *self) {
+    for(int i = 0; i < GSR_REPLAY_BUFFER_NUM_RINGS; ++i) {
+        ring_deinit(&self->rings[i]);
+    }
+    ring_deinit(&self->spill_ring);
+    free(self);
+}
+
+static bool ring_is_empty(const gsr_replay_ring *ring) {
+    return ring->head_seq == ring->tail_seq;
+}
+
+static const gsr_replay_keyframe* keyframe_at(const gsr_replay_ring *ring, size_t index) {
+    return &ring->keyframes[(ring->keyframes_start + index) % ring->keyframes_capacity];
+}
+
+static bool push_keyframe(gsr_replay_ring *ring, const gsr_replay_keyframe *keyframe) {
+    if(ring->num_keyframes == ring->keyframes_capacity) {
+        const size_t new_capacity = ring->keyframes_capacity * 2;
+        gsr_replay_keyframe *new_keyframes = malloc(new_capacity * sizeof(gsr_replay_keyframe));
+        if(!new_keyframes)
+            return false;
+
+        for(size_t i = 0; i < ring->num_keyframes; ++i) {
+            new_keyframes[i] = *keyframe_at(ring, i);
+        }
+
+        free(ring->keyframes);
+        ring->keyframes = new_keyframes;
+        ring->keyframes_capacity = new_capacity;
+        ring->keyframes_start = 0;
+    }
+
+    ring->keyframes[(ring->keyframes_start + ring->num_keyframes) % ring->keyframes_capacity] = *keyframe;
+    ++ring->num_keyframes;
+    return true;
+}
+
+static void pop_keyframes_before_tail(gsr_replay_ring *ring) {
+    while(ring->num_keyframes > 0 && keyframe_at(ring, 0)->seq < ring->tail_seq) {
+        ring->keyframes_start = (ring->keyframes_start + 1) % ring->keyframes_capacity;
+        --ring->num_keyframes;
+    }
+}
+
+/* Returns the first keyframe after the oldest entry, which is where the next gop starts. Returns NULL if there is none */
+static const gsr_replay_keyframe* next_gop_start(const gsr_replay_ring *ring) {
+    for(size_t i = 0; i < ring->num_keyframes && i < 2; ++i) {
+        const gsr_replay_keyframe *keyframe = keyframe_at(ring, i);
+        if(keyframe->seq > ring->tail_seq)
+            return keyframe;
+    }
+    return NULL;
+}
+
+static const gsr_replay_entry* entry_at(const gsr_replay_ring *ring, uint64_t pos) {
+    return (const gsr_replay_entry*)(ring->arena + (pos % ring->capacity));
+}
+
+/* Moves |pos| past the padding at the end of the arena, if there is any at |pos| */
+static uint64_t skip_padding(const gsr_replay_ring *ring, uint64_t pos, uint64_t end) {
+    if(pos == end)
+        return pos;
+
+    const size_t remaining = ring->capacity - (pos % ring->capacity);
+    if(remaining < sizeof(gsr_replay_entry))
+        return pos + remaining;
+
+    const gsr_replay_entry *entry = entry_at(ring, pos);
+    if(entry->flags & ENTRY_FLAG_WRAP)
+        return pos + entry->entry_size;
+
+    return pos;
+}
+
+static void ring_publish_head(gsr_replay_ring *ring) {
+    atomic_store_explicit(&ring->published_head, ring->head, memory_order_release);
+    if(ring->shm_header)
+        atomic_store_explicit(&ring->shm_header->head, ring->head, memory_order_release);
+}
+
+static void ring_publish_tail(gsr_replay_ring *ring) {
+    /* This has to be visible to snapshot readers before the pins are checked, see |snapshot_pin_tail| */
+    atomic_store(&ring->published_tail, ring->tail);
+    if(ring->shm_header) {
+        atomic_store_explicit(&ring->shm_header->tail, ring->tail, memory_order_relaxed);
+        /* Readers in other processes copy entries without pinning them and check the tail afterwards, so it has to be visible before the space is overwritten */
+        atomic_thread_fence(memory_order_release);
+    }
+}
+
+static void read_entry(const gsr_replay_ring *ring, uint64_t pos, gsr_replay_packet *packet, uint64_t *next_pos) {
+    const gsr_replay_entry *entry = entry_at(ring, pos);
+    packet->data = (const uint8_t*)entry + sizeof(gsr_replay_entry);
+    packet->size = entry->size;
+    packet->stream_index = entry->stream_index;
+    packet->flags = entry->flags;
+    packet->pts = entry->pts;
+    packet->dts = entry->dts;
+    packet->timestamp = entry->timestamp;
+    packet->fd = ring->fd;
+    packet->fd_offset = (pos % ring->capacity) + sizeof(gsr_replay_entry);
+    *next_pos = pos + entry->entry_size;
+}
+
+static int64_t get_realtime_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (int64_t)now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/* Checks an entry that was written by another process, so that a corrupt entry can't make a reader go out of bounds */
+static bool entry_is_valid(const gsr_replay_ring *ring, const gsr_replay_entry *entry, uint64_t pos, uint64_t end) {
+    return !(entry->flags & ENTRY_FLAG_WRAP)
+        && entry->entry_size >= sizeof(gsr_replay_entry)
+        && entry->size <= entry->entry_size - sizeof(gsr_replay_entry)
+        && entry->entry_size <= end - pos
+        && (pos % ring->capacity) + entry->entry_size <= ring->capacity;
+}
+
+static void ring_clear(gsr_replay_ring *ring) {
+    ring->head = 0;
+    ring->tail = 0;
+    ring->head_seq = 0;
+    ring->tail_seq = 0;
+    ring->keyframes_start = 0;
+    ring->num_keyframes = 0;
+    ring_publish_head(ring);
+    ring_publish_tail(ring);
+}
+
+/*
+    Rebuilds the state of a ring from the entries between the tail and head in its shared memory header, which were written by a previous process.
+    Returns false if the entries are corrupt.
+*/
+static bool ring_restore(gsr_replay_buffer *self, gsr_replay_ring *ring) {
+    const uint64_t head = atomic_load(&ring->shm_header->head);
+    const uint64_t tail = atomic_load(&ring->shm_header->tail);
+    if(head < tail || head - tail > ring->capacity)
+        return false;
+
+    ring->head = head;
+    ring->tail = tail;
+    ring->head_seq = 0;
+    ring->tail_seq = 0;
+
+    bool first = true;
+    uint64_t pos = tail;
+    while((pos = skip_padding(ring, pos, head)) < head) {
+        const gsr_replay_entry *entry = entry_at(ring, pos);
+        if(!entry_is_valid(ring, entry, pos, head))
+            return false;
+
+        if(first) {
+            ring->head_seq = entry->seq;
+            ring->tail_seq = entry->seq;
+            first = false;
+        } else if(entry->seq != ring->head_seq) {
+            return false;
+        }
+
+        if(entry->stream_index == self->params.keyframe_stream_index && (entry->flags & GSR_REPLAY_PACKET_FLAG_KEY)) {
+            gsr_replay_keyframe keyframe;
+            keyframe.pos = pos;
+            keyframe.seq = entry->seq;
+            keyframe.timestamp = entry->timestamp;
+            if(!push_keyframe(ring, &keyframe))
+                return false;
+        }
+
+        pos += entry->entry_size;
+        ++ring->head_seq;
+    }
+
+    if(pos != head)
+        return false;
+
+    atomic_store(&ring->published_head, head);
+    atomic_store(&ring->published_tail, tail);
+    self->reattached = !ring_is_empty(ring);
+    return true;
+}
+
+static void ring_evict_to(gsr_replay_ring *ring, uint64_t pos, uint64_t seq) {
+    ring->tail = pos;
+    ring->tail_seq = seq;
+    ring_publish_tail(ring);
+    pop_keyframes_before_tail(ring);
+}
+
+/* Gets the position of the next gop, or of the entry after the oldest entry if there is no next keyframe. The ring can't be empty */
+static void ring_get_oldest_gop_end(const gsr_replay_ring *ring, uint64_t *pos, uint64_t *seq) {
+    const gsr_replay_keyframe *gop_start = next_gop_start(ring);
+    if(gop_start) {
+        *pos = gop_start->pos;
+        *seq = gop_start->seq;
+    } else {
+        const uint64_t tail = skip_padding(ring, ring->tail, ring->head);
+        *pos = skip_padding(ring, tail + entry_at(ring, tail)->entry_size, ring->head);
+        *seq = ring->tail_seq + 1;
+    }
+}
+
+/* Returns the oldest position that can't be overwritten */
+static uint64_t ring_get_reclaim_pos(const gsr_replay_ring *ring, uint64_t pos) {
+    for(int i = 0; i < GSR_REPLAY_BUFFER_MAX_SNAPSHOTS; ++i) {
+        const uint64_t pin = atomic_load(&ring->pins[i]);
+        if(pin < pos)
+            pos = pin;
+    }
+    return pos;
+}
+
+/*
+    Starts writing the new entry to disk, without waiting for it. The writeback thread makes sure the entries that are DISK_WRITEBACK_LAG behind it
+    are on disk, so their pages are clean and can be dropped. Otherwise the whole file would end up in memory
+*/
+static void ring_writeback(gsr_replay_ring *ring, uint64_t pos, size_t size) {
+    sync_file_range(ring->fd, pos % ring->capacity, size, SYNC_FILE_RANGE_WRITE);
+
+    const uint64_t new_head = pos + size;
+    if(new_head - ring->writeback_signaled_head >= DISK_WRITEBACK_CHUNK) {
+        ring->writeback_signaled_head = new_head;
+        /* The writeback thread only holds the mutex while it checks the head, never while it waits for the disk */
+        pthread_mutex_lock(&ring->writeback_mutex);
+        ring->writeback_head = new_head;
+        pthread_cond_signal(&ring->writeback_cond);
+        pthread_mutex_unlock(&ring->writeback_mutex);
+    }
+}
+
+static bool evict_oldest_gop(gsr_replay_buffer *self, gsr_replay_ring *ring);
+
+/* Writes a wrap entry at the head if there is room for it, so that readers that are at the head skip the padding */
+static void write_padding(gsr_replay_ring *ring, size_t padding) {
+    if(padding >= sizeof(gsr_replay_entry)) {
+        gsr_replay_entry *wrap_entry = (gsr_replay_entry*)(ring->arena + (ring->head % ring->capacity));
+        memset(wrap_entry, 0, sizeof(gsr_replay_entry));
+        wrap_entry->flags = ENTRY_FLAG_WRAP;
+        wrap_entry->entry_size = padding;
+    }
+    ring->head += padding;
+}
+
+/*
+    Makes room for an entry of |entry_size| bytes at the head. Returns NULL if snapshots are pinning the space that is needed,
+    in this ring or in the disk ring that the oldest gop would be moved to. Nothing is evicted in that case, unless a snapshot pins the tail while this runs
+*/
+static gsr_replay_entry* ring_reserve(gsr_replay_buffer *self, gsr_replay_ring *ring, size_t entry_size) {
+    const size_t remaining = ring->capacity - (ring->head % ring->capacity);
+    size_t padding = remaining < entry_size ? remaining : 0;
+
+    /* The pins are checked again after evicting, because a snapshot that starts reading the memory ring can pin the tail in the meantime (see |snapshot_pin_tail|) */
+    const uint64_t oldest_pin = ring_get_reclaim_pos(ring, PIN_UNUSED);
+    if(oldest_pin != PIN_UNUSED && ring->head + padding + entry_size - oldest_pin > ring->capacity)
+        return NULL;
+
+    while(ring->head + padding + entry_size - ring->tail > ring->capacity && !ring_is_empty(ring)) {
+        if(!evict_oldest_gop(self, ring))
+            return NULL;
+    }
+
+    if(ring_is_empty(ring) && padding + entry_size > ring->capacity) {
+        /* The packet only fits if it starts at the beginning of the arena. The tail has to move with the head, which has to happen before the pins are checked */
+        write_padding(ring, padding);
+        ring_publish_head(ring);
+        ring_evict_to(ring, ring->head, ring->head_seq);
+        padding = 0;
+    }
+
+    if(ring->head + padding + entry_size - ring_get_reclaim_pos(ring, ring->tail) > ring->capacity) {
+        /* This only happens if saving a replay is slower than recording */
+        return NULL;
+    }
+
+    write_padding(ring, padding);
+    return (gsr_replay_entry*)(ring->arena + (ring->head % ring->capacity));
+}
+
+static bool ring_append(gsr_replay_buffer *self, gsr_replay_ring *ring, const gsr_replay_packet *packet, uint64_t seq) {
+    const size_t entry_size = align_up(sizeof(gsr_replay_entry) + packet->size, ENTRY_ALIGNMENT);
+    if(entry_size > ring->capacity)
+        return false;
+
+    gsr_replay_entry *entry = ring_reserve(self, ring, entry_size);
+    if(!entry)
+        return false;
+
+    if(packet->stream_index == self->params.keyframe_stream_index && (packet->flags & GSR_REPLAY_PACKET_FLAG_KEY)) {
+        gsr_replay_keyframe keyframe;
+        keyframe.pos = ring->head;
+        keyframe.seq = ring->head_seq;
+        keyframe.timestamp = packet->timestamp;
+        if(!push_keyframe(ring, &keyframe)) {
+            fprintf(stderr, "gsr error: gsr_replay_buffer_append: failed to grow the keyframe index\n");
+            return false;
+        }
+    }
+
+    entry->size = packet->size;
+    entry->stream_index = packet->stream_index;
+    entry->flags = packet->flags & ~ENTRY_FLAG_WRAP;
+    entry->entry_size = entry_size;
+    entry->seq = seq;
+    entry->pts = packet->pts;
+    entry->dts = packet->dts;
+    entry->timestamp = packet->timestamp;
+    memcpy((uint8_t*)entry + sizeof(gsr_replay_entry), packet->data, packet->size);
+
+    if(ring->fd != -1)
+        ring_writeback(ring, ring->head, entry_size);
+
+    ring->head += entry_size;
+    ++ring->head_seq;
+    ring_publish_head(ring);
+    return true;
+}
+
+/*
+    Removes everything before the next keyframe, or only the oldest entry if there is no next keyframe.
+    Entries that are removed from the memory ring are moved to the disk ring, if there is one. If the disk ring can't take them
+    (because a snapshot pins it) then only the entries that were moved are removed, and false is returned if that's none of them.
+    The entries are never lost in the memory ring, so a snapshot that is being read doesn't skip them without knowing it
+*/
+static bool evict_oldest_gop(gsr_replay_buffer *self, gsr_replay_ring *ring) {
+    uint64_t gop_end_pos, gop_end_seq;
+    ring_get_oldest_gop_end(ring, &gop_end_pos, &gop_end_seq);
+
+    if(self->has_disk_ring && ring == &self->rings[GSR_REPLAY_BUFFER_RING_MEMORY]) {
+        gsr_replay_ring *disk_ring = &self->rings[GSR_REPLAY_BUFFER_RING_DISK];
+        uint64_t pos = ring->tail;
+        gsr_replay_packet packet;
+        for(uint64_t seq = ring->tail_seq; seq < gop_end_seq; ++seq) {
+            pos = skip_padding(ring, pos, ring->head);
+            const uint64_t packet_pos = pos;
+            const uint64_t packet_seq = entry_at(ring, pos)->seq;
+            read_entry(ring, pos, &packet, &pos);
+            if(!ring_append(self, disk_ring, &packet, packet_seq)) {
+                /* The rest of the gop stays in the memory ring, it continues where the disk ring ends */
+                if(seq == ring->tail_seq)
+                    return false;
+                ring_evict_to(ring, packet_pos, seq);
+                return true;
+            }
+        }
+    }
+
+    ring_evict_to(ring, gop_end_pos, gop_end_seq);
+    return true;
+}
+
+/* Returns the ring with the oldest packets, or NULL if the replay buffer is empty */
+static gsr_replay_ring* get_oldest_ring(gsr_replay_buffer *self) {
+    for(int i = 0; i < GSR_REPLAY_BUFFER_NUM_RINGS; ++i) {
+        if(!ring_is_empty(&self->rings[i]))
+            return &self->rings[i];
+    }
+    return NULL;
+}
+
+/* Only whole gops are removed, so that the replay buffer always starts with a keyframe and is at least |max_duration_secs| long */
+static void evict_expired(gsr_replay_buffer *self, double newest_timestamp) {
+    gsr_replay_ring *memory_ring = &self->rings[GSR_REPLAY_BUFFER_RING_MEMORY];
+    for(;;) {
+        gsr_replay_ring *ring = get_oldest_ring(self);
+        if(!ring || gsr_replay_buffer_get_num_packets(self) <= 1)
+            break;
+
+        uint64_t gop_end_pos, gop_end_seq;
+        if(self->params.keyframe_stream_index < 0) {
+            const gsr_replay_entry *oldest = entry_at(ring, skip_padding(ring, ring->tail, ring->head));
+            if(newest_timestamp - oldest->timestamp <= self->params.max_duration_secs)
+                break;
+
+            ring_get_oldest_gop_end(ring, &gop_end_pos, &gop_end_seq);
+            ring_evict_to(ring, gop_end_pos, gop_end_seq);
+            continue;
+        }
+
+        const gsr_replay_keyframe *gop_start = next_gop_start(ring);
+        if(gop_start) {
+            if(newest_timestamp - gop_start->timestamp < self->params.max_duration_secs)
+                break;
+            ring_evict_to(ring, gop_start->pos, gop_start->seq);
+        } else if(ring != memory_ring && memory_ring->num_keyframes > 0) {
+            /* The next gop starts in the memory ring, so everything in the disk ring goes */
+            const gsr_replay_keyframe memory_gop_start = *keyframe_at(memory_ring, 0);
+            if(newest_timestamp - memory_gop_start.timestamp < self->params.max_duration_secs)
+                break;
+            ring_evict_to(ring, ring->head, ring->head_seq);
+            ring_evict_to(memory_ring, memory_gop_start.pos, memory_gop_start.seq);
+        } else {
+            break;
+        }
+    }
+}
+
+static bool append_to_memory_ring(gsr_replay_buffer *self, const gsr_replay_packet *packet) {
+    gsr_replay_ring *memory_ring = &self->rings[GSR_REPLAY_BUFFER_RING_MEMORY];
+    if(!ring_append(self, memory_ring, packet, memory_ring->head_seq))
+        return false;
+
+    /* The streams are encoded with different delays, so only the timestamps of one stream decide how long the replay buffer is */
+    if(self->params.keyframe_stream_index < 0 || packet->stream_index == self->params.keyframe_stream_index) {
+        evict_expired(self, packet->timestamp);
+        if(memory_ring->shm_header) {
+            memory_ring->shm_header->newest_timestamp = packet->timestamp;
+            memory_ring->shm_header->newest_realtime_ns = get_realtime_ns();
+        }
+    }
+    return true;
+}
+
+/* Moves the spilled packets to the memory ring, for as long as they fit */
+static void flush_spill(gsr_replay_buffer *self) {
+    gsr_replay_ring *spill_ring = &self->spill_ring;
+    while(!ring_is_empty(spill_ring)) {
+        gsr_replay_packet packet;
+        uint64_t next_pos;
+        read_entry(spill_ring, skip_padding(spill_ring, spill_ring->tail, spill_ring->head), &packet, &next_pos);
+        if(!append_to_memory_ring(self, &packet))
+            break;
+        ring_evict_to(spill_ring, next_pos, spill_ring->tail_seq + 1);
+    }
+}
+
+/* Returns false if the spill ring is full, nothing is evicted from it */
+static bool spill_packet(gsr_replay_buffer *self, const gsr_replay_packet *packet) {
+    gsr_replay_ring *spill_ring = &self->spill_ring;
+    const size_t entry_size = align_up(sizeof(gsr_replay_entry) + packet->size, ENTRY_ALIGNMENT);
+    const size_t remaining = spill_ring->capacity - (spill_ring->head % spill_ring->capacity);
+    const size_t padding = remaining < entry_size ? remaining : 0;
+    if(entry_size > spill_ring->capacity || (!ring_is_empty(spill_ring) && spill_ring->head + padding + entry_size - spill_ring->tail > spill_ring->capacity))
+        return false;
+    return ring_append(self, spill_ring, packet, spill_ring->head_seq);
+}
+
+bool gsr_replay_buffer_append(gsr_replay_buffer *self, const gsr_replay_packet *packet) {
+    const bool is_keyframe_stream = packet->stream_index == self->params.keyframe_stream_index;
+    if(self->drop_until_keyframe && is_keyframe_stream) {
+        if(!(packet->flags & GSR_REPLAY_PACKET_FLAG_KEY)) {
+            ++self->num_dropped_packets;
+            return false;
+        }
+        self->drop_until_keyframe = false;
+    }
+
+    gsr_replay_packet new_packet = *packet;
+    if(self->discontinuity)
+        new_packet.flags |= GSR_REPLAY_PACKET_FLAG_DISCONTINUITY;
+
+    /* The spilled packets go first, so the packets stay in order. A packet that is larger than the whole arena would never leave the spill ring */
+    flush_spill(self);
+    const bool fits_in_arena = align_up(sizeof(gsr_replay_entry) + packet->size, ENTRY_ALIGNMENT) <= self->rings[GSR_REPLAY_BUFFER_RING_MEMORY].capacity;
+    if(fits_in_arena && ((ring_is_empty(&self->spill_ring) && append_to_memory_ring(self, &new_packet)) || spill_packet(self, &new_packet))) {
+        self->discontinuity = false;
+        return true;
+    }
+
+    ++self->num_dropped_packets;
+    self->discontinuity = true;
+    if(is_keyframe_stream)
+        self->drop_until_keyframe = true;
+    return false;
+}
+
+size_t gsr_replay_buffer_get_num_packets(const gsr_replay_buffer *self) {
+    size_t num_packets = 0;
+    for(int i = 0; i < GSR_REPLAY_BUFFER_NUM_RINGS; ++i) {
+        num_packets += self->rings[i].head_seq - self->rings[i].tail_seq;
+    }
+    return num_packets;
+}
+
+size_t gsr_replay_buffer_get_size_bytes(const gsr_replay_buffer *self) {
+    size_t size = 0;
+    for(int i = 0; i < GSR_REPLAY_BUFFER_NUM_RINGS; ++i) {
+        size += self->rings[i].head - self->rings[i].tail;
+    }
+    return size;
+}
+
+uint64_t gsr_replay_buffer_get_num_dropped_packets(const gsr_replay_buffer *self) {
+    return self->num_dropped_packets;
+}
+
+bool gsr_replay_buffer_get_resume_timestamp(const gsr_replay_buffer *self, double *timestamp) {
+    const gsr_replay_shm_header *header = self->rings[GSR_REPLAY_BUFFER_RING_MEMORY].shm_header;
+    if(!self->reattached)
+        return false;
+
+    const double secs_since_newest = (double)(get_realtime_ns() - header->newest_realtime_ns) * 0.000000001;
+    *timestamp = header->newest_timestamp + (secs_since_newest > 0.0 ? secs_since_newest : 0.0);
+    return true;
+}
+
+gsr_replay_buffer_iterator gsr_replay_buffer_begin(const gsr_replay_buffer *self) {
+    gsr_replay_buffer_iterator it;
+    it.ring = GSR_REPLAY_BUFFER_RING_MEMORY;
+    for(int i = 0; i < GSR_REPLAY_BUFFER_NUM_RINGS; ++i) {
+        if(!ring_is_empty(&self->rings[i])) {
+            it.ring = i;
+            break;
+        }
+    }
+    it.pos = self->rings[it.ring].tail;
+    return it;
+}
+
+bool gsr_replay_buffer_find_first_keyframe(const gsr_replay_buffer *self, gsr_replay_buffer_iterator *it) {
+    for(int i = 0; i < GSR_REPLAY_BUFFER_NUM_RINGS; ++i) {
+        const gsr_replay_ring *ring = &self->rings[i];
+        if(ring->num_keyframes > 0) {
+            it->ring = i;
+            it->pos = keyframe_at(ring, 0)->pos;
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Returns the number of keyframes in the ring with a timestamp before or at |timestamp| */
+static size_t count_keyframes_before(const gsr_replay_ring *ring, double timestamp) {
+    size_t low = 0;
+    size_t high = ring->num_keyframes;
+    while(low < high) {
+        const size_t mid = low + (high - low) / 2;
+        if(keyframe_at(ring, mid)->timestamp <= timestamp)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return low;
+}
+
+bool gsr_replay_buffer_find_keyframe_before(const gsr_replay_buffer *self, double timestamp, gsr_replay_buffer_iterator *it) {
+    if(!gsr_replay_buffer_find_first_keyframe(self, it))
+        return false;
+
+    for(int i = 0; i < GSR_REPLAY_BUFFER_NUM_RINGS; ++i) {
+        const gsr_replay_ring *ring = &self->rings[i];
+        const size_t num_keyframes_before = count_keyframes_before(ring, timestamp);
+        if(num_keyframes_before > 0) {
+            it->ring = i;
+            it->pos = keyframe_at(ring, num_keyframes_before - 1)->pos;
+        }
+    }
+    return true;
+}
+
+bool gsr_replay_buffer_next(const gsr_replay_buffer *self, gsr_replay_buffer_iterator *it, gsr_replay_packet *packet) {
+    for(;;) {
+        const gsr_replay_ring *ring = &self->rings[it->ring];
+        it->pos = skip_padding(ring, it->pos, ring->head);
+        if(it->pos < ring->head) {
+            read_entry(ring, it->pos, packet, &it->pos);
+            return true;
+        }
+
+        if(it->ring + 1 >= GSR_REPLAY_BUFFER_NUM_RINGS)
+            return false;
+
+        ++it->ring;
+        it->pos = self->rings[it->ring].tail;
+    }
+}
+
+/* Returns the sequence number of the first packet at or after |pos| */
+static uint64_t get_seq_at(const gsr_replay_ring *ring, uint64_t pos, uint64_t head_seq) {
+    pos = skip_padding(ring, pos, ring->head);
+    return pos < ring->head ? entry_at(ring, pos)->seq : head_seq;
+}
+
+bool gsr_replay_buffer_snapshot_create(gsr_replay_buffer *self, const gsr_replay_buffer_iterator *start, double end_timestamp, gsr_replay_buffer_snapshot *snapshot) {
+    gsr_replay_ring *memory_ring = &self->rings[GSR_REPLAY_BUFFER_RING_MEMORY];
+    for(int i = 0; i < GSR_REPLAY_BUFFER_MAX_SNAPSHOTS; ++i) {
+        if(atomic_exchange(&self->snapshot_used[i], true))
+            continue;
+
+        snapshot->buffer = self;
+        snapshot->pin_index = i;
+        snapshot->ring = start->ring;
+        snapshot->pos[GSR_REPLAY_BUFFER_RING_DISK] = self->rings[GSR_REPLAY_BUFFER_RING_DISK].head;
+        snapshot->pos[GSR_REPLAY_BUFFER_RING_MEMORY] = memory_ring->head;
+        snapshot->pos[start->ring] = start->pos;
+        snapshot->seq = get_seq_at(&self->rings[start->ring], start->pos, memory_ring->head_seq);
+        snapshot->end_seq = memory_ring->head_seq;
+        snapshot->end_timestamp = end_timestamp;
+        /* When starting in the disk ring the memory ring isn't pinned yet, so the packets in it can still be moved to the disk ring while the snapshot is read */
+        atomic_store(&self->rings[start->ring].pins[i], start->pos);
+        return true;
+    }
+    return false;
+}
+
+void gsr_replay_buffer_snapshot_destroy(gsr_replay_buffer_snapshot *snapshot) {
+    if(snapshot->pin_index == -1)
+        return;
+
+    gsr_replay_buffer *self = snapshot->buffer;
+    for(int i = 0; i < GSR_REPLAY_BUFFER_NUM_RINGS; ++i) {
+        atomic_store_explicit(&self->rings[i].pins[snapshot->pin_index], PIN_UNUSED, memory_order_release);
+    }
+    atomic_store_explicit(&self->snapshot_used[snapshot->pin_index], false, memory_order_release);
+    snapshot->pin_index = -1;
+}
+
+/*
+    Pins the oldest entry of the ring. The pin is stored before the tail is checked again and the writer moves the tail
+    before checking the pins, so either the writer sees the pin or this sees the new tail and tries again.
+*/
+static uint64_t snapshot_pin_tail(gsr_replay_ring *ring, int pin_index) {
+    uint64_t tail = atomic_load(&ring->published_tail);
+    for(;;) {
+        atomic_store(&ring->pins[pin_index], tail);
+        const uint64_t new_tail = atomic_load(&ring->published_tail);
+        if(new_tail == tail)
+            return tail;
+        tail = new_tail;
+    }
+}
+
+bool gsr_replay_buffer_snapshot_next(gsr_replay_buffer_snapshot *snapshot, gsr_replay_packet *packet) {
+    gsr_replay_ring *disk_ring = &snapshot->buffer->rings[GSR_REPLAY_BUFFER_RING_DISK];
+    gsr_replay_ring *memory_ring = &snapshot->buffer->rings[GSR_REPLAY_BUFFER_RING_MEMORY];
+    while(snapshot->seq < snapshot->end_seq) {
+        gsr_replay_ring *ring = &snapshot->buffer->rings[snapshot->ring];
+        uint64_t *pos = &snapshot->pos[snapshot->ring];
+        const uint64_t head = atomic_load_explicit(&ring->published_head, memory_order_acquire);
+
+        *pos = skip_padding(ring, *pos, head);
+        /* The previously returned packet is no longer used, allow the space to be reused */
+        atomic_store_explicit(&ring->pins[snapshot->pin_index], *pos, memory_order_release);
+
+        if(*pos == head) {
+            if(ring == memory_ring)
+                return false;
+
+            /* The rest of the packets haven't been moved to the disk ring (yet) */
+            snapshot->ring = GSR_REPLAY_BUFFER_RING_MEMORY;
+            snapshot->pos[GSR_REPLAY_BUFFER_RING_MEMORY] = snapshot_pin_tail(memory_ring, snapshot->pin_index);
+            continue;
+        }
+
+        const gsr_replay_entry *entry = entry_at(ring, *pos);
+        if(entry->seq < snapshot->seq) {
+            /* Already read from the other ring */
+            *pos += entry->entry_size;
+            continue;
+        }
+
+        if(ring == memory_ring && entry->seq > snapshot->seq && snapshot->pos[GSR_REPLAY_BUFFER_RING_DISK] != atomic_load_explicit(&disk_ring->published_head, memory_order_acquire)) {
+            /* The packets were moved to the disk ring after the disk ring was read */
+            atomic_store_explicit(&ring->pins[snapshot->pin_index], PIN_UNUSED, memory_order_release);
+            snapshot->ring = GSR_REPLAY_BUFFER_RING_DISK;
+            continue;
+        }
+
+        if(entry->seq >= snapshot->end_seq)
+            break;
+
+        /* Packets between the previous packet and this one are missing (they were evicted from a ring that the snapshot didn't pin) */
+        const bool packets_missing = entry->seq > snapshot->seq;
+
+        if(entry->timestamp > snapshot->end_timestamp) {
+            /* Other streams can still have packets within the end after this, so their packets after the end are skipped instead of ending the snapshot */
+            if(snapshot->buffer->params.keyframe_stream_index < 0 || entry->stream_index == snapshot->buffer->params.keyframe_stream_index)
+                break;
+            snapshot->seq = entry->seq + 1;
+            *pos += entry->entry_size;
+            continue;
+        }
+
+        snapshot->seq = entry->seq + 1;
+        read_entry(ring, *pos, packet, pos);
+        if(packets_missing)
+            packet->flags |= GSR_REPLAY_PACKET_FLAG_DISCONTINUITY;
+        return true;
+    }
+    return false;
+}
+
+struct gsr_replay_buffer_reader {
+    const gsr_replay_shm_header *header;
+    size_t mapping_size;
+    gsr_replay_ring ring; /* Only |arena| and |capacity| are used */
+    uint64_t pos;
+    uint64_t end;
+    uint8_t *data; /* Copy of the data of the last packet */
+    size_t data_capacity;
+};
+
+gsr_replay_buffer_reader* gsr_replay_buffer_reader_open(const char *shm_name) {
+    const int fd = shm_open(shm_name, O_RDONLY | O_CLOEXEC, 0);
+    if(fd == -1) {
+        fprintf(stderr, "gsr error: gsr_replay_buffer_reader_open: failed to open shared memory %s, error: %s\n", shm_name, strerror(errno));
+        return NULL;
+    }
+
+    struct stat st;
+    if(fstat(fd, &st) == -1 || (size_t)st.st_size < shm_header_size()) {
+        fprintf(stderr, "gsr error: gsr_replay_buffer_reader_open: shared memory %s is not a replay buffer\n", shm_name);
+        close(fd);
+        return NULL;
+    }
+
+    uint8_t *mapping = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(mapping == MAP_FAILED) {
+        fprintf(stderr, "gsr error: gsr_replay_buffer_reader_open: failed to map shared memory %s, error: %s\n", shm_name, strerror(errno));
+        return NULL;
+    }
+
+    const gsr_replay_shm_header *header = (const gsr_replay_shm_header*)mapping;
+    if(header->magic != SHM_MAGIC || header->version != SHM_VERSION || shm_header_size() + header->capacity != (size_t)st.st_size) {
+        fprintf(stderr, "gsr error: gsr_replay_buffer_reader_open: shared memory %s is not a replay buffer or it was created by a different version\n", shm_name);
+        munmap(mapping, st.st_size);
+        return NULL;
+    }
+
+    gsr_replay_buffer_reader *self = calloc(1, sizeof(gsr_replay_buffer_reader));
+    if(!self) {
+        munmap(mapping, st.st_size);
+        return NULL;
+    }
+
+    self->header = header;
+    self->mapping_size = st.st_size;
+    self->ring.arena = mapping + shm_header_size();
+    self->ring.capacity = header->capacity;
+    return self;
+}
+
+void gsr_replay_buffer_reader_close(gsr_replay_buffer_reader *self) {
+    munmap((void*)self->header, self->mapping_size);
+    free(self->data);
+    free(self);
+}
+
+const void* gsr_replay_buffer_reader_get_stream_info(const gsr_replay_buffer_reader *self, size_t *size) {
+    *size = self->header->stream_info_size;
+    return self->header->stream_info;
+}
+
+/* Returns true if the recording has moved its tail past |pos|, which means that what was read at |pos| may have been overwritten */
+static bool reader_is_overwritten(const gsr_replay_buffer_reader *self, uint64_t pos) {
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&self->header->tail, memory_order_relaxed) > pos;
+}
+
+/* Returns false if the entries were overwritten while they were scanned, or if they don't make sense because they were being overwritten */
+static bool reader_find_start(gsr_replay_buffer_reader *self, double duration_secs, uint64_t tail, uint64_t head, uint64_t *start, bool *found) {
+    const int keyframe_stream_index = self->header->keyframe_stream_index;
+    double newest_timestamp = -1.0;
+    uint64_t pos = tail;
+    while((pos = skip_padding(&self->ring, pos, head)) < head) {
+        const gsr_replay_entry *entry = entry_at(&self->ring, pos);
+        if(!entry_is_valid(&self->ring, entry, pos, head))
+            return false;
+        if(entry->stream_index == keyframe_stream_index && entry->timestamp > newest_timestamp)
+            newest_timestamp = entry->timestamp;
+        pos += entry->entry_size;
+    }
+
+    *found = false;
+    pos = tail;
+    while((pos = skip_padding(&self->ring, pos, head)) < head) {
+        const gsr_replay_entry *entry = entry_at(&self->ring, pos);
+        if(!entry_is_valid(&self->ring, entry, pos, head))
+            return false;
+
+        if(entry->stream_index == keyframe_stream_index && (entry->flags & GSR_REPLAY_PACKET_FLAG_KEY)) {
+            if(!*found || (duration_secs > 0.0 && entry->timestamp <= newest_timestamp - duration_secs)) {
+                *start = pos;
+                *found = true;
+            }
+        }
+        pos += entry->entry_size;
+    }
+
+    return !reader_is_overwritten(self, tail);
+}
+
+bool gsr_replay_buffer_reader_seek(gsr_replay_buffer_reader *self, double duration_secs) {
+    for(int attempt = 0; attempt < 10; ++attempt) {
+        const uint64_t head = atomic_load_explicit(&self->header->head, memory_order_acquire);
+        const uint64_t tail = atomic_load_explicit(&self->header->tail, memory_order_acquire);
+        if(head < tail || head - tail > self->ring.capacity)
+            continue;
+
+        uint64_t start = tail;
+        bool found = false;
+        if(!reader_find_start(self, duration_secs, tail, head, &start, &found))
+            continue;
+
+        self->pos = start;
+        self->end = head;
+        return found;
+    }
+
+    fprintf(stderr, "gsr error: gsr_replay_buffer_reader_seek: the replay buffer changed too quickly to be read\n");
+    return false;
+}
+
+bool gsr_replay_buffer_reader_next(gsr_replay_buffer_reader *self, gsr_replay_packet *packet) {
+    const uint64_t pos = self->pos;
+    self->pos = skip_padding(&self->ring, self->pos, self->end);
+    if(self->pos >= self->end)
+        return false;
+
+    gsr_replay_entry entry;
+    memcpy(&entry, entry_at(&self->ring, self->pos), sizeof(entry));
+    const bool valid = entry_is_valid(&self->ring, &entry, self->pos, self->end);
+    if(valid) {
+        if(entry.size > self->data_capacity) {
+            uint8_t *new_data = realloc(self->data, entry.size);
+            if(!new_data) {
+                fprintf(stderr, "gsr error: gsr_replay_buffer_reader_next: failed to allocate %u bytes\n", entry.size);
+                return false;
+            }
+            self->data = new_data;
+            self->data_capacity = entry.size;
+        }
+        memcpy(self->data, self->ring.arena + (self->pos % self->ring.capacity) + sizeof(gsr_replay_entry), entry.size);
+    }
+
+    if(reader_is_overwritten(self, pos)) {
+        fprintf(stderr, "gsr error: gsr_replay_buffer_reader_next: the packets were overwritten by the recording before they could be read\n");
+        self->pos = self->end;
+        return false;
+    }
+
+    if(!valid) {
+        fprintf(stderr, "gsr error: gsr_replay_buffer_reader_next: the replay buffer is corrupt\n");
+        self->pos = self->end;
+        return false;
+    }
+
+    packet->data = self->data;
+    packet->size = entry.size;
+    packet->stream_index = entry.stream_index;
+    packet->flags = entry.flags;
+    packet->pts = entry.pts;
+    packet->dts = entry.dts;
+    packet->timestamp = entry.timestamp;
+    packet->fd = -1;
+    packet->fd_offset = 0;
+    self->pos += entry.entry_size;
+    return true;
+}
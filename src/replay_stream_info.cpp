@@ -0,0 +1,73 @@
+#include "../include/replay_stream_info.hpp"
+#include <stdio.h>
+#include <string.h>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+}
+
+bool replay_streams_info_add(ReplayStreamsInfo &streams_info, const AVCodecContext *codec_context) {
+    if(streams_info.num_streams >= REPLAY_STREAM_INFO_MAX_STREAMS) {
+        fprintf(stderr, "Error: replay_streams_info_add: too many streams, the max is %d\n", REPLAY_STREAM_INFO_MAX_STREAMS);
+        return false;
+    }
+
+    if(codec_context->extradata_size < 0 || codec_context->extradata_size > REPLAY_STREAM_INFO_MAX_EXTRADATA_SIZE) {
+        fprintf(stderr, "Error: replay_streams_info_add: codec extradata is too large (%d bytes), the max is %d\n", codec_context->extradata_size, REPLAY_STREAM_INFO_MAX_EXTRADATA_SIZE);
+        return false;
+    }
+
+    ReplayStreamInfo &stream_info = streams_info.streams[streams_info.num_streams];
+    stream_info.codec_type = codec_context->codec_type;
+    stream_info.codec_id = codec_context->codec_id;
+    stream_info.width = codec_context->width;
+    stream_info.height = codec_context->height;
+    stream_info.sample_rate = codec_context->sample_rate;
+#if LIBAVCODEC_VERSION_MAJOR < 60
+    stream_info.num_channels = codec_context->channels;
+#else
+    stream_info.num_channels = codec_context->ch_layout.nb_channels;
+#endif
+    stream_info.frame_size = codec_context->frame_size;
+    stream_info.format = codec_context->codec_type == AVMEDIA_TYPE_AUDIO ? (int32_t)codec_context->sample_fmt : (int32_t)codec_context->pix_fmt;
+    stream_info.time_base_num = codec_context->time_base.num;
+    stream_info.time_base_den = codec_context->time_base.den;
+    stream_info.framerate_num = codec_context->framerate.num;
+    stream_info.framerate_den = codec_context->framerate.den;
+    stream_info.extradata_size = codec_context->extradata_size;
+    if(codec_context->extradata_size > 0)
+        memcpy(stream_info.extradata, codec_context->extradata, codec_context->extradata_size);
+
+    ++streams_info.num_streams;
+    return true;
+}
+
+bool replay_stream_info_to_codec_parameters(const ReplayStreamInfo &stream_info, AVCodecParameters *codecpar) {
+    if(stream_info.extradata_size > REPLAY_STREAM_INFO_MAX_EXTRADATA_SIZE)
+        return false;
+
+    codecpar->codec_type = (AVMediaType)stream_info.codec_type;
+    codecpar->codec_id = (AVCodecID)stream_info.codec_id;
+    codecpar->format = stream_info.format;
+    codecpar->width = stream_info.width;
+    codecpar->height = stream_info.height;
+    codecpar->sample_rate = stream_info.sample_rate;
+    codecpar->frame_size = stream_info.frame_size;
+    if(stream_info.codec_type == AVMEDIA_TYPE_AUDIO) {
+#if LIBAVCODEC_VERSION_MAJOR < 60
+        codecpar->channels = stream_info.num_channels;
+        codecpar->channel_layout = av_get_default_channel_layout(stream_info.num_channels);
+#else
+        av_channel_layout_default(&codecpar->ch_layout, stream_info.num_channels);
+#endif
+    }
+
+    if(stream_info.extradata_size > 0) {
+        codecpar->extradata = (uint8_t*)av_mallocz(stream_info.extradata_size + AV_INPUT_BUFFER_PADDING_SIZE);
+        if(!codecpar->extradata)
+            return false;
+        memcpy(codecpar->extradata, stream_info.extradata, stream_info.extradata_size);
+        codecpar->extradata_size = stream_info.extradata_size;
+    }
+    return true;
+}
@@ -8,61 +8,161 @@ extern "C" {
 #include <string.h>
 #include <cmath>
 #include <time.h>
+#include <unistd.h>
+#include <assert.h>
+#include <algorithm>
 
 #include <pulse/pulseaudio.h>
 #include <pulse/mainloop.h>
 #include <pulse/xmalloc.h>
 #include <pulse/error.h>
 
-#define CHECK_DEAD_GOTO(p, rerror, label)                               \
-    do {                                                                \
-        if (!(p)->context || !PA_CONTEXT_IS_GOOD(pa_context_get_state((p)->context)) || \
-            !(p)->stream || !PA_STREAM_IS_GOOD(pa_stream_get_state((p)->stream))) { \
-            if (((p)->context && pa_context_get_state((p)->context) == PA_CONTEXT_FAILED) || \
-                ((p)->stream && pa_stream_get_state((p)->stream) == PA_STREAM_FAILED)) { \
-                if (rerror)                                             \
-                    *(rerror) = pa_context_errno((p)->context);         \
-            } else                                                      \
-                if (rerror)                                             \
-                    *(rerror) = PA_ERR_BADSTATE;                        \
-            goto label;                                                 \
-        }                                                               \
-    } while(false);
+// Every device records through the same connection to the server, with one main loop. The main loop is only run by the thread that calls
+// |sound_devices_iterate|, so all devices are read by one thread that sleeps until any of them has audio
+static pa_mainloop *shared_mainloop = nullptr;
+static pa_context *shared_context = nullptr;
+static int shared_context_num_users = 0;
+// Audio that is received while the devices are being opened (outside |sound_devices_iterate|) is dropped
+static bool shared_mainloop_reading = false;
 
 struct pa_handle {
-    pa_context *context;
-    pa_stream *stream;
-    pa_mainloop *mainloop;
+    pa_stream *stream = nullptr;
 
-    const void *read_data;
-    size_t read_index, read_length;
+    uint8_t *output_data = nullptr;
+    size_t output_index = 0, output_length = 0;
+    unsigned int frames = 0;
 
-    uint8_t *output_data;
-    size_t output_index, output_length;
-
-    int operation_success;
+    SoundDeviceReadCallback read_callback;
 };
 
+static void shared_context_unref() {
+    assert(shared_context_num_users > 0);
+    --shared_context_num_users;
+    if(shared_context_num_users > 0)
+        return;
+
+    if(shared_context) {
+        pa_context_disconnect(shared_context);
+        pa_context_unref(shared_context);
+        shared_context = nullptr;
+    }
+
+    if(shared_mainloop) {
+        pa_mainloop_free(shared_mainloop);
+        shared_mainloop = nullptr;
+    }
+}
+
+// Returns a negative value on failure
+static int shared_context_ref(const char *server, const char *name, int *rerror) {
+    ++shared_context_num_users;
+    if(shared_context)
+        return 0;
+
+    int error = PA_ERR_INTERNAL;
+
+    if (!(shared_mainloop = pa_mainloop_new()))
+        goto fail;
+
+    if (!(shared_context = pa_context_new(pa_mainloop_get_api(shared_mainloop), name)))
+        goto fail;
+
+    if (pa_context_connect(shared_context, server, PA_CONTEXT_NOFLAGS, NULL) < 0) {
+        error = pa_context_errno(shared_context);
+        goto fail;
+    }
+
+    for (;;) {
+        pa_context_state_t state = pa_context_get_state(shared_context);
+
+        if (state == PA_CONTEXT_READY)
+            break;
+
+        if (!PA_CONTEXT_IS_GOOD(state)) {
+            error = pa_context_errno(shared_context);
+            goto fail;
+        }
+
+        pa_mainloop_iterate(shared_mainloop, 1, NULL);
+    }
+
+    return 0;
+
+fail:
+    if (rerror)
+        *rerror = error;
+    shared_context_unref();
+    return -1;
+}
+
 static void pa_sound_device_free(pa_handle *s) {
     assert(s);
 
-    if (s->stream)
+    if (s->stream) {
+        pa_stream_set_read_callback(s->stream, NULL, NULL);
+        pa_stream_disconnect(s->stream);
         pa_stream_unref(s->stream);
-
-    if (s->context) {
-        pa_context_disconnect(s->context);
-        pa_context_unref(s->context);
     }
 
-    if (s->mainloop)
-        pa_mainloop_free(s->mainloop);
-
     if (s->output_data) {
         free(s->output_data);
         s->output_data = NULL;
     }
 
-    pa_xfree(s);
+    delete s;
+    shared_context_unref();
+}
+
+// Returns the CLOCK_MONOTONIC time when the sample at the read index of the stream was recorded
+static double pa_stream_get_read_index_time(pa_stream *stream) {
+    const double now = clock_get_monotonic_seconds();
+    pa_usec_t latency_usec = 0;
+    int negative = 0;
+    // The latency of a record stream is the latency of the source plus the audio that is waiting to be read,
+    // which is how long ago the sample at the read index was recorded
+    if(pa_stream_get_latency(stream, &latency_usec, &negative) != 0 || negative)
+        return now;
+    return now - (double)latency_usec * 0.000001;
+}
+
+// Called by the main loop when the stream has audio. The audio is collected into |p->output_data| and every time it's full
+// (one period) it's given to the read callback, with the time its first sample was recorded
+static void pa_stream_read_cb(pa_stream *stream, size_t, void *userdata) {
+    pa_handle *p = (pa_handle*)userdata;
+    const double bytes_per_second = pa_bytes_per_second(pa_stream_get_sample_spec(stream));
+
+    for(;;) {
+        const void *read_data = NULL;
+        size_t read_length = 0;
+        if(pa_stream_peek(stream, &read_data, &read_length) < 0 || read_length == 0)
+            break;
+
+        const double read_data_time = pa_stream_get_read_index_time(stream);
+
+        // A hole in the stream is filled with silence, so the audio after it keeps its place in time
+        const uint8_t *data = (const uint8_t*)read_data;
+        size_t read_offset = 0;
+        while(read_offset < read_length) {
+            const size_t space_free_in_output_buffer = p->output_length - p->output_index;
+            const size_t copy_size = std::min(space_free_in_output_buffer, read_length - read_offset);
+            if(data)
+                memcpy(p->output_data + p->output_index, data + read_offset, copy_size);
+            else
+                memset(p->output_data + p->output_index, 0, copy_size);
+            p->output_index += copy_size;
+            read_offset += copy_size;
+
+            if(p->output_index == p->output_length) {
+                p->output_index = 0;
+                const double timestamp = read_data_time + ((double)read_offset - (double)p->output_length) / bytes_per_second;
+                if(shared_mainloop_reading && p->read_callback)
+                    p->read_callback(p->output_data, p->frames, timestamp);
+            }
+        }
+
+        if(pa_stream_drop(stream) != 0)
+            break;
+    }
 }
 
 static pa_handle* pa_sound_device_new(const char *server,
@@ -71,20 +171,22 @@ static pa_handle* pa_sound_device_new(const char *server,
         const char *stream_name,
         const pa_sample_spec *ss,
         const pa_buffer_attr *attr,
+        unsigned int period_frame_size,
         int *rerror) {
-    pa_handle *p;
     int error = PA_ERR_INTERNAL, r;
 
-    p = pa_xnew0(pa_handle, 1);
-    p->read_data = NULL;
-    p->read_length = 0;
-    p->read_index = 0;
+    if(shared_context_ref(server, name, rerror) != 0)
+        return NULL;
+
+    pa_handle *p = new pa_handle();
+    p->frames = period_frame_size;
 
-    const int buffer_size = attr->maxlength;
+    const int buffer_size = attr->fragsize;
     void *buffer = malloc(buffer_size);
     if(!buffer) {
         fprintf(stderr, "failed to allocate buffer for audio\n");
         *rerror = -1;
+        pa_sound_device_free(p);
         return NULL;
     }
 
@@ -92,41 +194,18 @@ static pa_handle* pa_sound_device_new(const char *server,
     p->output_length = buffer_size;
     p->output_index = 0;
 
-    if (!(p->mainloop = pa_mainloop_new()))
+    if (!(p->stream = pa_stream_new(shared_context, stream_name, ss, NULL))) {
+        error = pa_context_errno(shared_context);
         goto fail;
-
-    if (!(p->context = pa_context_new(pa_mainloop_get_api(p->mainloop), name)))
-        goto fail;
-
-    if (pa_context_connect(p->context, server, PA_CONTEXT_NOFLAGS, NULL) < 0) {
-        error = pa_context_errno(p->context);
-        goto fail;
-    }
-
-    for (;;) {
-        pa_context_state_t state = pa_context_get_state(p->context);
-
-        if (state == PA_CONTEXT_READY)
-            break;
-
-        if (!PA_CONTEXT_IS_GOOD(state)) {
-            error = pa_context_errno(p->context);
-            goto fail;
-        }
-
-        pa_mainloop_iterate(p->mainloop, 1, NULL);
     }
 
-    if (!(p->stream = pa_stream_new(p->context, stream_name, ss, NULL))) {
-        error = pa_context_errno(p->context);
-        goto fail;
-    }
+    pa_stream_set_read_callback(p->stream, pa_stream_read_cb, p);
 
     r = pa_stream_connect_record(p->stream, dev, attr,
         (pa_stream_flags_t)(PA_STREAM_INTERPOLATE_TIMING|PA_STREAM_ADJUST_LATENCY|PA_STREAM_AUTO_TIMING_UPDATE));
 
     if (r < 0) {
-        error = pa_context_errno(p->context);
+        error = pa_context_errno(shared_context);
         goto fail;
     }
 
@@ -137,11 +216,11 @@ static pa_handle* pa_sound_device_new(const char *server,
             break;
 
         if (!PA_STREAM_IS_GOOD(state)) {
-            error = pa_context_errno(p->context);
+            error = pa_context_errno(shared_context);
             goto fail;
         }
 
-        pa_mainloop_iterate(p->mainloop, 1, NULL);
+        pa_mainloop_iterate(shared_mainloop, 1, NULL);
     }
 
     return p;
@@ -153,80 +232,6 @@ fail:
     return NULL;
 }
 
-// Returns a negative value on failure or if |p->output_length| data is not available within the time frame specified by the sample rate
-static int pa_sound_device_read(pa_handle *p) {
-    assert(p);
-
-    const int64_t timeout_ms = std::round((1000.0 / (double)pa_stream_get_sample_spec(p->stream)->rate) * 1000.0);
-    const double start_time = clock_get_monotonic_seconds();
-
-    bool success = false;
-    int r = 0;
-    int *rerror = &r;
-    CHECK_DEAD_GOTO(p, rerror, fail);
-
-    while (p->output_index < p->output_length) {
-        if((clock_get_monotonic_seconds() - start_time) * 1000 >= timeout_ms)
-            return -1;
-
-        if(!p->read_data) {
-            pa_mainloop_prepare(p->mainloop, 1 * 1000); // 1 ms
-            pa_mainloop_poll(p->mainloop);
-            pa_mainloop_dispatch(p->mainloop);
-
-            if(pa_stream_peek(p->stream, &p->read_data, &p->read_length) < 0)
-                goto fail;
-
-            if(!p->read_data && p->read_length == 0)
-                continue;
-
-            if(!p->read_data && p->read_length > 0) {
-                // There is a hole in the stream :( drop it. Maybe we should generate silence instead? TODO
-                if(pa_stream_drop(p->stream) != 0)
-                    goto fail;
-                continue;
-            }
-
-            if(p->read_length <= 0) {
-                p->read_data = NULL;
-                if(pa_stream_drop(p->stream) != 0)
-                    goto fail;
-
-                CHECK_DEAD_GOTO(p, rerror, fail);
-                continue;
-            }
-        }
-
-        const size_t space_free_in_output_buffer = p->output_length - p->output_index;
-        if(space_free_in_output_buffer < p->read_length) {
-            memcpy(p->output_data + p->output_index, (const uint8_t*)p->read_data + p->read_index, space_free_in_output_buffer);
-            p->output_index = 0;
-            p->read_index += space_free_in_output_buffer;
-            p->read_length -= space_free_in_output_buffer;
-            break;
-        } else {
-            memcpy(p->output_data + p->output_index, (const uint8_t*)p->read_data + p->read_index, p->read_length);
-            p->output_index += p->read_length;
-            p->read_data = NULL;
-            p->read_length = 0;
-            p->read_index = 0;
-            
-            if(pa_stream_drop(p->stream) != 0)
-                goto fail;
-
-            if(p->output_index == p->output_length) {
-                p->output_index = 0;
-                break;
-            }
-        }
-    }
-
-    success = true;
-
-    fail:
-    return success ? 0 : -1;
-}
-
 static pa_sample_format_t audio_format_to_pulse_audio_format(AudioFormat audio_format) {
     switch(audio_format) {
         case S16: return PA_SAMPLE_S16LE;
@@ -253,15 +258,18 @@ int sound_device_get_by_name(SoundDevice *device, const char *device_name, const
     ss.rate = 48000;
     ss.channels = num_channels;
 
+    const uint32_t period_size = period_frame_size * audio_format_to_get_bytes_per_sample(audio_format) * num_channels; // 2/4 bytes/sample, @num_channels channels
+
     pa_buffer_attr buffer_attr;
     buffer_attr.tlength = -1;
     buffer_attr.prebuf = -1;
     buffer_attr.minreq = -1;
-    buffer_attr.maxlength = period_frame_size * audio_format_to_get_bytes_per_sample(audio_format) * num_channels; // 2/4 bytes/sample, @num_channels channels
-    buffer_attr.fragsize = buffer_attr.maxlength;
+    // The server sends one period at a time, but buffers a few more periods in case the audio thread is busy with another device
+    buffer_attr.maxlength = period_size * 4;
+    buffer_attr.fragsize = period_size;
 
     int error = 0;
-    pa_handle *handle = pa_sound_device_new(nullptr, description, device_name, description, &ss, &buffer_attr, &error);
+    pa_handle *handle = pa_sound_device_new(nullptr, "gpu-screen-recorder", device_name, description, &ss, &buffer_attr, period_frame_size, &error);
     if(!handle) {
         fprintf(stderr, "pa_sound_device_new() failed: %s. Audio input device %s might not be valid\n", pa_strerror(error), description);
         return -1;
@@ -278,14 +286,33 @@ void sound_device_close(SoundDevice *device) {
     device->handle = NULL;
 }
 
-int sound_device_read_next_chunk(SoundDevice *device, void **buffer) {
+void sound_device_set_read_callback(SoundDevice *device, SoundDeviceReadCallback read_callback) {
     pa_handle *pa = (pa_handle*)device->handle;
-    if(pa_sound_device_read(pa) < 0) {
-        //fprintf(stderr, "pa_simple_read() failed: %s\n", pa_strerror(error));
-        return -1;
+    pa->read_callback = std::move(read_callback);
+}
+
+int sound_devices_iterate(int timeout_ms) {
+    if(!shared_mainloop) {
+        usleep(timeout_ms * 1000);
+        return 0;
     }
-    *buffer = pa->output_data;
-    return device->frames;
+
+    if(pa_mainloop_prepare(shared_mainloop, timeout_ms * 1000) < 0)
+        return -1;
+
+    if(pa_mainloop_poll(shared_mainloop) < 0)
+        return -1;
+
+    shared_mainloop_reading = true;
+    const int dispatch_result = pa_mainloop_dispatch(shared_mainloop);
+    shared_mainloop_reading = false;
+    if(dispatch_result < 0)
+        return -1;
+
+    if(!PA_CONTEXT_IS_GOOD(pa_context_get_state(shared_context)))
+        return -1;
+
+    return 0;
 }
 
 static void pa_state_cb(pa_context *c, void *userdata) {
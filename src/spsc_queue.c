@@ -0,0 +1,98 @@
+#include "../include/spsc_queue.h"
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <stdio.h>
+
+#define CACHE_LINE_SIZE 64
+
+struct gsr_spsc_queue {
+    /* Written by the producer */
+    _Alignas(CACHE_LINE_SIZE) _Atomic uint64_t tail;
+    uint64_t cached_head; /* The last head the producer has seen, so it doesn't have to read |head| on every push */
+
+    /* Written by the consumer */
+    _Alignas(CACHE_LINE_SIZE) _Atomic uint64_t head;
+    uint64_t cached_tail;
+
+    _Alignas(CACHE_LINE_SIZE) size_t capacity;
+    size_t mask;
+    void **items;
+};
+
+static size_t round_up_to_power_of_two(size_t value) {
+    size_t result = 1;
+    while(result < value)
+        result <<= 1;
+    return result;
+}
+
+gsr_spsc_queue* gsr_spsc_queue_create(size_t capacity) {
+    if(capacity == 0) {
+        fprintf(stderr, "gsr error: gsr_spsc_queue_create: capacity is 0\n");
+        return NULL;
+    }
+
+    gsr_spsc_queue *self = aligned_alloc(CACHE_LINE_SIZE, sizeof(gsr_spsc_queue));
+    if(!self)
+        return NULL;
+
+    self->capacity = round_up_to_power_of_two(capacity);
+    self->mask = self->capacity - 1;
+    self->items = calloc(self->capacity, sizeof(void*));
+    if(!self->items) {
+        free(self);
+        return NULL;
+    }
+
+    atomic_init(&self->tail, 0);
+    atomic_init(&self->head, 0);
+    self->cached_head = 0;
+    self->cached_tail = 0;
+    return self;
+}
+
+void gsr_spsc_queue_destroy(gsr_spsc_queue *self) {
+    if(!self)
+        return;
+
+    free(self->items);
+    free(self);
+}
+
+bool gsr_spsc_queue_push(gsr_spsc_queue *self, void *item) {
+    const uint64_t tail = atomic_load_explicit(&self->tail, memory_order_relaxed);
+    if(tail - self->cached_head == self->capacity) {
+        self->cached_head = atomic_load_explicit(&self->head, memory_order_acquire);
+        if(tail - self->cached_head == self->capacity)
+            return false;
+    }
+
+    self->items[tail & self->mask] = item;
+    atomic_store_explicit(&self->tail, tail + 1, memory_order_release);
+    return true;
+}
+
+bool gsr_spsc_queue_pop(gsr_spsc_queue *self, void **item) {
+    const uint64_t head = atomic_load_explicit(&self->head, memory_order_relaxed);
+    if(head == self->cached_tail) {
+        self->cached_tail = atomic_load_explicit(&self->tail, memory_order_acquire);
+        if(head == self->cached_tail)
+            return false;
+    }
+
+    *item = self->items[head & self->mask];
+    atomic_store_explicit(&self->head, head + 1, memory_order_release);
+    return true;
+}
+
+size_t gsr_spsc_queue_size(const gsr_spsc_queue *self) {
+    /* Head is loaded first, so that the tail is never behind it */
+    const uint64_t head = atomic_load_explicit(&self->head, memory_order_acquire);
+    const uint64_t tail = atomic_load_explicit(&self->tail, memory_order_acquire);
+    return (size_t)(tail - head);
+}
+
+size_t gsr_spsc_queue_capacity(const gsr_spsc_queue *self) {
+    return self->capacity;
+}
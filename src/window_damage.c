@@ -0,0 +1,65 @@
+#include "../include/window_damage.h"
+#include <stdio.h>
+
+void window_damage_init(WindowDamage *self, Display *display) {
+    self->display = display;
+    self->window = None;
+    self->damage = None;
+    self->damage_event = 0;
+    self->damaged = true;
+
+    int damage_error = 0;
+    self->supported = XDamageQueryExtension(display, &self->damage_event, &damage_error);
+    if(!self->supported)
+        fprintf(stderr, "gsr warning: window_damage_init: the X server doesn't support XDamage, all frames will be captured\n");
+}
+
+void window_damage_deinit(WindowDamage *self) {
+    if(self->damage) {
+        XDamageDestroy(self->display, self->damage);
+        self->damage = None;
+    }
+    self->window = None;
+}
+
+void window_damage_set_window(WindowDamage *self, Window window) {
+    self->damaged = true;
+    if(!self->supported || window == self->window)
+        return;
+
+    window_damage_deinit(self);
+    self->window = window;
+    if(window)
+        self->damage = XDamageCreate(self->display, window, XDamageReportNonEmpty);
+}
+
+void window_damage_update(WindowDamage *self) {
+    if(!self->supported)
+        return;
+
+    /* Events of a previous window are removed from the queue as well */
+    XEvent xev;
+    while(XCheckTypedEvent(self->display, self->damage_event + XDamageNotify, &xev)) {
+        const XDamageNotifyEvent *damage_event = (const XDamageNotifyEvent*)&xev;
+        if(damage_event->damage == self->damage)
+            self->damaged = true;
+    }
+}
+
+bool window_damage_is_damaged(const WindowDamage *self) {
+    return !self->supported || self->damaged;
+}
+
+void window_damage_clear(WindowDamage *self) {
+    if(!self->supported || !self->damaged)
+        return;
+
+    self->damaged = false;
+    /* With XDamageReportNonEmpty a new event is only sent once the damage region is emptied */
+    if(self->damage)
+        XDamageSubtract(self->display, self->damage, None, None);
+}
+
+void window_damage_set_damaged(WindowDamage *self) {
+    self->damaged = true;
+}
@@ -0,0 +1,227 @@
+extern "C" {
+#include "../include/audio_mixer.h"
+#include "../include/time.h"
+}
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <vector>
+
+extern "C" {
+#include <libavfilter/avfilter.h>
+#include <libavfilter/buffersink.h>
+#include <libavfilter/buffersrc.h>
+#include <libavutil/channel_layout.h>
+#include <libavutil/mem.h>
+#include <libavutil/opt.h>
+#include <libswresample/swresample.h>
+}
+
+// Compares the speed of mixing audio devices with the built-in mixer (each kernel the cpu supports) against
+// an abuffer -> amix -> abuffersink graph, which is how merged audio devices used to be mixed.
+// It also compares deinterleaving float audio for encoders that take planar float audio (aac) against swr_convert,
+// which is how the audio used to be converted.
+// This is only for development, it's not installed.
+
+#define SAMPLE_RATE 48000
+#define NUM_CHANNELS 2
+#define FRAME_SIZE 1024
+#define NUM_FRAMES (SAMPLE_RATE * 60 / FRAME_SIZE) // A minute of audio
+
+struct MixerFormat {
+    const char *name;
+    gsr_audio_mixer_format mixer_format;
+    AVSampleFormat sample_format;
+};
+
+static const MixerFormat mixer_formats[] = {
+    { "s16", GSR_AUDIO_MIXER_FORMAT_S16, AV_SAMPLE_FMT_S16 },
+    { "s32", GSR_AUDIO_MIXER_FORMAT_S32, AV_SAMPLE_FMT_S32 },
+    { "f32", GSR_AUDIO_MIXER_FORMAT_F32, AV_SAMPLE_FMT_FLT  },
+};
+
+static void fill_random(uint8_t *data, size_t size, AVSampleFormat sample_format) {
+    if(sample_format == AV_SAMPLE_FMT_FLT) {
+        float *samples = (float*)data;
+        for(size_t i = 0; i < size / sizeof(float); ++i)
+            samples[i] = ((float)rand() / (float)RAND_MAX) * 2.0f - 1.0f;
+    } else {
+        for(size_t i = 0; i < size; ++i)
+            data[i] = rand();
+    }
+}
+
+// Returns the number of seconds it took to mix NUM_FRAMES frames
+static double benchmark_mixer(gsr_audio_mixer_kernel kernel, const MixerFormat &format, const std::vector<uint8_t*> &inputs, uint8_t *output) {
+    std::vector<float> gains(inputs.size(), 1.0f / (float)inputs.size());
+    const double start_time = clock_get_monotonic_seconds();
+    for(int i = 0; i < NUM_FRAMES; ++i) {
+        gsr_audio_mix_with_kernel(kernel, format.mixer_format, output, (const void *const*)inputs.data(), gains.data(), inputs.size(), FRAME_SIZE * NUM_CHANNELS);
+    }
+    return clock_get_monotonic_seconds() - start_time;
+}
+
+static double benchmark_amix(const MixerFormat &format, const std::vector<uint8_t*> &inputs) {
+    AVFilterGraph *graph = avfilter_graph_alloc();
+    std::vector<AVFilterContext*> sources;
+    char args[512];
+    for(size_t i = 0; i < inputs.size(); ++i) {
+        snprintf(args, sizeof(args), "sample_rate=%d:sample_fmt=%s:channel_layout=stereo:time_base=1/%d", SAMPLE_RATE, av_get_sample_fmt_name(format.sample_format), SAMPLE_RATE);
+        AVFilterContext *source = nullptr;
+        char name[32];
+        snprintf(name, sizeof(name), "src%d", (int)i);
+        if(avfilter_graph_create_filter(&source, avfilter_get_by_name("abuffer"), name, args, nullptr, graph) < 0) {
+            fprintf(stderr, "Error: failed to create abuffer\n");
+            exit(1);
+        }
+        sources.push_back(source);
+    }
+
+    AVFilterContext *mix = nullptr;
+    AVFilterContext *sink = nullptr;
+    snprintf(args, sizeof(args), "inputs=%d", (int)inputs.size());
+    if(avfilter_graph_create_filter(&mix, avfilter_get_by_name("amix"), "amix", args, nullptr, graph) < 0
+        || avfilter_graph_create_filter(&sink, avfilter_get_by_name("abuffersink"), "sink", nullptr, nullptr, graph) < 0)
+    {
+        fprintf(stderr, "Error: failed to create amix\n");
+        exit(1);
+    }
+
+    for(size_t i = 0; i < sources.size(); ++i) {
+        avfilter_link(sources[i], 0, mix, i);
+    }
+    avfilter_link(mix, 0, sink, 0);
+    if(avfilter_graph_config(graph, nullptr) < 0) {
+        fprintf(stderr, "Error: failed to configure the filter graph\n");
+        exit(1);
+    }
+
+    AVFrame *frame = av_frame_alloc();
+    AVFrame *mixed_frame = av_frame_alloc();
+    frame->sample_rate = SAMPLE_RATE;
+    frame->nb_samples = FRAME_SIZE;
+    frame->format = format.sample_format;
+#if LIBAVCODEC_VERSION_MAJOR < 60
+    frame->channels = NUM_CHANNELS;
+    frame->channel_layout = AV_CH_LAYOUT_STEREO;
+#else
+    av_channel_layout_default(&frame->ch_layout, NUM_CHANNELS);
+#endif
+    av_frame_get_buffer(frame, 0);
+
+    const size_t frame_size_bytes = FRAME_SIZE * NUM_CHANNELS * av_get_bytes_per_sample(format.sample_format);
+    const double start_time = clock_get_monotonic_seconds();
+    for(int i = 0; i < NUM_FRAMES; ++i) {
+        for(size_t j = 0; j < sources.size(); ++j) {
+            // The same as the recorder did, the frame is copied into the graph for each input
+            av_frame_make_writable(frame);
+            memcpy(frame->data[0], inputs[j], frame_size_bytes);
+            frame->pts = (int64_t)i * FRAME_SIZE;
+            av_buffersrc_write_frame(sources[j], frame);
+        }
+
+        while(av_buffersink_get_frame(sink, mixed_frame) >= 0) {
+            av_frame_unref(mixed_frame);
+        }
+    }
+    const double elapsed = clock_get_monotonic_seconds() - start_time;
+
+    av_frame_free(&mixed_frame);
+    av_frame_free(&frame);
+    avfilter_graph_free(&graph);
+    return elapsed;
+}
+
+// Returns the number of seconds it took to deinterleave NUM_FRAMES frames
+static double benchmark_deinterleave(gsr_audio_mixer_kernel kernel, const float *input, float *const *outputs) {
+    const double start_time = clock_get_monotonic_seconds();
+    for(int i = 0; i < NUM_FRAMES; ++i) {
+        gsr_audio_deinterleave_f32_with_kernel(kernel, input, outputs, NUM_CHANNELS, FRAME_SIZE);
+    }
+    return clock_get_monotonic_seconds() - start_time;
+}
+
+static double benchmark_swr(AVSampleFormat input_sample_format, const uint8_t *input, uint8_t **outputs) {
+    SwrContext *swr = swr_alloc();
+    av_opt_set_int(swr, "in_channel_layout", AV_CH_LAYOUT_STEREO, 0);
+    av_opt_set_int(swr, "out_channel_layout", AV_CH_LAYOUT_STEREO, 0);
+    av_opt_set_int(swr, "in_sample_rate", SAMPLE_RATE, 0);
+    av_opt_set_int(swr, "out_sample_rate", SAMPLE_RATE, 0);
+    av_opt_set_sample_fmt(swr, "in_sample_fmt", input_sample_format, 0);
+    av_opt_set_sample_fmt(swr, "out_sample_fmt", AV_SAMPLE_FMT_FLTP, 0);
+    if(swr_init(swr) < 0) {
+        fprintf(stderr, "Error: failed to create SwrContext\n");
+        exit(1);
+    }
+
+    const double start_time = clock_get_monotonic_seconds();
+    for(int i = 0; i < NUM_FRAMES; ++i) {
+        swr_convert(swr, outputs, FRAME_SIZE, &input, FRAME_SIZE);
+    }
+    const double elapsed = clock_get_monotonic_seconds() - start_time;
+
+    swr_free(&swr);
+    return elapsed;
+}
+
+int main() {
+    const gsr_audio_mixer_kernel kernels[] = { GSR_AUDIO_MIXER_KERNEL_SCALAR, GSR_AUDIO_MIXER_KERNEL_SSE2, GSR_AUDIO_MIXER_KERNEL_AVX2, GSR_AUDIO_MIXER_KERNEL_NEON };
+
+    fprintf(stderr, "Mixing %d seconds of %d hz stereo audio in frames of %d samples, the time per frame:\n", NUM_FRAMES * FRAME_SIZE / SAMPLE_RATE, SAMPLE_RATE, FRAME_SIZE);
+    for(const MixerFormat &format : mixer_formats) {
+        for(int num_inputs = 2; num_inputs <= 4; ++num_inputs) {
+            const size_t frame_size_bytes = FRAME_SIZE * NUM_CHANNELS * av_get_bytes_per_sample(format.sample_format);
+            std::vector<uint8_t*> inputs;
+            for(int i = 0; i < num_inputs; ++i) {
+                uint8_t *input = (uint8_t*)av_malloc(frame_size_bytes);
+                fill_random(input, frame_size_bytes, format.sample_format);
+                inputs.push_back(input);
+            }
+            uint8_t *output = (uint8_t*)av_malloc(frame_size_bytes);
+
+            fprintf(stderr, "%s, %d inputs:\n", format.name, num_inputs);
+            for(gsr_audio_mixer_kernel kernel : kernels) {
+                if(!gsr_audio_mixer_kernel_is_supported(kernel))
+                    continue;
+                const double elapsed = benchmark_mixer(kernel, format, inputs, output);
+                fprintf(stderr, "  %-8s %8.3f us\n", gsr_audio_mixer_kernel_get_name(kernel), elapsed * 1000000.0 / NUM_FRAMES);
+            }
+            const double elapsed = benchmark_amix(format, inputs);
+            fprintf(stderr, "  %-8s %8.3f us\n", "amix", elapsed * 1000000.0 / NUM_FRAMES);
+
+            av_free(output);
+            for(uint8_t *input : inputs) {
+                av_free(input);
+            }
+        }
+    }
+
+    fprintf(stderr, "Converting interleaved audio to fltp:\n");
+    {
+        const size_t frame_size_bytes = FRAME_SIZE * NUM_CHANNELS * sizeof(float);
+        uint8_t *input = (uint8_t*)av_malloc(frame_size_bytes);
+        fill_random(input, frame_size_bytes, AV_SAMPLE_FMT_FLT);
+        uint8_t *outputs[NUM_CHANNELS];
+        for(int i = 0; i < NUM_CHANNELS; ++i) {
+            outputs[i] = (uint8_t*)av_malloc(FRAME_SIZE * sizeof(float));
+        }
+
+        for(gsr_audio_mixer_kernel kernel : kernels) {
+            if(!gsr_audio_mixer_kernel_is_supported(kernel))
+                continue;
+            const double elapsed = benchmark_deinterleave(kernel, (const float*)input, (float *const*)outputs);
+            fprintf(stderr, "  %-8s %8.3f us\n", gsr_audio_mixer_kernel_get_name(kernel), elapsed * 1000000.0 / NUM_FRAMES);
+        }
+        fprintf(stderr, "  %-8s %8.3f us\n", "swr f32", benchmark_swr(AV_SAMPLE_FMT_FLT, input, outputs) * 1000000.0 / NUM_FRAMES);
+        fprintf(stderr, "  %-8s %8.3f us\n", "swr s32", benchmark_swr(AV_SAMPLE_FMT_S32, input, outputs) * 1000000.0 / NUM_FRAMES);
+
+        for(int i = 0; i < NUM_CHANNELS; ++i) {
+            av_free(outputs[i]);
+        }
+        av_free(input);
+    }
+
+    return 0;
+}
@@ -0,0 +1,182 @@
+extern "C" {
+#include "../include/replay_buffer.h"
+}
+
+#include "../include/replay_stream_info.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+}
+
+// Exports a replay from the replay buffer of a running (or crashed) gpu-screen-recorder that was started with -rs.
+// The replay buffer is only read, so this doesn't affect the recording.
+
+static char av_error_buffer[AV_ERROR_MAX_STRING_SIZE];
+
+static char* av_error_to_string(int err) {
+    if(av_strerror(err, av_error_buffer, sizeof(av_error_buffer)) < 0)
+        strcpy(av_error_buffer, "Unknown error");
+    return av_error_buffer;
+}
+
+static void usage() {
+    fprintf(stderr, "usage: gpu-screen-recorder-replay-export <replay_buffer_shm_name> <output_file> [duration_sec]\n");
+    fprintf(stderr, "OPTIONS:\n");
+    fprintf(stderr, "  replay_buffer_shm_name  The name that was given to gpu-screen-recorder with -rs, for example /gsr-replay.\n");
+    fprintf(stderr, "  output_file             The file to save the replay to. The container format is determined from the filename extension.\n");
+    fprintf(stderr, "  duration_sec            Save only the last seconds of the replay buffer. The replay starts at the keyframe before that. Optional, the whole replay buffer is saved by default.\n");
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    if(argc != 3 && argc != 4)
+        usage();
+
+    const char *shm_name = argv[1];
+    const char *output_filepath = argv[2];
+    double duration_secs = 0.0;
+    if(argc == 4) {
+        duration_secs = atof(argv[3]);
+        if(duration_secs <= 0.0) {
+            fprintf(stderr, "Error: duration_sec has to be greater than 0, was: %s\n", argv[3]);
+            usage();
+        }
+    }
+
+    gsr_replay_buffer_reader *reader = gsr_replay_buffer_reader_open(shm_name);
+    if(!reader)
+        return 1;
+
+    size_t stream_info_size = 0;
+    const void *stream_info = gsr_replay_buffer_reader_get_stream_info(reader, &stream_info_size);
+    if(stream_info_size != sizeof(ReplayStreamsInfo)) {
+        fprintf(stderr, "Error: the replay buffer %s was created by a different version of gpu-screen-recorder\n", shm_name);
+        gsr_replay_buffer_reader_close(reader);
+        return 1;
+    }
+
+    // Copied out because the shared memory can be cleared by a new recording while this runs
+    ReplayStreamsInfo streams_info;
+    memcpy(&streams_info, stream_info, sizeof(streams_info));
+    if(streams_info.num_streams == 0 || streams_info.num_streams > REPLAY_STREAM_INFO_MAX_STREAMS) {
+        fprintf(stderr, "Error: the replay buffer %s has invalid stream info\n", shm_name);
+        gsr_replay_buffer_reader_close(reader);
+        return 1;
+    }
+
+    AVFormatContext *av_format_context = nullptr;
+    avformat_alloc_output_context2(&av_format_context, nullptr, nullptr, output_filepath);
+    if(!av_format_context) {
+        fprintf(stderr, "Error: Failed to deduce container format from file extension\n");
+        gsr_replay_buffer_reader_close(reader);
+        return 1;
+    }
+
+    std::vector<AVStream*> streams;
+    std::vector<AVRational> time_bases;
+    int video_stream_index = -1;
+    for(uint32_t i = 0; i < streams_info.num_streams; ++i) {
+        const ReplayStreamInfo &info = streams_info.streams[i];
+        AVStream *stream = avformat_new_stream(av_format_context, nullptr);
+        if(!stream || !replay_stream_info_to_codec_parameters(info, stream->codecpar)) {
+            fprintf(stderr, "Error: Could not allocate stream\n");
+            return 1;
+        }
+
+        stream->id = i;
+        stream->time_base = AVRational{ info.time_base_num, info.time_base_den };
+        stream->avg_frame_rate = AVRational{ info.framerate_num, info.framerate_den };
+        streams.push_back(stream);
+        time_bases.push_back(stream->time_base);
+        if(video_stream_index == -1 && info.codec_type == AVMEDIA_TYPE_VIDEO)
+            video_stream_index = i;
+    }
+
+    if(video_stream_index == -1) {
+        fprintf(stderr, "Error: the replay buffer %s doesn't have a video stream\n", shm_name);
+        return 1;
+    }
+
+    if(!gsr_replay_buffer_reader_seek(reader, duration_secs)) {
+        fprintf(stderr, "Error: the replay buffer %s doesn't have any video yet\n", shm_name);
+        return 1;
+    }
+
+    int ret = avio_open(&av_format_context->pb, output_filepath, AVIO_FLAG_WRITE);
+    if (ret < 0) {
+        fprintf(stderr, "Error: Could not open '%s': %s\n", output_filepath, av_error_to_string(ret));
+        return 1;
+    }
+
+    AVDictionary *options = nullptr;
+    av_dict_set(&options, "strict", "experimental", 0);
+    ret = avformat_write_header(av_format_context, &options);
+    av_dict_free(&options);
+    if (ret < 0) {
+        fprintf(stderr, "Error occurred when writing header to output file: %s\n", av_error_to_string(ret));
+        return 1;
+    }
+
+    // The replay starts at a video keyframe. All streams are cut at the presentation time of that keyframe, like when gpu-screen-recorder saves a replay
+    bool got_first_packet = false;
+    std::vector<int64_t> pts_offsets(streams.size(), 0);
+    bool success = true;
+    gsr_replay_packet replay_packet;
+    while(gsr_replay_buffer_reader_next(reader, &replay_packet)) {
+        if(replay_packet.stream_index < 0 || replay_packet.stream_index >= (int)streams.size())
+            continue;
+
+        if(!got_first_packet) {
+            for(size_t i = 0; i < streams.size(); ++i) {
+                pts_offsets[i] = av_rescale_q(replay_packet.pts, time_bases[video_stream_index], time_bases[i]);
+            }
+            got_first_packet = true;
+        }
+
+        const int64_t pts_offset = pts_offsets[replay_packet.stream_index];
+        if(replay_packet.pts < pts_offset)
+            continue;
+
+        AVPacket av_packet;
+        memset(&av_packet, 0, sizeof(av_packet));
+        if(av_new_packet(&av_packet, replay_packet.size) < 0) {
+            fprintf(stderr, "Error: failed to allocate replay packet\n");
+            success = false;
+            break;
+        }
+
+        memcpy(av_packet.data, replay_packet.data, replay_packet.size);
+        av_packet.pts = replay_packet.pts - pts_offset;
+        av_packet.dts = replay_packet.dts - pts_offset;
+        if(replay_packet.flags & GSR_REPLAY_PACKET_FLAG_KEY)
+            av_packet.flags |= AV_PKT_FLAG_KEY;
+
+        AVStream *stream = streams[replay_packet.stream_index];
+        av_packet.stream_index = stream->index;
+        av_packet_rescale_ts(&av_packet, time_bases[replay_packet.stream_index], stream->time_base);
+
+        ret = av_interleaved_write_frame(av_format_context, &av_packet);
+        if(ret < 0)
+            fprintf(stderr, "Error: Failed to write frame index %d to muxer, reason: %s (%d)\n", stream->index, av_error_to_string(ret), ret);
+        av_packet_unref(&av_packet);
+    }
+
+    if (av_write_trailer(av_format_context) != 0)
+        fprintf(stderr, "Failed to write trailer\n");
+
+    avio_close(av_format_context->pb);
+    avformat_free_context(av_format_context);
+    gsr_replay_buffer_reader_close(reader);
+
+    if(!success)
+        return 1;
+
+    puts(output_filepath);
+    return 0;
+}